@@ -0,0 +1,115 @@
+#ifndef IP_H_ARENA
+#define IP_H_ARENA
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/**
+ * arena.
+ * Bump allocates from chunks of IP_ARENA_CHUNK bytes, bigger blocks get a
+ * chunk of their own. Blocks are not freed one by one, ip_arena_dtor frees
+ * all of them at once. The engines make the procs of ip_vm_new_proc and
+ * their insts in the arena of their vm, next to each other in the order
+ * they are made, instead of scattered over the heap.
+ *
+ * The helpers take a NULL arena for malloc and free, so the same code
+ * makes the procs of ip_proc_new.
+ */
+
+#define IP_ARENA_CHUNK (64 * 1024)
+
+union ip_arena_align
+{
+  long double d;
+  long long l;
+  void* p;
+};
+
+struct ip_arena_chunk
+{
+  struct ip_arena_chunk* next;
+  /* the blocks follow, aligned like it */
+  union ip_arena_align data;
+};
+
+struct ip_arena
+{
+  struct ip_arena_chunk* chunks;
+  char* top;
+  char* end;
+};
+
+static void
+ip_arena_init(struct ip_arena* arena) __attribute__((unused));
+static void
+ip_arena_init(struct ip_arena* arena)
+{
+  arena->chunks = NULL;
+  arena->top = NULL;
+  arena->end = NULL;
+}
+
+/* bytes from arena, or from malloc if it is NULL */
+static void*
+ip_arena_alloc(struct ip_arena* arena, size_t bytes) __attribute__((unused));
+static void*
+ip_arena_alloc(struct ip_arena* arena, size_t bytes)
+{
+  size_t align = sizeof(union ip_arena_align);
+  char* block;
+
+  if (NULL == arena) {
+    return malloc(bytes);
+  }
+
+  bytes = (bytes + align - 1) / align * align;
+  if ((size_t)(arena->end - arena->top) < bytes) {
+    size_t size = bytes < IP_ARENA_CHUNK ? IP_ARENA_CHUNK : bytes;
+    struct ip_arena_chunk* chunk;
+
+    chunk = malloc(offsetof(struct ip_arena_chunk, data) + size);
+    if (NULL == chunk) {
+      return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    /* the rest of the current chunk stays for the next blocks */
+    if (IP_ARENA_CHUNK <= bytes) {
+      return &chunk->data;
+    }
+    arena->top = (char*)&chunk->data;
+    arena->end = arena->top + size;
+  }
+
+  block = arena->top;
+  arena->top += bytes;
+  return block;
+}
+
+/* block back to malloc if it did not come from an arena, the arena keeps
+ * its blocks until ip_arena_dtor */
+static void
+ip_arena_release(struct ip_arena* arena, void* block) __attribute__((unused));
+static void
+ip_arena_release(struct ip_arena* arena, void* block)
+{
+  if (NULL == arena) {
+    free(block);
+  }
+}
+
+static void
+ip_arena_dtor(struct ip_arena* arena) __attribute__((unused));
+static void
+ip_arena_dtor(struct ip_arena* arena)
+{
+  while (NULL != arena->chunks) {
+    struct ip_arena_chunk* next = arena->chunks->next;
+
+    free(arena->chunks);
+    arena->chunks = next;
+  }
+  ip_arena_init(arena);
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef IP_H_CALL
+#define IP_H_CALL
+
+#include "vm.h"
+#include <stdlib.h>
+
+/**
+ * arity of calls.
+ * The compilers give the operand stack a fixed layout, so they need the
+ * number of args of every call when they compile it. A CALL names its
+ * callee. The callee of a CALL_INDIRECT is known if its procref is pushed
+ * by a CONST right before it that no jump lands after; otherwise it is only
+ * known when the call runs and the engines handle it their own way:
+ *
+ *   register - the proc keeps its stack code
+ *   opt      - the args are every value below the procref, an arity miss
+ *              finishes the activation in the interpreter
+ *   aot      - the proc stays interpreted
+ */
+
+/* the callee is not registered yet */
+#define IP_CALL_MISSING (-1)
+/* the callee is only known when the call runs */
+#define IP_CALL_UNKNOWN (-2)
+
+/* the nargs of the proc at ref, 1 if there is none */
+typedef int (*ip_call_lookup_t)(void* ctx, ip_proc_ref_t ref, size_t* nargs);
+
+/* the procref of the CALL_INDIRECT at insts[at] if it is a constant, or -1 */
+static ip_proc_ref_t
+ip_call_indirect_callee(const struct ip_inst* insts, size_t ninsts, size_t at)
+  __attribute__((unused));
+static ip_proc_ref_t
+ip_call_indirect_callee(const struct ip_inst* insts, size_t ninsts, size_t at)
+{
+  size_t i;
+
+  if (!at || IP_CODE_CONST != insts[at - 1].code) {
+    return -1;
+  }
+  for (i = 0; i < ninsts; i++) {
+    /* jumps land after the target, one to the CONST lands on the call */
+    if ((IP_CODE_JUMP == insts[i].code ||
+         IP_CODE_JUMP_IF_ZERO == insts[i].code ||
+         IP_CODE_JUMP_IF_NEG == insts[i].code) &&
+        insts[i].u.pos + 1 == at) {
+      return -1;
+    }
+  }
+  /* as the call reads it, a negative ref is no proc */
+  return IP_VALUE2PROCREF(insts[at - 1].u.v) < 0
+           ? -1
+           : IP_VALUE2PROCREF(insts[at - 1].u.v);
+}
+
+/**
+ * the number of args of the CALL, TAIL_CALL or CALL_INDIRECT at insts[at],
+ * IP_CALL_MISSING if its callee is not in `lookup`, which may be NULL, or
+ * IP_CALL_UNKNOWN if it is a CALL_INDIRECT whose callee is not a constant.
+ */
+static long
+ip_call_nargs(const struct ip_inst* insts,
+              size_t ninsts,
+              size_t at,
+              ip_call_lookup_t lookup,
+              void* ctx) __attribute__((unused));
+static long
+ip_call_nargs(const struct ip_inst* insts,
+              size_t ninsts,
+              size_t at,
+              ip_call_lookup_t lookup,
+              void* ctx)
+{
+  ip_proc_ref_t ref = insts[at].u.p;
+  size_t nargs;
+
+  if (IP_CODE_CALL_INDIRECT == insts[at].code) {
+    ref = ip_call_indirect_callee(insts, ninsts, at);
+    if (ref < 0) {
+      return IP_CALL_UNKNOWN;
+    }
+  }
+  if (NULL == lookup || lookup(ctx, ref, &nargs)) {
+    return IP_CALL_MISSING;
+  }
+  return nargs;
+}
+
+#endif
@@ -0,0 +1,591 @@
+#include "vm.h"
+#include <stdio.h>
+
+/**
+ * small procs on the corners of the engines. Every case runs in a vm of its
+ * own and prints its result, `make check` compares them with simple's.
+ */
+
+struct ip_check_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst* insts;
+};
+
+#define IP_CHECK_PROC(nargs, nlocals, insts)                                   \
+  {                                                                            \
+    nargs, nlocals, sizeof(insts) / sizeof(insts[0]), insts                    \
+  }
+
+#ifdef IP_CHECK_STACK_LIMITS
+/* the stack limits of the vms of the next cases, 0 for the defaults */
+static size_t ip_check_nvalues;
+static size_t ip_check_ncalls;
+#endif
+
+/* register `procs` in order, so procs[i] is proc i, and run procs[0] on
+ * `args`. 0 with the result in `result`, 1 on errors */
+static int
+ip_check_run(struct ip_check_proc* procs,
+             size_t nprocs,
+             ip_value_t* args,
+             size_t nargs,
+             ip_value_t* result)
+{
+  struct ip_vm* vm;
+  size_t i;
+  int ret;
+
+  if (ip_vm_new(&vm)) {
+    return 1;
+  }
+#ifdef IP_CHECK_STACK_LIMITS
+  if (ip_check_nvalues &&
+      ip_vm_set_stack_limits(vm, ip_check_nvalues, ip_check_ncalls)) {
+    ip_vm_dtor(vm);
+    return 1;
+  }
+#endif
+
+  for (i = 0; i < nprocs; i++) {
+    struct ip_proc* proc;
+
+    if (ip_proc_new(procs[i].nargs,
+                    procs[i].nlocals,
+                    procs[i].ninsts,
+                    procs[i].insts,
+                    &proc) ||
+        ip_vm_register_proc(vm, proc) < 0) {
+      ip_vm_dtor(vm);
+      return 1;
+    }
+  }
+
+#ifdef IP_VM_AOT
+  if (ip_vm_compile_aot(vm)) {
+    ip_vm_dtor(vm);
+    return 1;
+  }
+#endif
+
+  for (i = 0; i < nargs; i++) {
+    if (ip_vm_push_arg(vm, args[i])) {
+      ip_vm_dtor(vm);
+      return 1;
+    }
+  }
+
+  ret = ip_vm_exec(vm, 0) || ip_vm_get_result(vm, result);
+  ip_vm_dtor(vm);
+
+  return ret;
+}
+
+static void
+ip_check(const char* name,
+         struct ip_check_proc* procs,
+         size_t nprocs,
+         ip_value_t* args,
+         size_t nargs)
+{
+  ip_value_t result;
+
+  if (ip_check_run(procs, nprocs, args, nargs, &result)) {
+    printf("%s: error\n", name);
+  } else {
+    printf("%s: %lld\n", name, IP_VALUE2LLINT(result));
+  }
+}
+
+/* a constant returned as it is, and one folded from an ADD */
+static void
+ip_check_return_const(void)
+{
+  struct ip_inst entry[] = {
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+  struct ip_inst k[] = {
+    IP_INST_CONST(42),
+    IP_INST_RETURN(),
+  };
+  struct ip_inst folded[] = {
+    IP_INST_CONST(-2),
+    IP_INST_CONST(0),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_inst exit_k[] = {
+    IP_INST_CONST(43),
+    IP_INST_EXIT(),
+  };
+  struct ip_check_proc k_procs[] = {
+    IP_CHECK_PROC(0, 0, entry),
+    IP_CHECK_PROC(0, 0, k),
+  };
+  struct ip_check_proc folded_procs[] = {
+    IP_CHECK_PROC(0, 0, entry),
+    IP_CHECK_PROC(0, 0, folded),
+  };
+  struct ip_check_proc exit_procs[] = {
+    IP_CHECK_PROC(0, 0, exit_k),
+  };
+
+  ip_check("return const", k_procs, 2, NULL, 0);
+  ip_check("return folded const", folded_procs, 2, NULL, 0);
+  ip_check("exit const", exit_procs, 1, NULL, 0);
+}
+
+/* the const branch of a tail recursive proc */
+static void
+ip_check_tail_const(void)
+{
+  struct ip_inst entry[] = {
+    IP_INST_CONST(10),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+#define n 0
+  struct ip_inst count[] = {
+    /*  0 */ IP_INST_GET_LOCAL(n),
+    /*  1 */ IP_INST_JUMP_IF_ZERO(6),
+    /*  2 */ IP_INST_GET_LOCAL(n),
+    /*  3 */ IP_INST_CONST(1),
+    /*  4 */ IP_INST_SUB(),
+    /*  5 */ IP_INST_CALL(1),
+    /*  6 */ IP_INST_RETURN(),
+    /*  7 */ IP_INST_CONST(7),
+    /*  8 */ IP_INST_RETURN(),
+  };
+#undef n
+  struct ip_check_proc procs[] = {
+    IP_CHECK_PROC(0, 0, entry),
+    IP_CHECK_PROC(1, 0, count),
+  };
+
+  ip_check("tail call const branch", procs, 2, NULL, 0);
+}
+
+/* CALL_INDIRECT with values below its args */
+static void
+ip_check_indirect(void)
+{
+  ip_value_t args[] = { IP_LLINT2VALUE(5), IP_PROCREF2VALUE(2) };
+  struct ip_inst entry[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+  struct ip_inst entry2[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_GET_LOCAL(1),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+#define n 0
+#define h 1
+  struct ip_inst twice_const[] = {
+    IP_INST_GET_LOCAL(n),
+    IP_INST_GET_LOCAL(n),
+    IP_INST_CONST(2),
+    IP_INST_CALL_INDIRECT(),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_inst ref_arg[] = {
+    IP_INST_GET_LOCAL(n),
+    IP_INST_GET_LOCAL(h),
+    IP_INST_CALL_INDIRECT(),
+    IP_INST_RETURN(),
+  };
+#undef n
+#undef h
+  struct ip_inst inc[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CONST(1),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_check_proc const_procs[] = {
+    IP_CHECK_PROC(1, 0, entry),
+    IP_CHECK_PROC(1, 0, twice_const),
+    IP_CHECK_PROC(1, 0, inc),
+  };
+  struct ip_check_proc arg_procs[] = {
+    IP_CHECK_PROC(2, 0, entry2),
+    IP_CHECK_PROC(2, 0, ref_arg),
+    IP_CHECK_PROC(1, 0, inc),
+  };
+
+  ip_check("call indirect const below args", const_procs, 3, args, 1);
+  ip_check("call indirect ref arg", arg_procs, 3, args, 2);
+}
+
+/* a loop headed by the first inst, run long enough to be entered by OSR */
+static void
+ip_check_loop_at_entry(void)
+{
+  ip_value_t args[] = { IP_LLINT2VALUE(3000) };
+#define n 0
+#define acc 1
+  struct ip_inst sum[] = {
+    /*  0 */ IP_INST_GET_LOCAL(n),
+    /*  1 */ IP_INST_JUMP_IF_ZERO(10),
+    /*  2 */ IP_INST_GET_LOCAL(acc),
+    /*  3 */ IP_INST_GET_LOCAL(n),
+    /*  4 */ IP_INST_ADD(),
+    /*  5 */ IP_INST_SET_LOCAL(acc),
+    /*  6 */ IP_INST_GET_LOCAL(n),
+    /*  7 */ IP_INST_CONST(1),
+    /*  8 */ IP_INST_SUB(),
+    /*  9 */ IP_INST_SET_LOCAL(n),
+    /* 10 */ IP_INST_JUMP((size_t)-1),
+    /* 11 */ IP_INST_GET_LOCAL(acc),
+    /* 12 */ IP_INST_EXIT(),
+  };
+#undef n
+#undef acc
+  struct ip_check_proc procs[] = {
+    IP_CHECK_PROC(1, 1, sum),
+  };
+
+  ip_check("loop at entry", procs, 1, args, 1);
+}
+
+/* pops below the bottom of the stack, which fail */
+static void
+ip_check_underflow(void)
+{
+  ip_value_t args[] = { IP_LLINT2VALUE(5) };
+  struct ip_inst add[] = {
+    IP_INST_ADD(),
+    IP_INST_EXIT(),
+  };
+  struct ip_inst exit_empty[] = {
+    IP_INST_EXIT(),
+  };
+  struct ip_inst add_args[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_ADD(),
+    IP_INST_EXIT(),
+  };
+  struct ip_check_proc add_procs[] = {
+    IP_CHECK_PROC(0, 0, add),
+  };
+  struct ip_check_proc exit_procs[] = {
+    IP_CHECK_PROC(0, 0, exit_empty),
+  };
+  struct ip_check_proc args_procs[] = {
+    IP_CHECK_PROC(1, 0, add_args),
+  };
+
+  ip_check("add on an empty stack", add_procs, 1, NULL, 0);
+  ip_check("exit on an empty stack", exit_procs, 1, NULL, 0);
+  ip_check("exit without its frame", args_procs, 1, args, 1);
+}
+
+#ifdef IP_CHECK_TAIL_CALLS
+/* 1 + ... + n by tail calls, in constant stack space */
+static void
+ip_check_deep_tail_calls(void)
+{
+  ip_value_t args[] = { IP_LLINT2VALUE(100000) };
+  struct ip_inst entry[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CONST(0),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+#define n 0
+#define acc 1
+  struct ip_inst sum[] = {
+    /*  0 */ IP_INST_GET_LOCAL(n),
+    /*  1 */ IP_INST_JUMP_IF_ZERO(9),
+    /*  2 */ IP_INST_GET_LOCAL(n),
+    /*  3 */ IP_INST_CONST(1),
+    /*  4 */ IP_INST_SUB(),
+    /*  5 */ IP_INST_GET_LOCAL(acc),
+    /*  6 */ IP_INST_GET_LOCAL(n),
+    /*  7 */ IP_INST_ADD(),
+    /*  8 */ IP_INST_CALL(1),
+    /*  9 */ IP_INST_RETURN(),
+    /* 10 */ IP_INST_GET_LOCAL(acc),
+    /* 11 */ IP_INST_RETURN(),
+  };
+#undef n
+#undef acc
+  struct ip_check_proc procs[] = {
+    IP_CHECK_PROC(1, 0, entry),
+    IP_CHECK_PROC(2, 0, sum),
+  };
+
+  ip_check("tail recursion 100000 deep", procs, 2, args, 1);
+#ifdef IP_CHECK_STACK_LIMITS
+  ip_check_nvalues = 64;
+  ip_check_ncalls = 64;
+  ip_check("tail recursion in 64 calls", procs, 2, args, 1);
+  ip_check_nvalues = 0;
+#endif
+}
+#endif
+
+#ifdef IP_CHECK_STACK_LIMITS
+/* 1 + ... + n by plain recursion, as deep as the stack limits let it */
+static void
+ip_check_deep_recursion(void)
+{
+  ip_value_t args[] = { IP_LLINT2VALUE(100000) };
+  ip_value_t deeper[] = { IP_LLINT2VALUE(1000000) };
+  struct ip_inst entry[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+#define n 0
+  struct ip_inst sum[] = {
+    /*  0 */ IP_INST_GET_LOCAL(n),
+    /*  1 */ IP_INST_JUMP_IF_ZERO(8),
+    /*  2 */ IP_INST_GET_LOCAL(n),
+    /*  3 */ IP_INST_GET_LOCAL(n),
+    /*  4 */ IP_INST_CONST(1),
+    /*  5 */ IP_INST_SUB(),
+    /*  6 */ IP_INST_CALL(1),
+    /*  7 */ IP_INST_ADD(),
+    /*  8 */ IP_INST_RETURN(),
+    /*  9 */ IP_INST_CONST(0),
+    /* 10 */ IP_INST_RETURN(),
+  };
+#undef n
+  struct ip_check_proc procs[] = {
+    IP_CHECK_PROC(1, 0, entry),
+    IP_CHECK_PROC(1, 0, sum),
+  };
+
+  ip_check("recursion 100000 deep", procs, 2, args, 1);
+  /* past the default limits */
+  ip_check_nvalues = 8 << 20;
+  ip_check_ncalls = 2 << 20;
+  ip_check("recursion 1000000 deep", procs, 2, deeper, 1);
+  ip_check_nvalues = 1000;
+  ip_check_ncalls = 1000;
+  ip_check("recursion past the limits", procs, 2, args, 1);
+  ip_check_nvalues = 0;
+}
+#endif
+
+/* a CALL_INDIRECT whose callee takes fewer args than the values below the
+ * ref, in a proc called often enough for the tiered engine to compile it */
+static void
+ip_check_indirect_miss(void)
+{
+  ip_value_t args[] = { IP_PROCREF2VALUE(2) };
+#define h 0
+#define i 1
+#define acc 2
+  struct ip_inst entry[] = {
+    /*  0 */ IP_INST_CONST(3000),
+    /*  1 */ IP_INST_SET_LOCAL(i),
+    /* loop, until the callee exits */
+    /*  2 */ IP_INST_GET_LOCAL(acc),
+    /*  3 */ IP_INST_GET_LOCAL(i),
+    /*  4 */ IP_INST_GET_LOCAL(h),
+    /*  5 */ IP_INST_CALL(1),
+    /*  6 */ IP_INST_ADD(),
+    /*  7 */ IP_INST_SET_LOCAL(acc),
+    /*  8 */ IP_INST_GET_LOCAL(i),
+    /*  9 */ IP_INST_CONST(1),
+    /* 10 */ IP_INST_SUB(),
+    /* 11 */ IP_INST_SET_LOCAL(i),
+    /* 12 */ IP_INST_JUMP(1),
+  };
+#undef h
+#undef i
+#undef acc
+#define n 0
+#define h 1
+#define t 2
+  /* n until it is 0, then 40 is left below the call and 3 + t exits */
+  struct ip_inst miss[] = {
+    /*  0 */ IP_INST_CONST(5),
+    /*  1 */ IP_INST_SET_LOCAL(t),
+    /*  2 */ IP_INST_GET_LOCAL(n),
+    /*  3 */ IP_INST_JUMP_IF_ZERO(5),
+    /*  4 */ IP_INST_GET_LOCAL(n),
+    /*  5 */ IP_INST_RETURN(),
+    /*  6 */ IP_INST_CONST(40),
+    /*  7 */ IP_INST_CONST(2),
+    /*  8 */ IP_INST_GET_LOCAL(h),
+    /*  9 */ IP_INST_CALL_INDIRECT(),
+    /* 10 */ IP_INST_GET_LOCAL(t),
+    /* 11 */ IP_INST_ADD(),
+    /* 12 */ IP_INST_EXIT(),
+  };
+#undef n
+#undef h
+#undef t
+  struct ip_inst inc[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CONST(1),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_check_proc procs[] = {
+    IP_CHECK_PROC(1, 2, entry),
+    IP_CHECK_PROC(2, 1, miss),
+    IP_CHECK_PROC(1, 0, inc),
+  };
+
+  ip_check("call indirect arity miss", procs, 3, args, 1);
+}
+
+/* run the proc at ref on 10 and 3 often enough for the tiered engine to
+ * compile it, and print the last result */
+static void
+ip_check_rerun(struct ip_vm* vm, ip_proc_ref_t ref, const char* name)
+{
+  ip_value_t result = 0;
+  int i, ret = 0;
+
+  for (i = 0; !ret && i < 1500; i++) {
+    ret = ip_vm_push_arg(vm, IP_LLINT2VALUE(10)) ||
+          ip_vm_push_arg(vm, IP_LLINT2VALUE(3)) || ip_vm_exec(vm, ref) ||
+          ip_vm_get_result(vm, &result);
+  }
+  if (ret) {
+    printf("%s: error\n", name);
+  } else {
+    printf("%s: %lld\n", name, IP_VALUE2LLINT(result));
+  }
+}
+
+/* a callee replaced at its ref after its caller ran, by one of another
+ * arity and then by one of the same */
+static void
+ip_check_reregister(void)
+{
+  struct ip_inst entry[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_GET_LOCAL(1),
+    IP_INST_CALL(1),
+    IP_INST_EXIT(),
+  };
+  struct ip_inst add100[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CONST(100),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_inst sub[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_GET_LOCAL(1),
+    IP_INST_SUB(),
+    IP_INST_RETURN(),
+  };
+  struct ip_inst add[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_GET_LOCAL(1),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_vm* vm;
+  struct ip_proc *f, *g1, *g2, *g3;
+  ip_proc_ref_t fref, gref;
+
+  if (ip_vm_new(&vm)) {
+    printf("reregister: error\n");
+    return;
+  }
+  fref = ip_vm_reserve_proc(vm);
+  gref = ip_vm_reserve_proc(vm);
+  if (fref < 0 || gref < 0 || ip_proc_new(2, 0, 4, entry, &f) ||
+      ip_proc_new(1, 0, 4, add100, &g1) || ip_proc_new(2, 0, 4, sub, &g2) ||
+      ip_proc_new(2, 0, 4, add, &g3)) {
+    printf("reregister: error\n");
+    ip_vm_dtor(vm);
+    return;
+  }
+  ip_vm_register_proc_at(vm, f, fref);
+  ip_vm_register_proc_at(vm, g1, gref);
+#ifdef IP_VM_AOT
+  if (ip_vm_compile_aot(vm)) {
+    printf("reregister: error\n");
+    ip_vm_dtor(vm);
+    return;
+  }
+#endif
+
+  ip_check_rerun(vm, fref, "reregister 1 arg");
+  ip_vm_register_proc_at(vm, g2, gref);
+  ip_check_rerun(vm, fref, "reregister 2 args");
+  ip_vm_register_proc_at(vm, g3, gref);
+  ip_check_rerun(vm, fref, "reregister same arity");
+
+  ip_vm_dtor(vm);
+}
+
+/* procs made by ip_vm_new_proc, freed with their vm */
+static void
+ip_check_vm_procs(void)
+{
+  struct ip_inst entry[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CALL(1),
+    IP_INST_GET_LOCAL(0),
+    IP_INST_CALL(1),
+    IP_INST_ADD(),
+    IP_INST_EXIT(),
+  };
+  struct ip_inst twice[] = {
+    IP_INST_GET_LOCAL(0),
+    IP_INST_GET_LOCAL(0),
+    IP_INST_ADD(),
+    IP_INST_RETURN(),
+  };
+  struct ip_vm* vm;
+  struct ip_proc *f, *g;
+  ip_value_t result;
+  int ret;
+
+  if (ip_vm_new(&vm)) {
+    printf("procs of the vm: error\n");
+    return;
+  }
+  ret = ip_vm_new_proc(vm, 1, 0, 6, entry, &f) ||
+        ip_vm_new_proc(vm, 1, 0, 4, twice, &g) ||
+        ip_vm_register_proc(vm, f) < 0 || ip_vm_register_proc(vm, g) < 0;
+#ifdef IP_VM_AOT
+  ret = ret || ip_vm_compile_aot(vm);
+#endif
+  ret = ret || ip_vm_push_arg(vm, IP_LLINT2VALUE(5)) || ip_vm_exec(vm, 0) ||
+        ip_vm_get_result(vm, &result);
+  ip_vm_dtor(vm);
+
+  if (ret) {
+    printf("procs of the vm: error\n");
+  } else {
+    printf("procs of the vm: %lld\n", IP_VALUE2LLINT(result));
+  }
+}
+
+int
+main()
+{
+  ip_check_return_const();
+  ip_check_tail_const();
+  ip_check_indirect();
+  ip_check_loop_at_entry();
+  ip_check_underflow();
+#ifdef IP_CHECK_TAIL_CALLS
+  ip_check_deep_tail_calls();
+#endif
+#ifdef IP_CHECK_STACK_LIMITS
+  ip_check_deep_recursion();
+#endif
+  ip_check_indirect_miss();
+  ip_check_reregister();
+  ip_check_vm_procs();
+
+  return 0;
+}
@@ -0,0 +1,345 @@
+#ifndef IP_H_INLINER
+#define IP_H_INLINER
+
+#include "tail_call.h"
+#include "vm.h"
+#include <stdlib.h>
+
+/**
+ * bytecode inliner.
+ * Splices the bodies of small callees into their callers in place of the
+ * CALLs. The args popped by the CALL are stored to locals of the caller and
+ * the callee's locals are renumbered after the caller's, so the call site
+ * runs without a callinfo, a PUSHN of the locals or a POPN on RETURN. A
+ * RETURN of the callee becomes a JUMP past the spliced body, leaving the
+ * result on the stack like the CALL did.
+ *
+ *   caller          callee(a)           caller after inlining
+ *   GET_LOCAL x     GET_LOCAL a         GET_LOCAL x
+ *   CALL callee     CONST 1             SET_LOCAL 1      ; a
+ *   GET_LOCAL x     ADD                 GET_LOCAL 1
+ *   ADD             RETURN              CONST 1
+ *   RETURN                              ADD
+ *                                       GET_LOCAL x
+ *                                       ADD
+ *                                       RETURN
+ *
+ * Callees are spliced again into the spliced bodies up to
+ * IP_INLINE_MAX_DEPTH, which also bounds the unrolling of recursive ones.
+ * Sibling sites share the same renumbered locals, the caller's frame only
+ * grows by the deepest chain of splices. Tail calls are left as they are.
+ */
+
+/* insts of a callee to be spliced */
+#define IP_INLINE_MAX_CALLEE 32
+/* nested splices in a caller */
+#define IP_INLINE_MAX_DEPTH 2
+/* insts of a caller, no callee is spliced once it is reached */
+#define IP_INLINE_MAX_INSTS 512
+
+/* a proc as the inliner sees it. insts are the ones it was registered with */
+struct ip_inline_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  const struct ip_inst* insts;
+};
+
+/* the proc at ref, 1 if there is none */
+typedef int (*ip_inline_lookup_t)(void* ctx,
+                                  ip_proc_ref_t ref,
+                                  struct ip_inline_proc* ret);
+
+struct ip_inline_buf
+{
+  size_t n;
+  size_t cap;
+  struct ip_inst* insts;
+};
+
+static int
+ip_inline_put(struct ip_inline_buf* buf, struct ip_inst inst)
+{
+  if (buf->n == buf->cap) {
+    struct ip_inst* insts;
+
+    insts = realloc(buf->insts, 2 * buf->cap * sizeof(struct ip_inst));
+    if (NULL == insts) {
+      return 1;
+    }
+    buf->insts = insts;
+    buf->cap *= 2;
+  }
+  buf->insts[buf->n++] = inst;
+
+  return 0;
+}
+
+/* the inst a jump at inst lands on */
+#define IP_INLINE_TARGET(inst) ((inst).u.pos + 1)
+
+/* can callee be spliced. the depth of its stack must be known at every
+ * inst and be 1 at every RETURN, that is, nothing but the result may be
+ * left under the frame when it is gone. it may not leave the proc but by a
+ * RETURN */
+static int
+ip_inline_can(const struct ip_inline_proc* callee,
+              ip_inline_lookup_t lookup,
+              void* ctx)
+{
+  size_t i, n, nwork, *work;
+  long *depths, d;
+  struct ip_inline_proc p;
+  int ret = 0;
+
+  n = callee->ninsts;
+  if (0 == n || IP_INLINE_MAX_CALLEE < n) {
+    return 0;
+  }
+
+  depths = malloc(n * sizeof(long));
+  work = malloc(n * sizeof(size_t));
+  if (NULL == depths || NULL == work) {
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    depths[i] = -1;
+  }
+
+#define SUCC(s, sd)                                                            \
+  do {                                                                         \
+    if (n <= (s) || (sd) < 0) {                                                \
+      goto done;                                                               \
+    }                                                                          \
+    if (depths[s] < 0) {                                                       \
+      depths[s] = (sd);                                                        \
+      work[nwork++] = (s);                                                     \
+    } else if (depths[s] != (sd)) {                                            \
+      goto done;                                                               \
+    }                                                                          \
+  } while (0)
+
+  nwork = 0;
+  SUCC(0, 0);
+  while (nwork) {
+    const struct ip_inst* inst;
+
+    i = work[--nwork];
+    inst = &callee->insts[i];
+    d = depths[i];
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        SUCC(i + 1, d + 1);
+        break;
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        if (inst->u.i < 0 ||
+            callee->nargs + callee->nlocals <= (size_t)inst->u.i) {
+          goto done;
+        }
+        SUCC(i + 1, IP_CODE_GET_LOCAL == inst->code ? d + 1 : d - 1);
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        SUCC(i + 1, d < 2 ? -1 : d - 1);
+        break;
+      case IP_CODE_JUMP:
+        SUCC(IP_INLINE_TARGET(*inst), d);
+        break;
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        SUCC(IP_INLINE_TARGET(*inst), d - 1);
+        SUCC(i + 1, d - 1);
+        break;
+      case IP_CODE_CALL:
+        if (lookup(ctx, inst->u.p, &p) || d < (long)p.nargs) {
+          goto done;
+        }
+        SUCC(i + 1, d - (long)p.nargs + 1);
+        break;
+      case IP_CODE_RETURN:
+        if (1 != d) {
+          goto done;
+        }
+        break;
+      default:
+        /* the arity of CALL_INDIRECT is not known, EXIT ends the vm and
+         * TAIL_CALL drops the frame, which is the caller's once spliced */
+        goto done;
+    }
+  }
+#undef SUCC
+
+  ret = 1;
+
+done:
+  free(depths);
+  free(work);
+  return ret;
+}
+
+/* emits the insts of proc, its locals starting at base in the frame of the
+ * caller. frame is the size of the frame needed so far */
+static int
+ip_inline_splice(struct ip_inline_buf* buf,
+                 const struct ip_inline_proc* proc,
+                 size_t base,
+                 size_t depth,
+                 size_t* frame,
+                 ip_inline_lookup_t lookup,
+                 void* ctx)
+{
+  size_t i, k, cbase, *map;
+  struct ip_inst inst;
+  struct ip_inline_proc callee;
+
+  /* the position of each inst in buf, and of the end */
+  map = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == map) {
+    return 1;
+  }
+
+  cbase = base + proc->nargs + proc->nlocals;
+  if (*frame < cbase) {
+    *frame = cbase;
+  }
+
+  for (i = 0; i < proc->ninsts; i++) {
+    map[i] = buf->n;
+    inst = proc->insts[i];
+
+    switch (inst.code) {
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        inst.u.i += base;
+        break;
+      case IP_CODE_CALL:
+        /* a tail call already runs in the frame of the caller */
+        if (IP_TAIL_CALL_AT(proc->insts, proc->ninsts, i) ||
+            IP_INLINE_MAX_DEPTH <= depth ||
+            lookup(ctx, inst.u.p, &callee) ||
+            IP_INLINE_MAX_INSTS < buf->n + callee.ninsts + callee.nargs +
+                                    2 * callee.nlocals ||
+            !ip_inline_can(&callee, lookup, ctx)) {
+          break;
+        }
+
+        /* the args, last one on the top */
+        for (k = callee.nargs; k--;) {
+          inst.code = IP_CODE_SET_LOCAL;
+          inst.u.i = cbase + k;
+          if (ip_inline_put(buf, inst)) {
+            goto fail;
+          }
+        }
+        /* the locals start at 0 on every call */
+        for (k = 0; k < callee.nlocals; k++) {
+          inst.code = IP_CODE_CONST;
+          inst.u.v = IP_LLINT2VALUE(0);
+          if (ip_inline_put(buf, inst)) {
+            goto fail;
+          }
+          inst.code = IP_CODE_SET_LOCAL;
+          inst.u.i = cbase + callee.nargs + k;
+          if (ip_inline_put(buf, inst)) {
+            goto fail;
+          }
+        }
+        if (ip_inline_splice(
+              buf, &callee, cbase, depth + 1, frame, lookup, ctx)) {
+          goto fail;
+        }
+        continue;
+      case IP_CODE_RETURN:
+        if (0 == depth) {
+          break;
+        }
+        /* the last inst falls through to the end */
+        if (i + 1 == proc->ninsts) {
+          continue;
+        }
+        /* a JUMP to the end, patched below */
+        inst.code = IP_CODE_JUMP;
+        break;
+      default:
+        break;
+    }
+    if (ip_inline_put(buf, inst)) {
+      goto fail;
+    }
+  }
+  map[proc->ninsts] = buf->n;
+
+  /* jumps are emitted as one inst each, at map[i] */
+  for (i = 0; i < proc->ninsts; i++) {
+    size_t t;
+
+    switch (proc->insts[i].code) {
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        t = IP_INLINE_TARGET(proc->insts[i]);
+        if (proc->ninsts < t) {
+          t = proc->ninsts;
+        }
+        buf->insts[map[i]].u.pos = map[t] - 1;
+        break;
+      case IP_CODE_RETURN:
+        if (0 < depth && i + 1 < proc->ninsts) {
+          buf->insts[map[i]].u.pos = map[proc->ninsts] - 1;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  free(map);
+  return 0;
+
+fail:
+  free(map);
+  return 1;
+}
+
+/* the insts of proc with its callees spliced in, in a malloced array, and
+ * the number of locals of the grown frame */
+static int
+ip_inline(const struct ip_inline_proc* proc,
+          ip_inline_lookup_t lookup,
+          void* ctx,
+          struct ip_inst** insts,
+          size_t* ninsts,
+          size_t* nlocals) __attribute__((unused));
+static int
+ip_inline(const struct ip_inline_proc* proc,
+          ip_inline_lookup_t lookup,
+          void* ctx,
+          struct ip_inst** insts,
+          size_t* ninsts,
+          size_t* nlocals)
+{
+  struct ip_inline_buf buf;
+  size_t frame = 0;
+
+  buf.n = 0;
+  buf.cap = proc->ninsts + 1;
+  buf.insts = malloc(buf.cap * sizeof(struct ip_inst));
+  if (NULL == buf.insts) {
+    return 1;
+  }
+
+  if (ip_inline_splice(&buf, proc, 0, 0, &frame, lookup, ctx)) {
+    free(buf.insts);
+    return 1;
+  }
+
+  *insts = buf.insts;
+  *ninsts = buf.n;
+  *nlocals = frame - proc->nargs;
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,466 @@
+#ifndef IP_H_JIT
+#define IP_H_JIT
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* x86-64 code emission helpers shared by the native engines. */
+
+enum ip_jit_reg
+{
+  IP_JIT_RAX,
+  IP_JIT_RCX,
+  IP_JIT_RDX,
+  IP_JIT_RBX,
+  IP_JIT_RSP,
+  IP_JIT_RBP,
+  IP_JIT_RSI,
+  IP_JIT_RDI,
+  IP_JIT_R8,
+  IP_JIT_R9,
+  IP_JIT_R10,
+  IP_JIT_R11,
+  IP_JIT_R12,
+  IP_JIT_R13,
+  IP_JIT_R14,
+  IP_JIT_R15,
+};
+
+/* condition codes, used as 0x0F 0x80+cc (jcc rel32) */
+enum ip_jit_cond
+{
+  IP_JIT_CC_B = 0x2,
+  IP_JIT_CC_AE = 0x3,
+  IP_JIT_CC_E = 0x4,
+  IP_JIT_CC_NE = 0x5,
+  IP_JIT_CC_BE = 0x6,
+  IP_JIT_CC_A = 0x7,
+  IP_JIT_CC_S = 0x8,
+  IP_JIT_CC_NS = 0x9,
+  IP_JIT_CC_L = 0xc,
+  IP_JIT_CC_GE = 0xd,
+  IP_JIT_CC_LE = 0xe,
+  IP_JIT_CC_G = 0xf,
+};
+
+/* opcodes of the `op r/m64, r64` and `op r64, r/m64` families */
+#define IP_JIT_OP_ADD_RM_R 0x01
+#define IP_JIT_OP_ADD_R_RM 0x03
+#define IP_JIT_OP_SUB_RM_R 0x29
+#define IP_JIT_OP_SUB_R_RM 0x2b
+#define IP_JIT_OP_CMP_RM_R 0x39
+#define IP_JIT_OP_CMP_R_RM 0x3b
+#define IP_JIT_OP_TEST_RM_R 0x85
+#define IP_JIT_OP_MOV_RM_R 0x89
+#define IP_JIT_OP_MOV_R_RM 0x8b
+#define IP_JIT_OP_LEA 0x8d
+
+/* extensions of the 0x81 immediate group */
+#define IP_JIT_EXT_ADD 0
+#define IP_JIT_EXT_SUB 5
+#define IP_JIT_EXT_CMP 7
+
+/**
+ * growable buffer the code is emitted into before it is copied to the
+ * executable arena. Running out of memory sets `failed` and further
+ * emission is ignored, so callers check once at the end.
+ */
+struct ip_jit_buf
+{
+  unsigned char* data;
+  size_t size;
+  size_t len;
+  int failed;
+};
+
+static int ip_jit_buf_init(struct ip_jit_buf* buf) __attribute__((unused));
+static int
+ip_jit_buf_init(struct ip_jit_buf* buf)
+{
+  buf->size = 256;
+  buf->len = 0;
+  buf->failed = 0;
+  buf->data = malloc(buf->size);
+  if (NULL == buf->data) {
+    return 1;
+  }
+  return 0;
+}
+
+static void ip_jit_buf_dtor(struct ip_jit_buf* buf) __attribute__((unused));
+static void
+ip_jit_buf_dtor(struct ip_jit_buf* buf)
+{
+  free(buf->data);
+}
+
+static void ip_jit_emit_u8(struct ip_jit_buf* buf, unsigned char b)
+  __attribute__((unused));
+static void
+ip_jit_emit_u8(struct ip_jit_buf* buf, unsigned char b)
+{
+  if (buf->failed) {
+    return;
+  }
+  if (buf->len == buf->size) {
+    unsigned char* data = realloc(buf->data, buf->size * 2);
+    if (NULL == data) {
+      buf->failed = 1;
+      return;
+    }
+    buf->data = data;
+    buf->size *= 2;
+  }
+  buf->data[buf->len++] = b;
+}
+
+static void ip_jit_emit_u32(struct ip_jit_buf* buf, uint32_t v)
+  __attribute__((unused));
+static void
+ip_jit_emit_u32(struct ip_jit_buf* buf, uint32_t v)
+{
+  int i;
+  for (i = 0; i < 4; i++) {
+    ip_jit_emit_u8(buf, (v >> (8 * i)) & 0xff);
+  }
+}
+
+static void ip_jit_emit_u64(struct ip_jit_buf* buf, uint64_t v)
+  __attribute__((unused));
+static void
+ip_jit_emit_u64(struct ip_jit_buf* buf, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    ip_jit_emit_u8(buf, (v >> (8 * i)) & 0xff);
+  }
+}
+
+static void ip_jit_patch_u32(unsigned char* at, uint32_t v)
+  __attribute__((unused));
+static void
+ip_jit_patch_u32(unsigned char* at, uint32_t v)
+{
+  int i;
+  for (i = 0; i < 4; i++) {
+    at[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+static void ip_jit_patch_u64(unsigned char* at, uint64_t v)
+  __attribute__((unused));
+static void
+ip_jit_patch_u64(unsigned char* at, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    at[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+/* REX.W prefix with the high bits of reg and rm */
+static void ip_jit_rex_w(struct ip_jit_buf* buf, int reg, int rm)
+  __attribute__((unused));
+static void
+ip_jit_rex_w(struct ip_jit_buf* buf, int reg, int rm)
+{
+  ip_jit_emit_u8(buf, 0x48 | ((reg >> 1) & 4) | ((rm >> 3) & 1));
+}
+
+/* ModRM (and SIB) for [base + disp]. mod=00 is never used so rbp/r13 work */
+static void ip_jit_modrm_mem(struct ip_jit_buf* buf,
+                             int reg,
+                             int base,
+                             int32_t disp) __attribute__((unused));
+static void
+ip_jit_modrm_mem(struct ip_jit_buf* buf, int reg, int base, int32_t disp)
+{
+  int mod = (-128 <= disp && disp < 128) ? 1 : 2;
+
+  ip_jit_emit_u8(buf, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == IP_JIT_RSP) {
+    ip_jit_emit_u8(buf, 0x24);
+  }
+  if (1 == mod) {
+    ip_jit_emit_u8(buf, (unsigned char)disp);
+  } else {
+    ip_jit_emit_u32(buf, (uint32_t)disp);
+  }
+}
+
+/* `op reg, [base + disp]` or `op [base + disp], reg` depending on opcode */
+static void ip_jit_op_mem(struct ip_jit_buf* buf,
+                          unsigned char opcode,
+                          int reg,
+                          int base,
+                          int32_t disp) __attribute__((unused));
+static void
+ip_jit_op_mem(struct ip_jit_buf* buf,
+              unsigned char opcode,
+              int reg,
+              int base,
+              int32_t disp)
+{
+  ip_jit_rex_w(buf, reg, base);
+  ip_jit_emit_u8(buf, opcode);
+  ip_jit_modrm_mem(buf, reg, base, disp);
+}
+
+/* `op rm, reg` with both operands registers */
+static void ip_jit_op_reg(struct ip_jit_buf* buf,
+                          unsigned char opcode,
+                          int reg,
+                          int rm) __attribute__((unused));
+static void
+ip_jit_op_reg(struct ip_jit_buf* buf, unsigned char opcode, int reg, int rm)
+{
+  ip_jit_rex_w(buf, reg, rm);
+  ip_jit_emit_u8(buf, opcode);
+  ip_jit_emit_u8(buf, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* `add/sub/cmp rm, imm32` */
+static void ip_jit_op_imm(struct ip_jit_buf* buf, int ext, int rm, int32_t imm)
+  __attribute__((unused));
+static void
+ip_jit_op_imm(struct ip_jit_buf* buf, int ext, int rm, int32_t imm)
+{
+  ip_jit_rex_w(buf, 0, rm);
+  ip_jit_emit_u8(buf, 0x81);
+  ip_jit_emit_u8(buf, 0xc0 | (ext << 3) | (rm & 7));
+  ip_jit_emit_u32(buf, (uint32_t)imm);
+}
+
+/* `add/sub/cmp qword [base + disp], imm32` */
+static void ip_jit_op_mem_imm(struct ip_jit_buf* buf,
+                              int ext,
+                              int base,
+                              int32_t disp,
+                              int32_t imm) __attribute__((unused));
+static void
+ip_jit_op_mem_imm(struct ip_jit_buf* buf,
+                  int ext,
+                  int base,
+                  int32_t disp,
+                  int32_t imm)
+{
+  ip_jit_rex_w(buf, 0, base);
+  ip_jit_emit_u8(buf, 0x81);
+  ip_jit_modrm_mem(buf, ext, base, disp);
+  ip_jit_emit_u32(buf, (uint32_t)imm);
+}
+
+/* `mov reg, imm`, choosing the shortest encoding */
+static void ip_jit_mov_imm(struct ip_jit_buf* buf, int reg, int64_t imm)
+  __attribute__((unused));
+static void
+ip_jit_mov_imm(struct ip_jit_buf* buf, int reg, int64_t imm)
+{
+  if (INT32_MIN <= imm && imm <= INT32_MAX) {
+    /* mov r/m64, imm32 (sign extended) */
+    ip_jit_rex_w(buf, 0, reg);
+    ip_jit_emit_u8(buf, 0xc7);
+    ip_jit_emit_u8(buf, 0xc0 | (reg & 7));
+    ip_jit_emit_u32(buf, (uint32_t)imm);
+  } else {
+    /* movabs */
+    ip_jit_rex_w(buf, 0, reg);
+    ip_jit_emit_u8(buf, 0xb8 | (reg & 7));
+    ip_jit_emit_u64(buf, (uint64_t)imm);
+  }
+}
+
+/* `mov qword [base + disp], imm32` (sign extended) */
+static void ip_jit_mov_mem_imm(struct ip_jit_buf* buf,
+                               int base,
+                               int32_t disp,
+                               int32_t imm) __attribute__((unused));
+static void
+ip_jit_mov_mem_imm(struct ip_jit_buf* buf, int base, int32_t disp, int32_t imm)
+{
+  ip_jit_rex_w(buf, 0, base);
+  ip_jit_emit_u8(buf, 0xc7);
+  ip_jit_modrm_mem(buf, 0, base, disp);
+  ip_jit_emit_u32(buf, (uint32_t)imm);
+}
+
+static void ip_jit_push(struct ip_jit_buf* buf, int reg) __attribute__((unused));
+static void
+ip_jit_push(struct ip_jit_buf* buf, int reg)
+{
+  if (reg >= 8) {
+    ip_jit_emit_u8(buf, 0x41);
+  }
+  ip_jit_emit_u8(buf, 0x50 | (reg & 7));
+}
+
+static void ip_jit_pop(struct ip_jit_buf* buf, int reg) __attribute__((unused));
+static void
+ip_jit_pop(struct ip_jit_buf* buf, int reg)
+{
+  if (reg >= 8) {
+    ip_jit_emit_u8(buf, 0x41);
+  }
+  ip_jit_emit_u8(buf, 0x58 | (reg & 7));
+}
+
+static void ip_jit_ret(struct ip_jit_buf* buf) __attribute__((unused));
+static void
+ip_jit_ret(struct ip_jit_buf* buf)
+{
+  ip_jit_emit_u8(buf, 0xc3);
+}
+
+/* `jmp/call qword [base + disp]` */
+static void ip_jit_jmp_mem(struct ip_jit_buf* buf, int base, int32_t disp)
+  __attribute__((unused));
+static void
+ip_jit_jmp_mem(struct ip_jit_buf* buf, int base, int32_t disp)
+{
+  if (base >= 8) {
+    ip_jit_emit_u8(buf, 0x41);
+  }
+  ip_jit_emit_u8(buf, 0xff);
+  ip_jit_modrm_mem(buf, 4, base, disp);
+}
+
+static void ip_jit_call_mem(struct ip_jit_buf* buf, int base, int32_t disp)
+  __attribute__((unused));
+static void
+ip_jit_call_mem(struct ip_jit_buf* buf, int base, int32_t disp)
+{
+  if (base >= 8) {
+    ip_jit_emit_u8(buf, 0x41);
+  }
+  ip_jit_emit_u8(buf, 0xff);
+  ip_jit_modrm_mem(buf, 2, base, disp);
+}
+
+/* `call reg` */
+static void ip_jit_call_reg(struct ip_jit_buf* buf, int reg)
+  __attribute__((unused));
+static void
+ip_jit_call_reg(struct ip_jit_buf* buf, int reg)
+{
+  if (reg >= 8) {
+    ip_jit_emit_u8(buf, 0x41);
+  }
+  ip_jit_emit_u8(buf, 0xff);
+  ip_jit_emit_u8(buf, 0xd0 | (reg & 7));
+}
+
+/**
+ * rel32 branches. They return the offset of the displacement so it can be
+ * patched once the target is known.
+ */
+static size_t ip_jit_jmp(struct ip_jit_buf* buf) __attribute__((unused));
+static size_t
+ip_jit_jmp(struct ip_jit_buf* buf)
+{
+  ip_jit_emit_u8(buf, 0xe9);
+  ip_jit_emit_u32(buf, 0);
+  return buf->len - 4;
+}
+
+static size_t ip_jit_jcc(struct ip_jit_buf* buf, enum ip_jit_cond cc)
+  __attribute__((unused));
+static size_t
+ip_jit_jcc(struct ip_jit_buf* buf, enum ip_jit_cond cc)
+{
+  ip_jit_emit_u8(buf, 0x0f);
+  ip_jit_emit_u8(buf, 0x80 | cc);
+  ip_jit_emit_u32(buf, 0);
+  return buf->len - 4;
+}
+
+static size_t ip_jit_call(struct ip_jit_buf* buf) __attribute__((unused));
+static size_t
+ip_jit_call(struct ip_jit_buf* buf)
+{
+  ip_jit_emit_u8(buf, 0xe8);
+  ip_jit_emit_u32(buf, 0);
+  return buf->len - 4;
+}
+
+/* point the rel32 at `at` (both offsets into the same buffer) to `target` */
+static void ip_jit_link(struct ip_jit_buf* buf, size_t at, size_t target)
+  __attribute__((unused));
+static void
+ip_jit_link(struct ip_jit_buf* buf, size_t at, size_t target)
+{
+  if (buf->failed) {
+    return;
+  }
+  ip_jit_patch_u32(buf->data + at, (uint32_t)(target - (at + 4)));
+}
+
+/* point the rel32 at `at` (in placed code) to the absolute `target` */
+static void ip_jit_link_abs(unsigned char* at, void* target)
+  __attribute__((unused));
+static void
+ip_jit_link_abs(unsigned char* at, void* target)
+{
+  ip_jit_patch_u32(at, (uint32_t)((unsigned char*)target - (at + 4)));
+}
+
+/**
+ * executable arena.
+ * All the code of a translation unit lives in one reserved region so that
+ * rel32 calls between procs always reach. Code is never freed.
+ */
+#define IP_JIT_ARENA_SIZE (64 * 1024 * 1024)
+
+static unsigned char* ip_jit_arena;
+static size_t ip_jit_arena_used;
+
+static void* ip_jit_alloc(size_t size) __attribute__((unused));
+static void*
+ip_jit_alloc(size_t size)
+{
+  void* ret;
+
+  if (NULL == ip_jit_arena) {
+    void* p = mmap(NULL,
+                   IP_JIT_ARENA_SIZE,
+                   PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                   -1,
+                   0);
+    if (MAP_FAILED == p) {
+      return NULL;
+    }
+    ip_jit_arena = p;
+    ip_jit_arena_used = 0;
+  }
+
+  size = (size + 15) & ~(size_t)15;
+  if (IP_JIT_ARENA_SIZE - ip_jit_arena_used < size) {
+    return NULL;
+  }
+
+  ret = ip_jit_arena + ip_jit_arena_used;
+  ip_jit_arena_used += size;
+  return ret;
+}
+
+/* copy the finished buffer into the arena */
+static void* ip_jit_place(struct ip_jit_buf* buf) __attribute__((unused));
+static void*
+ip_jit_place(struct ip_jit_buf* buf)
+{
+  void* code;
+
+  if (buf->failed) {
+    return NULL;
+  }
+  code = ip_jit_alloc(buf->len);
+  if (NULL == code) {
+    return NULL;
+  }
+  memcpy(code, buf->data, buf->len);
+  return code;
+}
+
+#endif
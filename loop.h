@@ -0,0 +1,740 @@
+#ifndef IP_H_LOOP
+#define IP_H_LOOP
+
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * counted loops.
+ * Built with IP_LOOP, every engine passes the insts given to ip_proc_init
+ * through ip_loop. It looks for loops of the shape
+ *
+ *   head: <test>              GET_LOCAL, CONST, ADD, SUB
+ *         JUMP_IF_NEG/JUMP_IF_ZERO exit
+ *         <body>              GET_LOCAL, CONST, ADD, SUB, SET_LOCAL
+ *         JUMP head
+ *
+ * entered by no other jump but at head. The test and the body are run on
+ * linear expressions of the locals at the head. Each local the body writes
+ * must be an induction variable, i += c, or a reduction, s += a linear
+ * expression of the induction variables and of the locals it does not
+ * write, which nothing but s itself reads. The test must be such an
+ * expression too, going down by a constant step every iteration.
+ *
+ * If the test and the terms of the reductions are constants when the loop
+ * is entered, its number of iterations is known and the loop becomes the
+ * values it leaves in the locals. Otherwise a copy of the body runs
+ * IP_LOOP_UNROLL iterations at once, while the test says they all would
+ * run, with the sums of the reductions strength reduced to adds of the
+ * induction variables, and the loop as it was runs the last ones:
+ *
+ *   head: <test> JUMP_IF_NEG rest
+ *         <test> + (IP_LOOP_UNROLL - 1) * step JUMP_IF_NEG rest
+ *         s += IP_LOOP_UNROLL * terms + sums of the steps of the terms
+ *         i += IP_LOOP_UNROLL * c
+ *         JUMP head
+ *   rest: the loop
+ *
+ * The arithmetic wraps like the engines do. The loops transformed are
+ * written to stderr.
+ */
+
+#define IP_LOOP_UNROLL 16
+/* GET_LOCALs of the terms of the reductions of an unrolled loop */
+#define IP_LOOP_MAX_TERMS 64
+
+#define IP_LOOP_TARGET(inst) ((inst).u.pos + 1)
+
+#define IP_LOOP_IS_JUMP(code)                                                  \
+  (IP_CODE_JUMP == (code) || IP_CODE_JUMP_IF_ZERO == (code) ||                 \
+   IP_CODE_JUMP_IF_NEG == (code))
+
+/* can be run on expressions */
+#define IP_LOOP_IS_LINEAR(code)                                                \
+  (IP_CODE_CONST == (code) || IP_CODE_GET_LOCAL == (code) ||                   \
+   IP_CODE_SET_LOCAL == (code) || IP_CODE_ADD == (code) ||                     \
+   IP_CODE_SUB == (code))
+
+enum ip_loop_kind
+{
+  IP_LOOP_INVARIANT,
+  IP_LOOP_INDUCTION,
+  IP_LOOP_REDUCTION,
+};
+
+/**
+ * An expression is nvars + 1 values, the factor of each local and a
+ * constant. The factors are unsigned to wrap.
+ */
+typedef unsigned long long ip_loop_word_t;
+
+struct ip_loop
+{
+  size_t nargs;
+  size_t nvars;
+  size_t n;
+  const struct ip_inst* insts;
+  /* the number of jumps landing on each inst */
+  size_t* targets;
+
+  /* the loop being looked at */
+  size_t head;
+  /* its JUMP_IF_* and its JUMP back */
+  size_t test;
+  size_t back;
+  /* the test */
+  ip_loop_word_t* cond;
+  /* each local after an iteration */
+  ip_loop_word_t* vars;
+  ip_loop_word_t* stack;
+  char* kinds;
+  /* the change of the test each iteration */
+  long long step;
+
+  /* the locals known when the loop is entered, and the stack on the way */
+  char* known;
+  ip_loop_word_t* values;
+  char* sknown;
+  ip_loop_word_t* svalues;
+
+  /* the output, with the jumps to old positions marked */
+  size_t nout;
+  size_t cap;
+  struct ip_inst* out;
+  char* fix;
+};
+
+static int
+ip_loop_put(struct ip_loop* lp, struct ip_inst inst, int fix)
+{
+  if (lp->nout == lp->cap) {
+    struct ip_inst* out;
+    char* f;
+
+    out = realloc(lp->out, 2 * lp->cap * sizeof(struct ip_inst));
+    if (NULL == out) {
+      return 1;
+    }
+    lp->out = out;
+    f = realloc(lp->fix, 2 * lp->cap);
+    if (NULL == f) {
+      return 1;
+    }
+    lp->fix = f;
+    lp->cap *= 2;
+  }
+  lp->out[lp->nout] = inst;
+  lp->fix[lp->nout] = fix;
+  lp->nout += 1;
+
+  return 0;
+}
+
+static int
+ip_loop_put_code(struct ip_loop* lp, enum ip_code code, ip_value_t v)
+{
+  struct ip_inst inst;
+
+  inst.code = code;
+  if (IP_CODE_GET_LOCAL == code || IP_CODE_SET_LOCAL == code) {
+    inst.u.i = (int)v;
+  } else {
+    inst.u.v = v;
+  }
+  return ip_loop_put(lp, inst, 0);
+}
+
+/* a jump to the inst at out, which is in the output if fix is 0 and in the
+ * insts given otherwise */
+static int
+ip_loop_put_jump(struct ip_loop* lp, enum ip_code code, size_t at, int fix)
+{
+  struct ip_inst inst;
+
+  inst.code = code;
+  inst.u.pos = at - 1;
+  return ip_loop_put(lp, inst, fix);
+}
+
+/* runs insts[from, to) on the expressions of the locals in vars and of the
+ * stack from depth on. 1 if an inst is not linear or pops what was there
+ * before */
+static int
+ip_loop_eval(struct ip_loop* lp, size_t from, size_t to, size_t* depth)
+{
+  size_t i, k, w = lp->nvars + 1;
+  ip_loop_word_t* top;
+
+  for (i = from; i < to; i++) {
+    const struct ip_inst* inst = &lp->insts[i];
+
+    top = &lp->stack[*depth * w];
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        memset(top, 0, w * sizeof(ip_loop_word_t));
+        top[lp->nvars] = (ip_loop_word_t)IP_VALUE2LLINT(inst->u.v);
+        *depth += 1;
+        break;
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        if (inst->u.i < 0 || lp->nvars <= (size_t)inst->u.i) {
+          return 1;
+        }
+        if (IP_CODE_GET_LOCAL == inst->code) {
+          memcpy(top, &lp->vars[inst->u.i * w], w * sizeof(ip_loop_word_t));
+          *depth += 1;
+        } else {
+          if (0 == *depth) {
+            return 1;
+          }
+          *depth -= 1;
+          memcpy(&lp->vars[inst->u.i * w], top - w, w * sizeof(ip_loop_word_t));
+        }
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        if (*depth < 2) {
+          return 1;
+        }
+        for (k = 0; k < w; k++) {
+          if (IP_CODE_ADD == inst->code) {
+            top[k - 2 * w] += top[k - w];
+          } else {
+            top[k - 2 * w] -= top[k - w];
+          }
+        }
+        *depth -= 1;
+        break;
+      default:
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* the factor of local u in e as a small signed number, or 0 if it is too
+ * large to be unrolled into adds */
+static long long
+ip_loop_factor(const ip_loop_word_t* e, size_t u)
+{
+  long long a = (long long)e[u];
+
+  return -IP_LOOP_MAX_TERMS <= a && a <= IP_LOOP_MAX_TERMS ? a : 0;
+}
+
+/* is the loop from head to its JUMP back at back of the shape, with its
+ * locals sorted into kinds and the step of its test */
+static int
+ip_loop_match(struct ip_loop* lp, size_t head, size_t back)
+{
+  size_t i, u, v, depth, w = lp->nvars + 1, test = lp->n;
+  ip_loop_word_t* e;
+
+  for (i = head; i < back; i++) {
+    if (IP_LOOP_IS_JUMP(lp->insts[i].code) && lp->n == test) {
+      test = i;
+    } else if (!IP_LOOP_IS_LINEAR(lp->insts[i].code)) {
+      return 0;
+    }
+    /* entered at head only */
+    if (head < i && lp->targets[i]) {
+      return 0;
+    }
+  }
+  if (lp->n == test || IP_CODE_JUMP == lp->insts[test].code ||
+      lp->targets[back]) {
+    return 0;
+  }
+  /* the exit leaves the loop */
+  i = IP_LOOP_TARGET(lp->insts[test]);
+  if (head <= i && i <= back) {
+    return 0;
+  }
+  for (i = head; i < test; i++) {
+    if (IP_CODE_SET_LOCAL == lp->insts[i].code) {
+      return 0;
+    }
+  }
+
+  /* the locals as they are at head */
+  memset(lp->vars, 0, lp->nvars * w * sizeof(ip_loop_word_t));
+  for (u = 0; u < lp->nvars; u++) {
+    lp->vars[u * w + u] = 1;
+  }
+  depth = 0;
+  if (ip_loop_eval(lp, head, test, &depth) || 1 != depth) {
+    return 0;
+  }
+  memcpy(lp->cond, lp->stack, w * sizeof(ip_loop_word_t));
+  depth = 0;
+  if (ip_loop_eval(lp, test + 1, back, &depth) || 0 != depth) {
+    return 0;
+  }
+
+  for (v = 0; v < lp->nvars; v++) {
+    e = &lp->vars[v * w];
+    lp->kinds[v] = IP_LOOP_INVARIANT;
+    for (u = 0; u < lp->nvars; u++) {
+      if (u != v && e[u]) {
+        lp->kinds[v] = IP_LOOP_REDUCTION;
+      }
+    }
+    if (1 != e[v]) {
+      return 0;
+    }
+    if (IP_LOOP_INVARIANT == lp->kinds[v] && e[lp->nvars]) {
+      lp->kinds[v] = IP_LOOP_INDUCTION;
+    }
+  }
+  /* a reduction is only read by itself, its terms are not reductions */
+  for (v = 0; v < lp->nvars; v++) {
+    e = &lp->vars[v * w];
+    for (u = 0; u < lp->nvars; u++) {
+      if (u != v && e[u] &&
+          (IP_LOOP_REDUCTION == lp->kinds[u] || !ip_loop_factor(e, u))) {
+        return 0;
+      }
+    }
+  }
+
+  lp->step = 0;
+  for (u = 0; u < lp->nvars; u++) {
+    if (!lp->cond[u]) {
+      continue;
+    }
+    if (IP_LOOP_REDUCTION == lp->kinds[u] || !ip_loop_factor(lp->cond, u)) {
+      return 0;
+    }
+    if (IP_LOOP_INDUCTION == lp->kinds[u]) {
+      lp->step += (long long)(lp->cond[u] * lp->vars[u * w + lp->nvars]);
+    }
+  }
+  /* a test going down, JUMP_IF_ZERO by 1 so it does not jump over 0 */
+  if (IP_CODE_JUMP_IF_NEG == lp->insts[test].code
+        ? !(-IP_LOOP_MAX_TERMS <= lp->step && lp->step < 0)
+        : !(-1 == lp->step || 1 == lp->step)) {
+    return 0;
+  }
+
+  lp->head = head;
+  lp->test = test;
+  lp->back = back;
+  return 1;
+}
+
+/* the values of the locals known when the loop is entered, from the insts
+ * running straight into head */
+static void
+ip_loop_entry(struct ip_loop* lp)
+{
+  size_t i, from, k, depth = 0;
+
+  memset(lp->known, 0, lp->nvars);
+  /* nothing but the JUMP back and the inst before lands on head */
+  if (1 != lp->targets[lp->head]) {
+    return;
+  }
+  for (from = lp->head;
+       0 < from && IP_LOOP_IS_LINEAR(lp->insts[from - 1].code) &&
+       (from == lp->head || !lp->targets[from]);
+       from--) {
+  }
+  /* the locals start at 0 */
+  if (0 == from && !lp->targets[0]) {
+    for (k = lp->nargs; k < lp->nvars; k++) {
+      lp->known[k] = 1;
+      lp->values[k] = 0;
+    }
+  }
+
+  for (i = from; i < lp->head; i++) {
+    const struct ip_inst* inst = &lp->insts[i];
+
+    k = inst->u.i;
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        lp->sknown[depth] = 1;
+        lp->svalues[depth++] = (ip_loop_word_t)IP_VALUE2LLINT(inst->u.v);
+        break;
+      case IP_CODE_GET_LOCAL:
+        lp->sknown[depth] = k < lp->nvars && lp->known[k];
+        lp->svalues[depth++] = k < lp->nvars ? lp->values[k] : 0;
+        break;
+      case IP_CODE_SET_LOCAL:
+        if (k < lp->nvars) {
+          lp->known[k] = 0 < depth && lp->sknown[depth - 1];
+          lp->values[k] = 0 < depth ? lp->svalues[depth - 1] : 0;
+        }
+        depth -= 0 < depth;
+        break;
+      default:
+        /* ADD, SUB. the values pushed before from are not known */
+        if (depth < 2) {
+          depth = 1;
+          lp->sknown[0] = 0;
+          break;
+        }
+        lp->sknown[depth - 2] = lp->sknown[depth - 2] && lp->sknown[depth - 1];
+        if (IP_CODE_ADD == inst->code) {
+          lp->svalues[depth - 2] += lp->svalues[depth - 1];
+        } else {
+          lp->svalues[depth - 2] -= lp->svalues[depth - 1];
+        }
+        depth -= 1;
+        break;
+    }
+  }
+}
+
+/* n * (n - 1) / 2, wrapping */
+static ip_loop_word_t
+ip_loop_triangle(ip_loop_word_t n)
+{
+  return n % 2 ? n * ((n - 1) / 2) : n / 2 * (n - 1);
+}
+
+/* what iterations times reduction v adds to it, besides the terms of the
+ * locals at the start, whose sum of factors is in *terms */
+static ip_loop_word_t
+ip_loop_increment(struct ip_loop* lp,
+                  size_t v,
+                  ip_loop_word_t iterations,
+                  size_t* terms)
+{
+  size_t u, w = lp->nvars + 1;
+  const ip_loop_word_t* e = &lp->vars[v * w];
+  ip_loop_word_t steps = 0;
+  long long a;
+
+  *terms = 0;
+  for (u = 0; u < lp->nvars; u++) {
+    if (u != v && e[u]) {
+      a = (long long)e[u];
+      *terms += a < 0 ? -a : a;
+      /* by the step of an induction variable, 0 for an invariant */
+      steps += e[u] * lp->vars[u * w + lp->nvars];
+    }
+  }
+  return iterations * e[lp->nvars] + ip_loop_triangle(iterations) * steps;
+}
+
+/* the locals as the loop leaves them, if the number of iterations is known.
+ * 1 if it is not */
+static int
+ip_loop_put_closed(struct ip_loop* lp)
+{
+  size_t u, v, terms, w = lp->nvars + 1;
+  ip_loop_word_t t0 = lp->cond[lp->nvars], iterations, inc;
+  const struct ip_inst* test = &lp->insts[lp->test];
+
+  ip_loop_entry(lp);
+  for (u = 0; u < lp->nvars; u++) {
+    if (lp->cond[u]) {
+      if (!lp->known[u]) {
+        return 1;
+      }
+      t0 += lp->cond[u] * lp->values[u];
+    }
+  }
+  for (v = 0; v < lp->nvars; v++) {
+    for (u = 0; IP_LOOP_REDUCTION == lp->kinds[v] && u < lp->nvars; u++) {
+      if (u != v && lp->vars[v * w + u] && !lp->known[u]) {
+        return 1;
+      }
+    }
+  }
+
+  if (IP_CODE_JUMP_IF_NEG == test->code) {
+    iterations =
+      (long long)t0 < 0 ? 0 : t0 / (ip_loop_word_t)-lp->step + 1;
+  } else {
+    /* around the values until 0 */
+    iterations = 1 == lp->step ? -t0 : t0;
+  }
+
+  for (v = 0; v < lp->nvars; v++) {
+    if (IP_LOOP_INVARIANT == lp->kinds[v]) {
+      continue;
+    }
+    inc = ip_loop_increment(lp, v, iterations, &terms);
+    for (u = 0; u < lp->nvars; u++) {
+      if (u != v && lp->vars[v * w + u]) {
+        inc += iterations * lp->vars[v * w + u] * lp->values[u];
+      }
+    }
+    if (lp->known[v]) {
+      if (ip_loop_put_code(lp, IP_CODE_CONST, lp->values[v] + inc)) {
+        return 1;
+      }
+    } else if (ip_loop_put_code(lp, IP_CODE_GET_LOCAL, v) ||
+               ip_loop_put_code(lp, IP_CODE_CONST, inc) ||
+               ip_loop_put_code(lp, IP_CODE_ADD, 0)) {
+      return 1;
+    }
+    if (ip_loop_put_code(lp, IP_CODE_SET_LOCAL, v)) {
+      return 1;
+    }
+  }
+  if (IP_LOOP_TARGET(*test) != lp->back + 1) {
+    return ip_loop_put_jump(lp, IP_CODE_JUMP, IP_LOOP_TARGET(*test), 1);
+  }
+
+  return 0;
+}
+
+/* the test, the unrolled body and the loop as it was */
+static int
+ip_loop_put_unrolled(struct ip_loop* lp)
+{
+  size_t i, j, u, v, k, terms, head, w = lp->nvars + 1, njumps = 0, jumps[2];
+  const ip_loop_word_t* e;
+  ip_loop_word_t inc;
+  struct ip_inst inst;
+
+  for (v = 0, terms = 0; v < lp->nvars; v++) {
+    if (IP_LOOP_REDUCTION == lp->kinds[v]) {
+      ip_loop_increment(lp, v, IP_LOOP_UNROLL, &k);
+      terms += k * IP_LOOP_UNROLL;
+    }
+  }
+  if (IP_LOOP_MAX_TERMS < terms) {
+    return 1;
+  }
+
+  head = lp->nout;
+#define PUT(code, v)                                                           \
+  do {                                                                         \
+    if (ip_loop_put_code(lp, code, v)) {                                       \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+#define PUT_TEST()                                                             \
+  do {                                                                         \
+    for (i = lp->head; i < lp->test; i++) {                                    \
+      if (ip_loop_put(lp, lp->insts[i], 0)) {                                  \
+        return 1;                                                              \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+#define PUT_EXIT()                                                             \
+  do {                                                                         \
+    jumps[njumps++] = lp->nout;                                                \
+    if (ip_loop_put_jump(lp, IP_CODE_JUMP_IF_NEG, 0, 0)) {                     \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+  if (IP_CODE_JUMP_IF_NEG == lp->insts[lp->test].code) {
+    /* the first and the last of the iterations run, the test goes down in
+     * between without wrapping */
+    PUT_TEST();
+    PUT_EXIT();
+    PUT_TEST();
+    PUT(IP_CODE_CONST, (IP_LOOP_UNROLL - 1) * lp->step);
+    PUT(IP_CODE_ADD, 0);
+  } else if (-1 == lp->step) {
+    /* not 0 for any of them */
+    PUT_TEST();
+    PUT(IP_CODE_CONST, -IP_LOOP_UNROLL);
+    PUT(IP_CODE_ADD, 0);
+  } else {
+    PUT(IP_CODE_CONST, -IP_LOOP_UNROLL);
+    PUT_TEST();
+    PUT(IP_CODE_SUB, 0);
+  }
+  PUT_EXIT();
+
+  /* the reductions read the induction variables before they move */
+  for (v = 0; v < lp->nvars; v++) {
+    if (IP_LOOP_REDUCTION != lp->kinds[v]) {
+      continue;
+    }
+    e = &lp->vars[v * w];
+    inc = ip_loop_increment(lp, v, IP_LOOP_UNROLL, &terms);
+    PUT(IP_CODE_GET_LOCAL, v);
+    for (u = 0; u < lp->nvars; u++) {
+      long long a = (long long)e[u];
+
+      for (j = 0; u != v && j < IP_LOOP_UNROLL * (size_t)(a < 0 ? -a : a);
+           j++) {
+        PUT(IP_CODE_GET_LOCAL, u);
+        PUT(a < 0 ? IP_CODE_SUB : IP_CODE_ADD, 0);
+      }
+    }
+    PUT(IP_CODE_CONST, inc);
+    PUT(IP_CODE_ADD, 0);
+    PUT(IP_CODE_SET_LOCAL, v);
+  }
+  for (v = 0; v < lp->nvars; v++) {
+    if (IP_LOOP_INDUCTION == lp->kinds[v]) {
+      PUT(IP_CODE_GET_LOCAL, v);
+      PUT(IP_CODE_CONST, IP_LOOP_UNROLL * lp->vars[v * w + lp->nvars]);
+      PUT(IP_CODE_ADD, 0);
+      PUT(IP_CODE_SET_LOCAL, v);
+    }
+  }
+  if (ip_loop_put_jump(lp, IP_CODE_JUMP, head, 0)) {
+    return 1;
+  }
+#undef PUT
+#undef PUT_TEST
+#undef PUT_EXIT
+
+  /* the rest */
+  for (j = 0; j < njumps; j++) {
+    lp->out[jumps[j]].u.pos = lp->nout - 1;
+  }
+  for (i = lp->head; i < lp->back; i++) {
+    inst = lp->insts[i];
+    if (ip_loop_put(lp, inst, i == lp->test)) {
+      return 1;
+    }
+  }
+  return ip_loop_put_jump(
+    lp, IP_CODE_JUMP, lp->nout - (lp->back - lp->head), 0);
+}
+
+/* the JUMP back to head of a loop of the shape, or 0 */
+static size_t
+ip_loop_find(struct ip_loop* lp, size_t head)
+{
+  size_t i, njumps = 0;
+
+  if (!lp->targets[head]) {
+    return 0;
+  }
+  for (i = head; i < lp->n && njumps < 2; i++) {
+    if (IP_LOOP_IS_JUMP(lp->insts[i].code)) {
+      njumps += 1;
+    } else if (!IP_LOOP_IS_LINEAR(lp->insts[i].code)) {
+      return 0;
+    }
+  }
+  i -= 1;
+  if (2 != njumps || IP_CODE_JUMP != lp->insts[i].code ||
+      IP_LOOP_TARGET(lp->insts[i]) != head ||
+      !ip_loop_match(lp, head, i)) {
+    return 0;
+  }
+  return i;
+}
+
+/* the insts of a proc with its counted loops transformed, in a buffer
+ * reused by the next call. the insts as given if none was or they could not
+ * be */
+static struct ip_inst*
+ip_loop(size_t nargs,
+        size_t nlocals,
+        size_t* ninsts,
+        struct ip_inst* insts) __attribute__((unused));
+static struct ip_inst*
+ip_loop(size_t nargs, size_t nlocals, size_t* ninsts, struct ip_inst* insts)
+{
+  static struct ip_inst* last;
+  struct ip_loop lp;
+  struct ip_inst* ret = insts;
+  size_t i, t, back, start, n = *ninsts, *map, w = nargs + nlocals + 1;
+  int closed, ntransformed = 0;
+
+  if (0 == n) {
+    return insts;
+  }
+
+  memset(&lp, 0, sizeof(lp));
+  lp.nargs = nargs;
+  lp.nvars = nargs + nlocals;
+  lp.n = n;
+  lp.insts = insts;
+  lp.targets = calloc(n + 1, sizeof(size_t));
+  lp.cond = malloc(w * sizeof(ip_loop_word_t));
+  lp.vars = malloc(lp.nvars * w * sizeof(ip_loop_word_t) + 1);
+  lp.stack = malloc(n * w * sizeof(ip_loop_word_t));
+  lp.kinds = malloc(w);
+  lp.known = malloc(w);
+  lp.values = malloc(w * sizeof(ip_loop_word_t));
+  lp.sknown = malloc(n);
+  lp.svalues = malloc(n * sizeof(ip_loop_word_t));
+  lp.cap = n;
+  lp.out = malloc(n * sizeof(struct ip_inst));
+  lp.fix = malloc(n);
+  map = malloc((n + 1) * sizeof(size_t));
+  if (NULL == lp.targets || NULL == lp.cond || NULL == lp.vars ||
+      NULL == lp.stack || NULL == lp.kinds || NULL == lp.known ||
+      NULL == lp.values || NULL == lp.sknown || NULL == lp.svalues ||
+      NULL == lp.out || NULL == lp.fix || NULL == map) {
+    goto done;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (IP_LOOP_IS_JUMP(insts[i].code)) {
+      t = IP_LOOP_TARGET(insts[i]);
+      lp.targets[t < n ? t : n] += 1;
+    }
+  }
+
+  for (i = 0; i < n;) {
+    map[i] = lp.nout;
+    back = ip_loop_find(&lp, i);
+    if (back) {
+      start = lp.nout;
+      closed = !ip_loop_put_closed(&lp);
+      if (!closed) {
+        lp.nout = start;
+      }
+      if (closed || !ip_loop_put_unrolled(&lp)) {
+        fprintf(stderr,
+                "loop: %lu..%lu %s\n",
+                (unsigned long)i,
+                (unsigned long)back,
+                closed ? "closed form" : "unrolled");
+        ntransformed += 1;
+        for (; i <= back; i++) {
+          map[i] = start;
+        }
+        continue;
+      }
+      lp.nout = start;
+    }
+    if (ip_loop_put(&lp, insts[i], IP_LOOP_IS_JUMP(insts[i].code))) {
+      goto done;
+    }
+    i++;
+  }
+  map[n] = lp.nout;
+
+  if (0 == ntransformed) {
+    goto done;
+  }
+  for (i = 0; i < lp.nout; i++) {
+    if (lp.fix[i]) {
+      t = IP_LOOP_TARGET(lp.out[i]);
+      lp.out[i].u.pos = (t < n ? map[t] : lp.nout + (t - n)) - 1;
+    }
+  }
+
+  free(last);
+  last = lp.out;
+  lp.out = NULL;
+  *ninsts = lp.nout;
+  ret = last;
+
+done:
+  free(lp.targets);
+  free(lp.cond);
+  free(lp.vars);
+  free(lp.stack);
+  free(lp.kinds);
+  free(lp.known);
+  free(lp.values);
+  free(lp.sknown);
+  free(lp.svalues);
+  free(lp.out);
+  free(lp.fix);
+  free(map);
+  return ret;
+}
+
+#endif
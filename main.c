@@ -1,6 +1,43 @@
 #include "vm.h"
 #include <stdio.h>
 
+#ifdef IP_VM_PERF
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* user space hardware counter of this process, or -1 */
+static int
+ip_perf_open(unsigned long long config)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+ip_perf_report(const char* name, int fd)
+{
+  unsigned long long count;
+
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+    fprintf(stderr, "%s: unavailable\n", name);
+    return;
+  }
+  fprintf(stderr, "%s: %llu\n", name, count);
+}
+#endif
+
 ip_proc_ref_t
 ip_register_sum(struct ip_vm* vm)
 {
@@ -144,6 +181,9 @@ main()
   int ret;
   ip_proc_ref_t sum, fib, entry;
   ip_value_t result;
+#ifdef IP_VM_PERF
+  int branches, misses;
+#endif
 
   ret = ip_vm_new(&vm);
   if (ret) {
@@ -169,6 +209,20 @@ main()
     return 1;
   }
 
+#ifdef IP_VM_AOT
+  if (ip_vm_compile_aot(vm)) {
+    puts("aot compilation failed");
+    return 1;
+  }
+#endif
+
+#ifdef IP_VM_PERF
+  branches = ip_perf_open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+  misses = ip_perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+  ioctl(branches, PERF_EVENT_IOC_ENABLE, 0);
+  ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+
   /* call fib */
   if (ip_vm_push_arg(vm, IP_INT2VALUE(36))) {
     puts("initialization failed");
@@ -221,6 +275,13 @@ main()
   printf("result of sum: %lld\n", IP_VALUE2LLINT(result));
   /* end sum */
 
+#ifdef IP_VM_PERF
+  ioctl(branches, PERF_EVENT_IOC_DISABLE, 0);
+  ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+  ip_perf_report("branches", branches);
+  ip_perf_report("branch-misses", misses);
+#endif
+
   ip_vm_dtor(vm);
 
   return 0;
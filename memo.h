@@ -0,0 +1,264 @@
+#ifndef IP_H_MEMO
+#define IP_H_MEMO
+
+#include "verifier.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * memoization of pure procs.
+ * A proc is pure if its result only depends on its args: it reads nothing
+ * but its args and locals, does not EXIT, does not use CALL_INDIRECT, whose
+ * callee is not known, and only calls pure procs. It must also pass the
+ * verifier, or it could pop the values of its caller below its args.
+ * Recursive procs like fib are pure as long as nothing else in the cycle
+ * makes them impure.
+ *
+ * A pure proc gets a table of its results keyed on its args. The table has
+ * IP_MEMO_SETS sets of IP_MEMO_WAYS entries, the args are hashed to a set
+ * and the entries of a set are kept from the most to the least recently
+ * used, a new one evicting the last.
+ */
+
+#define IP_MEMO_SETS 1024
+#define IP_MEMO_WAYS 4
+
+struct ip_memo
+{
+  size_t nargs;
+  /* entries used in each set */
+  unsigned char* used;
+  /* per entry, the args then the result */
+  ip_value_t* entries;
+  /* an entry being moved */
+  ip_value_t* scratch;
+};
+
+/* a proc as the analysis sees it */
+struct ip_memo_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  const struct ip_inst* insts;
+};
+
+/* the proc at ref, 1 if there is none */
+typedef int (*ip_memo_lookup_t)(void* ctx,
+                                ip_proc_ref_t ref,
+                                struct ip_memo_proc* ret);
+
+struct ip_memo_verify_ctx
+{
+  ip_memo_lookup_t lookup;
+  void* ctx;
+};
+
+/* the lookup of the verifier */
+static int
+ip_memo_verify_lookup(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_memo_verify_ctx* vctx = ctx;
+  struct ip_memo_proc proc;
+
+  if (vctx->lookup(vctx->ctx, ref, &proc)) {
+    return 1;
+  }
+  *nargs = proc.nargs;
+
+  return 0;
+}
+
+/* 0 if the proc passes the verifier */
+static int
+ip_memo_verify(const struct ip_memo_proc* proc,
+               ip_memo_lookup_t lookup,
+               void* ctx)
+{
+  struct ip_memo_verify_ctx vctx;
+  struct ip_verify_proc vproc;
+  size_t depth;
+
+  vctx.lookup = lookup;
+  vctx.ctx = ctx;
+  vproc.nargs = proc->nargs;
+  vproc.nlocals = proc->nlocals;
+  vproc.ninsts = proc->ninsts;
+  vproc.insts = proc->insts;
+
+  return ip_verify(&vproc, ip_memo_verify_lookup, &vctx, &depth);
+}
+
+/* pure[ref] for each of the nprocs procs. every proc is taken as pure and
+ * the ones that are not are dropped until none is left, so a cycle of calls
+ * stays pure */
+static void
+ip_memo_pure(size_t nprocs,
+             ip_memo_lookup_t lookup,
+             void* ctx,
+             char* pure) __attribute__((unused));
+static void
+ip_memo_pure(size_t nprocs, ip_memo_lookup_t lookup, void* ctx, char* pure)
+{
+  struct ip_memo_proc proc;
+  size_t p, i;
+  int changed = 1;
+
+  for (p = 0; p < nprocs; p++) {
+    pure[p] = !lookup(ctx, p, &proc) && !ip_memo_verify(&proc, lookup, ctx);
+  }
+
+  while (changed) {
+    changed = 0;
+    for (p = 0; p < nprocs; p++) {
+      if (!pure[p] || lookup(ctx, p, &proc)) {
+        continue;
+      }
+      for (i = 0; i < proc.ninsts; i++) {
+        const struct ip_inst* inst = &proc.insts[i];
+
+        if (IP_CODE_CALL_INDIRECT == inst->code ||
+            IP_CODE_EXIT == inst->code ||
+            ((IP_CODE_CALL == inst->code ||
+              IP_CODE_TAIL_CALL == inst->code) &&
+             (inst->u.p < 0 || nprocs <= (size_t)inst->u.p ||
+              !pure[inst->u.p]))) {
+          pure[p] = 0;
+          changed = 1;
+          break;
+        }
+      }
+    }
+  }
+}
+
+static int
+ip_memo_new(size_t nargs, struct ip_memo** ret) __attribute__((unused));
+static int
+ip_memo_new(size_t nargs, struct ip_memo** ret)
+{
+  struct ip_memo* memo;
+
+  memo = malloc(sizeof(struct ip_memo));
+  if (NULL == memo) {
+    return 1;
+  }
+  memo->nargs = nargs;
+  memo->used = calloc(IP_MEMO_SETS, 1);
+  memo->entries = malloc(IP_MEMO_SETS * IP_MEMO_WAYS * (nargs + 1) *
+                         sizeof(ip_value_t));
+  memo->scratch = malloc((nargs + 1) * sizeof(ip_value_t));
+  if (NULL == memo->used || NULL == memo->entries || NULL == memo->scratch) {
+    free(memo->used);
+    free(memo->entries);
+    free(memo->scratch);
+    free(memo);
+    return 1;
+  }
+
+  *ret = memo;
+  return 0;
+}
+
+static void
+ip_memo_free(struct ip_memo* memo) __attribute__((unused));
+static void
+ip_memo_free(struct ip_memo* memo)
+{
+  if (NULL == memo) {
+    return;
+  }
+  free(memo->used);
+  free(memo->entries);
+  free(memo->scratch);
+  free(memo);
+}
+
+static size_t
+ip_memo_set(const struct ip_memo* memo, const ip_value_t* args)
+{
+  unsigned long long h = 0;
+  size_t i;
+
+  for (i = 0; i < memo->nargs; i++) {
+    h = (h ^ (unsigned long long)IP_VALUE2LLINT(args[i])) *
+        0x9e3779b97f4a7c15ULL;
+  }
+  return (size_t)(h >> 32) % IP_MEMO_SETS;
+}
+
+/* the entry at way of set */
+#define IP_MEMO_ENTRY(memo, set, way)                                          \
+  (&(memo)->entries[((set)*IP_MEMO_WAYS + (way)) * ((memo)->nargs + 1)])
+
+/* moves the entry at way of set to the front, the ones before it move back
+ * by one */
+static void
+ip_memo_touch(struct ip_memo* memo, size_t set, size_t way)
+{
+  size_t size = (memo->nargs + 1) * sizeof(ip_value_t);
+  ip_value_t* first = IP_MEMO_ENTRY(memo, set, 0);
+
+  memcpy(memo->scratch, IP_MEMO_ENTRY(memo, set, way), size);
+  memmove(IP_MEMO_ENTRY(memo, set, 1), first, way * size);
+  memcpy(first, memo->scratch, size);
+}
+
+/* 0 if the result for args is known, in result */
+static int
+ip_memo_find(struct ip_memo* memo,
+             const ip_value_t* args,
+             ip_value_t* result) __attribute__((unused));
+static int
+ip_memo_find(struct ip_memo* memo, const ip_value_t* args, ip_value_t* result)
+{
+  size_t set, way, n = memo->nargs;
+
+  set = ip_memo_set(memo, args);
+  for (way = 0; way < memo->used[set]; way++) {
+    const ip_value_t* entry = IP_MEMO_ENTRY(memo, set, way);
+
+    if (0 == memcmp(entry, args, n * sizeof(ip_value_t))) {
+      *result = entry[n];
+      if (0 < way) {
+        ip_memo_touch(memo, set, way);
+      }
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* the result for args, in their entry if a nested call already put one,
+ * or evicting the least recently used entry of their set if it is full */
+static void
+ip_memo_put(struct ip_memo* memo,
+            const ip_value_t* args,
+            ip_value_t result) __attribute__((unused));
+static void
+ip_memo_put(struct ip_memo* memo, const ip_value_t* args, ip_value_t result)
+{
+  size_t set, way, n = memo->nargs;
+  ip_value_t* entry;
+
+  set = ip_memo_set(memo, args);
+  for (way = 0; way < memo->used[set]; way++) {
+    if (0 ==
+        memcmp(IP_MEMO_ENTRY(memo, set, way), args, n * sizeof(ip_value_t))) {
+      break;
+    }
+  }
+  if (IP_MEMO_WAYS == way) {
+    way -= 1;
+  } else if (way == memo->used[set]) {
+    memo->used[set] += 1;
+  }
+  entry = IP_MEMO_ENTRY(memo, set, way);
+  memcpy(entry, args, n * sizeof(ip_value_t));
+  entry[n] = result;
+  ip_memo_touch(memo, set, way);
+}
+
+#endif
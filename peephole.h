@@ -0,0 +1,434 @@
+#ifndef IP_H_PEEPHOLE
+#define IP_H_PEEPHOLE
+
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * peephole optimizer.
+ * Built with IP_PEEPHOLE, every engine passes the insts given to
+ * ip_proc_init through ip_peephole first. It repeats until nothing changes:
+ *
+ *   - CONST a; CONST b; ADD/SUB becomes CONST a+b/a-b
+ *   - CONST a; JUMP_IF_ZERO/JUMP_IF_NEG becomes a JUMP or nothing
+ *   - jumps to a JUMP go to its target, a JUMP to the next inst goes away
+ *   - the insts no path reaches go away
+ *   - GET_LOCAL of a local known to hold a constant becomes a CONST, and
+ *     CONST a; SET_LOCAL of a local already holding a, like the zeroes
+ *     locals start with, goes away
+ *   - SET_LOCAL x; GET_LOCAL x goes away when x is not read again
+ *
+ * Nothing is folded over an inst a jump lands on, except away from it. The
+ * jumps are moved with the insts they land on. The numbers of insts before
+ * and after are written to stderr.
+ */
+
+/* the inst a jump at inst lands on */
+#define IP_PEEPHOLE_TARGET(inst) ((inst).u.pos + 1)
+
+#define IP_PEEPHOLE_IS_JUMP(code)                                              \
+  (IP_CODE_JUMP == (code) || IP_CODE_JUMP_IF_ZERO == (code) ||                 \
+   IP_CODE_JUMP_IF_NEG == (code))
+
+/* ends the path, the next inst is only reached by jumps */
+#define IP_PEEPHOLE_IS_END(code)                                               \
+  (IP_CODE_JUMP == (code) || IP_CODE_RETURN == (code) ||                       \
+   IP_CODE_EXIT == (code) || IP_CODE_TAIL_CALL == (code))
+
+struct ip_peephole
+{
+  size_t n;
+  size_t nargs;
+  size_t nvars;
+  struct ip_inst* insts;
+  char* dead;
+  char* reached;
+  /* a jump lands on it */
+  char* target;
+  /* the value of each local if known, along the path being scanned */
+  char* known;
+  ip_value_t* values;
+  /* the locals read after each inst, nvars per inst */
+  char* live;
+  size_t* work;
+};
+
+/* the first inst alive after i, or n */
+static size_t
+ip_peephole_next(struct ip_peephole* ph, size_t i)
+{
+  for (i++; i < ph->n && ph->dead[i]; i++) {
+  }
+  return i;
+}
+
+/* the inst alive from i on */
+static size_t
+ip_peephole_land(struct ip_peephole* ph, size_t i)
+{
+  return i < ph->n && ph->dead[i] ? ip_peephole_next(ph, i) : i;
+}
+
+static int
+ip_peephole_is_var(struct ip_peephole* ph, const struct ip_inst* inst)
+{
+  return 0 <= inst->u.i && (size_t)inst->u.i < ph->nvars;
+}
+
+/* is local k read before it is written again from t on, given what is read
+ * after t */
+static int
+ip_peephole_live_at(struct ip_peephole* ph, size_t t, size_t k)
+{
+  const struct ip_inst* inst = &ph->insts[t];
+
+  if ((size_t)inst->u.i == k) {
+    if (IP_CODE_GET_LOCAL == inst->code) {
+      return 1;
+    }
+    if (IP_CODE_SET_LOCAL == inst->code) {
+      return 0;
+    }
+  }
+  return ph->live[t * ph->nvars + k];
+}
+
+/* points the jumps to insts alive, drops the insts no path reaches from the
+ * entry and marks the ones a jump lands on */
+static int
+ip_peephole_reach(struct ip_peephole* ph)
+{
+  size_t i, t, nwork = 0;
+  char* reached = ph->reached;
+  int changed = 0;
+
+  for (i = 0; i < ph->n; i++) {
+    struct ip_inst* inst = &ph->insts[i];
+
+    if (!ph->dead[i] && IP_PEEPHOLE_IS_JUMP(inst->code)) {
+      t = IP_PEEPHOLE_TARGET(*inst);
+      if (t < ph->n && ph->dead[t]) {
+        inst->u.pos = ip_peephole_land(ph, t) - 1;
+      }
+    }
+  }
+
+  memset(reached, 0, ph->n);
+  memset(ph->target, 0, ph->n);
+  i = ip_peephole_land(ph, 0);
+  if (ph->n <= i) {
+    return 0;
+  }
+  reached[i] = 1;
+  ph->work[nwork++] = i;
+  while (nwork) {
+    const struct ip_inst* inst;
+
+    i = ph->work[--nwork];
+    inst = &ph->insts[i];
+    if (IP_PEEPHOLE_IS_JUMP(inst->code)) {
+      t = IP_PEEPHOLE_TARGET(*inst);
+      if (t < ph->n) {
+        ph->target[t] = 1;
+        if (!reached[t]) {
+          reached[t] = 1;
+          ph->work[nwork++] = t;
+        }
+      }
+    }
+    t = ip_peephole_next(ph, i);
+    if (!IP_PEEPHOLE_IS_END(inst->code) && t < ph->n && !reached[t]) {
+      reached[t] = 1;
+      ph->work[nwork++] = t;
+    }
+  }
+
+  for (i = 0; i < ph->n; i++) {
+    if (!ph->dead[i] && !reached[i]) {
+      ph->dead[i] = 1;
+      changed = 1;
+    }
+  }
+
+  return changed;
+}
+
+/* the locals read after each inst, by a backward pass to the fixpoint */
+static void
+ip_peephole_liveness(struct ip_peephole* ph)
+{
+  size_t i, k, t, nv = ph->nvars;
+  char* out;
+  int changed = 1;
+
+  memset(ph->live, 0, ph->n * nv);
+  while (changed) {
+    changed = 0;
+    for (i = ph->n; i--;) {
+      const struct ip_inst* inst = &ph->insts[i];
+
+      if (ph->dead[i]) {
+        continue;
+      }
+      out = &ph->live[i * nv];
+      /* live after i: live before each successor */
+      if (IP_PEEPHOLE_IS_JUMP(inst->code)) {
+        t = IP_PEEPHOLE_TARGET(*inst);
+        for (k = 0; t < ph->n && k < nv; k++) {
+          if (!out[k] && ip_peephole_live_at(ph, t, k)) {
+            out[k] = 1;
+            changed = 1;
+          }
+        }
+      }
+      t = ip_peephole_next(ph, i);
+      for (k = 0; !IP_PEEPHOLE_IS_END(inst->code) && t < ph->n && k < nv; k++) {
+        if (!out[k] && ip_peephole_live_at(ph, t, k)) {
+          out[k] = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+}
+
+/* one forward scan of the rewrites */
+static int
+ip_peephole_scan(struct ip_peephole* ph)
+{
+  size_t i, j, k, t, steps;
+  struct ip_inst* insts = ph->insts;
+  int changed = 0;
+
+  /* the locals start at 0, the args are not known */
+  memset(ph->known, 0, ph->nvars);
+  for (k = ph->nargs; k < ph->nvars; k++) {
+    ph->known[k] = 1;
+    ph->values[k] = IP_LLINT2VALUE(0);
+  }
+
+  for (i = 0; i < ph->n;) {
+    struct ip_inst* inst = &insts[i];
+
+    if (ph->dead[i]) {
+      i++;
+      continue;
+    }
+    if (ph->target[i]) {
+      memset(ph->known, 0, ph->nvars);
+    }
+
+    j = ip_peephole_next(ph, i);
+    k = j < ph->n ? ip_peephole_next(ph, j) : ph->n;
+
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        if (j == ph->n || ph->target[j]) {
+          break;
+        }
+        if (IP_CODE_CONST == insts[j].code && k < ph->n && !ph->target[k] &&
+            (IP_CODE_ADD == insts[k].code || IP_CODE_SUB == insts[k].code)) {
+          unsigned long long x = IP_VALUE2LLINT(inst->u.v);
+          unsigned long long y = IP_VALUE2LLINT(insts[j].u.v);
+
+          /* wraps like the engines do */
+          inst->u.v = IP_LLINT2VALUE(
+            IP_CODE_ADD == insts[k].code ? x + y : x - y);
+          ph->dead[j] = ph->dead[k] = 1;
+          changed = 1;
+          /* again, with the next ones */
+          continue;
+        }
+        if (IP_CODE_JUMP_IF_ZERO == insts[j].code ||
+            IP_CODE_JUMP_IF_NEG == insts[j].code) {
+          long long int v = IP_VALUE2LLINT(inst->u.v);
+
+          if (IP_CODE_JUMP_IF_ZERO == insts[j].code ? !v : v < 0) {
+            insts[j].code = IP_CODE_JUMP;
+          } else {
+            ph->dead[j] = 1;
+          }
+          ph->dead[i] = 1;
+          changed = 1;
+          i = j;
+          continue;
+        }
+        if (IP_CODE_SET_LOCAL == insts[j].code &&
+            ip_peephole_is_var(ph, &insts[j])) {
+          int x = insts[j].u.i;
+
+          if (ph->known[x] && ph->values[x] == inst->u.v) {
+            ph->dead[i] = ph->dead[j] = 1;
+            changed = 1;
+          } else {
+            ph->known[x] = 1;
+            ph->values[x] = inst->u.v;
+          }
+          i = k;
+          continue;
+        }
+        break;
+      case IP_CODE_GET_LOCAL:
+        if (ip_peephole_is_var(ph, inst) && ph->known[inst->u.i]) {
+          inst->u.v = ph->values[inst->u.i];
+          inst->code = IP_CODE_CONST;
+          changed = 1;
+          continue;
+        }
+        break;
+      case IP_CODE_SET_LOCAL:
+        if (!ip_peephole_is_var(ph, inst)) {
+          break;
+        }
+        ph->known[inst->u.i] = 0;
+        /* the store only feeds the load */
+        if (j < ph->n && !ph->target[j] &&
+            IP_CODE_GET_LOCAL == insts[j].code &&
+            insts[j].u.i == inst->u.i &&
+            !ph->live[j * ph->nvars + inst->u.i]) {
+          ph->dead[i] = ph->dead[j] = 1;
+          changed = 1;
+          i = k;
+          continue;
+        }
+        break;
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        /* through the JUMPs it lands on, a cycle of them is left alone */
+        t = IP_PEEPHOLE_TARGET(*inst);
+        for (steps = 0; t < ph->n && IP_CODE_JUMP == insts[t].code &&
+                        !ph->dead[t] && steps < ph->n;
+             steps++) {
+          t = IP_PEEPHOLE_TARGET(insts[t]);
+        }
+        if (ph->n <= steps) {
+          t = IP_PEEPHOLE_TARGET(*inst);
+        } else if (t != IP_PEEPHOLE_TARGET(*inst)) {
+          inst->u.pos = t - 1;
+          changed = 1;
+        }
+        if (IP_CODE_JUMP == inst->code && t == j) {
+          ph->dead[i] = 1;
+          changed = 1;
+        }
+        break;
+      default:
+        break;
+    }
+    if (IP_PEEPHOLE_IS_END(inst->code)) {
+      memset(ph->known, 0, ph->nvars);
+    }
+    i = j;
+  }
+
+  return changed;
+}
+
+/* the insts of a proc optimized, in a buffer reused by the next call. the
+ * insts as given if they could not be */
+static struct ip_inst*
+ip_peephole(size_t nargs,
+            size_t nlocals,
+            size_t* ninsts,
+            struct ip_inst* insts) __attribute__((unused));
+static struct ip_inst*
+ip_peephole(size_t nargs,
+            size_t nlocals,
+            size_t* ninsts,
+            struct ip_inst* insts)
+{
+  static struct ip_inst* buf;
+  static size_t cap;
+  struct ip_peephole ph;
+  struct ip_inst* ret = insts;
+  size_t i, t, m, n = *ninsts, *map;
+  int changed = 1;
+
+  if (0 == n) {
+    return insts;
+  }
+
+  ph.n = n;
+  ph.nargs = nargs;
+  ph.nvars = nargs + nlocals;
+  ph.insts = malloc(n * sizeof(struct ip_inst));
+  ph.dead = calloc(n, 1);
+  ph.reached = malloc(n);
+  ph.target = malloc(n);
+  ph.known = malloc(ph.nvars + 1);
+  ph.values = malloc((ph.nvars + 1) * sizeof(ip_value_t));
+  ph.live = malloc(n * ph.nvars + 1);
+  ph.work = malloc(n * sizeof(size_t));
+  map = malloc((n + 1) * sizeof(size_t));
+  if (NULL == ph.insts || NULL == ph.dead || NULL == ph.reached ||
+      NULL == ph.target || NULL == ph.known || NULL == ph.values ||
+      NULL == ph.live || NULL == ph.work || NULL == map) {
+    goto done;
+  }
+  memcpy(ph.insts, insts, n * sizeof(struct ip_inst));
+
+  while (changed) {
+    changed = ip_peephole_reach(&ph);
+    ip_peephole_liveness(&ph);
+    changed |= ip_peephole_scan(&ph);
+  }
+
+  for (i = 0, m = 0; i < n; i++) {
+    map[i] = m;
+    m += !ph.dead[i];
+  }
+  map[n] = m;
+  if (0 == m) {
+    goto done;
+  }
+
+  if (cap < m) {
+    struct ip_inst* grown = realloc(buf, m * sizeof(struct ip_inst));
+
+    if (NULL == grown) {
+      goto done;
+    }
+    buf = grown;
+    cap = m;
+  }
+  for (i = 0; i < n; i++) {
+    struct ip_inst inst = ph.insts[i];
+
+    if (ph.dead[i]) {
+      continue;
+    }
+    if (IP_PEEPHOLE_IS_JUMP(inst.code)) {
+      t = IP_PEEPHOLE_TARGET(inst);
+      if (t < n) {
+        inst.u.pos = map[t] - 1;
+      } else {
+        inst.u.pos += m - n;
+      }
+    }
+    buf[map[i]] = inst;
+  }
+
+  fprintf(stderr,
+          "peephole: %lu -> %lu insts\n",
+          (unsigned long)n,
+          (unsigned long)m);
+  *ninsts = m;
+  ret = buf;
+
+done:
+  free(ph.insts);
+  free(ph.dead);
+  free(ph.reached);
+  free(ph.target);
+  free(ph.known);
+  free(ph.values);
+  free(ph.live);
+  free(ph.work);
+  free(map);
+  return ret;
+}
+
+#endif
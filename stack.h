@@ -1,28 +1,248 @@
 #ifndef IP_H_STACK
 #define IP_H_STACK
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * reserved stacks.
+ * A stack reserves the address range of its limit when it is made and
+ * commits the pages under its entries as it grows, so it never moves and
+ * pointers into it stay valid. push grows a full stack, the engines which
+ * check the room themselves call ip_stack_grow or ip_stack_commit, which
+ * fail past the limit. Stacks made by ip_stack_init can grow to
+ * IP_STACK_LIMIT entries, a shallow run only commits the pages it touched.
+ */
+
+#define IP_STACK_LIMIT (1 << 20)
+
+static size_t ip_stack_page;
+
+/* bytes rounded up to pages */
+static size_t
+ip_stack_round(size_t bytes)
+{
+  if (0 == ip_stack_page) {
+    ip_stack_page = sysconf(_SC_PAGESIZE);
+  }
+  return (bytes + ip_stack_page - 1) / ip_stack_page * ip_stack_page;
+}
+
+#ifdef IP_STACK_GUARD
+#include <setjmp.h>
+#include <signal.h>
+
+/**
+ * guard pages.
+ * With IP_STACK_GUARD the stacks are mapped between two PROT_NONE pages,
+ * the data starting right after the lower one and ending at the upper one
+ * as near as the size of an entry allows. The whole limit is committed
+ * when the stack is made, push and pop do not check the bounds, going past
+ * them faults on a guard page. The SIGSEGV handler jumps back to the
+ * ip_vm_exec which armed it, which fails. A fault anywhere else, or while
+ * no ip_vm_exec runs, kills the process as usual. The guard pages of all
+ * the stacks are listed for the handler, the list grows with them.
+ */
+
+static char** ip_stack_guards;
+static size_t ip_stack_nguards;
+static size_t ip_stack_guards_size;
+static int ip_stack_guard_installed;
+static sigjmp_buf ip_stack_guard_env;
+static volatile sig_atomic_t ip_stack_guard_armed;
+
+static void
+ip_stack_guard_handler(int sig, siginfo_t* info, void* uctx)
+{
+  char* addr = info->si_addr;
+  size_t i;
+
+  (void)uctx;
+  if (ip_stack_guard_armed) {
+    for (i = 0; i < ip_stack_nguards; i++) {
+      if (ip_stack_guards[i] <= addr &&
+          addr < ip_stack_guards[i] + ip_stack_page) {
+        ip_stack_guard_armed = 0;
+        siglongjmp(ip_stack_guard_env, 1);
+      }
+    }
+  }
+  /* not ours, fault again without the handler */
+  signal(sig, SIG_DFL);
+}
+
+/* *bytes, rounded up to pages, between two guard pages */
+static void*
+ip_stack_guard_map(size_t* bytes)
+{
+  char* base;
+  size_t n;
+
+  if (!ip_stack_guard_installed) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = ip_stack_guard_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL)) {
+      return NULL;
+    }
+    ip_stack_guard_installed = 1;
+  }
+  if (ip_stack_guards_size < ip_stack_nguards + 2) {
+    size_t size = ip_stack_guards_size ? ip_stack_guards_size * 2 : 64;
+    char** guards = realloc(ip_stack_guards, size * sizeof(char*));
+
+    if (NULL == guards) {
+      return NULL;
+    }
+    ip_stack_guards = guards;
+    ip_stack_guards_size = size;
+  }
+
+  n = ip_stack_round(*bytes);
+  base = mmap(NULL,
+              n + 2 * ip_stack_page,
+              PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS,
+              -1,
+              0);
+  if (MAP_FAILED == base) {
+    return NULL;
+  }
+  if (mprotect(base, ip_stack_page, PROT_NONE) ||
+      mprotect(base + ip_stack_page + n, ip_stack_page, PROT_NONE)) {
+    munmap(base, n + 2 * ip_stack_page);
+    return NULL;
+  }
+
+  ip_stack_guards[ip_stack_nguards++] = base;
+  ip_stack_guards[ip_stack_nguards++] = base + ip_stack_page + n;
+  *bytes = n;
+
+  return base + ip_stack_page;
+}
+
+static void
+ip_stack_guard_unmap(void* data, size_t bytes)
+{
+  char* base = (char*)data - ip_stack_page;
+  size_t i, n;
+
+  n = ip_stack_round(bytes);
+  for (i = 0; i < ip_stack_nguards;) {
+    if (base <= ip_stack_guards[i] &&
+        ip_stack_guards[i] <= base + ip_stack_page + n) {
+      ip_stack_guards[i] = ip_stack_guards[--ip_stack_nguards];
+    } else {
+      i++;
+    }
+  }
+  munmap(base, n + 2 * ip_stack_page);
+}
+
+#define IP_STACK_MAP(bytes) ip_stack_guard_map(bytes)
+/* all of it is */
+#define IP_STACK_COMMIT(data, committed, bytes, reserved)                      \
+  (*(bytes) = (reserved), 0)
+#define IP_STACK_UNMAP(data, bytes) ip_stack_guard_unmap(data, bytes)
+/* the guard pages check them */
+#define IP_STACK_IN_BOUNDS(cond) 1
+#else
+/* *bytes, rounded up to pages, reserved and none of them committed */
+static void*
+ip_stack_map(size_t* bytes)
+{
+  void* data;
+
+  *bytes = ip_stack_round(*bytes);
+  data = mmap(NULL,
+              *bytes,
+              PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+              -1,
+              0);
+  if (MAP_FAILED == data) {
+    return NULL;
+  }
+
+  return data;
+}
+
+/* the pages of data under *bytes committed, the ones under committed
+ * already are. *bytes is rounded up to them */
+static int
+ip_stack_commit_pages(void* data, size_t committed, size_t* bytes)
+{
+  committed = ip_stack_round(committed);
+  *bytes = ip_stack_round(*bytes);
+  if (*bytes <= committed) {
+    return 0;
+  }
+
+  return mprotect((char*)data + committed,
+                  *bytes - committed,
+                  PROT_READ | PROT_WRITE);
+}
+
+#define IP_STACK_MAP(bytes) ip_stack_map(bytes)
+#define IP_STACK_COMMIT(data, committed, bytes, reserved)                      \
+  ip_stack_commit_pages(data, committed, bytes)
+#define IP_STACK_UNMAP(data, bytes) munmap(data, ip_stack_round(bytes))
+#define IP_STACK_IN_BOUNDS(cond) (cond)
+#endif
+
+
 /* pseudo generics. */
 /* the stack is empty stack */
 #define def_ip_stack(ty)                                                       \
   typedef struct ip_stack_##ty                                                 \
   {                                                                            \
+    /* the committed entries */                                                \
     size_t size;                                                               \
+    /* the reserved ones */                                                    \
+    size_t limit;                                                              \
     size_t sp;                                                                 \
     ty* data;                                                                  \
   } ip_stack_##ty##_t;                                                         \
-  static int ip_stack_init_##ty(struct ip_stack_##ty* stack, size_t size)      \
+  /* size entries committed out of the limit reserved */                       \
+  static int ip_stack_reserve_##ty(                                            \
+    struct ip_stack_##ty* stack, size_t size, size_t limit)                    \
     __attribute__((unused));                                                   \
-  static int ip_stack_init_##ty(struct ip_stack_##ty* stack, size_t size)      \
+  static int ip_stack_reserve_##ty(                                            \
+    struct ip_stack_##ty* stack, size_t size, size_t limit)                    \
   {                                                                            \
-    stack->data = malloc(size * sizeof(ty));                                   \
+    size_t bytes, reserved;                                                    \
+                                                                               \
+    if (limit < size) {                                                        \
+      limit = size;                                                            \
+    }                                                                          \
+    reserved = limit * sizeof(ty);                                             \
+    stack->data = IP_STACK_MAP(&reserved);                                     \
     if (NULL == stack->data) {                                                 \
       return 1;                                                                \
     }                                                                          \
-    stack->size = size;                                                        \
+    bytes = size * sizeof(ty);                                                 \
+    if (IP_STACK_COMMIT(stack->data, 0, &bytes, reserved)) {                   \
+      IP_STACK_UNMAP(stack->data, reserved);                                   \
+      return 1;                                                                \
+    }                                                                          \
+    stack->limit = limit;                                                      \
+    stack->size = bytes / sizeof(ty) < limit ? bytes / sizeof(ty) : limit;     \
     stack->sp = 0;                                                             \
     return 0;                                                                  \
   }                                                                            \
                                                                                \
+  static int ip_stack_init_##ty(struct ip_stack_##ty* stack, size_t size)      \
+    __attribute__((unused));                                                   \
+  static int ip_stack_init_##ty(struct ip_stack_##ty* stack, size_t size)      \
+  {                                                                            \
+    return ip_stack_reserve_##ty(stack, size, IP_STACK_LIMIT);                 \
+  }                                                                            \
+                                                                               \
   static int ip_stack_new_##ty(size_t size, struct ip_stack_##ty** ret)        \
     __attribute__((unused));                                                   \
   static int ip_stack_new_##ty(size_t size, struct ip_stack_##ty** ret)        \
@@ -39,7 +259,69 @@
     __attribute__((unused));                                                   \
   static void ip_stack_dtor_##ty(struct ip_stack_##ty* stack)                  \
   {                                                                            \
-    free(stack->data);                                                         \
+    IP_STACK_UNMAP(stack->data, stack->limit * sizeof(ty));                    \
+  }                                                                            \
+                                                                               \
+  /* at least n entries committed, twice as many as before if the limit        \
+   * lets them be. it and grow are out of line to keep push small enough to    \
+   * be inlined */                                                             \
+  static int ip_stack_commit_##ty(struct ip_stack_##ty* stack, size_t n)       \
+    __attribute__((unused, noinline));                                         \
+  static int ip_stack_commit_##ty(struct ip_stack_##ty* stack, size_t n)       \
+  {                                                                            \
+    size_t size, bytes;                                                        \
+                                                                               \
+    if (n <= stack->size) {                                                    \
+      return 0;                                                                \
+    }                                                                          \
+    if (stack->limit < n) {                                                    \
+      return 1;                                                                \
+    }                                                                          \
+    size = stack->size * 2 < n ? n : stack->size * 2;                          \
+    if (stack->limit < size) {                                                 \
+      size = stack->limit;                                                     \
+    }                                                                          \
+    bytes = size * sizeof(ty);                                                 \
+    if (IP_STACK_COMMIT(stack->data,                                           \
+                        stack->size * sizeof(ty),                              \
+                        &bytes,                                                \
+                        stack->limit * sizeof(ty))) {                          \
+      return 1;                                                                \
+    }                                                                          \
+    size = bytes / sizeof(ty);                                                 \
+    stack->size = size < stack->limit ? size : stack->limit;                   \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  /* room for n entries over sp */                                             \
+  static int ip_stack_grow_##ty(struct ip_stack_##ty* stack, size_t n)         \
+    __attribute__((unused, noinline));                                         \
+  static int ip_stack_grow_##ty(struct ip_stack_##ty* stack, size_t n)         \
+  {                                                                            \
+    if (stack->limit - stack->sp < n) {                                        \
+      return 1;                                                                \
+    }                                                                          \
+    return ip_stack_commit_##ty(stack, stack->sp + n);                         \
+  }                                                                            \
+                                                                               \
+  /* the entries moved to a range reserved for limit entries. nothing may      \
+   * point into the stack */                                                   \
+  static int ip_stack_limit_##ty(struct ip_stack_##ty* stack, size_t limit)    \
+    __attribute__((unused));                                                   \
+  static int ip_stack_limit_##ty(struct ip_stack_##ty* stack, size_t limit)    \
+  {                                                                            \
+    struct ip_stack_##ty moved;                                                \
+                                                                               \
+    if (limit < stack->sp ||                                                   \
+        ip_stack_reserve_##ty(                                                 \
+          &moved, stack->size < limit ? stack->size : limit, limit)) {         \
+      return 1;                                                                \
+    }                                                                          \
+    memcpy(moved.data, stack->data, stack->sp * sizeof(ty));                   \
+    moved.sp = stack->sp;                                                      \
+    ip_stack_dtor_##ty(stack);                                                 \
+    *stack = moved;                                                            \
+    return 0;                                                                  \
   }                                                                            \
                                                                                \
   static size_t ip_stack_size_##ty(struct ip_stack_##ty* stack)                \
@@ -53,7 +335,8 @@
     __attribute__((unused));                                                   \
   static int ip_stack_push_##ty(struct ip_stack_##ty* stack, ty v)             \
   {                                                                            \
-    if (stack->sp < stack->size) {                                             \
+    if (IP_STACK_IN_BOUNDS(stack->sp < stack->size ||                          \
+                           !ip_stack_grow_##ty(stack, 1))) {                   \
       stack->data[stack->sp++] = v;                                            \
       return 0;                                                                \
     } else {                                                                   \
@@ -65,7 +348,7 @@
     __attribute__((unused));                                                   \
   static int ip_stack_pop_##ty(struct ip_stack_##ty* stack, ty* v)             \
   {                                                                            \
-    if (0 < stack->sp) {                                                       \
+    if (IP_STACK_IN_BOUNDS(0 < stack->sp)) {                                   \
       *v = stack->data[--stack->sp];                                           \
       return 0;                                                                \
     } else {                                                                   \
@@ -74,9 +357,14 @@
   }
 
 #define ip_stack(ty) ip_stack_##ty##_t
+#define ip_stack_reserve(ty, stack, size, limit)                               \
+  ip_stack_reserve_##ty(stack, size, limit)
 #define ip_stack_init(ty, stack, size) ip_stack_init_##ty(stack, size)
 #define ip_stack_new(ty, size, ret) ip_stack_new_##ty(size, ret)
 #define ip_stack_dtor(ty, stack) ip_stack_dtor_##ty(stack)
+#define ip_stack_commit(ty, stack, n) ip_stack_commit_##ty(stack, n)
+#define ip_stack_grow(ty, stack, n) ip_stack_grow_##ty(stack, n)
+#define ip_stack_limit(ty, stack, limit) ip_stack_limit_##ty(stack, limit)
 #define ip_stack_size(ty, stack) ip_stack_size_##ty(stack)
 #define ip_stack_push(ty, stack, v) ip_stack_push_##ty(stack, v)
 #define ip_stack_pop(ty, stack, ref) ip_stack_pop_##ty(stack, ref)
@@ -0,0 +1,77 @@
+#ifndef IP_H_STENCIL
+#define IP_H_STENCIL
+
+#include "vm.h"
+
+/**
+ * interface between the copy-and-patch engine and its stencils.
+ *
+ * A stencil is the machine code of one handler in
+ * vm_simple_jit_stencils.c. Every handler is a function taking the
+ * interpreter state in argument registers and continuing by a tail call,
+ * so its code can be copied anywhere. The values known only when a proc is
+ * compiled are references to the IP_HOLE_* symbols below, which the
+ * generator turns into holes patched at ip_proc_init time.
+ */
+
+#define IP_STENCIL_MAX_DEPTH 1024
+
+struct ip_stencil_state
+{
+  /* start and end of the value stack */
+  ip_value_t* bottom;
+  ip_value_t* limit;
+  /* entry of each registered proc, NULL if not registered yet */
+  void** entries;
+  size_t nentries;
+  size_t depth;
+  int exited;
+};
+
+/* returns the new sp, or NULL on error */
+typedef ip_value_t* (*ip_stencil_fn)(ip_value_t* sp,
+                                     ip_value_t* base,
+                                     struct ip_stencil_state* st);
+
+enum ip_hole_kind
+{
+  IP_HOLE_KIND_NONE,
+  /* the operand of the inst, any member of `u` */
+  IP_HOLE_KIND_OPERAND,
+  /* the code of the next inst */
+  IP_HOLE_KIND_CONTINUE,
+  /* the code of the jump target */
+  IP_HOLE_KIND_JUMP,
+  /* nargs and nlocals of the proc */
+  IP_HOLE_KIND_NARGS,
+  IP_HOLE_KIND_NLOCALS,
+};
+
+struct ip_stencil_hole
+{
+  size_t offset;
+  enum ip_hole_kind kind;
+  long addend;
+};
+
+struct ip_stencil
+{
+  const unsigned char* code;
+  size_t size;
+  const struct ip_stencil_hole* holes;
+  size_t nholes;
+};
+
+extern char IP_HOLE_OPERAND[];
+extern char IP_HOLE_NARGS[];
+extern char IP_HOLE_NLOCALS[];
+extern ip_value_t* IP_HOLE_CONTINUE(ip_value_t* sp,
+                                    ip_value_t* base,
+                                    struct ip_stencil_state* st);
+extern ip_value_t* IP_HOLE_JUMP(ip_value_t* sp,
+                                ip_value_t* base,
+                                struct ip_stencil_state* st);
+
+#define IP_HOLE_VALUE(hole) ((long long int)(hole))
+
+#endif
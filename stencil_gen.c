@@ -0,0 +1,206 @@
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * stencil generator for the copy-and-patch engine.
+ *
+ * usage: stencil_gen vm_simple_jit_stencils.o > vm_simple_jit_stencils.h
+ *
+ * Reads the relocatable x86-64 object the handlers were compiled to and
+ * prints, for every global function named ip_stencil_X, its code and the
+ * list of holes: the offsets where the address of an IP_HOLE_* symbol has
+ * to be written. The handlers are compiled with -mcmodel=large so every
+ * hole is an absolute 64 bit relocation. Anything else (a reference to
+ * .rodata, a call to libc) cannot be copied and is an error.
+ */
+
+#define PREFIX "ip_stencil_"
+
+static const char* hole_names[] = {
+  "IP_HOLE_OPERAND", "IP_HOLE_CONTINUE", "IP_HOLE_JUMP",
+  "IP_HOLE_NARGS",   "IP_HOLE_NLOCALS",
+};
+static const char* hole_kinds[] = {
+  "IP_HOLE_KIND_OPERAND", "IP_HOLE_KIND_CONTINUE", "IP_HOLE_KIND_JUMP",
+  "IP_HOLE_KIND_NARGS",   "IP_HOLE_KIND_NLOCALS",
+};
+
+static unsigned char*
+read_file(const char* path, size_t* size)
+{
+  FILE* f;
+  unsigned char* data;
+  long len;
+
+  f = fopen(path, "rb");
+  if (NULL == f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(len);
+  if (NULL == data || fread(data, 1, len, f) != (size_t)len) {
+    fclose(f);
+    free(data);
+    return NULL;
+  }
+  fclose(f);
+  *size = len;
+  return data;
+}
+
+static int
+hole_index(const char* name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(hole_names) / sizeof(hole_names[0]); i++) {
+    if (!strcmp(name, hole_names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int
+dump_stencil(unsigned char* obj,
+             Elf64_Shdr* shdrs,
+             size_t nshdrs,
+             Elf64_Sym* syms,
+             const char* strtab,
+             Elf64_Sym* sym,
+             const char* name)
+{
+  Elf64_Shdr* text = &shdrs[sym->st_shndx];
+  unsigned char* code = obj + text->sh_offset + sym->st_value;
+  size_t i, j, size = sym->st_size;
+
+  printf("static const unsigned char ip_stencil_%s_code[] = {", name);
+  for (i = 0; i < size; i++) {
+    printf("%s0x%02x,", i % 12 ? " " : "\n  ", code[i]);
+  }
+  printf("\n};\n");
+
+  printf("static const struct ip_stencil_hole ip_stencil_%s_holes[] = {\n",
+         name);
+  for (i = 0; i < nshdrs; i++) {
+    Elf64_Rela* relas;
+    size_t nrelas;
+
+    if (SHT_RELA != shdrs[i].sh_type ||
+        &shdrs[shdrs[i].sh_info] != text) {
+      continue;
+    }
+    relas = (Elf64_Rela*)(obj + shdrs[i].sh_offset);
+    nrelas = shdrs[i].sh_size / sizeof(Elf64_Rela);
+    for (j = 0; j < nrelas; j++) {
+      Elf64_Sym* target = &syms[ELF64_R_SYM(relas[j].r_info)];
+      const char* target_name = strtab + target->st_name;
+      int hole = hole_index(target_name);
+
+      if (relas[j].r_offset < sym->st_value ||
+          relas[j].r_offset >= sym->st_value + size) {
+        continue;
+      }
+      if (R_X86_64_64 != ELF64_R_TYPE(relas[j].r_info) || hole < 0) {
+        fprintf(stderr,
+                "stencil %s: unsupported relocation %d to '%s'\n",
+                name,
+                (int)ELF64_R_TYPE(relas[j].r_info),
+                target_name);
+        return 1;
+      }
+      printf("  { %lu, %s, %ld },\n",
+             (unsigned long)(relas[j].r_offset - sym->st_value),
+             hole_kinds[hole],
+             (long)relas[j].r_addend);
+    }
+  }
+  /* an empty initializer list is not C89 */
+  printf("  { 0, IP_HOLE_KIND_NONE, 0 },\n};\n");
+
+  printf("static const struct ip_stencil ip_stencil_%s = {\n"
+         "  ip_stencil_%s_code,\n"
+         "  sizeof(ip_stencil_%s_code),\n"
+         "  ip_stencil_%s_holes,\n"
+         "  sizeof(ip_stencil_%s_holes) / sizeof(ip_stencil_%s_holes[0]) - 1,\n"
+         "};\n\n",
+         name,
+         name,
+         name,
+         name,
+         name,
+         name);
+
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned char* obj;
+  size_t size, i, nshdrs, nsyms = 0;
+  Elf64_Ehdr* ehdr;
+  Elf64_Shdr* shdrs;
+  Elf64_Sym* syms = NULL;
+  const char* strtab = NULL;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s stencils.o\n", argv[0]);
+    return 1;
+  }
+
+  obj = read_file(argv[1], &size);
+  if (NULL == obj) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  ehdr = (Elf64_Ehdr*)obj;
+  if (size < sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ELFCLASS64 != ehdr->e_ident[EI_CLASS] || ET_REL != ehdr->e_type ||
+      EM_X86_64 != ehdr->e_machine) {
+    fprintf(stderr, "%s: not an x86-64 relocatable object\n", argv[1]);
+    return 1;
+  }
+
+  shdrs = (Elf64_Shdr*)(obj + ehdr->e_shoff);
+  nshdrs = ehdr->e_shnum;
+  for (i = 0; i < nshdrs; i++) {
+    if (SHT_SYMTAB == shdrs[i].sh_type) {
+      syms = (Elf64_Sym*)(obj + shdrs[i].sh_offset);
+      nsyms = shdrs[i].sh_size / sizeof(Elf64_Sym);
+      strtab = (const char*)(obj + shdrs[shdrs[i].sh_link].sh_offset);
+    }
+  }
+  if (NULL == syms) {
+    fprintf(stderr, "%s: no symbol table\n", argv[1]);
+    return 1;
+  }
+
+  printf("/* generated by stencil_gen from %s. do not edit. */\n\n", argv[1]);
+  for (i = 0; i < nsyms; i++) {
+    const char* name = strtab + syms[i].st_name;
+
+    if (STT_FUNC != ELF64_ST_TYPE(syms[i].st_info) ||
+        STB_GLOBAL != ELF64_ST_BIND(syms[i].st_info) ||
+        strncmp(name, PREFIX, strlen(PREFIX))) {
+      continue;
+    }
+    if (dump_stencil(obj,
+                     shdrs,
+                     nshdrs,
+                     syms,
+                     strtab,
+                     &syms[i],
+                     name + strlen(PREFIX))) {
+      return 1;
+    }
+  }
+
+  free(obj);
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef IP_H_SUPERINST
+#define IP_H_SUPERINST
+
+#include "vm.h"
+
+/**
+ * superinstructions.
+ * A superinst is a sequence of insts run by a single handler. The set is
+ * listed in superinsts.def, which is written by the profiling build
+ * (`make superinsts`). Fusion keeps the positions: only the head inst
+ * gets the code of the superinst, the following ones are left as they are
+ * for jumps into the middle of the sequence and for their operands.
+ */
+
+#define IP_SUPERINST_MAXLEN 4
+
+/* ops fused in any position. only the last one may be a branch */
+#define IP_SUPERINST_IS_STRAIGHT(code) ((code) <= IP_CODE_SUB)
+#define IP_SUPERINST_IS_BRANCH(code)                                           \
+  (IP_CODE_JUMP <= (code) && (code) <= IP_CODE_JUMP_IF_NEG)
+
+/* the profiling build writes the set, it does not read it */
+#ifndef IP_VM_PROFILE
+
+struct ip_superinst
+{
+  size_t len;
+  enum ip_code codes[IP_SUPERINST_MAXLEN];
+};
+
+static const struct ip_superinst ip_superinsts[] = {
+#define IP_SUPERINST2(a, b)                                                    \
+  { 2, { IP_CODE_##a, IP_CODE_##b } },
+#define IP_SUPERINST3(a, b, c)                                                 \
+  { 3, { IP_CODE_##a, IP_CODE_##b, IP_CODE_##c } },
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  { 4, { IP_CODE_##a, IP_CODE_##b, IP_CODE_##c, IP_CODE_##d } },
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+  /* an empty initializer list is not C89 */
+  { 0, { IP_CODE_EXIT } },
+};
+
+#define IP_NSUPERINSTS                                                         \
+  (sizeof(ip_superinsts) / sizeof(ip_superinsts[0]) - 1)
+
+/* the longest superinst starting at insts[i], or -1 */
+static int
+ip_superinst_match(const struct ip_inst* insts, size_t ninsts, size_t i)
+  __attribute__((unused));
+static int
+ip_superinst_match(const struct ip_inst* insts, size_t ninsts, size_t i)
+{
+  size_t j, k;
+  int best = -1;
+
+  for (j = 0; j < IP_NSUPERINSTS; j++) {
+    const struct ip_superinst* s = &ip_superinsts[j];
+
+    if (i + s->len > ninsts ||
+        (0 <= best && s->len <= ip_superinsts[best].len)) {
+      continue;
+    }
+    for (k = 0; k < s->len; k++) {
+      if (insts[i + k].code != s->codes[k]) {
+        break;
+      }
+    }
+    if (k == s->len) {
+      best = j;
+    }
+  }
+
+  return best;
+}
+
+#endif /* IP_VM_PROFILE */
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef IP_H_TAIL_CALL
+#define IP_H_TAIL_CALL
+
+#include "vm.h"
+#include <stdlib.h>
+
+/**
+ * tail calls.
+ * A TAIL_CALL moves the args over the frame of the running proc and jumps to
+ * the callee without a callinfo, the callee returns to the caller of the
+ * running proc. The interpreters keeping a callstack run it that way and
+ * turn every CALL followed by a RETURN into one. The RETURN is kept for the
+ * jumps landing on it. The other engines lower it back to CALL; RETURN.
+ */
+
+/* is insts[i] a TAIL_CALL, written as one or as CALL; RETURN */
+#define IP_TAIL_CALL_AT(insts, ninsts, i)                                      \
+  (IP_CODE_TAIL_CALL == (insts)[i].code ||                                     \
+   (IP_CODE_CALL == (insts)[i].code && (i) + 1 < (ninsts) &&                   \
+    IP_CODE_RETURN == (insts)[(i) + 1].code))
+
+/* CALL; RETURN to TAIL_CALL; RETURN */
+static void
+ip_tail_call_rewrite(struct ip_inst* insts, size_t ninsts)
+  __attribute__((unused));
+static void
+ip_tail_call_rewrite(struct ip_inst* insts, size_t ninsts)
+{
+  size_t i;
+
+  for (i = 0; i < ninsts; i++) {
+    if (IP_TAIL_CALL_AT(insts, ninsts, i)) {
+      insts[i].code = IP_CODE_TAIL_CALL;
+    }
+  }
+}
+
+/* TAIL_CALL to CALL; RETURN, in a malloced array. the jumps are moved with
+ * the insts they land on */
+static int
+ip_tail_call_lower(const struct ip_inst* insts,
+                   size_t ninsts,
+                   struct ip_inst** ret,
+                   size_t* nret) __attribute__((unused));
+static int
+ip_tail_call_lower(const struct ip_inst* insts,
+                   size_t ninsts,
+                   struct ip_inst** ret,
+                   size_t* nret)
+{
+  size_t i, n, t, *map;
+  struct ip_inst* result;
+
+  map = malloc((ninsts + 1) * sizeof(size_t));
+  if (NULL == map) {
+    return 1;
+  }
+  for (i = 0, n = 0; i < ninsts; i++) {
+    map[i] = n;
+    n += IP_CODE_TAIL_CALL == insts[i].code ? 2 : 1;
+  }
+  map[ninsts] = n;
+
+  result = malloc((n ? n : 1) * sizeof(struct ip_inst));
+  if (NULL == result) {
+    free(map);
+    return 1;
+  }
+
+  for (i = 0; i < ninsts; i++) {
+    struct ip_inst inst = insts[i];
+
+    switch (inst.code) {
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        /* jumps land after the target */
+        t = inst.u.pos + 1;
+        if (t <= ninsts) {
+          inst.u.pos = map[t] - 1;
+        } else {
+          inst.u.pos += n - ninsts;
+        }
+        break;
+      case IP_CODE_TAIL_CALL:
+        inst.code = IP_CODE_CALL;
+        result[map[i] + 1].code = IP_CODE_RETURN;
+        result[map[i] + 1].u.v = 0;
+        break;
+      default:
+        break;
+    }
+    result[map[i]] = inst;
+  }
+
+  free(map);
+  *ret = result;
+  *nret = n;
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef IP_H_VERIFIER
+#define IP_H_VERIFIER
+
+#include "vm.h"
+#include <stdlib.h>
+
+/**
+ * bytecode verifier.
+ * Computes the depth of the stack above the locals at every inst of a proc.
+ * A proc is verified if the depth is the same on every path to an inst, no
+ * inst pops below the locals, the locals are in the frame, the jumps land
+ * in the proc, it returns with nothing but the result over its locals and
+ * it does not run off its end. Such a proc cannot overflow its stack once
+ * it has room for its locals and its deepest point, so the engines check
+ * that once when it is called and run it on handlers without checks.
+ *
+ * The arity of a callee of CALL_INDIRECT is not known, a proc using it is
+ * not verified.
+ */
+
+/* a proc as the verifier sees it */
+struct ip_verify_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  const struct ip_inst* insts;
+};
+
+/* the nargs of the proc at ref, 1 if there is none */
+typedef int (*ip_verify_lookup_t)(void* ctx, ip_proc_ref_t ref, size_t* nargs);
+
+/* 0 if proc is verified, with the deepest point of its stack above the
+ * locals in depth */
+static int
+ip_verify(const struct ip_verify_proc* proc,
+          ip_verify_lookup_t lookup,
+          void* ctx,
+          size_t* depth) __attribute__((unused));
+static int
+ip_verify(const struct ip_verify_proc* proc,
+          ip_verify_lookup_t lookup,
+          void* ctx,
+          size_t* depth)
+{
+  size_t i, n, nargs, nwork, *work;
+  long *depths, d, max = 0;
+  int ret = 1;
+
+  n = proc->ninsts;
+  if (0 == n) {
+    return 1;
+  }
+
+  depths = malloc(n * sizeof(long));
+  work = malloc(n * sizeof(size_t));
+  if (NULL == depths || NULL == work) {
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    depths[i] = -1;
+  }
+
+#define SUCC(s, sd)                                                            \
+  do {                                                                         \
+    if (n <= (s) || (sd) < 0) {                                                \
+      goto done;                                                               \
+    }                                                                          \
+    if (depths[s] < 0) {                                                       \
+      depths[s] = (sd);                                                        \
+      work[nwork++] = (s);                                                     \
+    } else if (depths[s] != (sd)) {                                            \
+      goto done;                                                               \
+    }                                                                          \
+  } while (0)
+
+  nwork = 0;
+  SUCC(0, 0);
+  while (nwork) {
+    const struct ip_inst* inst;
+
+    i = work[--nwork];
+    inst = &proc->insts[i];
+    d = depths[i];
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        SUCC(i + 1, d + 1);
+        break;
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        if (inst->u.i < 0 ||
+            proc->nargs + proc->nlocals <= (size_t)inst->u.i) {
+          goto done;
+        }
+        SUCC(i + 1, IP_CODE_GET_LOCAL == inst->code ? d + 1 : d - 1);
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        SUCC(i + 1, d < 2 ? -1 : d - 1);
+        break;
+      case IP_CODE_JUMP:
+        SUCC(inst->u.pos + 1, d);
+        break;
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        SUCC(inst->u.pos + 1, d - 1);
+        SUCC(i + 1, d - 1);
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_TAIL_CALL:
+        if (lookup(ctx, inst->u.p, &nargs) || d < (long)nargs) {
+          goto done;
+        }
+        /* the callee reserves its own frame */
+        if (IP_CODE_CALL == inst->code) {
+          SUCC(i + 1, d - (long)nargs + 1);
+        }
+        break;
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT:
+        /* the frame goes with the top, nothing may be left over it */
+        if (1 != d) {
+          goto done;
+        }
+        break;
+      default:
+        goto done;
+    }
+    if (max < d + 1) {
+      max = d + 1;
+    }
+  }
+#undef SUCC
+
+  *depth = max;
+  ret = 0;
+
+done:
+  free(depths);
+  free(work);
+  return ret;
+}
+
+/* number of values `inst` of `proc` pops, RETURN and EXIT drop the frame */
+static size_t
+ip_verify_pops(const struct ip_verify_proc* proc, const struct ip_inst* inst)
+  __attribute__((unused));
+static size_t
+ip_verify_pops(const struct ip_verify_proc* proc, const struct ip_inst* inst)
+{
+  switch (inst->code) {
+    case IP_CODE_ADD:
+    case IP_CODE_SUB:
+      return 2;
+    case IP_CODE_SET_LOCAL:
+    case IP_CODE_JUMP_IF_ZERO:
+    case IP_CODE_JUMP_IF_NEG:
+    case IP_CODE_CALL_INDIRECT:
+      return 1;
+    case IP_CODE_RETURN:
+    case IP_CODE_EXIT:
+      return 1 + proc->nargs + proc->nlocals;
+    default:
+      /* a callee checks its args itself */
+      return 0;
+  }
+}
+
+/**
+ * the fewest values on the stack, counted from its bottom, before each inst
+ * of a proc entered with its args and locals on the stack. An inst popping
+ * more than floors[i] values may go below the bottom and has to check, the
+ * ones popping less do not. A call leaves only its result known, insts no
+ * path reaches get 0. 0 on success, 1 if out of memory.
+ */
+static int
+ip_verify_floors(const struct ip_verify_proc* proc, size_t* floors)
+  __attribute__((unused));
+static int
+ip_verify_floors(const struct ip_verify_proc* proc, size_t* floors)
+{
+  size_t i, n = proc->ninsts, nwork = 0, *work;
+  unsigned char* queued;
+
+  work = malloc((n + 1) * sizeof(size_t));
+  queued = calloc(n + 1, 1);
+  if (NULL == work || NULL == queued) {
+    free(work);
+    free(queued);
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    floors[i] = (size_t)-1;
+  }
+
+#define SUCC(s, sf)                                                            \
+  do {                                                                         \
+    size_t s_ = (s), sf_ = (sf);                                               \
+    if (s_ < n && sf_ < floors[s_]) {                                          \
+      floors[s_] = sf_;                                                        \
+      if (!queued[s_]) {                                                       \
+        queued[s_] = 1;                                                        \
+        work[nwork++] = s_;                                                    \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+  SUCC(0, proc->nargs + proc->nlocals);
+  while (nwork) {
+    const struct ip_inst* inst;
+    size_t f;
+
+    i = work[--nwork];
+    queued[i] = 0;
+    inst = &proc->insts[i];
+    f = ip_verify_pops(proc, inst);
+    f = f <= floors[i] ? floors[i] - f : 0;
+    switch (inst->code) {
+      case IP_CODE_CONST:
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        SUCC(i + 1, f + 1);
+        break;
+      case IP_CODE_SET_LOCAL:
+        SUCC(i + 1, f);
+        break;
+      case IP_CODE_JUMP:
+        SUCC(inst->u.pos + 1, f);
+        break;
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        SUCC(inst->u.pos + 1, f);
+        SUCC(i + 1, f);
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT:
+        /* the callee leaves its result where its args were */
+        SUCC(i + 1, 1);
+        break;
+      default:
+        break;
+    }
+  }
+#undef SUCC
+
+  for (i = 0; i < n; i++) {
+    if ((size_t)-1 == floors[i]) {
+      floors[i] = 0;
+    }
+  }
+  free(work);
+  free(queued);
+  return 0;
+}
+
+#endif
@@ -27,6 +27,8 @@ enum ip_code
   IP_CODE_CALL_INDIRECT,
   IP_CODE_RETURN,
   IP_CODE_EXIT,
+  /* CALL; RETURN reusing the frame, see tail_call.h */
+  IP_CODE_TAIL_CALL,
 };
 
 struct ip_inst
@@ -89,6 +91,10 @@ struct ip_inst
   {                                                                            \
     IP_CODE_EXIT, {}                                                           \
   }
+#define IP_INST_TAIL_CALL(p)                                                   \
+  {                                                                            \
+    IP_CODE_TAIL_CALL, { p }                                                   \
+  }
 
 struct ip_proc;
 int
@@ -127,7 +133,35 @@ ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg);
 int
 ip_vm_get_result(struct ip_vm* vm, ip_value_t* result);
 
+/* the guard engine maps the stacks of every vm in full between guard pages,
+ * so the vms are only bounded by the address space, and catches faults on
+ * them with a SIGSEGV handler of the process: there one ip_vm_exec may run
+ * at a time, in one thread */
 int
 ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref);
 
+/* the most values and calls the stacks of vm grow to, they commit memory as
+ * they grow. only the interpreters keeping their calls in stack.h stacks
+ * support it: simple, threaded, direct threaded, stack caching, register and
+ * frame. the other engines return 1. not while ip_vm_exec runs */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls);
+
+/* ip_proc_new with the proc and its insts in the arena of vm, next to the
+ * procs made before it. ip_vm_dtor frees them all at once, ip_proc_dtor
+ * must not be called on them. the engines without limits for
+ * ip_vm_set_stack_limits have no arena, they make the proc with ip_proc_new
+ * and free it in ip_vm_dtor */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret);
+
+/* compile the registered procs ahead of time. only the aot engine has it */
+int
+ip_vm_compile_aot(struct ip_vm* vm);
+
 #endif
@@ -0,0 +1,1024 @@
+#include "call.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "vm.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * ahead of time compilation to C.
+ * Procs are interpreted until ip_vm_compile_aot translates every registered
+ * proc into a C function, builds them into a shared object with the system
+ * C compiler and loads it with dlopen. Locals and operand stack slots
+ * become C variables, jumps become gotos and CALL a direct call of the
+ * function of the callee, so the C compiler sees whole procs. The sum loop
+ * is generated as
+ *
+ *   i4:
+ *     s0 = l0;
+ *     s1 = l1;
+ *     s0 = IP_AOT_SUB(s0, s1);
+ *     if (s0 < 0) goto i17;
+ *     ...
+ *     goto i4;
+ *
+ * Errors and EXIT are left in ctx->status, which the callers check after
+ * each call. The frames of compiled procs live on the native stack but
+ * are counted in ctx->used against the size of vm->stack, so deep
+ * recursion fails as in the other engines. Procs that cannot be
+ * translated, because of inconsistent stack depths or calls to procs not
+ * registered yet, stay interpreted and are called through ip_aot_call, as
+ * are the CALL_INDIRECT targets.
+ *
+ * A CALL_INDIRECT is only compiled when its procref is a constant, see
+ * call.h, and passes as many values as the callee takes; a proc with any
+ * other CALL_INDIRECT stays interpreted. The compiled procs call the
+ * functions of their callees directly, so replacing a registered proc sends
+ * every proc back to the interpreter until the next ip_vm_compile_aot.
+ */
+
+/* the compiler and its flags, the output options are appended */
+#ifndef IP_AOT_CC
+#define IP_AOT_CC "cc -O2 -w"
+#endif
+
+/* native stack the procs may use before failing */
+#define IP_AOT_NATIVE_STACK (1024 * 1024)
+
+#define IP_AOT_OK 0
+#define IP_AOT_ERROR 1
+#define IP_AOT_EXIT 2
+
+/* state shared with the generated code, see ip_aot_prelude */
+struct ip_aot_ctx
+{
+  int status;
+  ip_value_t result;
+  char* limit;
+  /* values taken by the frames, out of size */
+  size_t used;
+  size_t size;
+  ip_value_t (*call)(struct ip_aot_ctx* ctx,
+                     ip_value_t ref,
+                     size_t nargs,
+                     ip_value_t* args);
+};
+
+typedef ip_value_t (*ip_aot_entry_t)(struct ip_aot_ctx* ctx, ip_value_t* args);
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst* insts;
+  /* the compiled proc, NULL while interpreted */
+  ip_aot_entry_t entry;
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
+};
+
+/**
+ * stack usage of the interpreter
+ *        args                          sp
+ *         v                            v
+ *        --+----------+------------+---
+ * bottom <-| args ... | locals ... | data -> top
+ *        --+----------+------------+---
+ */
+struct ip_vm
+{
+  /* first, the generated code only gets the ctx */
+  struct ip_aot_ctx ctx;
+  ip_stack(ip_value_t) stack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+  /* the loaded shared object */
+  void* so;
+};
+
+static const char ip_aot_prelude[] =
+  "#include <stddef.h>\n"
+  "\n"
+  "typedef long long int ip_value_t;\n"
+  "\n"
+  "struct ip_aot_ctx\n"
+  "{\n"
+  "  int status;\n"
+  "  ip_value_t result;\n"
+  "  char* limit;\n"
+  "  size_t used;\n"
+  "  size_t size;\n"
+  "  ip_value_t (*call)(struct ip_aot_ctx* ctx,\n"
+  "                     ip_value_t ref,\n"
+  "                     size_t nargs,\n"
+  "                     ip_value_t* args);\n"
+  "};\n"
+  "\n"
+  "/* wrapping like the interpreters */\n"
+  "#define IP_AOT_ADD(x, y)"
+  " ((ip_value_t)((unsigned long long)(x) + (unsigned long long)(y)))\n"
+  "#define IP_AOT_SUB(x, y)"
+  " ((ip_value_t)((unsigned long long)(x) - (unsigned long long)(y)))\n"
+  "#define IP_AOT_ENTER(ctx, n)"
+  " if ((char*)__builtin_frame_address(0) < (ctx)->limit ||"
+  " (ctx)->size - (ctx)->used < (n)) goto err; (ctx)->used += (n)\n"
+  "#define IP_AOT_LEAVE(ctx, n) (ctx)->used -= (n)\n"
+  "#define IP_AOT_CHECK(ctx) if ((ctx)->status) return 0\n"
+  "\n";
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  /* TAIL_CALL runs as CALL; RETURN */
+  if (ip_tail_call_lower(insts, ninsts, &proc->insts, &ninsts)) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+  proc->entry = NULL;
+
+  return 0;
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  free(proc->insts);
+}
+
+static ip_value_t
+ip_aot_call(struct ip_aot_ctx* ctx,
+            ip_value_t ref,
+            size_t nargs,
+            ip_value_t* args);
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  vm->ctx.status = IP_AOT_OK;
+  vm->ctx.result = 0;
+  vm->ctx.limit = NULL;
+  vm->ctx.used = 0;
+  vm->ctx.size = 0;
+  vm->ctx.call = ip_aot_call;
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->owned = NULL;
+  vm->so = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  size_t i;
+
+  /* the compiled procs may reach the one replaced */
+  if (NULL != vm->procs[at]) {
+    for (i = 0; i < vm->nprocs; i++) {
+      if (NULL != vm->procs[i]) {
+        vm->procs[i]->entry = NULL;
+      }
+    }
+    proc->entry = NULL;
+  }
+  vm->procs[at] = proc;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc *proc, *next;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  if (NULL != vm->so) {
+    dlclose(vm->so);
+  }
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
+}
+
+/* interpreter */
+
+/* run `proc` on a copy of `args` above the top of the stack */
+static ip_value_t
+ip_aot_interp(struct ip_vm* vm, struct ip_proc* proc, ip_value_t* args)
+{
+  struct ip_aot_ctx* ctx = &vm->ctx;
+  size_t nframe = proc->nargs + proc->nlocals;
+  size_t base = vm->stack.sp, ip = 0, i;
+  /* the frame is accounted in ctx->used while calling */
+  size_t used = ctx->used;
+  ip_value_t* data = vm->stack.data;
+
+#define SP (vm->stack.sp)
+#define FAIL()                                                                 \
+  do {                                                                         \
+    ctx->status = IP_AOT_ERROR;                                                \
+    vm->stack.sp = base;                                                       \
+    return 0;                                                                  \
+  } while (0)
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    if (SP - base >= ctx->size - used ||                                       \
+        ip_stack_push(ip_value_t, &vm->stack, v)) {                            \
+      FAIL();                                                                  \
+    }                                                                          \
+  } while (0)
+#define NEED(n)                                                                \
+  do {                                                                         \
+    if (SP - base < nframe + (n)) {                                            \
+      FAIL();                                                                  \
+    }                                                                          \
+  } while (0)
+
+  if ((char*)__builtin_frame_address(0) < ctx->limit) {
+    FAIL();
+  }
+  if (SP >= proc->nargs && args == data + SP - proc->nargs) {
+    /* called by the interpreter, the args are in place */
+    base = SP - proc->nargs;
+  } else {
+    for (i = 0; i < proc->nargs; i++) {
+      PUSH(args[i]);
+    }
+  }
+  for (i = 0; i < proc->nlocals; i++) {
+    PUSH(IP_LLINT2VALUE(0));
+  }
+
+  while (1) {
+    struct ip_inst inst;
+
+    if (ip >= proc->ninsts) {
+      FAIL();
+    }
+
+    inst = proc->insts[ip];
+    switch (inst.code) {
+      case IP_CODE_CONST: {
+        PUSH(inst.u.v);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        if (inst.u.i < 0 || (size_t)inst.u.i >= nframe) {
+          FAIL();
+        }
+        PUSH(data[base + inst.u.i]);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        if (inst.u.i < 0 || (size_t)inst.u.i >= nframe) {
+          FAIL();
+        }
+        NEED(1);
+        data[base + inst.u.i] = data[--SP];
+        break;
+      }
+      case IP_CODE_ADD:
+      case IP_CODE_SUB: {
+        long long int x, y;
+
+        NEED(2);
+        y = IP_VALUE2LLINT(data[--SP]);
+        x = IP_VALUE2LLINT(data[SP - 1]);
+        data[SP - 1] = IP_LLINT2VALUE(IP_CODE_ADD == inst.code ? x + y : x - y);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        ip = inst.u.pos;
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO: {
+        NEED(1);
+        if (!IP_VALUE2LLINT(data[--SP])) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_JUMP_IF_NEG: {
+        NEED(1);
+        if (IP_VALUE2LLINT(data[--SP]) < 0) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        ip_value_t ref = IP_PROCREF2VALUE(inst.u.p), v;
+        size_t nargs, top;
+
+        if (IP_CODE_CALL_INDIRECT == inst.code) {
+          NEED(1);
+          ref = data[--SP];
+        }
+        if (ref < 0 || (size_t)ref >= vm->nprocs || NULL == vm->procs[ref]) {
+          FAIL();
+        }
+        nargs = vm->procs[ref]->nargs;
+        NEED(nargs);
+
+        top = SP - nargs;
+        ctx->used = used + (top - base);
+        v = ip_aot_call(ctx, ref, nargs, data + top);
+        ctx->used = used;
+        if (ctx->status) {
+          vm->stack.sp = base;
+          return 0;
+        }
+        SP = top;
+        PUSH(v);
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT: {
+        ip_value_t v;
+
+        NEED(1);
+        v = data[SP - 1];
+        vm->stack.sp = base;
+        if (IP_CODE_EXIT == inst.code) {
+          ctx->result = v;
+          ctx->status = IP_AOT_EXIT;
+          return 0;
+        }
+        return v;
+      }
+      default: {
+        printf("code: %d, u: %d", inst.code, inst.u.i);
+        FAIL();
+      }
+    }
+    ip += 1;
+  }
+
+#undef SP
+#undef FAIL
+#undef PUSH
+#undef NEED
+}
+
+/* call the proc `ref`, compiled or not, on `nargs` args */
+static ip_value_t
+ip_aot_call(struct ip_aot_ctx* ctx,
+            ip_value_t ref,
+            size_t nargs,
+            ip_value_t* args)
+{
+  /* the ctx is the head of the vm */
+  struct ip_vm* vm = (struct ip_vm*)ctx;
+  struct ip_proc* proc;
+
+  if (ref < 0 || (size_t)ref >= vm->nprocs || NULL == vm->procs[ref] ||
+      vm->procs[ref]->nargs != nargs) {
+    ctx->status = IP_AOT_ERROR;
+    return 0;
+  }
+
+  proc = vm->procs[ref];
+  if (NULL != proc->entry) {
+    return proc->entry(ctx, args);
+  }
+  return ip_aot_interp(vm, proc, args);
+}
+
+/* translation to C */
+
+#define IP_DEPTH_UNKNOWN ((size_t)-1)
+
+static int
+ip_vm_nargs_lookup(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (NULL == vm || ref < 0 || vm->nprocs <= (size_t)ref ||
+      NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/* number of args taken by the call at insts[at], or -1 if not known */
+static long
+ip_aot_call_nargs(struct ip_vm* vm, struct ip_proc* proc, size_t at)
+{
+  long nargs =
+    ip_call_nargs(proc->insts, proc->ninsts, at, ip_vm_nargs_lookup, vm);
+
+  return nargs < 0 ? -1 : nargs;
+}
+
+/**
+ * compute the operand stack depth before each inst.
+ * returns 1 if it is not the same on every path or a callee is unknown.
+ */
+static int
+ip_aot_compute_depths(struct ip_vm* vm,
+                      struct ip_proc* proc,
+                      size_t* depths,
+                      size_t* max_depth)
+{
+  size_t* work;
+  size_t nwork = 0, nframe = proc->nargs + proc->nlocals, i;
+
+  work = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == work) {
+    return 1;
+  }
+
+  for (i = 0; i < proc->ninsts; i++) {
+    depths[i] = IP_DEPTH_UNKNOWN;
+  }
+  *max_depth = 0;
+
+#define FLOW(to, d)                                                            \
+  do {                                                                         \
+    size_t to_ = (to), d_ = (d);                                               \
+    if (to_ >= proc->ninsts) {                                                 \
+      /* runs into the error label */                                          \
+      break;                                                                   \
+    }                                                                          \
+    if (IP_DEPTH_UNKNOWN == depths[to_]) {                                     \
+      depths[to_] = d_;                                                        \
+      work[nwork++] = to_;                                                     \
+    } else if (depths[to_] != d_) {                                            \
+      free(work);                                                              \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+  if (proc->ninsts) {
+    depths[0] = 0;
+    work[nwork++] = 0;
+  }
+
+  while (nwork) {
+    size_t at = work[--nwork];
+    size_t d = depths[at];
+    struct ip_inst* inst = &proc->insts[at];
+    long pops = 0, pushes = 0;
+    int falls = 1;
+
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        pushes = 1;
+        break;
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        if (inst->u.i < 0 || (size_t)inst->u.i >= nframe) {
+          free(work);
+          return 1;
+        }
+        pops = IP_CODE_SET_LOCAL == inst->code;
+        pushes = IP_CODE_GET_LOCAL == inst->code;
+        break;
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        pops = 1;
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        pops = 2;
+        pushes = 1;
+        break;
+      case IP_CODE_JUMP:
+        falls = 0;
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        long nargs;
+
+        if (IP_CODE_CALL_INDIRECT == inst->code && !d) {
+          free(work);
+          return 1;
+        }
+        nargs = ip_aot_call_nargs(vm, proc, at);
+        if (nargs < 0) {
+          free(work);
+          return 1;
+        }
+        pops = nargs + (IP_CODE_CALL_INDIRECT == inst->code);
+        pushes = 1;
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT:
+        pops = 1;
+        falls = 0;
+        break;
+      default:
+        free(work);
+        return 1;
+    }
+
+    if ((size_t)pops > d) {
+      free(work);
+      return 1;
+    }
+    d = d - pops + pushes;
+    if (d > *max_depth) {
+      *max_depth = d;
+    }
+
+    if (IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+        IP_CODE_JUMP_IF_NEG == inst->code) {
+      /* jumps land after the target, as `ip` is incremented afterwards */
+      FLOW(inst->u.pos + 1, d);
+    }
+    if (falls) {
+      FLOW(at + 1, d);
+    }
+  }
+
+#undef FLOW
+
+  free(work);
+  return 0;
+}
+
+static void
+ip_aot_emit_signature(FILE* out, struct ip_proc* proc, size_t k)
+{
+  size_t i;
+
+  fprintf(out,
+          "static ip_value_t\nip_aot_%lu(struct ip_aot_ctx* ctx",
+          (unsigned long)k);
+  for (i = 0; i < proc->nargs; i++) {
+    fprintf(out, ", ip_value_t l%lu", (unsigned long)i);
+  }
+  fprintf(out, ")");
+}
+
+/* where a jump to `pos` lands */
+static void
+ip_aot_emit_goto(FILE* out, struct ip_proc* proc, size_t pos)
+{
+  if (pos + 1 < proc->ninsts) {
+    fprintf(out, "goto i%lu;\n", (unsigned long)(pos + 1));
+  } else {
+    fprintf(out, "goto err;\n");
+  }
+}
+
+/* the call at insts[at] of `proc`, with the stack at depth `d` */
+static void
+ip_aot_emit_call(FILE* out,
+                 struct ip_vm* vm,
+                 struct ip_proc* proc,
+                 size_t at,
+                 size_t d,
+                 unsigned char* compiled)
+{
+  struct ip_inst* inst = &proc->insts[at];
+  size_t nargs = ip_aot_call_nargs(vm, proc, at), r, j;
+
+  r = d - nargs - (IP_CODE_CALL_INDIRECT == inst->code);
+  if (IP_CODE_CALL == inst->code && compiled[inst->u.p]) {
+    fprintf(out, "  s%lu = ip_aot_%d(ctx", (unsigned long)r, inst->u.p);
+    for (j = 0; j < nargs; j++) {
+      fprintf(out, ", s%lu", (unsigned long)(r + j));
+    }
+    fprintf(out, ");\n");
+  } else {
+    /* through the runtime */
+    fprintf(out, "  {\n    ip_value_t a[%lu];\n", (unsigned long)nargs + 1);
+    for (j = 0; j < nargs; j++) {
+      fprintf(out,
+              "    a[%lu] = s%lu;\n",
+              (unsigned long)j,
+              (unsigned long)(r + j));
+    }
+    fprintf(out, "    s%lu = ctx->call(ctx, ", (unsigned long)r);
+    if (IP_CODE_CALL_INDIRECT == inst->code) {
+      fprintf(out, "s%lu", (unsigned long)(d - 1));
+    } else {
+      fprintf(out, "%d", inst->u.p);
+    }
+    fprintf(out, ", %lu, a);\n  }\n", (unsigned long)nargs);
+  }
+  fprintf(out, "  IP_AOT_CHECK(ctx);\n");
+}
+
+static void
+ip_aot_emit_proc(FILE* out,
+                 struct ip_vm* vm,
+                 size_t k,
+                 size_t* depths,
+                 size_t max_depth,
+                 unsigned char* compiled)
+{
+  struct ip_proc* proc = vm->procs[k];
+  unsigned char* targets;
+  size_t nframe = proc->nargs + proc->nlocals, i;
+
+  targets = calloc(proc->ninsts + 1, 1);
+  for (i = 0; i < proc->ninsts && NULL != targets; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+
+    if ((IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+         IP_CODE_JUMP_IF_NEG == inst->code) &&
+        inst->u.pos + 1 < proc->ninsts) {
+      targets[inst->u.pos + 1] = 1;
+    }
+  }
+
+  ip_aot_emit_signature(out, proc, k);
+  fprintf(out, "\n{\n");
+  for (i = proc->nargs; i < proc->nargs + proc->nlocals; i++) {
+    fprintf(out, "  ip_value_t l%lu = 0;\n", (unsigned long)i);
+  }
+  for (i = 0; i < max_depth; i++) {
+    fprintf(out, "  ip_value_t s%lu;\n", (unsigned long)i);
+  }
+  fprintf(out, "\n  IP_AOT_ENTER(ctx, %lu);\n", (unsigned long)nframe);
+
+  for (i = 0; i < proc->ninsts; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+    unsigned long d = depths[i];
+
+    if (IP_DEPTH_UNKNOWN == depths[i]) {
+      continue;
+    }
+    /* labels at the jump targets, everywhere without the table */
+    if (NULL == targets || targets[i]) {
+      fprintf(out, "i%lu:\n", (unsigned long)i);
+    }
+
+    switch (inst->code) {
+      case IP_CODE_CONST:
+        fprintf(out,
+                "  s%lu = (ip_value_t)%lluULL;\n",
+                d,
+                (unsigned long long)inst->u.v);
+        break;
+      case IP_CODE_GET_LOCAL:
+        fprintf(out, "  s%lu = l%d;\n", d, inst->u.i);
+        break;
+      case IP_CODE_SET_LOCAL:
+        fprintf(out, "  l%d = s%lu;\n", inst->u.i, d - 1);
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        fprintf(out,
+                "  s%lu = IP_AOT_%s(s%lu, s%lu);\n",
+                d - 2,
+                IP_CODE_ADD == inst->code ? "ADD" : "SUB",
+                d - 2,
+                d - 1);
+        break;
+      case IP_CODE_JUMP:
+        fprintf(out, "  ");
+        ip_aot_emit_goto(out, proc, inst->u.pos);
+        break;
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        fprintf(out,
+                IP_CODE_JUMP_IF_ZERO == inst->code ? "  if (!s%lu) "
+                                                   : "  if (s%lu < 0) ",
+                d - 1);
+        ip_aot_emit_goto(out, proc, inst->u.pos);
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT:
+        ip_aot_emit_call(out, vm, proc, i, d, compiled);
+        break;
+      case IP_CODE_RETURN:
+        fprintf(out,
+                "  IP_AOT_LEAVE(ctx, %lu);\n  return s%lu;\n",
+                (unsigned long)nframe,
+                d - 1);
+        break;
+      case IP_CODE_EXIT:
+        fprintf(out,
+                "  ctx->result = s%lu;\n  ctx->status = %d;\n  return 0;\n",
+                d - 1,
+                IP_AOT_EXIT);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /* falling off the end, bad jumps and native stack overflows */
+  fprintf(out, "err:\n  ctx->status = %d;\n  return 0;\n}\n\n", IP_AOT_ERROR);
+  free(targets);
+}
+
+/**
+ * write the C file of the procs that can be translated. `compiled` is set
+ * for them.
+ */
+static int
+ip_aot_emit(struct ip_vm* vm, FILE* out, unsigned char* compiled)
+{
+  size_t** depths;
+  size_t* max_depths;
+  size_t k, i;
+
+  depths = calloc(vm->nprocs + 1, sizeof(size_t*));
+  max_depths = calloc(vm->nprocs + 1, sizeof(size_t));
+  if (NULL == depths || NULL == max_depths) {
+    free(depths);
+    free(max_depths);
+    return 1;
+  }
+
+  fputs(ip_aot_prelude, out);
+
+  /* declare first for the calls between procs */
+  for (k = 0; k < vm->nprocs; k++) {
+    struct ip_proc* proc = vm->procs[k];
+
+    compiled[k] = 0;
+    if (NULL == proc) {
+      continue;
+    }
+    depths[k] = malloc((proc->ninsts + 1) * sizeof(size_t));
+    if (NULL == depths[k] ||
+        ip_aot_compute_depths(vm, proc, depths[k], &max_depths[k])) {
+      continue;
+    }
+    compiled[k] = 1;
+    ip_aot_emit_signature(out, proc, k);
+    fprintf(out, ";\n");
+  }
+  fprintf(out, "\n");
+
+  for (k = 0; k < vm->nprocs; k++) {
+    struct ip_proc* proc = vm->procs[k];
+
+    if (!compiled[k]) {
+      continue;
+    }
+    ip_aot_emit_proc(out, vm, k, depths[k], max_depths[k], compiled);
+
+    /* the entry of the runtime, with the args in an array */
+    fprintf(out,
+            "static ip_value_t\nip_aot_entry_%lu(struct ip_aot_ctx* ctx, "
+            "ip_value_t* args)\n{\n  return ip_aot_%lu(ctx",
+            (unsigned long)k,
+            (unsigned long)k);
+    for (i = 0; i < proc->nargs; i++) {
+      fprintf(out, ", args[%lu]", (unsigned long)i);
+    }
+    fprintf(out, ");\n}\n\n");
+  }
+
+  fprintf(out,
+          "ip_value_t (*const ip_aot_entries[])(struct ip_aot_ctx*, "
+          "ip_value_t*) = {\n");
+  for (k = 0; k < vm->nprocs; k++) {
+    if (!compiled[k]) {
+      fprintf(out, "  0,\n");
+    } else {
+      fprintf(out, "  ip_aot_entry_%lu,\n", (unsigned long)k);
+    }
+  }
+  /* an empty initializer list is not C89 */
+  fprintf(out, "  0,\n};\n");
+
+  for (k = 0; k < vm->nprocs; k++) {
+    free(depths[k]);
+  }
+  free(depths);
+  free(max_depths);
+
+  return ferror(out) ? 1 : 0;
+}
+
+int
+ip_vm_compile_aot(struct ip_vm* vm)
+{
+  char dir[] = "/tmp/ip_aot_XXXXXX";
+  char src[sizeof(dir) + 16], so[sizeof(dir) + 16];
+  char* cmd;
+  unsigned char* compiled;
+  ip_aot_entry_t* entries;
+  void* handle = NULL;
+  FILE* out;
+  size_t k;
+  int ret;
+
+  compiled = malloc(vm->nprocs + 1);
+  cmd = malloc(sizeof(IP_AOT_CC) + 2 * sizeof(so) + 32);
+  if (NULL == compiled || NULL == cmd || NULL == mkdtemp(dir)) {
+    free(compiled);
+    free(cmd);
+    return 1;
+  }
+  sprintf(src, "%s/procs.c", dir);
+  sprintf(so, "%s/procs.so", dir);
+
+  out = fopen(src, "w");
+  ret = NULL == out;
+  if (!ret) {
+    ret = ip_aot_emit(vm, out, compiled);
+    ret = fclose(out) || ret;
+  }
+  if (!ret) {
+    sprintf(cmd, "%s -shared -fPIC -o %s %s", IP_AOT_CC, so, src);
+    ret = 0 != system(cmd);
+  }
+  if (!ret) {
+    handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+  }
+
+  /* the mapping outlives the files */
+  unlink(so);
+  unlink(src);
+  rmdir(dir);
+  free(cmd);
+
+  entries = NULL == handle ? NULL : dlsym(handle, "ip_aot_entries");
+  if (NULL == entries) {
+    if (NULL != handle) {
+      dlclose(handle);
+    }
+    free(compiled);
+    return 1;
+  }
+
+  for (k = 0; k < vm->nprocs; k++) {
+    if (NULL != vm->procs[k]) {
+      vm->procs[k]->entry = entries[k];
+    }
+  }
+  if (NULL != vm->so) {
+    dlclose(vm->so);
+  }
+  vm->so = handle;
+
+  free(compiled);
+  return 0;
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  struct ip_proc* proc;
+  size_t base;
+
+  if (procref < 0 || (size_t)procref >= vm->nprocs ||
+      NULL == vm->procs[procref]) {
+    return 1;
+  }
+  proc = vm->procs[procref];
+  if (vm->stack.sp < proc->nargs) {
+    return 1;
+  }
+  base = vm->stack.sp - proc->nargs;
+
+  vm->ctx.status = IP_AOT_OK;
+  vm->ctx.used = 0;
+  vm->ctx.size = vm->stack.size - vm->stack.sp;
+  vm->ctx.limit = (char*)__builtin_frame_address(0) - IP_AOT_NATIVE_STACK;
+  if (NULL != proc->entry) {
+    proc->entry(&vm->ctx, vm->stack.data + base);
+  } else {
+    ip_aot_interp(vm, proc, vm->stack.data + base);
+  }
+
+  /* returning from the entry proc means there was no EXIT */
+  if (IP_AOT_EXIT != vm->ctx.status) {
+    return 1;
+  }
+  vm->stack.sp = base;
+
+  return ip_stack_push(ip_value_t, &vm->stack, vm->ctx.result);
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
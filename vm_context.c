@@ -0,0 +1,597 @@
+#include "jit.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * context threaded vm.
+ * Every proc is translated to native code, one piece per inst laid out in
+ * the order of the insts. The control flow is native: the jumps are
+ * native (conditional) jumps, CALL is a native `call` to the code of the
+ * callee and RETURN a native `ret`. The branch predictor then sees a
+ * distinct branch for each jump of the program and the return stack
+ * predictor matches the returns, instead of every handler sharing one
+ * `goto *`. The bodies of the other insts are a few moves each and are
+ * inlined rather than called: a call through a register per inst cost
+ * more than the dispatch it replaced. The machine state lives in
+ * registers the C ABI preserves:
+ *
+ *   rbx - sp, address of the next free slot of vm->stack
+ *   r12 - address of the first arg of the current frame
+ *   r13 - end of vm->stack, for overflow checks
+ *   r14 - the struct ip_vm
+ */
+
+#define IP_CT_SP IP_JIT_RBX
+#define IP_CT_BASE IP_JIT_R12
+#define IP_CT_LIMIT IP_JIT_R13
+#define IP_CT_VM IP_JIT_R14
+
+/* each native frame is a return address and the saved base */
+#define IP_CT_MAX_DEPTH 1024
+#define IP_CT_FRAME_SIZE 16
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  unsigned char* code;
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
+};
+
+typedef int (*ip_ct_trampoline_t)(struct ip_vm* vm, void* code);
+
+static ip_ct_trampoline_t ip_ct_trampoline;
+static void* ip_ct_trampoline_out;
+
+/**
+ * stack usage
+ *               base                             sp
+ *               v                                v
+ *        --+----------+------------+--------------
+ * bottom <-| args ... | locals ... | data | data | -> top
+ *        --+----------+------------+--------------
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+
+  /* state shared with the generated code */
+  ip_value_t* sp;
+  ip_value_t* bottom;
+  ip_value_t* limit;
+  void* rsp;
+  void* rsp_limit;
+  void* out;
+};
+
+#define IP_CT_VM_FIELD(f) ((int32_t)offsetof(struct ip_vm, f))
+
+/* pop the value on top of the stack into rax */
+static void
+ip_ct_emit_pop_rax(struct ip_jit_buf* buf)
+{
+  ip_jit_op_imm(buf, IP_JIT_EXT_SUB, IP_CT_SP, 8);
+  ip_jit_op_mem(buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_CT_SP, 0);
+}
+
+/* push rax on the stack, the room is checked before */
+static void
+ip_ct_emit_push_rax(struct ip_jit_buf* buf)
+{
+  ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_CT_SP, 0);
+  ip_jit_op_imm(buf, IP_JIT_EXT_ADD, IP_CT_SP, 8);
+}
+
+/* jump to the error stub when there is no room for `n` more values */
+static void
+ip_ct_emit_check_push(struct ip_jit_buf* buf,
+                      size_t n,
+                      size_t* fixups,
+                      size_t* nfixups)
+{
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_CT_SP, n * 8);
+  ip_jit_op_reg(buf, IP_JIT_OP_CMP_RM_R, IP_CT_LIMIT, IP_JIT_RAX);
+  fixups[(*nfixups)++] = ip_jit_jcc(buf, IP_JIT_CC_A);
+}
+
+/* jump to the error stub when there are less than `n` values */
+static void
+ip_ct_emit_check_pop(struct ip_jit_buf* buf,
+                     size_t n,
+                     size_t* fixups,
+                     size_t* nfixups)
+{
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_CT_SP, -(int32_t)(n * 8));
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_CMP_R_RM, IP_JIT_RAX, IP_CT_VM, IP_CT_VM_FIELD(bottom));
+  fixups[(*nfixups)++] = ip_jit_jcc(buf, IP_JIT_CC_B);
+}
+
+/* call the proc in rcx, jumping to the error stub if it is NULL */
+static void
+ip_ct_emit_call_proc(struct ip_jit_buf* buf, size_t* fixups, size_t* nfixups)
+{
+  ip_jit_op_reg(buf, IP_JIT_OP_TEST_RM_R, IP_JIT_RCX, IP_JIT_RCX);
+  fixups[(*nfixups)++] = ip_jit_jcc(buf, IP_JIT_CC_E);
+  ip_jit_call_mem(buf, IP_JIT_RCX, offsetof(struct ip_proc, code));
+}
+
+/* replace the frame by the value on top and drop it */
+static void
+ip_ct_emit_unwind(struct ip_jit_buf* buf)
+{
+  ip_jit_op_mem(buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_CT_SP, -8);
+  ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_CT_BASE, 0);
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_CT_SP, IP_CT_BASE, 8);
+}
+
+/* leave the generated code with `status` as the result of ip_vm_exec */
+static void
+ip_ct_emit_leave(struct ip_jit_buf* buf, int status)
+{
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RSP, IP_CT_VM, IP_CT_VM_FIELD(rsp));
+  ip_jit_mov_imm(buf, IP_JIT_RAX, status);
+  ip_jit_jmp_mem(buf, IP_CT_VM, IP_CT_VM_FIELD(out));
+}
+
+static int
+ip_ct_init_trampoline(void)
+{
+  struct ip_jit_buf buf;
+  size_t out;
+  unsigned char* code;
+
+  if (NULL != ip_ct_trampoline) {
+    return 0;
+  }
+
+  if (ip_jit_buf_init(&buf)) {
+    return 1;
+  }
+
+  /* r15 is not used, but an odd number of pushes keeps the native stack
+   * aligned as in C */
+  ip_jit_push(&buf, IP_JIT_RBX);
+  ip_jit_push(&buf, IP_JIT_R12);
+  ip_jit_push(&buf, IP_JIT_R13);
+  ip_jit_push(&buf, IP_JIT_R14);
+  ip_jit_push(&buf, IP_JIT_R15);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RDI, IP_CT_VM);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_CT_SP, IP_CT_VM, IP_CT_VM_FIELD(sp));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_CT_LIMIT, IP_CT_VM, IP_CT_VM_FIELD(limit));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RSP, IP_CT_VM, IP_CT_VM_FIELD(rsp));
+  ip_jit_op_mem(&buf,
+                IP_JIT_OP_LEA,
+                IP_JIT_RAX,
+                IP_JIT_RSP,
+                -(IP_CT_MAX_DEPTH * IP_CT_FRAME_SIZE));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_CT_VM, IP_CT_VM_FIELD(rsp_limit));
+  ip_jit_call_reg(&buf, IP_JIT_RSI);
+  /* returning from the entry proc means there was no EXIT */
+  ip_jit_mov_imm(&buf, IP_JIT_RAX, 1);
+  out = buf.len;
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_CT_SP, IP_CT_VM, IP_CT_VM_FIELD(sp));
+  ip_jit_pop(&buf, IP_JIT_R15);
+  ip_jit_pop(&buf, IP_JIT_R14);
+  ip_jit_pop(&buf, IP_JIT_R13);
+  ip_jit_pop(&buf, IP_JIT_R12);
+  ip_jit_pop(&buf, IP_JIT_RBX);
+  ip_jit_ret(&buf);
+
+  code = ip_jit_place(&buf);
+  ip_jit_buf_dtor(&buf);
+  if (NULL == code) {
+    return 1;
+  }
+
+  ip_ct_trampoline = (ip_ct_trampoline_t)(void*)code;
+  ip_ct_trampoline_out = code + out;
+
+  return 0;
+}
+
+static int
+ip_proc_emit(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  struct ip_jit_buf buf;
+  size_t i, nfixups = 0, err;
+  size_t* labels;
+  size_t* fixups;
+  size_t* targets;
+  size_t* floors;
+  struct ip_verify_proc vproc;
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+  proc->code = NULL;
+
+  if (ip_ct_init_trampoline()) {
+    return 1;
+  }
+
+  vproc.nargs = nargs;
+  vproc.nlocals = nlocals;
+  vproc.ninsts = ninsts;
+  vproc.insts = insts;
+  labels = malloc((ninsts + 1) * sizeof(size_t));
+  /* at most three branches to the error stub per inst, plus the prologue */
+  fixups = malloc((3 * ninsts + 3) * sizeof(size_t));
+  targets = malloc(ninsts * sizeof(size_t));
+  floors = malloc((ninsts + 1) * sizeof(size_t));
+  if (NULL == labels || NULL == fixups || NULL == targets || NULL == floors ||
+      ip_verify_floors(&vproc, floors) || ip_jit_buf_init(&buf)) {
+    free(labels);
+    free(fixups);
+    free(targets);
+    free(floors);
+    return 1;
+  }
+
+  /* prologue. saving the caller's base also aligns the native stack */
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_CMP_R_RM, IP_JIT_RSP, IP_CT_VM, IP_CT_VM_FIELD(rsp_limit));
+  fixups[nfixups++] = ip_jit_jcc(&buf, IP_JIT_CC_B);
+  ip_jit_push(&buf, IP_CT_BASE);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_LEA, IP_CT_BASE, IP_CT_SP, -(int32_t)(8 * nargs));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_CMP_R_RM, IP_CT_BASE, IP_CT_VM, IP_CT_VM_FIELD(bottom));
+  fixups[nfixups++] = ip_jit_jcc(&buf, IP_JIT_CC_B);
+  if (nlocals) {
+    ip_ct_emit_check_push(&buf, nlocals, fixups, &nfixups);
+    for (i = 0; i < nlocals; i++) {
+      ip_jit_mov_mem_imm(&buf, IP_CT_SP, 8 * i, 0);
+    }
+    ip_jit_op_imm(&buf, IP_JIT_EXT_ADD, IP_CT_SP, 8 * nlocals);
+  }
+
+  for (i = 0; i < ninsts; i++) {
+    struct ip_inst inst = insts[i];
+
+    labels[i] = buf.len;
+    targets[i] = 0;
+
+    /* the pops that may go below the stack */
+    if (floors[i] < ip_verify_pops(&vproc, &inst)) {
+      ip_ct_emit_check_pop(
+        &buf, ip_verify_pops(&vproc, &inst), fixups, &nfixups);
+    }
+
+    switch (inst.code) {
+      case IP_CODE_CONST: {
+        ip_ct_emit_check_push(&buf, 1, fixups, &nfixups);
+        ip_jit_mov_imm(&buf, IP_JIT_RAX, inst.u.v);
+        ip_ct_emit_push_rax(&buf);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        ip_ct_emit_check_push(&buf, 1, fixups, &nfixups);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_CT_BASE, 8 * inst.u.i);
+        ip_ct_emit_push_rax(&buf);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        ip_ct_emit_pop_rax(&buf);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_CT_BASE, 8 * inst.u.i);
+        break;
+      }
+      case IP_CODE_ADD: {
+        ip_ct_emit_pop_rax(&buf);
+        ip_jit_op_mem(&buf, IP_JIT_OP_ADD_RM_R, IP_JIT_RAX, IP_CT_SP, -8);
+        break;
+      }
+      case IP_CODE_SUB: {
+        ip_ct_emit_pop_rax(&buf);
+        ip_jit_op_mem(&buf, IP_JIT_OP_SUB_RM_R, IP_JIT_RAX, IP_CT_SP, -8);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        targets[i] = ip_jit_jmp(&buf);
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG: {
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_CT_SP, 8);
+        ip_jit_op_mem_imm(&buf, IP_JIT_EXT_CMP, IP_CT_SP, 0, 0);
+        targets[i] = ip_jit_jcc(
+          &buf,
+          IP_CODE_JUMP_IF_ZERO == inst.code ? IP_JIT_CC_E : IP_JIT_CC_L);
+        break;
+      }
+      case IP_CODE_CALL: {
+        /* the callee may be registered later, look it up at run time */
+        ip_jit_op_mem_imm(
+          &buf, IP_JIT_EXT_CMP, IP_CT_VM, IP_CT_VM_FIELD(nprocs), inst.u.p);
+        fixups[nfixups++] = ip_jit_jcc(&buf, IP_JIT_CC_BE);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RCX, IP_CT_VM, IP_CT_VM_FIELD(procs));
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RCX, IP_JIT_RCX, 8 * inst.u.p);
+        ip_ct_emit_call_proc(&buf, fixups, &nfixups);
+        break;
+      }
+      case IP_CODE_CALL_INDIRECT: {
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_CT_SP, 8);
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_CT_SP, 0);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_CMP_R_RM, IP_JIT_RAX, IP_CT_VM, IP_CT_VM_FIELD(nprocs));
+        fixups[nfixups++] = ip_jit_jcc(&buf, IP_JIT_CC_AE);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RCX, IP_CT_VM, IP_CT_VM_FIELD(procs));
+        /* mov rcx, [rcx + rax * 8] */
+        ip_jit_emit_u8(&buf, 0x48);
+        ip_jit_emit_u8(&buf, 0x8b);
+        ip_jit_emit_u8(&buf, 0x0c);
+        ip_jit_emit_u8(&buf, 0xc1);
+        ip_ct_emit_call_proc(&buf, fixups, &nfixups);
+        break;
+      }
+      case IP_CODE_RETURN: {
+        ip_ct_emit_unwind(&buf);
+        ip_jit_pop(&buf, IP_CT_BASE);
+        ip_jit_ret(&buf);
+        break;
+      }
+      case IP_CODE_EXIT: {
+        ip_ct_emit_unwind(&buf);
+        ip_ct_emit_leave(&buf, 0);
+        break;
+      }
+      default: {
+        printf("code: %d, u: %d", inst.code, inst.u.i);
+        goto fail;
+      }
+    }
+  }
+
+  /* falling off the end, bad jumps, overflows and bad calls end here */
+  err = buf.len;
+  labels[ninsts] = err;
+  ip_ct_emit_leave(&buf, 1);
+
+  for (i = 0; i < nfixups; i++) {
+    ip_jit_link(&buf, fixups[i], err);
+  }
+  for (i = 0; i < ninsts; i++) {
+    if (targets[i]) {
+      /* jumps land after the target, as `ip` is incremented afterwards */
+      size_t pos = insts[i].u.pos + 1;
+      ip_jit_link(&buf, targets[i], pos <= ninsts ? labels[pos] : err);
+    }
+  }
+
+  proc->code = ip_jit_place(&buf);
+  if (NULL == proc->code) {
+    goto fail;
+  }
+
+  ip_jit_buf_dtor(&buf);
+  free(labels);
+  free(fixups);
+  free(targets);
+  free(floors);
+  return 0;
+
+fail:
+  ip_jit_buf_dtor(&buf);
+  free(labels);
+  free(fixups);
+  free(targets);
+  free(floors);
+  return 1;
+}
+
+/* TAIL_CALL runs as CALL; RETURN */
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  struct ip_inst* lowered;
+  int ret;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  if (ip_tail_call_lower(insts, ninsts, &lowered, &ninsts)) {
+    return 1;
+  }
+  ret = ip_proc_emit(proc, nargs, nlocals, ninsts, lowered);
+  free(lowered);
+
+  return ret;
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  /* the code stays in the arena */
+  (void)proc;
+}
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->owned = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  vm->procs[at] = proc;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc *proc, *next;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  int ret;
+
+  vm->sp = vm->stack.data + vm->stack.sp;
+  vm->bottom = vm->stack.data;
+  vm->limit = vm->stack.data + vm->stack.size;
+  vm->out = ip_ct_trampoline_out;
+
+  ret = ip_ct_trampoline(vm, vm->procs[procref]->code);
+
+  vm->stack.sp = vm->sp - vm->stack.data;
+
+  return ret;
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
@@ -1,4 +1,10 @@
+#include "arena.h"
+#include "loop.h"
+#include "peephole.h"
 #include "stack.h"
+#include "superinst.h"
+#include "tail_call.h"
+#include "verifier.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +12,22 @@
 
 def_ip_stack(ip_value_t);
 
+/**
+ * With IP_VM_REPLICATE the handlers of the straight ops, the jumps and the
+ * superinsts have IP_NREPLICAS copies, given to the sites of the op in turn
+ * when they are compiled. Each copy ends with its own `goto *`, so the
+ * predictor keeps a history per copy instead of one per op.
+ */
+#define IP_NREPLICAS 4
+
+/**
+ * CALLs are linked to their callee: the inst gets the struct ip_proc*
+ * instead of the procref and a handler that skips vm->procs. The calls of
+ * a proc are linked when it is registered. Those to procs only reserved
+ * so far, like the recursive calls, look the callee up and link
+ * themselves the first time they run. Registering a proc at a ref sends
+ * the calls to it back to the lookup. TAIL_CALLs are linked the same way.
+ */
 struct ip_inst_internal
 {
   void* label;
@@ -15,12 +37,22 @@ struct ip_inst_internal
     int i;
     size_t pos;
     ip_proc_ref_t p;
+    struct ip_proc* callee;
   } u;
 };
 
+/* a CALL or TAIL_CALL of a proc, relinked when `ref` is registered */
+struct ip_call_site
+{
+  size_t ip;
+  ip_proc_ref_t ref;
+  int tail;
+};
+
 enum ip_vm_mode
 {
   IP_VM_COMPILE,
+  IP_VM_LINK,
   IP_VM_EXEC,
 };
 union ip_vm_arg
@@ -30,12 +62,22 @@ union ip_vm_arg
     struct ip_vm* vm;
     ip_proc_ref_t procref;
   } exec;
+  /* to the handlers without checks if verified */
   struct
   {
     size_t ninsts;
     struct ip_inst* insts;
     struct ip_inst_internal* result;
+    int verified;
   } compile;
+  /* point `inst`, a CALL of `ref`, to `callee` or back to the lookup */
+  struct
+  {
+    struct ip_inst_internal* inst;
+    ip_proc_ref_t ref;
+    int tail;
+    struct ip_proc* callee;
+  } link;
 };
 
 int
@@ -47,33 +89,83 @@ struct ip_proc
   size_t nlocals;
   size_t ninsts;
   struct ip_inst_internal* insts;
+  size_t ncalls;
+  struct ip_call_site* calls;
+  /* as registered, compiled again when verified */
+  struct ip_inst* src;
+  /* the arena of the vm it was made in, or NULL */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+  /* the deepest point of the stack above the locals if verified, else 0 */
+  size_t depth;
+  int verified;
 };
 
-int
-ip_proc_init(struct ip_proc* proc,
-             size_t nargs,
-             size_t nlocals,
-             size_t ninsts,
-             struct ip_inst* insts)
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
 {
   union ip_vm_arg arg;
-
-  proc->insts = malloc(ninsts * sizeof(struct ip_inst_internal));
-  if (NULL == proc->insts) {
+  size_t i;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  proc->arena = arena;
+  proc->insts = ip_arena_alloc(arena, ninsts * sizeof(struct ip_inst_internal));
+  proc->calls =
+    ip_arena_alloc(arena, (ninsts + 1) * sizeof(struct ip_call_site));
+  proc->src = ip_arena_alloc(arena, (ninsts + 1) * sizeof(struct ip_inst));
+  if (NULL == proc->insts || NULL == proc->calls || NULL == proc->src) {
+    ip_arena_release(arena, proc->insts);
+    ip_arena_release(arena, proc->calls);
+    ip_arena_release(arena, proc->src);
     return 1;
   }
 
   proc->nargs = nargs;
   proc->nlocals = nlocals;
   proc->ninsts = ninsts;
+  proc->depth = 0;
+  proc->verified = 0;
+  memcpy(proc->src, insts, ninsts * sizeof(struct ip_inst));
+  proc->ncalls = 0;
+  for (i = 0; i < ninsts; i++) {
+    if (IP_CODE_CALL == insts[i].code || IP_CODE_TAIL_CALL == insts[i].code) {
+      proc->calls[proc->ncalls].ip = i;
+      proc->calls[proc->ncalls].ref = insts[i].u.p;
+      proc->calls[proc->ncalls].tail = IP_TAIL_CALL_AT(insts, ninsts, i);
+      proc->ncalls++;
+    }
+  }
 
   arg.compile.ninsts = ninsts;
   arg.compile.insts = insts;
   arg.compile.result = proc->insts;
+  arg.compile.verified = 0;
 
   return ip_vm_main(IP_VM_COMPILE, arg);
 }
 
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
 int
 ip_proc_new(size_t nargs,
             size_t nlocals,
@@ -92,7 +184,9 @@ ip_proc_new(size_t nargs,
 void
 ip_proc_dtor(struct ip_proc* proc)
 {
-  free(proc->insts);
+  ip_arena_release(proc->arena, proc->insts);
+  ip_arena_release(proc->arena, proc->calls);
+  ip_arena_release(proc->arena, proc->src);
 }
 
 typedef struct ip_callinfo
@@ -118,6 +212,11 @@ struct ip_vm
   ip_stack(ip_callinfo_t) callstack;
   size_t nprocs;
   struct ip_proc** procs;
+  /* are the registered procs verified against each other */
+  int verified;
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
 };
 
 int
@@ -135,8 +234,11 @@ ip_vm_init(struct ip_vm* vm)
     return 1;
   }
 
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
   vm->nprocs = 0;
   vm->procs = NULL;
+  vm->verified = 0;
 
   return 0;
 }
@@ -153,6 +255,32 @@ ip_vm_new(struct ip_vm** vm)
   return ip_vm_init(*vm);
 }
 
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  return ip_stack_limit(ip_value_t, &vm->stack, nvalues) ||
+         ip_stack_limit(ip_callinfo_t, &vm->callstack, ncalls);
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
+}
+
 ip_proc_ref_t
 ip_vm_reserve_proc(struct ip_vm* vm)
 {
@@ -161,14 +289,51 @@ ip_vm_reserve_proc(struct ip_vm* vm)
   if (NULL == vm->procs) {
     return -1;
   }
+  vm->procs[vm->nprocs - 1] = NULL;
 
   return vm->nprocs - 1;
 }
 
+static void
+ip_vm_link(struct ip_proc* proc,
+           struct ip_call_site* site,
+           struct ip_proc* callee)
+{
+  union ip_vm_arg arg;
+
+  arg.link.inst = &proc->insts[site->ip];
+  arg.link.ref = site->ref;
+  arg.link.tail = site->tail;
+  arg.link.callee = callee;
+  ip_vm_main(IP_VM_LINK, arg);
+}
+
 void
 ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
 {
+  size_t i, j;
+
   vm->procs[at] = proc;
+  vm->verified = 0;
+
+  /* unlink the calls to `at`, link those of `proc` to registered procs */
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+
+    if (NULL == p) {
+      continue;
+    }
+    for (j = 0; j < p->ncalls; j++) {
+      struct ip_call_site* site = &p->calls[j];
+
+      if (at == site->ref) {
+        ip_vm_link(p, site, NULL);
+      } else if (p == proc && 0 <= site->ref &&
+                 (size_t)site->ref < vm->nprocs) {
+        ip_vm_link(p, site, vm->procs[site->ref]);
+      }
+    }
+  }
 }
 
 ip_proc_ref_t
@@ -191,9 +356,77 @@ ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
 void
 ip_vm_dtor(struct ip_vm* vm)
 {
+  struct ip_proc* proc;
 
   ip_stack_dtor(ip_value_t, &vm->stack);
   ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
+}
+
+static int
+ip_vm_nargs(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (ref < 0 || vm->nprocs <= (size_t)ref || NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/* verifies every registered proc and compiles it again to the handlers of
+ * its kind. the calls are checked against the arity of the procs registered
+ * now, a proc registered again has all of them verified again */
+static void
+ip_vm_verify(struct ip_vm* vm)
+{
+  size_t p, j, depth;
+  int verified;
+  union ip_vm_arg arg;
+  struct ip_verify_proc src;
+  struct ip_proc* proc;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    proc = vm->procs[p];
+    if (NULL == proc) {
+      continue;
+    }
+
+    src.nargs = proc->nargs;
+    src.nlocals = proc->nlocals;
+    src.ninsts = proc->ninsts;
+    src.insts = proc->src;
+    verified = !ip_verify(&src, ip_vm_nargs, vm, &depth);
+    proc->depth = verified ? depth : 0;
+    if (verified == proc->verified) {
+      continue;
+    }
+    proc->verified = verified;
+
+    arg.compile.ninsts = proc->ninsts;
+    arg.compile.insts = proc->src;
+    arg.compile.result = proc->insts;
+    arg.compile.verified = verified;
+    ip_vm_main(IP_VM_COMPILE, arg);
+
+    for (j = 0; j < proc->ncalls; j++) {
+      struct ip_call_site* site = &proc->calls[j];
+
+      ip_vm_link(proc,
+                 site,
+                 0 <= site->ref && (size_t)site->ref < vm->nprocs
+                   ? vm->procs[site->ref]
+                   : NULL);
+    }
+  }
+  vm->verified = 1;
 }
 
 int
@@ -201,6 +434,10 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 {
   union ip_vm_arg arg;
 
+  if (!vm->verified) {
+    ip_vm_verify(vm);
+  }
+
   arg.exec.vm = vm;
   arg.exec.procref = procref;
 
@@ -214,23 +451,120 @@ ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg)
     &&L_CONST, &&L_GET_LOCAL,     &&L_SET_LOCAL,    &&L_ADD,
     &&L_SUB,   &&L_JUMP,          &&L_JUMP_IF_ZERO, &&L_JUMP_IF_NEG,
     &&L_CALL,  &&L_CALL_INDIRECT, &&L_RETURN,       &&L_EXIT,
+    &&L_TAIL_CALL,
+  /* superinsts, in the order of ip_superinsts */
+#define IP_SUPERINST2(a, b) &&L_##a##_##b,
+#define IP_SUPERINST3(a, b, c) &&L_##a##_##b##_##c,
+#define IP_SUPERINST4(a, b, c, d) &&L_##a##_##b##_##c##_##d,
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+  };
+  /* the handlers of the verified procs */
+  static void* verified_labels[] = {
+    &&L_V_CONST, &&L_V_GET_LOCAL,   &&L_V_SET_LOCAL,    &&L_V_ADD,
+    &&L_V_SUB,   &&L_JUMP,          &&L_V_JUMP_IF_ZERO, &&L_V_JUMP_IF_NEG,
+    &&L_CALL,    &&L_CALL_INDIRECT, &&L_V_RETURN,       &&L_V_EXIT,
+    &&L_TAIL_CALL,
+#define IP_SUPERINST2(a, b) &&L_V_##a##_##b,
+#define IP_SUPERINST3(a, b, c) &&L_V_##a##_##b##_##c,
+#define IP_SUPERINST4(a, b, c, d) &&L_V_##a##_##b##_##c##_##d,
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
   };
 
+#ifdef IP_VM_REPLICATE
+#define REPLICAS(name)                                                         \
+  { &&L_##name, &&L_##name##_1, &&L_##name##_2, &&L_##name##_3 }
+  static void* replicas[][IP_NREPLICAS] = {
+    REPLICAS(CONST),    REPLICAS(GET_LOCAL),    REPLICAS(SET_LOCAL),
+    REPLICAS(ADD),      REPLICAS(SUB),          REPLICAS(JUMP),
+    REPLICAS(JUMP_IF_ZERO), REPLICAS(JUMP_IF_NEG),
+  };
+  static void* verified_replicas[][IP_NREPLICAS] = {
+    REPLICAS(V_CONST),        REPLICAS(V_GET_LOCAL), REPLICAS(V_SET_LOCAL),
+    REPLICAS(V_ADD),          REPLICAS(V_SUB),       REPLICAS(JUMP),
+    REPLICAS(V_JUMP_IF_ZERO), REPLICAS(V_JUMP_IF_NEG),
+  };
+#define IP_SUPERINST2(a, b) REPLICAS(a##_##b),
+#define IP_SUPERINST3(a, b, c) REPLICAS(a##_##b##_##c),
+#define IP_SUPERINST4(a, b, c, d) REPLICAS(a##_##b##_##c##_##d),
+  static void* super_replicas[][IP_NREPLICAS] = {
+#include "superinsts.def"
+  };
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#define IP_SUPERINST2(a, b) REPLICAS(V_##a##_##b),
+#define IP_SUPERINST3(a, b, c) REPLICAS(V_##a##_##b##_##c),
+#define IP_SUPERINST4(a, b, c, d) REPLICAS(V_##a##_##b##_##c##_##d),
+  static void* verified_super_replicas[][IP_NREPLICAS] = {
+#include "superinsts.def"
+  };
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#undef REPLICAS
+  /* the copy the next site of each op and superinst gets */
+  static size_t next_replica[IP_CODE_TAIL_CALL + 1 + IP_NSUPERINSTS];
+#endif
+
   if (IP_VM_COMPILE == mode) {
     size_t i, ninsts = arg.compile.ninsts;
+    int s;
     struct ip_inst* insts = arg.compile.insts;
     struct ip_inst_internal* result = arg.compile.result;
+    void** table = arg.compile.verified ? verified_labels : labels;
+#ifdef IP_VM_REPLICATE
+    void* (*table_replicas)[IP_NREPLICAS] =
+      arg.compile.verified ? verified_replicas : replicas;
+    void* (*table_super_replicas)[IP_NREPLICAS] =
+      arg.compile.verified ? verified_super_replicas : super_replicas;
+#endif
     for (i = 0; i < ninsts; i++) {
       struct ip_inst_internal inst;
-      inst.label = labels[insts[i].code];
+      inst.label = table[IP_TAIL_CALL_AT(insts, ninsts, i) ? IP_CODE_TAIL_CALL
+                                                           : insts[i].code];
+#ifdef IP_VM_REPLICATE
+      if (insts[i].code <= IP_CODE_JUMP_IF_NEG) {
+        size_t r = next_replica[insts[i].code]++ % IP_NREPLICAS;
+        inst.label = table_replicas[insts[i].code][r];
+      }
+#endif
       inst.u.v = insts[i].u.v;
       inst.u.i = insts[i].u.i;
       inst.u.pos = insts[i].u.pos;
       inst.u.p = insts[i].u.p;
+
+      /* the following insts are kept for jumps into the superinst */
+      s = ip_superinst_match(insts, ninsts, i);
+      if (0 <= s) {
+        inst.label = table[IP_CODE_TAIL_CALL + 1 + s];
+#ifdef IP_VM_REPLICATE
+        inst.label =
+          table_super_replicas[s][next_replica[IP_CODE_TAIL_CALL + 1 + s]++ %
+                                  IP_NREPLICAS];
+#endif
+      }
       result[i] = inst;
     }
     return 0;
   }
+  if (IP_VM_LINK == mode) {
+    struct ip_inst_internal* inst = arg.link.inst;
+
+    if (NULL != arg.link.callee) {
+      inst->label = arg.link.tail ? &&L_TAIL_CALL_LINKED : &&L_CALL_LINKED;
+      inst->u.callee = arg.link.callee;
+    } else {
+      inst->label = labels[arg.link.tail ? IP_CODE_TAIL_CALL : IP_CODE_CALL];
+      inst->u.p = arg.link.ref;
+    }
+    return 0;
+  }
   /* else exec */
   size_t ip = 0;
   size_t fp;
@@ -259,17 +593,28 @@ ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg)
     for (i = 0; i < (n); i++)                                                  \
       POP(ref);                                                                \
   } while (0)
-#define PUSHN(n, v)                                                            \
+/* the frame of proc over its args, with room for its deepest point if it
+ * is verified */
+#define ENTER()                                                                \
   do {                                                                         \
     size_t i;                                                                  \
-    for (i = 0; i < (n); i++)                                                  \
-      PUSH(v);                                                                 \
+                                                                               \
+    if (vm->stack.sp < proc->nargs ||                                          \
+        (vm->stack.size - vm->stack.sp < proc->nlocals + proc->depth &&        \
+         ip_stack_grow(                                                        \
+           ip_value_t, &vm->stack, proc->nlocals + proc->depth))) {            \
+      return 1;                                                                \
+    }                                                                          \
+    for (i = 0; i < proc->nlocals; i++) {                                      \
+      ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) =                   \
+        IP_LLINT2VALUE(0);                                                     \
+    }                                                                          \
+    fp = vm->stack.sp;                                                         \
   } while (0)
 
   proc = vm->procs[procref];
 
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
-  fp = ip_stack_size(ip_value_t, &vm->stack);
+  ENTER();
 
 #define JUMP()                                                                 \
   do {                                                                         \
@@ -280,86 +625,130 @@ ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg)
   inst = proc->insts[ip];
   goto* inst.label;
 
+  /* the handler bodies, shared with the superinsts */
+#define OP_CONST()                                                             \
+  do {                                                                         \
+    PUSH(inst.u.v);                                                            \
+  } while (0)
+#define OP_GET_LOCAL()                                                         \
+  do {                                                                         \
+    int i;                                                                     \
+    ip_value_t v;                                                              \
+                                                                               \
+    i = inst.u.i;                                                              \
+    v = LOCAL(i);                                                              \
+                                                                               \
+    PUSH(v);                                                                   \
+  } while (0)
+#define OP_SET_LOCAL()                                                         \
+  do {                                                                         \
+    int i;                                                                     \
+    ip_value_t v;                                                              \
+                                                                               \
+    i = inst.u.i;                                                              \
+    POP(&v);                                                                   \
+                                                                               \
+    LOCAL(i) = v;                                                              \
+  } while (0)
+#define OP_ADD()                                                               \
+  do {                                                                         \
+    ip_value_t v1, v2, ret;                                                    \
+    long long int x, y;                                                        \
+                                                                               \
+    POP(&v1);                                                                  \
+    POP(&v2);                                                                  \
+    y = IP_VALUE2LLINT(v1);                                                    \
+    x = IP_VALUE2LLINT(v2);                                                    \
+                                                                               \
+    ret = IP_INT2VALUE(x + y);                                                 \
+                                                                               \
+    PUSH(ret);                                                                 \
+  } while (0)
+#define OP_SUB()                                                               \
+  do {                                                                         \
+    ip_value_t v1, v2, ret;                                                    \
+    long long int x, y;                                                        \
+                                                                               \
+    POP(&v1);                                                                  \
+    POP(&v2);                                                                  \
+    y = IP_VALUE2LLINT(v1);                                                    \
+    x = IP_VALUE2LLINT(v2);                                                    \
+                                                                               \
+    ret = IP_LLINT2VALUE(x - y);                                               \
+                                                                               \
+    PUSH(ret);                                                                 \
+  } while (0)
+#define OP_JUMP()                                                              \
+  do {                                                                         \
+    ip = inst.u.pos;                                                           \
+  } while (0)
+#define OP_JUMP_IF_ZERO()                                                      \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+                                                                               \
+    if (!IP_VALUE2LLINT(v)) {                                                  \
+      ip = inst.u.pos;                                                         \
+    }                                                                          \
+  } while (0)
+#define OP_JUMP_IF_NEG()                                                       \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+                                                                               \
+    if (IP_VALUE2LLINT(v) < 0) {                                               \
+      ip = inst.u.pos;                                                         \
+    }                                                                          \
+  } while (0)
+
 L_CONST : {
-  ip_stack_push(ip_value_t, &vm->stack, inst.u.v);
+  OP_CONST();
   JUMP();
 }
 L_GET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = inst.u.i;
-  v = LOCAL(i);
-
-  PUSH(v);
+  OP_GET_LOCAL();
   JUMP();
 }
 L_SET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = inst.u.i;
-  POP(&v);
-
-  LOCAL(i) = v;
-
+  OP_SET_LOCAL();
   JUMP();
 }
 L_ADD : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_INT2VALUE(x + y);
-
-  PUSH(ret);
-
+  OP_ADD();
   JUMP();
 }
 L_SUB : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_LLINT2VALUE(x - y);
-
-  PUSH(ret);
-
+  OP_SUB();
   JUMP();
 }
 L_JUMP : {
-  ip = inst.u.pos;
+  OP_JUMP();
   JUMP();
 }
 L_JUMP_IF_ZERO : {
-  ip_value_t v;
-
-  POP(&v);
-
-  if (!IP_VALUE2LLINT(v)) {
-    ip = inst.u.pos;
-  }
+  OP_JUMP_IF_ZERO();
   JUMP();
 }
 L_JUMP_IF_NEG : {
-  ip_value_t v;
-
-  POP(&v);
-
-  if (IP_VALUE2LLINT(v) < 0) {
-    ip = inst.u.pos;
-  }
+  OP_JUMP_IF_NEG();
   JUMP();
 }
 L_CALL : {
+  struct ip_proc* callee;
+
+  /* not linked yet, or the callee was registered again */
+  if (inst.u.p < 0 || (size_t)inst.u.p >= vm->nprocs ||
+      NULL == vm->procs[inst.u.p]) {
+    return 1;
+  }
+  callee = vm->procs[inst.u.p];
+  proc->insts[ip].label = &&L_CALL_LINKED;
+  proc->insts[ip].u.callee = callee;
+  inst.u.callee = callee;
+}
+L_CALL_LINKED : {
   int ret;
   ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
 
@@ -368,12 +757,11 @@ L_CALL : {
     return 1;
   }
 
-  proc = vm->procs[inst.u.p];
+  proc = inst.u.callee;
 
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
+  ENTER();
 
   ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
 
   JUMP();
 }
@@ -391,19 +779,21 @@ L_CALL_INDIRECT : {
 
   proc = vm->procs[IP_VALUE2PROCREF(p)];
 
-  PUSHN(proc->nlocals, IP_INT2VALUE(0));
+  ENTER();
 
   ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
 
   JUMP();
 }
 L_RETURN : {
   int ret;
+  size_t base;
   ip_value_t v;
   ip_value_t ignore;
   ip_callinfo_t ci;
 
+  base = fp - (proc->nlocals + proc->nargs);
+
   POP(&v);
 
   POPN(proc->nlocals + proc->nargs, &ignore);
@@ -414,6 +804,10 @@ L_RETURN : {
   if (ret) {
     return 1;
   }
+  /* a verified caller runs on the depth it expects after the call */
+  if (ci.proc->verified && base + 1 != vm->stack.sp) {
+    return 1;
+  }
 
   ip = ci.ip;
   fp = ci.fp;
@@ -432,6 +826,262 @@ L_EXIT : {
 
   return 0;
 }
+L_TAIL_CALL : {
+  struct ip_proc* callee;
+
+  if (inst.u.p < 0 || (size_t)inst.u.p >= vm->nprocs ||
+      NULL == vm->procs[inst.u.p]) {
+    return 1;
+  }
+  callee = vm->procs[inst.u.p];
+  proc->insts[ip].label = &&L_TAIL_CALL_LINKED;
+  proc->insts[ip].u.callee = callee;
+  inst.u.callee = callee;
+}
+L_TAIL_CALL_LINKED : {
+  size_t base, sp;
+
+  base = fp - (proc->nargs + proc->nlocals);
+  sp = ip_stack_size(ip_value_t, &vm->stack);
+  proc = inst.u.callee;
+  if (sp < proc->nargs) {
+    return 1;
+  }
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(&ip_stack_ref(ip_value_t, &vm->stack, base),
+          &ip_stack_ref(ip_value_t, &vm->stack, sp - proc->nargs),
+          proc->nargs * sizeof(ip_value_t));
+  vm->stack.sp = base + proc->nargs;
+
+  ENTER();
+
+  ip = -1;
+
+  JUMP();
+}
+
+  /* run the bodies of the insts in order, without dispatching in between */
+#define NEXT() inst = proc->insts[++ip]
+#define IP_SUPERINST2(a, b)                                                    \
+  L_##a##_##b : {                                                              \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_##a##_##b##_##c : {                                                        \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_##a##_##b##_##c##_##d : {                                                  \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    NEXT();                                                                    \
+    OP_##d();                                                                  \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+
+#ifdef IP_VM_REPLICATE
+  /* the copies of the handlers, the original is the first */
+#define REPLICATE(name, op)                                                    \
+  L_##name##_1 : {                                                             \
+    OP_##op();                                                                 \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##name##_2 : {                                                             \
+    OP_##op();                                                                 \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##name##_3 : {                                                             \
+    OP_##op();                                                                 \
+    JUMP();                                                                    \
+  }
+  REPLICATE(CONST, CONST)
+  REPLICATE(GET_LOCAL, GET_LOCAL)
+  REPLICATE(SET_LOCAL, SET_LOCAL)
+  REPLICATE(ADD, ADD)
+  REPLICATE(SUB, SUB)
+  REPLICATE(JUMP, JUMP)
+  REPLICATE(JUMP_IF_ZERO, JUMP_IF_ZERO)
+  REPLICATE(JUMP_IF_NEG, JUMP_IF_NEG)
+
+  /* the copies of the superinsts, the body goes through NEXT() */
+#define REPLICATE_SUPER(name, body)                                            \
+  L_##name##_1 : {                                                             \
+    body;                                                                      \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##name##_2 : {                                                             \
+    body;                                                                      \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##name##_3 : {                                                             \
+    body;                                                                      \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST2(a, b)                                                    \
+  REPLICATE_SUPER(a##_##b, OP_##a(); NEXT(); OP_##b())
+#define IP_SUPERINST3(a, b, c)                                                 \
+  REPLICATE_SUPER(a##_##b##_##c, OP_##a(); NEXT(); OP_##b(); NEXT(); OP_##c())
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  REPLICATE_SUPER(a##_##b##_##c##_##d,                                         \
+                  OP_##a(); NEXT(); OP_##b(); NEXT(); OP_##c(); NEXT();        \
+                  OP_##d())
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#endif
+
+#undef POP
+#undef PUSH
+  /* the handlers of the verified procs. ENTER reserved their stack, it can
+   * neither overflow nor underflow */
+#define POP(ref)                                                               \
+  do {                                                                         \
+    *(ref) = ip_stack_ref(ip_value_t, &vm->stack, --vm->stack.sp);             \
+  } while (0)
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) = (v);                \
+  } while (0)
+
+L_V_CONST : {
+  OP_CONST();
+  JUMP();
+}
+L_V_GET_LOCAL : {
+  OP_GET_LOCAL();
+  JUMP();
+}
+L_V_SET_LOCAL : {
+  OP_SET_LOCAL();
+  JUMP();
+}
+L_V_ADD : {
+  OP_ADD();
+  JUMP();
+}
+L_V_SUB : {
+  OP_SUB();
+  JUMP();
+}
+L_V_JUMP_IF_ZERO : {
+  OP_JUMP_IF_ZERO();
+  JUMP();
+}
+L_V_JUMP_IF_NEG : {
+  OP_JUMP_IF_NEG();
+  JUMP();
+}
+L_V_RETURN : {
+  int ret;
+  ip_value_t v;
+  ip_callinfo_t ci;
+
+  POP(&v);
+
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(v);
+
+  ret = ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci);
+  if (ret) {
+    return 1;
+  }
+
+  ip = ci.ip;
+  fp = ci.fp;
+  proc = ci.proc;
+
+  JUMP();
+}
+L_V_EXIT : {
+  ip_value_t v;
+
+  POP(&v);
+
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(v);
+
+  return 0;
+}
+
+#define IP_SUPERINST2(a, b)                                                    \
+  L_V_##a##_##b : {                                                            \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_V_##a##_##b##_##c : {                                                      \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_V_##a##_##b##_##c##_##d : {                                                \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    NEXT();                                                                    \
+    OP_##d();                                                                  \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+
+#ifdef IP_VM_REPLICATE
+#define IP_SUPERINST2(a, b)                                                    \
+  REPLICATE_SUPER(V_##a##_##b, OP_##a(); NEXT(); OP_##b())
+#define IP_SUPERINST3(a, b, c)                                                 \
+  REPLICATE_SUPER(V_##a##_##b##_##c,                                           \
+                  OP_##a(); NEXT(); OP_##b(); NEXT(); OP_##c())
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  REPLICATE_SUPER(V_##a##_##b##_##c##_##d,                                     \
+                  OP_##a(); NEXT(); OP_##b(); NEXT(); OP_##c(); NEXT();        \
+                  OP_##d())
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#undef REPLICATE_SUPER
+#endif
+#undef NEXT
+
+#ifdef IP_VM_REPLICATE
+  REPLICATE(V_CONST, CONST)
+  REPLICATE(V_GET_LOCAL, GET_LOCAL)
+  REPLICATE(V_SET_LOCAL, SET_LOCAL)
+  REPLICATE(V_ADD, ADD)
+  REPLICATE(V_SUB, SUB)
+  REPLICATE(V_JUMP_IF_ZERO, JUMP_IF_ZERO)
+  REPLICATE(V_JUMP_IF_NEG, JUMP_IF_NEG)
+#undef REPLICATE
+#endif
 
 #undef POP
 #undef PUSH
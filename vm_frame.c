@@ -0,0 +1,501 @@
+#include "arena.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * stack usage
+ *              fp - nvars                    fp
+ *                   v                        v
+ *  --+--------------+------+--------+--------+--------+------+--
+ *    | caller's ... | args | locals | ret ip | caller | data |
+ *    |              |      |        |        | fp     |      |
+ *  --+--------------+------+--------+--------+--------+------+--
+ *  bottom ->                                                   -> top
+ *
+ * One stack holds the values and the frames. A CALL clears the locals of the
+ * callee at once and puts the inst to return to and the fp of the caller
+ * over them. The operands of GET_LOCAL and SET_LOCAL are made offsets from
+ * fp by ip_proc_init and RETURN, EXIT and TAIL_CALL carry the size of the
+ * frame, so a running proc is never looked up again. Nothing under the data
+ * of the running proc is popped, a proc popping more than it pushed fails
+ * instead of taking its frame for values.
+ */
+
+struct ip_inst_internal;
+
+typedef union ip_slot
+{
+  ip_value_t v;
+  const struct ip_inst_internal* ip;
+  union ip_slot* fp;
+} ip_slot_t;
+
+def_ip_stack(ip_slot_t);
+
+struct ip_inst_internal
+{
+  enum ip_code code;
+  /* RETURN, EXIT, TAIL_CALL: the args and locals of the proc */
+  size_t nvars;
+  union
+  {
+    ip_value_t v;
+    /* GET_LOCAL, SET_LOCAL: from fp */
+    ptrdiff_t offset;
+    const struct ip_inst_internal* target;
+    ip_proc_ref_t p;
+  } u;
+};
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst_internal* insts;
+  /* the arena of the vm it was made in, or NULL */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+};
+
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
+{
+  size_t i, t, nvars = nargs + nlocals;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  /* and one failing for the procs running off their end */
+  proc->arena = arena;
+  proc->insts =
+    ip_arena_alloc(arena, (ninsts + 1) * sizeof(struct ip_inst_internal));
+  if (NULL == proc->insts) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+
+  for (i = 0; i < ninsts; i++) {
+    struct ip_inst_internal* inst = &proc->insts[i];
+
+    inst->code = insts[i].code;
+    inst->nvars = nvars;
+    switch (insts[i].code) {
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL:
+        inst->u.offset = (ptrdiff_t)insts[i].u.i - (ptrdiff_t)nvars;
+        break;
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        /* jumps land after the target */
+        t = insts[i].u.pos + 1;
+        inst->u.target = &proc->insts[t < ninsts ? t : ninsts];
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_TAIL_CALL:
+        if (IP_TAIL_CALL_AT(insts, ninsts, i)) {
+          inst->code = IP_CODE_TAIL_CALL;
+        }
+        inst->u.p = insts[i].u.p;
+        break;
+      default:
+        inst->u.v = insts[i].u.v;
+        break;
+    }
+  }
+  proc->insts[ninsts].code = (enum ip_code)-1;
+  proc->insts[ninsts].nvars = nvars;
+
+  return 0;
+}
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  ip_arena_release(proc->arena, proc->insts);
+}
+
+struct ip_vm
+{
+  ip_stack(ip_slot_t) stack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
+};
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  /* the values and callinfos of simple, a frame takes 2 slots */
+  ret = ip_stack_reserve(
+    ip_slot_t, &vm->stack, 1024 + 2 * 1024, 3 * IP_STACK_LIMIT);
+  if (ret) {
+    return 1;
+  }
+
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
+  vm->nprocs = 0;
+  vm->procs = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  return ip_stack_limit(ip_slot_t, &vm->stack, nvalues + 2 * ncalls);
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  vm->procs[at] = proc;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc* proc;
+
+  ip_stack_dtor(ip_slot_t, &vm->stack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
+}
+
+/* the speed of the dispatch loop depends on where its branches fall in the
+ * cache lines, it lost a quarter when the arena code before it moved it.
+ * aligned, its layout only depends on its own code */
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+  __attribute__((aligned(64)));
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  const struct ip_inst_internal* ip;
+  ip_slot_t *fp, *sp, *bottom, *top;
+  struct ip_proc* callee;
+
+  bottom = vm->stack.data;
+  top = vm->stack.data + vm->stack.size;
+  sp = vm->stack.data + vm->stack.sp;
+
+#define FAIL()                                                                 \
+  do {                                                                         \
+    vm->stack.sp = sp - bottom;                                                \
+    return 1;                                                                  \
+  } while (0)
+/* room for n slots over sp, the stack does not move */
+#define GROW(n)                                                                \
+  do {                                                                         \
+    if (ip_stack_commit(ip_slot_t, &vm->stack, sp - bottom + (n))) {           \
+      FAIL();                                                                  \
+    }                                                                          \
+    top = vm->stack.data + vm->stack.size;                                     \
+  } while (0)
+/* nothing below the frame is popped */
+#define POP(ref)                                                               \
+  do {                                                                         \
+    if (sp == fp + 2) {                                                        \
+      FAIL();                                                                  \
+    }                                                                          \
+    *(ref) = *--sp;                                                            \
+  } while (0)
+#define PUSH(slot)                                                             \
+  do {                                                                         \
+    if (sp == top) {                                                           \
+      GROW(1);                                                                 \
+    }                                                                          \
+    *sp++ = (slot);                                                            \
+  } while (0)
+/* the args of callee are in the data of the running proc */
+#define ARGS(callee)                                                           \
+  do {                                                                         \
+    if ((size_t)(sp - (fp + 2)) < (callee)->nargs) {                           \
+      FAIL();                                                                  \
+    }                                                                          \
+  } while (0)
+/* the locals of callee cleared and the frame put over them, ret and cfp are
+ * where it returns to */
+#define ENTER(callee, ret, cfp)                                                \
+  do {                                                                         \
+    if ((size_t)(top - sp) < (callee)->nlocals + 2) {                          \
+      GROW((callee)->nlocals + 2);                                             \
+    }                                                                          \
+    memset(sp, 0, (callee)->nlocals * sizeof(ip_slot_t));                      \
+    sp += (callee)->nlocals;                                                   \
+    sp[0].ip = (ret);                                                          \
+    sp[1].fp = (cfp);                                                          \
+    fp = sp;                                                                   \
+    sp += 2;                                                                   \
+    ip = (callee)->insts;                                                      \
+  } while (0)
+
+  /* no inst to return to */
+  fp = NULL;
+  callee = vm->procs[procref];
+  ENTER(callee, NULL, NULL);
+
+  while (1) {
+    const struct ip_inst_internal* inst = ip++;
+
+    switch (inst->code) {
+      case IP_CODE_CONST: {
+        ip_slot_t v;
+
+        v.v = inst->u.v;
+        PUSH(v);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        PUSH(fp[inst->u.offset]);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        POP(&fp[inst->u.offset]);
+        break;
+      }
+      case IP_CODE_ADD:
+      case IP_CODE_SUB: {
+        long long int x, y;
+
+        if (sp - fp < 2 + 2) {
+          FAIL();
+        }
+        y = IP_VALUE2LLINT(sp[-1].v);
+        x = IP_VALUE2LLINT(sp[-2].v);
+        sp -= 1;
+        sp[-1].v = IP_LLINT2VALUE(IP_CODE_ADD == inst->code ? x + y : x - y);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        ip = inst->u.target;
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO: {
+        ip_slot_t v;
+
+        POP(&v);
+        if (!IP_VALUE2LLINT(v.v)) {
+          ip = inst->u.target;
+        }
+        break;
+      }
+      case IP_CODE_JUMP_IF_NEG: {
+        ip_slot_t v;
+
+        POP(&v);
+        if (IP_VALUE2LLINT(v.v) < 0) {
+          ip = inst->u.target;
+        }
+        break;
+      }
+      case IP_CODE_CALL: {
+        callee = vm->procs[inst->u.p];
+        ARGS(callee);
+        ENTER(callee, ip, fp);
+        break;
+      }
+      case IP_CODE_CALL_INDIRECT: {
+        ip_slot_t p;
+
+        POP(&p);
+        callee = vm->procs[IP_VALUE2PROCREF(p.v)];
+        ARGS(callee);
+        ENTER(callee, ip, fp);
+        break;
+      }
+      case IP_CODE_RETURN: {
+        ip_slot_t v, *cfp;
+
+        POP(&v);
+        /* the proc ip_vm_exec was called with */
+        if (NULL == fp[0].ip) {
+          FAIL();
+        }
+
+        ip = fp[0].ip;
+        cfp = fp[1].fp;
+        sp = fp - inst->nvars;
+        *sp++ = v;
+        fp = cfp;
+
+        break;
+      }
+      case IP_CODE_EXIT: {
+        ip_slot_t v;
+
+        POP(&v);
+        sp = fp - inst->nvars;
+        *sp++ = v;
+        vm->stack.sp = sp - bottom;
+
+        return 0;
+      }
+      case IP_CODE_TAIL_CALL: {
+        const struct ip_inst_internal* ret;
+        ip_slot_t *base, *cfp;
+
+        callee = vm->procs[inst->u.p];
+        base = fp - inst->nvars;
+        ARGS(callee);
+
+        /* the args over the frame, it returns where the running proc would */
+        ret = fp[0].ip;
+        cfp = fp[1].fp;
+        memmove(base, sp - callee->nargs, callee->nargs * sizeof(ip_slot_t));
+        sp = base + callee->nargs;
+        ENTER(callee, ret, cfp);
+
+        break;
+      }
+      default: {
+        printf("code: %d", inst->code);
+        FAIL();
+      }
+    }
+  }
+
+#undef FAIL
+#undef POP
+#undef PUSH
+#undef GROW
+#undef ARGS
+#undef ENTER
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  ip_slot_t v;
+
+  v.v = arg;
+  return ip_stack_push(ip_slot_t, &vm->stack, v);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  ip_slot_t v;
+
+  if (ip_stack_pop(ip_slot_t, &vm->stack, &v)) {
+    return 1;
+  }
+  *result = v.v;
+
+  return 0;
+}
@@ -0,0 +1,3354 @@
+#include "call.h"
+#include "jit.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * optimizing jit.
+ * Procs are compiled once their callees are registered, in four steps:
+ *
+ * 1. the stack code is cut into basic blocks and put into SSA form. Args,
+ *    locals and operand stack slots are all variables, and every block
+ *    with several predecessors gets a phi per variable.
+ * 2. the IR is optimized: trivial phis are removed (copy propagation),
+ *    arithmetic on constants and branches on constants are folded, then
+ *    unreachable blocks and unused values are dropped.
+ * 3. values get registers by linear scan over the blocks in order. Values
+ *    live across a call only get the callee-saved ones, the rest spill to
+ *    the native frame.
+ * 4. x86-64 is emitted, with the phis turned into moves on the edges.
+ *
+ * The sum loop ends up with n, i and sum in registers:
+ *
+ *   loop: cmp n, i; js exit; add sum, i; add i, 1; jmp loop
+ *
+ * The value stack is only used to pass args. A proc finds its args at
+ * rbx, the base of its frame, and places the args of its callees right
+ * after its own:
+ *
+ *   rbx - base of the current frame in vm->stack
+ *   r13 - end of vm->stack, for overflow checks
+ *   r14 - the struct ip_vm
+ *
+ * Results are returned in rax. rbx, rbp, r12, r13, r14 and r15 are kept
+ * across calls, the other registers are not.
+ *
+ * With IP_VM_TIERED procs start in an interpreter and are only compiled
+ * once they have been called IP_TIER_CALL_THRESHOLD times or have jumped
+ * back IP_TIER_LOOP_THRESHOLD times. Until then their code is a stub
+ * calling the interpreter, so compiled code calls them as any other proc,
+ * and the interpreter calls compiled procs through the trampoline.
+ *
+ * Activations of a compiled proc still running in the interpreter move to
+ * compiled code at their next back-edge (on-stack replacement). The OSR
+ * code of a loop starts at its header with every variable taken from the
+ * interpreter frame, which has the same layout as the variables:
+ *
+ *   base[0 .. nargs + nlocals + depth) = args, locals, operand stack
+ *
+ * It only covers the blocks leading back to the header. The edges leaving
+ * the loop deoptimize: the variables are written back to the frame and the
+ * interpreter resumes at the inst the edge led to.
+ *
+ * Every CALL_INDIRECT has a polymorphic inline cache: IP_OPT_IC_SIZE
+ * compares of the procref, each followed by a direct call.
+ *
+ *   cmp rax, 3; jne next; call proc3; jmp done
+ *   next: ...
+ *   miss: look the proc up in vm->procs, fill an entry, call [proc.code]
+ *
+ * The entries start with an impossible procref and are patched by the
+ * misses until they are all taken. The next miss makes the site
+ * megamorphic: its first compare becomes a jump to the lookup. The calls
+ * are relinked with the direct ones, and the sites are reset when a cached
+ * proc is replaced. With IP_OPT_IC_STATS the hits and misses of every site
+ * are printed when the vm is destroyed.
+ *
+ * The args of a CALL_INDIRECT are laid out for the arity of its callee
+ * when its procref is a constant, see call.h, and for every value below
+ * the procref otherwise. A callee of another arity writes the frame back
+ * and the activation finishes in the interpreter from the call, which the
+ * build without IP_VM_TIERED only runs for that. The callers of a replaced
+ * proc are compiled again when its arity changes.
+ */
+
+#define IP_OPT_BASE IP_JIT_RBX
+#define IP_OPT_LIMIT IP_JIT_R13
+#define IP_OPT_VM IP_JIT_R14
+
+/* native stack the generated code may use before failing */
+#define IP_OPT_NATIVE_STACK (1024 * 1024)
+
+/* status of the trampoline when the proc returned instead of EXIT */
+#define IP_OPT_RETURNED 2
+/* status of OSR code leaving a loop, to resume at vm->resume */
+#define IP_OPT_DEOPT 3
+
+#ifdef IP_VM_TIERED
+#ifndef IP_TIER_CALL_THRESHOLD
+#define IP_TIER_CALL_THRESHOLD 1000
+#endif
+#ifndef IP_TIER_LOOP_THRESHOLD
+#define IP_TIER_LOOP_THRESHOLD 1000
+#endif
+/* the osr_entry of a proc no loop was compiled for yet */
+#define IP_TIER_NO_OSR ((size_t)-1)
+#endif
+
+struct ip_call_site
+{
+  size_t offset;
+  ip_proc_ref_t ref;
+};
+
+/* entries in the inline cache of a CALL_INDIRECT */
+#ifndef IP_OPT_IC_SIZE
+#define IP_OPT_IC_SIZE 4
+#endif
+
+/* the entries of a site, patched in the code */
+struct ip_opt_ic
+{
+  unsigned char* code;
+  /* entries in use, IP_OPT_IC_SIZE + 1 once megamorphic */
+  size_t n;
+  /* offsets in `code` of the site and of the lookup of the misses */
+  size_t start;
+  size_t miss;
+  /* offsets in `code` of the procref of the compares and of the calls */
+  size_t refs[IP_OPT_IC_SIZE];
+  size_t calls[IP_OPT_IC_SIZE];
+  struct ip_proc* procs[IP_OPT_IC_SIZE];
+#ifdef IP_OPT_IC_STATS
+  unsigned long hits;
+  unsigned long misses;
+#endif
+};
+
+#define IP_OPT_IC_FIELD(f) ((int32_t)offsetof(struct ip_opt_ic, f))
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst* insts;
+  /* NULL until the callees are known */
+  unsigned char* code;
+  size_t ncalls;
+  struct ip_call_site* calls;
+  /* inline caches of the CALL_INDIRECTs in `code` */
+  size_t nics;
+  struct ip_opt_ic* ics;
+#ifdef IP_VM_TIERED
+  /* code calling the interpreter, used until the proc is compiled */
+  unsigned char* stub;
+  /* 0 interpreted, 1 compiled, -1 failed to compile */
+  int tier;
+  size_t call_count;
+  size_t loop_count;
+  /* inst of the loop osr_code enters, IP_TIER_NO_OSR before the first */
+  size_t osr_entry;
+  /* values of the interpreter frame it takes: args, locals and stack */
+  size_t osr_nlive;
+  /* NULL if the loop failed to compile */
+  unsigned char* osr_code;
+  size_t osr_ncalls;
+  struct ip_call_site* osr_calls;
+  size_t osr_nics;
+  struct ip_opt_ic* osr_ics;
+#endif
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
+};
+
+typedef struct ip_callinfo
+{
+  size_t ip;
+  ip_value_t* base;
+  struct ip_proc* proc;
+} ip_callinfo_t;
+
+typedef int (*ip_opt_trampoline_t)(struct ip_vm* vm, void* code);
+
+static ip_opt_trampoline_t ip_opt_trampoline;
+static void* ip_opt_trampoline_out;
+
+/* called by the empty cache entries, fails */
+static unsigned char* ip_opt_fail;
+
+/**
+ * stack usage
+ *        base
+ *         v
+ *        --+----------+-------------------+---
+ * bottom <-| args ... | args of a callee  | ... -> top
+ *        --+----------+-------------------+---
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+
+  /* state shared with the generated code */
+  ip_value_t* base;
+  ip_value_t* sp;
+  ip_value_t* limit;
+  void* rsp;
+  void* rsp_limit;
+  void* out;
+  ip_value_t result;
+
+  /* status of the interpreter run by a stub or a deopt */
+  long status;
+  /* where the interpreter resumes after a deopt */
+  size_t resume;
+  ip_callinfo_t* callstack;
+  ip_callinfo_t* csp;
+  ip_callinfo_t* climit;
+};
+
+#define IP_OPT_VM_FIELD(f) ((int32_t)offsetof(struct ip_vm, f))
+
+/* IR */
+
+#define IP_IR_NONE ((size_t)-1)
+
+enum ip_ir_op
+{
+  IP_IR_CONST,
+  IP_IR_ARG,
+  IP_IR_PHI,
+  IP_IR_ADD,
+  IP_IR_SUB,
+  IP_IR_CALL,
+  IP_IR_CALL_INDIRECT,
+  IP_IR_DEOPT,
+};
+
+enum ip_ir_term
+{
+  IP_IR_TERM_JUMP,
+  IP_IR_TERM_JUMP_IF_ZERO,
+  IP_IR_TERM_JUMP_IF_NEG,
+  IP_IR_TERM_RETURN,
+  IP_IR_TERM_EXIT,
+  IP_IR_TERM_ERROR,
+  IP_IR_TERM_DEOPT,
+};
+
+enum ip_opt_loc_kind
+{
+  IP_OPT_LOC_NONE,
+  IP_OPT_LOC_REG,
+  IP_OPT_LOC_SLOT,
+  IP_OPT_LOC_CONST,
+};
+
+/* where a value is: a register, a slot of the native frame or a constant */
+struct ip_opt_loc
+{
+  enum ip_opt_loc_kind kind;
+  int r;
+  ip_value_t k;
+};
+
+/**
+ * operands are ir->ops[first .. first + nops). Phis have one per
+ * predecessor of their block, in the same order, and calls have their args
+ * followed by the procref for CALL_INDIRECT. A CALL_INDIRECT whose arity
+ * was guessed has the args and locals after them, to write the frame back
+ * on an arity miss. Deopts have the variables live in the interpreter
+ * frame.
+ */
+struct ip_ir_value
+{
+  enum ip_ir_op op;
+  size_t block;
+  size_t first;
+  size_t nops;
+  /* CONST: the constant, ARG: the index, CALL: the callee, DEOPT: the ip,
+   * CALL_INDIRECT: the ip to deopt to on an arity miss or -1 */
+  ip_value_t k;
+  /* the value replacing this one, itself if none */
+  size_t repl;
+  int live;
+  size_t nuses;
+  /* live range in the linear order, and where the value is defined */
+  size_t start;
+  size_t end;
+  size_t def;
+  int crosses_call;
+  struct ip_opt_loc loc;
+};
+
+struct ip_ir_block
+{
+  /* insts [pos, end) */
+  size_t pos;
+  size_t end;
+  size_t depth;
+  int reachable;
+  size_t npreds;
+  size_t* preds;
+  /* for branches succs[0] is the target and succs[1] the next inst */
+  size_t nsuccs;
+  size_t succs[2];
+  enum ip_ir_term term;
+  size_t cond;
+  /* the branch compares the operands of the SUB `cond` */
+  int fused;
+  /* values defined here, phis first */
+  size_t first;
+  size_t last;
+  /* value of each variable at the end */
+  size_t* out;
+  /* linear order. phis are defined at `from`, the terminator is at `to` */
+  size_t from;
+  size_t to;
+  unsigned char* live_in;
+  size_t label;
+};
+
+struct ip_ir
+{
+  struct ip_proc* proc;
+  struct ip_vm* vm;
+  size_t nvalues;
+  size_t cvalues;
+  struct ip_ir_value* values;
+  size_t nops;
+  size_t cops;
+  size_t* ops;
+  size_t nblocks;
+  struct ip_ir_block* blocks;
+  /* args, locals and operand stack slots */
+  size_t nvars;
+  size_t nslots;
+  /* the loop header OSR code starts at, IP_IR_NONE for the proc's code */
+  size_t entry;
+  int failed;
+};
+
+#define IP_DEPTH_UNKNOWN ((size_t)-1)
+
+static int
+ip_vm_nargs_lookup(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (NULL == vm || ref < 0 || vm->nprocs <= (size_t)ref ||
+      NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/**
+ * number of args taken by the call at insts[at], or -1 if not known yet.
+ * A CALL_INDIRECT whose callee is not a constant is guessed to take every
+ * value below the ref, `guessed` tells.
+ */
+static long
+ip_proc_call_nargs(struct ip_proc* proc,
+                   struct ip_vm* vm,
+                   size_t at,
+                   size_t depth,
+                   int* guessed)
+{
+  long nargs =
+    ip_call_nargs(proc->insts, proc->ninsts, at, ip_vm_nargs_lookup, vm);
+
+  *guessed = IP_CALL_UNKNOWN == nargs;
+  return *guessed ? (long)depth - 1 : nargs;
+}
+
+/**
+ * compute the operand stack depth before each inst.
+ * returns 0 on success, 1 on malformed code and -1 if a callee is missing.
+ */
+static int
+ip_compute_depths(struct ip_proc* proc,
+                  struct ip_vm* vm,
+                  size_t* depths,
+                  size_t* max_depth)
+{
+  size_t* work;
+  size_t nwork = 0, i;
+
+  work = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == work) {
+    return 1;
+  }
+
+  for (i = 0; i < proc->ninsts; i++) {
+    depths[i] = IP_DEPTH_UNKNOWN;
+  }
+  *max_depth = 0;
+
+#define FLOW(to, d)                                                            \
+  do {                                                                         \
+    size_t to_ = (to), d_ = (d);                                               \
+    if (to_ >= proc->ninsts) {                                                 \
+      /* runs into the error block */                                          \
+      break;                                                                   \
+    }                                                                          \
+    if (IP_DEPTH_UNKNOWN == depths[to_]) {                                     \
+      depths[to_] = d_;                                                        \
+      work[nwork++] = to_;                                                     \
+    } else if (depths[to_] != d_) {                                            \
+      free(work);                                                              \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+  if (proc->ninsts) {
+    depths[0] = 0;
+    work[nwork++] = 0;
+  }
+
+  while (nwork) {
+    size_t at = work[--nwork];
+    size_t d = depths[at];
+    struct ip_inst* inst = &proc->insts[at];
+    long pops = 0, pushes = 0;
+    int falls = 1;
+
+    switch (inst->code) {
+      case IP_CODE_CONST:
+      case IP_CODE_GET_LOCAL:
+        pushes = 1;
+        break;
+      case IP_CODE_SET_LOCAL:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        pops = 1;
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        pops = 2;
+        pushes = 1;
+        break;
+      case IP_CODE_JUMP:
+        falls = 0;
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        long nargs;
+        int guessed;
+        if (IP_CODE_CALL_INDIRECT == inst->code && !d) {
+          free(work);
+          return 1;
+        }
+        nargs = ip_proc_call_nargs(proc, vm, at, d, &guessed);
+        if (nargs < 0) {
+          free(work);
+          return -1;
+        }
+        pops = nargs + (IP_CODE_CALL_INDIRECT == inst->code);
+        pushes = 1;
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT:
+        pops = 1;
+        falls = 0;
+        break;
+      default:
+        free(work);
+        return 1;
+    }
+
+    if ((size_t)pops > d) {
+      free(work);
+      return 1;
+    }
+    d = d - pops + pushes;
+    if (d > *max_depth) {
+      *max_depth = d;
+    }
+
+    if (IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+        IP_CODE_JUMP_IF_NEG == inst->code) {
+      /* jumps land after the target, as `ip` is incremented afterwards */
+      FLOW(inst->u.pos + 1, d);
+    }
+    if (falls) {
+      FLOW(at + 1, d);
+    }
+  }
+
+#undef FLOW
+
+  free(work);
+  return 0;
+}
+
+static size_t
+ip_ir_new_value(struct ip_ir* ir,
+                enum ip_ir_op op,
+                size_t block,
+                size_t nops)
+{
+  struct ip_ir_value* v;
+  size_t i;
+
+  if (ir->nvalues == ir->cvalues) {
+    struct ip_ir_value* values;
+
+    ir->cvalues = ir->cvalues ? 2 * ir->cvalues : 64;
+    values = realloc(ir->values, ir->cvalues * sizeof(struct ip_ir_value));
+    if (NULL == values) {
+      ir->failed = 1;
+      return IP_IR_NONE;
+    }
+    ir->values = values;
+  }
+  while (ir->nops + nops > ir->cops) {
+    size_t* ops;
+
+    ir->cops = ir->cops ? 2 * ir->cops : 64;
+    ops = realloc(ir->ops, ir->cops * sizeof(size_t));
+    if (NULL == ops) {
+      ir->failed = 1;
+      return IP_IR_NONE;
+    }
+    ir->ops = ops;
+  }
+
+  v = &ir->values[ir->nvalues];
+  memset(v, 0, sizeof(*v));
+  v->op = op;
+  v->block = block;
+  v->first = ir->nops;
+  v->nops = nops;
+  v->repl = ir->nvalues;
+  for (i = 0; i < nops; i++) {
+    ir->ops[ir->nops++] = IP_IR_NONE;
+  }
+
+  return ir->nvalues++;
+}
+
+/* constants are shared, so that equal ones are the same value */
+static size_t
+ip_ir_const(struct ip_ir* ir, ip_value_t k)
+{
+  size_t i, v;
+
+  for (i = 0; i < ir->nvalues; i++) {
+    if (IP_IR_CONST == ir->values[i].op && k == ir->values[i].k) {
+      return i;
+    }
+  }
+
+  v = ip_ir_new_value(ir, IP_IR_CONST, 0, 0);
+  if (IP_IR_NONE != v) {
+    ir->values[v].k = k;
+  }
+  return v;
+}
+
+static size_t
+ip_ir_resolve(struct ip_ir* ir, size_t v)
+{
+  while (IP_IR_NONE != v && ir->values[v].repl != v) {
+    v = ir->values[v].repl;
+  }
+  return v;
+}
+
+static int
+ip_ir_is_const(struct ip_ir* ir, size_t v)
+{
+  return IP_IR_NONE != v && IP_IR_CONST == ir->values[v].op;
+}
+
+static int
+ip_ir_is_terminator(enum ip_code code)
+{
+  return IP_CODE_JUMP == code || IP_CODE_JUMP_IF_ZERO == code ||
+         IP_CODE_JUMP_IF_NEG == code || IP_CODE_RETURN == code ||
+         IP_CODE_EXIT == code;
+}
+
+/* turn the blocks that cannot lead back to `entry` into deopts */
+static int
+ip_ir_cut_loop(struct ip_ir* ir, size_t entry)
+{
+  unsigned char* loop;
+  size_t error = ir->nblocks - 1, b, i;
+  int changed = 1;
+
+  loop = calloc(ir->nblocks, 1);
+  if (NULL == loop) {
+    return 1;
+  }
+  loop[entry] = 1;
+  while (changed) {
+    changed = 0;
+    for (b = 1; b < error; b++) {
+      for (i = 0; i < ir->blocks[b].nsuccs && !loop[b]; i++) {
+        if (loop[ir->blocks[b].succs[i]]) {
+          loop[b] = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+
+  for (b = 1; b < error; b++) {
+    if (!loop[b]) {
+      ir->blocks[b].term = IP_IR_TERM_DEOPT;
+      ir->blocks[b].nsuccs = 0;
+      ir->blocks[b].end = ir->blocks[b].pos;
+    }
+  }
+
+  free(loop);
+  return 0;
+}
+
+/**
+ * cut the reachable insts into blocks. Block 0 is the prologue defining the
+ * args and locals, the last one is where falling off the end or jumping
+ * out of the proc leads. For OSR code block 0 loads every variable and
+ * leads to the loop header.
+ */
+static int
+ip_ir_build_cfg(struct ip_ir* ir, size_t* depths)
+{
+  struct ip_proc* proc = ir->proc;
+  size_t ninsts = proc->ninsts;
+  unsigned char* leaders;
+  size_t* blockof;
+  size_t i, b, nblocks, error;
+
+  leaders = calloc(ninsts + 1, 1);
+  blockof = malloc((ninsts + 1) * sizeof(size_t));
+  if (NULL == leaders || NULL == blockof) {
+    free(leaders);
+    free(blockof);
+    return 1;
+  }
+
+  if (ninsts) {
+    leaders[0] = 1;
+  }
+  if (IP_IR_NONE != ir->entry) {
+    if (ir->entry >= ninsts || IP_DEPTH_UNKNOWN == depths[ir->entry]) {
+      free(leaders);
+      free(blockof);
+      return 1;
+    }
+    leaders[ir->entry] = 1;
+  }
+  for (i = 0; i < ninsts; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+
+    if (IP_DEPTH_UNKNOWN == depths[i]) {
+      continue;
+    }
+    if (IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+        IP_CODE_JUMP_IF_NEG == inst->code) {
+      if (inst->u.pos + 1 < ninsts) {
+        leaders[inst->u.pos + 1] = 1;
+      }
+    }
+    if (ip_ir_is_terminator(inst->code) && i + 1 < ninsts &&
+        IP_DEPTH_UNKNOWN != depths[i + 1]) {
+      leaders[i + 1] = 1;
+    }
+  }
+
+  nblocks = 2;
+  for (i = 0; i < ninsts; i++) {
+    nblocks += leaders[i];
+  }
+  ir->blocks = calloc(nblocks, sizeof(struct ip_ir_block));
+  if (NULL == ir->blocks) {
+    free(leaders);
+    free(blockof);
+    return 1;
+  }
+  ir->nblocks = nblocks;
+  error = nblocks - 1;
+
+  b = 1;
+  for (i = 0; i < ninsts; i++) {
+    if (leaders[i]) {
+      ir->blocks[b].pos = i;
+      ir->blocks[b].depth = depths[i];
+      b++;
+    }
+    blockof[i] = b - 1;
+  }
+  blockof[ninsts] = error;
+  ir->blocks[error].pos = ninsts;
+  ir->blocks[error].end = ninsts;
+  ir->blocks[error].term = IP_IR_TERM_ERROR;
+
+  ir->blocks[0].term = IP_IR_TERM_JUMP;
+  ir->blocks[0].nsuccs = 1;
+  ir->blocks[0].succs[0] = ninsts ? 1 : error;
+  if (IP_IR_NONE != ir->entry) {
+    ir->blocks[0].succs[0] = blockof[ir->entry];
+    ir->blocks[0].depth = depths[ir->entry];
+  }
+
+  for (b = 1; b < error; b++) {
+    struct ip_ir_block* blk = &ir->blocks[b];
+
+    for (i = blk->pos; i < ninsts; i++) {
+      struct ip_inst* inst = &proc->insts[i];
+      size_t target =
+        inst->u.pos + 1 < ninsts ? blockof[inst->u.pos + 1] : error;
+
+      if (ip_ir_is_terminator(inst->code)) {
+        switch (inst->code) {
+          case IP_CODE_JUMP:
+            blk->term = IP_IR_TERM_JUMP;
+            blk->nsuccs = 1;
+            blk->succs[0] = target;
+            break;
+          case IP_CODE_JUMP_IF_ZERO:
+          case IP_CODE_JUMP_IF_NEG:
+            blk->term = IP_CODE_JUMP_IF_ZERO == inst->code
+                          ? IP_IR_TERM_JUMP_IF_ZERO
+                          : IP_IR_TERM_JUMP_IF_NEG;
+            blk->nsuccs = 2;
+            blk->succs[0] = target;
+            blk->succs[1] = blockof[i + 1];
+            break;
+          case IP_CODE_RETURN:
+            blk->term = IP_IR_TERM_RETURN;
+            break;
+          default:
+            blk->term = IP_IR_TERM_EXIT;
+            break;
+        }
+        i++;
+        break;
+      }
+      if (i + 1 == ninsts || leaders[i + 1]) {
+        /* falls into the next block */
+        blk->term = IP_IR_TERM_JUMP;
+        blk->nsuccs = 1;
+        blk->succs[0] = blockof[i + 1];
+        i++;
+        break;
+      }
+    }
+    blk->end = i;
+  }
+
+  if (IP_IR_NONE != ir->entry &&
+      ip_ir_cut_loop(ir, ir->blocks[0].succs[0])) {
+    free(leaders);
+    free(blockof);
+    return 1;
+  }
+
+  for (b = 0; b < nblocks; b++) {
+    for (i = 0; i < ir->blocks[b].nsuccs; i++) {
+      ir->blocks[ir->blocks[b].succs[i]].npreds++;
+    }
+  }
+  for (b = 0; b < nblocks; b++) {
+    ir->blocks[b].preds = malloc((ir->blocks[b].npreds + 1) * sizeof(size_t));
+    if (NULL == ir->blocks[b].preds) {
+      free(leaders);
+      free(blockof);
+      return 1;
+    }
+    ir->blocks[b].npreds = 0;
+  }
+  for (b = 0; b < nblocks; b++) {
+    for (i = 0; i < ir->blocks[b].nsuccs; i++) {
+      struct ip_ir_block* succ = &ir->blocks[ir->blocks[b].succs[i]];
+      succ->preds[succ->npreds++] = b;
+    }
+  }
+
+  free(leaders);
+  free(blockof);
+  return 0;
+}
+
+/* run the stack code of every block on variables to get SSA values */
+static int
+ip_ir_build_ssa(struct ip_ir* ir)
+{
+  struct ip_proc* proc = ir->proc;
+  size_t nframe = proc->nargs + proc->nlocals;
+  size_t* cur;
+  size_t b, i, j;
+
+  cur = malloc((ir->nvars + 1) * sizeof(size_t));
+  if (NULL == cur) {
+    return 1;
+  }
+
+#define PUSH(v) (cur[nframe + d++] = (v))
+#define POP() (cur[nframe + --d])
+
+  for (b = 0; b < ir->nblocks; b++) {
+    struct ip_ir_block* blk = &ir->blocks[b];
+    size_t nlive = nframe + blk->depth;
+    size_t d = blk->depth;
+
+    for (i = 0; i < ir->nvars; i++) {
+      cur[i] = IP_IR_NONE;
+    }
+    blk->first = ir->nvalues;
+
+    if (0 == b) {
+      /* OSR code finds the whole frame in the interpreter's */
+      size_t nargs = IP_IR_NONE == ir->entry ? proc->nargs : nlive;
+
+      for (i = 0; i < nargs; i++) {
+        cur[i] = ip_ir_new_value(ir, IP_IR_ARG, 0, 0);
+        if (IP_IR_NONE != cur[i]) {
+          ir->values[cur[i]].k = i;
+        }
+      }
+      for (; i < nframe; i++) {
+        cur[i] = ip_ir_const(ir, IP_LLINT2VALUE(0));
+      }
+    } else if (IP_IR_TERM_ERROR != blk->term) {
+      if (1 == blk->npreds && blk->preds[0] < b) {
+        memcpy(cur, ir->blocks[blk->preds[0]].out, nlive * sizeof(size_t));
+      } else {
+        for (i = 0; i < nlive; i++) {
+          cur[i] = ip_ir_new_value(ir, IP_IR_PHI, b, blk->npreds);
+          if (IP_IR_NONE != cur[i]) {
+            ir->values[cur[i]].k = i;
+          }
+        }
+      }
+    }
+
+    if (IP_IR_TERM_DEOPT == blk->term) {
+      size_t v = ip_ir_new_value(ir, IP_IR_DEOPT, b, nlive);
+
+      if (IP_IR_NONE != v) {
+        ir->values[v].k = blk->pos;
+        for (i = 0; i < nlive; i++) {
+          ir->ops[ir->values[v].first + i] = cur[i];
+        }
+      }
+    }
+
+    for (i = blk->pos; i < blk->end && !ir->failed; i++) {
+      struct ip_inst* inst = &proc->insts[i];
+
+      switch (inst->code) {
+        case IP_CODE_CONST: {
+          PUSH(ip_ir_const(ir, inst->u.v));
+          break;
+        }
+        case IP_CODE_GET_LOCAL:
+        case IP_CODE_SET_LOCAL: {
+          if (inst->u.i < 0 || (size_t)inst->u.i >= nframe) {
+            free(cur);
+            return 1;
+          }
+          if (IP_CODE_GET_LOCAL == inst->code) {
+            PUSH(cur[inst->u.i]);
+          } else {
+            cur[inst->u.i] = POP();
+          }
+          break;
+        }
+        case IP_CODE_ADD:
+        case IP_CODE_SUB: {
+          size_t v = ip_ir_new_value(
+            ir, IP_CODE_ADD == inst->code ? IP_IR_ADD : IP_IR_SUB, b, 2);
+
+          if (IP_IR_NONE != v) {
+            ir->ops[ir->values[v].first + 1] = POP();
+            ir->ops[ir->values[v].first] = POP();
+            PUSH(v);
+          }
+          break;
+        }
+        case IP_CODE_CALL:
+        case IP_CODE_CALL_INDIRECT: {
+          int guessed;
+          size_t n = ip_proc_call_nargs(proc, ir->vm, i, d, &guessed) +
+                     (IP_CODE_CALL_INDIRECT == inst->code);
+          size_t nframe_ops = 0, v;
+
+          /* an arity miss writes the frame back for the interpreter */
+          nframe_ops = guessed ? nframe : 0;
+          v = ip_ir_new_value(ir,
+                              IP_CODE_CALL == inst->code ? IP_IR_CALL
+                                                         : IP_IR_CALL_INDIRECT,
+                              b,
+                              n + nframe_ops);
+          if (IP_IR_NONE != v) {
+            ir->values[v].k = IP_CODE_CALL == inst->code ? inst->u.p
+                              : nframe_ops               ? (ip_value_t)i
+                                                         : -1;
+            for (j = 0; j < nframe_ops; j++) {
+              ir->ops[ir->values[v].first + n + j] = cur[j];
+            }
+            for (j = n; j > 0; j--) {
+              ir->ops[ir->values[v].first + j - 1] = POP();
+            }
+            PUSH(v);
+          }
+          break;
+        }
+        case IP_CODE_JUMP_IF_ZERO:
+        case IP_CODE_JUMP_IF_NEG:
+        case IP_CODE_RETURN:
+        case IP_CODE_EXIT: {
+          blk->cond = POP();
+          break;
+        }
+        default: {
+          break;
+        }
+      }
+    }
+
+    blk->last = ir->nvalues;
+    blk->out = malloc((ir->nvars + 1) * sizeof(size_t));
+    if (NULL == blk->out || ir->failed) {
+      free(cur);
+      return 1;
+    }
+    memcpy(blk->out, cur, ir->nvars * sizeof(size_t));
+  }
+
+#undef PUSH
+#undef POP
+
+  /* now that every block has its values, give the phis their operands */
+  for (i = 0; i < ir->nvalues; i++) {
+    struct ip_ir_value* v = &ir->values[i];
+    struct ip_ir_block* blk = &ir->blocks[v->block];
+
+    if (IP_IR_PHI != v->op) {
+      continue;
+    }
+    for (j = 0; j < v->nops; j++) {
+      ir->ops[v->first + j] = ir->blocks[blk->preds[j]].out[v->k];
+    }
+  }
+
+  free(cur);
+  return 0;
+}
+
+/* forget the edge `from` -> `to`, and the phi operands coming from it */
+static void
+ip_ir_remove_edge(struct ip_ir* ir, size_t from, size_t to)
+{
+  struct ip_ir_block* blk = &ir->blocks[to];
+  size_t i, j;
+
+  for (j = 0; j < blk->npreds; j++) {
+    if (from == blk->preds[j]) {
+      break;
+    }
+  }
+  if (j == blk->npreds) {
+    return;
+  }
+
+  memmove(&blk->preds[j],
+          &blk->preds[j + 1],
+          (blk->npreds - j - 1) * sizeof(size_t));
+  blk->npreds--;
+  for (i = blk->first; i < blk->last; i++) {
+    struct ip_ir_value* v = &ir->values[i];
+
+    if (IP_IR_PHI == v->op) {
+      memmove(&ir->ops[v->first + j],
+              &ir->ops[v->first + j + 1],
+              (v->nops - j - 1) * sizeof(size_t));
+      v->nops--;
+    }
+  }
+}
+
+static void
+ip_ir_mark(struct ip_ir* ir, size_t b)
+{
+  size_t i;
+
+  if (ir->blocks[b].reachable) {
+    return;
+  }
+  ir->blocks[b].reachable = 1;
+  for (i = 0; i < ir->blocks[b].nsuccs; i++) {
+    ip_ir_mark(ir, ir->blocks[b].succs[i]);
+  }
+}
+
+/* fold the values and branches once. returns 1 if anything changed */
+static int
+ip_ir_fold(struct ip_ir* ir)
+{
+  size_t i, j;
+  int changed = 0;
+
+  for (i = 0; i < ir->nvalues; i++) {
+    struct ip_ir_value* v = &ir->values[i];
+    size_t with = IP_IR_NONE;
+
+    if (v->repl != i || !ir->blocks[v->block].reachable) {
+      continue;
+    }
+
+    switch (v->op) {
+      case IP_IR_PHI: {
+        /* a phi whose operands are all the same value, or itself */
+        int trivial = 1;
+
+        for (j = 0; j < v->nops; j++) {
+          size_t o = ip_ir_resolve(ir, ir->ops[v->first + j]);
+
+          if (o == i || o == with) {
+            continue;
+          }
+          if (IP_IR_NONE != with) {
+            trivial = 0;
+            break;
+          }
+          with = o;
+        }
+        if (!trivial) {
+          with = IP_IR_NONE;
+        }
+        break;
+      }
+      case IP_IR_ADD:
+      case IP_IR_SUB: {
+        size_t a = ip_ir_resolve(ir, ir->ops[v->first]);
+        size_t b = ip_ir_resolve(ir, ir->ops[v->first + 1]);
+
+        if (ip_ir_is_const(ir, a) && ip_ir_is_const(ir, b)) {
+          unsigned long long x = ir->values[a].k, y = ir->values[b].k;
+
+          with = ip_ir_const(
+            ir, IP_LLINT2VALUE(IP_IR_ADD == v->op ? x + y : x - y));
+          /* the values may have moved */
+          v = &ir->values[i];
+        } else if (ip_ir_is_const(ir, b) && 0 == ir->values[b].k) {
+          with = a;
+        } else if (IP_IR_ADD == v->op && ip_ir_is_const(ir, a) &&
+                   0 == ir->values[a].k) {
+          with = b;
+        }
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+
+    if (IP_IR_NONE != with) {
+      v->repl = with;
+      changed = 1;
+    }
+  }
+
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+    size_t c;
+    int taken;
+
+    if (!blk->reachable || (IP_IR_TERM_JUMP_IF_ZERO != blk->term &&
+                            IP_IR_TERM_JUMP_IF_NEG != blk->term)) {
+      continue;
+    }
+    c = ip_ir_resolve(ir, blk->cond);
+    if (!ip_ir_is_const(ir, c)) {
+      continue;
+    }
+
+    taken = IP_IR_TERM_JUMP_IF_ZERO == blk->term
+              ? 0 == IP_VALUE2LLINT(ir->values[c].k)
+              : IP_VALUE2LLINT(ir->values[c].k) < 0;
+    ip_ir_remove_edge(ir, i, blk->succs[taken ? 1 : 0]);
+    blk->term = IP_IR_TERM_JUMP;
+    blk->succs[0] = blk->succs[taken ? 0 : 1];
+    blk->nsuccs = 1;
+    changed = 1;
+  }
+
+  /* drop the edges out of the blocks that cannot be reached anymore */
+  for (i = 0; i < ir->nblocks; i++) {
+    ir->blocks[i].reachable = 0;
+  }
+  ip_ir_mark(ir, 0);
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+
+    if (blk->reachable) {
+      continue;
+    }
+    for (j = 0; j < blk->nsuccs; j++) {
+      ip_ir_remove_edge(ir, i, blk->succs[j]);
+      changed = 1;
+    }
+    blk->nsuccs = 0;
+  }
+
+  return changed;
+}
+
+static void
+ip_ir_use(struct ip_ir* ir, size_t v, size_t* work, size_t* nwork)
+{
+  if (IP_IR_NONE == v) {
+    return;
+  }
+  ir->values[v].nuses++;
+  if (!ir->values[v].live) {
+    ir->values[v].live = 1;
+    work[(*nwork)++] = v;
+  }
+}
+
+/**
+ * optimize until nothing changes, then keep the values that calls and
+ * terminators need, with their operands resolved.
+ */
+static int
+ip_ir_optimize(struct ip_ir* ir)
+{
+  size_t* work;
+  size_t nwork = 0, i, j;
+
+  ip_ir_mark(ir, 0);
+  while (ip_ir_fold(ir)) {
+  }
+  if (ir->failed) {
+    return 1;
+  }
+
+  for (i = 0; i < ir->nvalues; i++) {
+    struct ip_ir_value* v = &ir->values[i];
+
+    for (j = 0; j < v->nops; j++) {
+      ir->ops[v->first + j] = ip_ir_resolve(ir, ir->ops[v->first + j]);
+    }
+    v->live = 0;
+    v->nuses = 0;
+  }
+
+  work = malloc((ir->nvalues + 1) * sizeof(size_t));
+  if (NULL == work) {
+    return 1;
+  }
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+
+    if (!blk->reachable) {
+      continue;
+    }
+    for (j = blk->first; j < blk->last; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      /* calls may not come back */
+      if (v->repl == j && (IP_IR_CALL == v->op ||
+                           IP_IR_CALL_INDIRECT == v->op ||
+                           IP_IR_DEOPT == v->op)) {
+        v->live = 1;
+        work[nwork++] = j;
+      }
+    }
+    if (IP_IR_TERM_JUMP != blk->term && IP_IR_TERM_ERROR != blk->term &&
+        IP_IR_TERM_DEOPT != blk->term) {
+      blk->cond = ip_ir_resolve(ir, blk->cond);
+      ip_ir_use(ir, blk->cond, work, &nwork);
+    }
+  }
+  while (nwork) {
+    struct ip_ir_value* v = &ir->values[work[--nwork]];
+
+    for (j = 0; j < v->nops; j++) {
+      ip_ir_use(ir, ir->ops[v->first + j], work, &nwork);
+    }
+  }
+  free(work);
+
+  /* a SUB only tested by the branch right after it becomes a compare */
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+    struct ip_ir_value* c;
+
+    if (!blk->reachable || (IP_IR_TERM_JUMP_IF_ZERO != blk->term &&
+                            IP_IR_TERM_JUMP_IF_NEG != blk->term)) {
+      continue;
+    }
+    c = &ir->values[blk->cond];
+    if (IP_IR_SUB != c->op || c->block != i || 1 != c->nuses) {
+      continue;
+    }
+    for (j = blk->cond + 1; j < blk->last; j++) {
+      if (ir->values[j].live && IP_IR_CONST != ir->values[j].op) {
+        break;
+      }
+    }
+    if (j == blk->last) {
+      blk->fused = 1;
+      c->live = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* liveness and register allocation */
+
+#define IP_BIT_GET(set, i) ((set)[(i) >> 3] & (1 << ((i)&7)))
+#define IP_BIT_SET(set, i) ((set)[(i) >> 3] |= (1 << ((i)&7)))
+#define IP_BIT_CLEAR(set, i) ((set)[(i) >> 3] &= ~(1 << ((i)&7)))
+
+/* values taking a location: live and not constants */
+static int
+ip_ir_is_allocated(struct ip_ir* ir, size_t v)
+{
+  return IP_IR_NONE != v && ir->values[v].live &&
+         IP_IR_CONST != ir->values[v].op && IP_IR_DEOPT != ir->values[v].op;
+}
+
+/* values used by the terminator of `blk` */
+static size_t
+ip_ir_term_uses(struct ip_ir* ir, struct ip_ir_block* blk, size_t* uses)
+{
+  if (blk->fused) {
+    struct ip_ir_value* c = &ir->values[blk->cond];
+
+    uses[0] = ir->ops[c->first];
+    uses[1] = ir->ops[c->first + 1];
+    return 2;
+  }
+  if (IP_IR_TERM_JUMP == blk->term || IP_IR_TERM_ERROR == blk->term ||
+      IP_IR_TERM_DEOPT == blk->term) {
+    return 0;
+  }
+  uses[0] = blk->cond;
+  return 1;
+}
+
+/* the values live at the end of block `b` */
+static void
+ip_ir_live_out(struct ip_ir* ir, size_t b, unsigned char* live, size_t size)
+{
+  struct ip_ir_block* blk = &ir->blocks[b];
+  size_t i, j, k;
+
+  memset(live, 0, size);
+  for (i = 0; i < blk->nsuccs; i++) {
+    struct ip_ir_block* succ = &ir->blocks[blk->succs[i]];
+
+    for (k = 0; k < size; k++) {
+      live[k] |= succ->live_in[k];
+    }
+    for (j = succ->first; j < succ->last; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      if (IP_IR_PHI == v->op && v->live) {
+        IP_BIT_CLEAR(live, j);
+      }
+    }
+    for (j = succ->first; j < succ->last; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      if (IP_IR_PHI == v->op && v->live) {
+        for (k = 0; k < succ->npreds; k++) {
+          if (b == succ->preds[k] &&
+              ip_ir_is_allocated(ir, ir->ops[v->first + k])) {
+            IP_BIT_SET(live, ir->ops[v->first + k]);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * number the values in block order and compute their live ranges, as the
+ * hull of the positions where they are live.
+ */
+static int
+ip_ir_live_ranges(struct ip_ir* ir)
+{
+  size_t size = (ir->nvalues + 7) / 8;
+  unsigned char* live;
+  size_t i, j, k, pos = 0;
+  int changed;
+
+  live = malloc(size + 1);
+  if (NULL == live) {
+    return 1;
+  }
+
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+
+    blk->live_in = calloc(size + 1, 1);
+    if (NULL == blk->live_in) {
+      free(live);
+      return 1;
+    }
+    if (!blk->reachable) {
+      continue;
+    }
+    blk->from = pos++;
+    for (j = blk->first; j < blk->last; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      v->def = IP_IR_PHI == v->op ? blk->from : pos++;
+      v->start = v->def;
+      v->end = v->def;
+    }
+    blk->to = pos++;
+  }
+
+  do {
+    changed = 0;
+    for (i = ir->nblocks; i > 0; i--) {
+      struct ip_ir_block* blk = &ir->blocks[i - 1];
+      size_t uses[2], nuses;
+
+      if (!blk->reachable) {
+        continue;
+      }
+      ip_ir_live_out(ir, i - 1, live, size);
+      nuses = ip_ir_term_uses(ir, blk, uses);
+      for (k = 0; k < nuses; k++) {
+        if (ip_ir_is_allocated(ir, uses[k])) {
+          IP_BIT_SET(live, uses[k]);
+        }
+      }
+      for (j = blk->last; j > blk->first; j--) {
+        struct ip_ir_value* v = &ir->values[j - 1];
+
+        if (!v->live) {
+          continue;
+        }
+        IP_BIT_CLEAR(live, j - 1);
+        if (IP_IR_PHI == v->op) {
+          continue;
+        }
+        for (k = 0; k < v->nops; k++) {
+          if (ip_ir_is_allocated(ir, ir->ops[v->first + k])) {
+            IP_BIT_SET(live, ir->ops[v->first + k]);
+          }
+        }
+      }
+      if (memcmp(live, blk->live_in, size)) {
+        memcpy(blk->live_in, live, size);
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  for (i = 0; i < ir->nblocks; i++) {
+    struct ip_ir_block* blk = &ir->blocks[i];
+    size_t uses[2], nuses;
+
+    if (!blk->reachable) {
+      continue;
+    }
+    ip_ir_live_out(ir, i, live, size);
+    for (j = 0; j < ir->nvalues; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      if (IP_BIT_GET(live, j) && v->end < blk->to) {
+        v->end = blk->to;
+      }
+      if (IP_BIT_GET(blk->live_in, j) && v->start > blk->from) {
+        v->start = blk->from;
+      }
+    }
+    for (j = blk->first; j < blk->last; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      if (!v->live || IP_IR_PHI == v->op) {
+        continue;
+      }
+      for (k = 0; k < v->nops; k++) {
+        struct ip_ir_value* o = &ir->values[ir->ops[v->first + k]];
+
+        /* the start of a value live around a loop may be before its def */
+        if (o->end < v->def) {
+          o->end = v->def;
+        }
+      }
+    }
+    nuses = ip_ir_term_uses(ir, blk, uses);
+    for (k = 0; k < nuses; k++) {
+      if (ir->values[uses[k]].end < blk->to) {
+        ir->values[uses[k]].end = blk->to;
+      }
+    }
+  }
+
+  /* the calls clobber every register but the callee-saved ones */
+  for (i = 0; i < ir->nvalues; i++) {
+    struct ip_ir_value* c = &ir->values[i];
+
+    if (!c->live || (IP_IR_CALL != c->op && IP_IR_CALL_INDIRECT != c->op)) {
+      continue;
+    }
+    for (j = 0; j < ir->nvalues; j++) {
+      struct ip_ir_value* v = &ir->values[j];
+
+      if (ip_ir_is_allocated(ir, j) && v->start < c->def && c->def < v->end) {
+        v->crosses_call = 1;
+      }
+    }
+  }
+
+  free(live);
+  return 0;
+}
+
+static const int ip_opt_caller_saved[] = {
+  IP_JIT_RSI, IP_JIT_RDI, IP_JIT_R8, IP_JIT_R9, IP_JIT_R10, IP_JIT_R11,
+};
+
+static const int ip_opt_callee_saved[] = {
+  IP_JIT_RBP,
+  IP_JIT_R12,
+  IP_JIT_R15,
+};
+
+#define IP_OPT_NCALLER_SAVED                                                   \
+  (sizeof(ip_opt_caller_saved) / sizeof(ip_opt_caller_saved[0]))
+#define IP_OPT_NCALLEE_SAVED                                                   \
+  (sizeof(ip_opt_callee_saved) / sizeof(ip_opt_callee_saved[0]))
+
+static int
+ip_opt_is_callee_saved(int r)
+{
+  size_t i;
+
+  for (i = 0; i < IP_OPT_NCALLEE_SAVED; i++) {
+    if (ip_opt_callee_saved[i] == r) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+ip_opt_spill(struct ip_ir* ir, struct ip_ir_value* v)
+{
+  v->loc.kind = IP_OPT_LOC_SLOT;
+  v->loc.r = ir->nslots++;
+}
+
+/* linear scan. returns the callee-saved registers used, as a bit set */
+static int
+ip_ir_allocate(struct ip_ir* ir, int* used)
+{
+  size_t* order;
+  size_t* active;
+  size_t norder = 0, nactive = 0, i, j, k;
+  int taken[16];
+
+  order = malloc((ir->nvalues + 1) * sizeof(size_t));
+  active = malloc((ir->nvalues + 1) * sizeof(size_t));
+  if (NULL == order || NULL == active) {
+    free(order);
+    free(active);
+    return 1;
+  }
+  memset(taken, 0, sizeof(taken));
+  *used = 0;
+  ir->nslots = 0;
+
+  /* by start, insertion sort keeps it simple for the sizes of procs */
+  for (i = 0; i < ir->nvalues; i++) {
+    if (!ip_ir_is_allocated(ir, i) ||
+        !ir->blocks[ir->values[i].block].reachable) {
+      continue;
+    }
+    for (j = norder; j > 0 && ir->values[order[j - 1]].start >
+                                ir->values[i].start;
+         j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+    norder++;
+  }
+
+  for (i = 0; i < norder; i++) {
+    struct ip_ir_value* v = &ir->values[order[i]];
+    int r = -1;
+
+    /* free the registers of the ranges that ended */
+    for (j = 0, k = 0; j < nactive; j++) {
+      struct ip_ir_value* a = &ir->values[active[j]];
+
+      if (a->end < v->start) {
+        taken[a->loc.r] = 0;
+      } else {
+        active[k++] = active[j];
+      }
+    }
+    nactive = k;
+
+    if (!v->crosses_call) {
+      for (j = 0; j < IP_OPT_NCALLER_SAVED && r < 0; j++) {
+        if (!taken[ip_opt_caller_saved[j]]) {
+          r = ip_opt_caller_saved[j];
+        }
+      }
+    }
+    for (j = 0; j < IP_OPT_NCALLEE_SAVED && r < 0; j++) {
+      if (!taken[ip_opt_callee_saved[j]]) {
+        r = ip_opt_callee_saved[j];
+      }
+    }
+
+    if (r < 0) {
+      /* spill whichever of this one and the active ones ends last */
+      size_t victim = IP_IR_NONE;
+
+      for (j = 0; j < nactive; j++) {
+        struct ip_ir_value* a = &ir->values[active[j]];
+
+        if (v->crosses_call && !ip_opt_is_callee_saved(a->loc.r)) {
+          continue;
+        }
+        if (IP_IR_NONE == victim || a->end > ir->values[active[victim]].end) {
+          victim = j;
+        }
+      }
+      if (IP_IR_NONE == victim || ir->values[active[victim]].end <= v->end) {
+        ip_opt_spill(ir, v);
+        continue;
+      }
+      r = ir->values[active[victim]].loc.r;
+      ip_opt_spill(ir, &ir->values[active[victim]]);
+      active[victim] = active[--nactive];
+    }
+
+    v->loc.kind = IP_OPT_LOC_REG;
+    v->loc.r = r;
+    taken[r] = 1;
+    if (ip_opt_is_callee_saved(r)) {
+      *used |= 1 << r;
+    }
+    active[nactive++] = order[i];
+  }
+
+  free(order);
+  free(active);
+  return 0;
+}
+
+/* code generation */
+
+static struct ip_opt_loc
+ip_opt_loc_of(struct ip_ir* ir, size_t v)
+{
+  struct ip_opt_loc loc;
+
+  if (ip_ir_is_const(ir, v)) {
+    loc.kind = IP_OPT_LOC_CONST;
+    loc.r = 0;
+    loc.k = ir->values[v].k;
+    return loc;
+  }
+  return ir->values[v].loc;
+}
+
+static int
+ip_opt_loc_eq(struct ip_opt_loc a, struct ip_opt_loc b)
+{
+  return a.kind == b.kind && IP_OPT_LOC_CONST != a.kind && a.r == b.r;
+}
+
+static int
+ip_opt_fits_imm32(ip_value_t k)
+{
+  return INT32_MIN <= k && k <= INT32_MAX;
+}
+
+/* reg = loc */
+static void
+ip_opt_emit_load(struct ip_jit_buf* buf, int reg, struct ip_opt_loc loc)
+{
+  switch (loc.kind) {
+    case IP_OPT_LOC_REG:
+      if (loc.r != reg) {
+        ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, loc.r, reg);
+      }
+      break;
+    case IP_OPT_LOC_SLOT:
+      ip_jit_op_mem(buf, IP_JIT_OP_MOV_R_RM, reg, IP_JIT_RSP, 8 * loc.r);
+      break;
+    case IP_OPT_LOC_CONST:
+      ip_jit_mov_imm(buf, reg, loc.k);
+      break;
+    default:
+      break;
+  }
+}
+
+/* loc = reg */
+static void
+ip_opt_emit_store(struct ip_jit_buf* buf, struct ip_opt_loc loc, int reg)
+{
+  switch (loc.kind) {
+    case IP_OPT_LOC_REG:
+      if (loc.r != reg) {
+        ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, reg, loc.r);
+      }
+      break;
+    case IP_OPT_LOC_SLOT:
+      ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, reg, IP_JIT_RSP, 8 * loc.r);
+      break;
+    default:
+      break;
+  }
+}
+
+/* dst = src, through rax when both are in memory */
+static void
+ip_opt_emit_move(struct ip_jit_buf* buf,
+                 struct ip_opt_loc dst,
+                 struct ip_opt_loc src)
+{
+  if (ip_opt_loc_eq(dst, src) || IP_OPT_LOC_NONE == dst.kind) {
+    return;
+  }
+  if (IP_OPT_LOC_REG == dst.kind) {
+    ip_opt_emit_load(buf, dst.r, src);
+  } else if (IP_OPT_LOC_REG == src.kind) {
+    ip_opt_emit_store(buf, dst, src.r);
+  } else if (IP_OPT_LOC_CONST == src.kind && ip_opt_fits_imm32(src.k)) {
+    ip_jit_mov_mem_imm(buf, IP_JIT_RSP, 8 * dst.r, (int32_t)src.k);
+  } else {
+    ip_opt_emit_load(buf, IP_JIT_RAX, src);
+    ip_opt_emit_store(buf, dst, IP_JIT_RAX);
+  }
+}
+
+/* `op reg, loc` for the ADD, SUB and CMP families */
+static void
+ip_opt_emit_arith(struct ip_jit_buf* buf,
+                  unsigned char rm_r,
+                  unsigned char r_rm,
+                  int ext,
+                  int reg,
+                  struct ip_opt_loc loc)
+{
+  switch (loc.kind) {
+    case IP_OPT_LOC_REG:
+      ip_jit_op_reg(buf, rm_r, loc.r, reg);
+      break;
+    case IP_OPT_LOC_SLOT:
+      ip_jit_op_mem(buf, r_rm, reg, IP_JIT_RSP, 8 * loc.r);
+      break;
+    case IP_OPT_LOC_CONST:
+      if (ip_opt_fits_imm32(loc.k)) {
+        ip_jit_op_imm(buf, ext, reg, (int32_t)loc.k);
+      } else {
+        ip_jit_mov_imm(buf, IP_JIT_RCX, loc.k);
+        ip_jit_op_reg(buf, rm_r, IP_JIT_RCX, reg);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* the index of `from` among the predecessors of `to` */
+static size_t
+ip_ir_pred_index(struct ip_ir* ir, size_t from, size_t to)
+{
+  size_t j;
+
+  for (j = 0; j < ir->blocks[to].npreds; j++) {
+    if (from == ir->blocks[to].preds[j]) {
+      break;
+    }
+  }
+  return j;
+}
+
+struct ip_opt_move
+{
+  struct ip_opt_loc dst;
+  struct ip_opt_loc src;
+};
+
+/* the moves giving the phis of `to` their values when coming from `from` */
+static size_t
+ip_opt_edge_moves(struct ip_ir* ir,
+                  size_t from,
+                  size_t to,
+                  struct ip_opt_move* moves)
+{
+  struct ip_ir_block* blk = &ir->blocks[to];
+  size_t j = ip_ir_pred_index(ir, from, to), i, n = 0;
+
+  for (i = blk->first; i < blk->last; i++) {
+    struct ip_ir_value* v = &ir->values[i];
+    struct ip_opt_loc src;
+
+    if (IP_IR_PHI != v->op || !v->live) {
+      continue;
+    }
+    src = ip_opt_loc_of(ir, ir->ops[v->first + j]);
+    if (!ip_opt_loc_eq(v->loc, src)) {
+      moves[n].dst = v->loc;
+      moves[n].src = src;
+      n++;
+    }
+  }
+  return n;
+}
+
+/**
+ * emit the moves of an edge as if they all happened at once: a move is
+ * done when no other one still reads its destination, and cycles are
+ * broken by saving a destination in rdx.
+ */
+static void
+ip_opt_emit_edge(struct ip_ir* ir,
+                 struct ip_jit_buf* buf,
+                 size_t from,
+                 size_t to,
+                 struct ip_opt_move* moves)
+{
+  size_t n = ip_opt_edge_moves(ir, from, to, moves), i, j;
+
+  while (n) {
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < n; j++) {
+        if (ip_opt_loc_eq(moves[j].src, moves[i].dst)) {
+          break;
+        }
+      }
+      if (j == n) {
+        break;
+      }
+    }
+
+    if (i == n) {
+      struct ip_opt_loc tmp;
+
+      tmp.kind = IP_OPT_LOC_REG;
+      tmp.r = IP_JIT_RDX;
+      tmp.k = 0;
+      ip_opt_emit_move(buf, tmp, moves[0].dst);
+      for (j = 0; j < n; j++) {
+        if (ip_opt_loc_eq(moves[j].src, moves[0].dst)) {
+          moves[j].src = tmp;
+        }
+      }
+      i = 0;
+    }
+
+    ip_opt_emit_move(buf, moves[i].dst, moves[i].src);
+    moves[i] = moves[--n];
+  }
+}
+
+/* empty the inline cache `ic` */
+static void
+ip_opt_ic_flush(struct ip_opt_ic* ic)
+{
+  size_t j;
+
+  if (IP_OPT_IC_SIZE < ic->n) {
+    /* back to cmp rax, imm32 */
+    ic->code[ic->start] = 0x48;
+    ic->code[ic->start + 1] = 0x81;
+    ic->code[ic->start + 2] = 0xf8;
+  }
+  for (j = 0; j < IP_OPT_IC_SIZE; j++) {
+    /* never a proc, the lookup of a miss would fail as well */
+    ip_jit_patch_u32(ic->code + ic->refs[j], (uint32_t)-1);
+    ip_jit_link_abs(ic->code + ic->calls[j], ip_opt_fail);
+  }
+  ic->n = 0;
+}
+
+/* called by the misses until the site is megamorphic */
+static void
+ip_opt_ic_fill(struct ip_opt_ic* ic, ip_value_t ref, struct ip_proc* proc)
+{
+  size_t j = ic->n++;
+
+  if (IP_OPT_IC_SIZE == j) {
+    /* jmp miss over the compares */
+    ic->code[ic->start] = 0xe9;
+    ip_jit_link_abs(ic->code + ic->start + 1, ic->code + ic->miss);
+    return;
+  }
+  /* procrefs are ints */
+  ip_jit_patch_u32(ic->code + ic->refs[j], (uint32_t)ref);
+  ip_jit_link_abs(ic->code + ic->calls[j], proc->code);
+  ic->procs[j] = proc;
+}
+
+/* leave the generated code with `status` as the result of ip_vm_exec */
+static void
+ip_opt_emit_leave(struct ip_jit_buf* buf, int status)
+{
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RSP, IP_OPT_VM, IP_OPT_VM_FIELD(rsp));
+  ip_jit_mov_imm(buf, IP_JIT_RAX, status);
+  ip_jit_jmp_mem(buf, IP_OPT_VM, IP_OPT_VM_FIELD(out));
+}
+
+/* code emission state of a proc */
+struct ip_opt_emitter
+{
+  struct ip_jit_buf buf;
+  /* branches to the error stub */
+  size_t nerrors;
+  size_t* errors;
+  /* branches to blocks */
+  size_t njumps;
+  size_t* jumps;
+  size_t* jump_targets;
+  struct ip_opt_move* moves;
+  int used;
+};
+
+static void
+ip_opt_jump_to(struct ip_opt_emitter* e, size_t at, size_t block)
+{
+  e->jumps[e->njumps] = at;
+  e->jump_targets[e->njumps] = block;
+  e->njumps++;
+}
+
+/* [base + off] = the value `v`, through rax */
+static void
+ip_opt_emit_frame_store(struct ip_ir* ir,
+                        struct ip_jit_buf* buf,
+                        int32_t off,
+                        size_t v)
+{
+  struct ip_opt_loc src = ip_opt_loc_of(ir, v);
+
+  if (IP_OPT_LOC_REG == src.kind) {
+    ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, src.r, IP_OPT_BASE, off);
+  } else if (IP_OPT_LOC_CONST == src.kind && ip_opt_fits_imm32(src.k)) {
+    ip_jit_mov_mem_imm(buf, IP_OPT_BASE, off, (int32_t)src.k);
+  } else {
+    ip_opt_emit_load(buf, IP_JIT_RAX, src);
+    ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_BASE, off);
+  }
+}
+
+/* store the args of a call after the frame, checking there is room */
+static void
+ip_opt_emit_args(struct ip_ir* ir,
+                 struct ip_opt_emitter* e,
+                 struct ip_ir_value* v,
+                 size_t nargs)
+{
+  size_t frame = ir->proc->nargs, j;
+
+  ip_jit_op_mem(
+    &e->buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_OPT_BASE, 8 * (frame + nargs));
+  ip_jit_op_reg(&e->buf, IP_JIT_OP_CMP_RM_R, IP_OPT_LIMIT, IP_JIT_RAX);
+  e->errors[e->nerrors++] = ip_jit_jcc(&e->buf, IP_JIT_CC_A);
+
+  for (j = 0; j < nargs; j++) {
+    ip_opt_emit_frame_store(
+      ir, &e->buf, 8 * (int32_t)(frame + j), ir->ops[v->first + j]);
+  }
+}
+
+static void
+ip_opt_emit_epilogue(struct ip_ir* ir, struct ip_opt_emitter* e)
+{
+  size_t j;
+
+  if (ir->nslots) {
+    ip_jit_op_imm(&e->buf, IP_JIT_EXT_ADD, IP_JIT_RSP, 8 * ir->nslots);
+  }
+  for (j = IP_OPT_NCALLEE_SAVED; j > 0; j--) {
+    if (e->used & (1 << ip_opt_callee_saved[j - 1])) {
+      ip_jit_pop(&e->buf, ip_opt_callee_saved[j - 1]);
+    }
+  }
+  ip_jit_ret(&e->buf);
+}
+
+static ip_value_t
+ip_tier_deopt(struct ip_vm* vm, struct ip_proc* proc, ip_value_t* base);
+
+/**
+ * the arity miss of the CALL_INDIRECT `v`, branched to from `miss` with the
+ * base past the args of the proc: write the frame back as the interpreter
+ * has it at the call, finish the activation with ip_tier_deopt and return
+ * its result or leave with its status.
+ */
+static void
+ip_opt_emit_call_deopt(struct ip_ir* ir,
+                       struct ip_opt_emitter* e,
+                       struct ip_ir_value* v,
+                       size_t nargs,
+                       size_t miss)
+{
+  struct ip_jit_buf* buf = &e->buf;
+  size_t nframe = v->nops - nargs - 1, over, leave, j;
+  int32_t top = 8 * (int32_t)(nframe + nargs + 1);
+
+  over = ip_jit_jmp(buf);
+  ip_jit_link(buf, miss, buf->len);
+  if (ir->proc->nargs) {
+    ip_jit_op_imm(buf, IP_JIT_EXT_SUB, IP_OPT_BASE, 8 * ir->proc->nargs);
+  }
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_OPT_BASE, top);
+  ip_jit_op_reg(buf, IP_JIT_OP_CMP_RM_R, IP_OPT_LIMIT, IP_JIT_RAX);
+  e->errors[e->nerrors++] = ip_jit_jcc(buf, IP_JIT_CC_A);
+
+  /* the args and locals, then the operand stack ending with the procref */
+  for (j = 0; j < nframe; j++) {
+    ip_opt_emit_frame_store(
+      ir, buf, 8 * (int32_t)j, ir->ops[v->first + nargs + 1 + j]);
+  }
+  for (j = 0; j <= nargs; j++) {
+    ip_opt_emit_frame_store(
+      ir, buf, 8 * (int32_t)(nframe + j), ir->ops[v->first + j]);
+  }
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_OPT_BASE, top);
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(sp));
+  ip_jit_mov_mem_imm(buf, IP_OPT_VM, IP_OPT_VM_FIELD(resume), (int32_t)v->k);
+
+  /* as the stubs call ip_tier_enter */
+  ip_jit_push(buf, IP_JIT_RBP);
+  ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RSP, IP_JIT_RBP);
+  /* and rsp, -16 */
+  ip_jit_emit_u8(buf, 0x48);
+  ip_jit_emit_u8(buf, 0x83);
+  ip_jit_emit_u8(buf, 0xe4);
+  ip_jit_emit_u8(buf, 0xf0);
+  ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_OPT_VM, IP_JIT_RDI);
+  ip_jit_mov_imm(buf, IP_JIT_RSI, (int64_t)(intptr_t)ir->proc);
+  ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_OPT_BASE, IP_JIT_RDX);
+  ip_jit_mov_imm(buf, IP_JIT_RAX, (int64_t)(intptr_t)ip_tier_deopt);
+  ip_jit_call_reg(buf, IP_JIT_RAX);
+  ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RBP, IP_JIT_RSP);
+  ip_jit_pop(buf, IP_JIT_RBP);
+
+  ip_jit_op_mem_imm(
+    buf, IP_JIT_EXT_CMP, IP_OPT_VM, IP_OPT_VM_FIELD(status), IP_OPT_RETURNED);
+  leave = ip_jit_jcc(buf, IP_JIT_CC_NE);
+  ip_opt_emit_epilogue(ir, e);
+  ip_jit_link(buf, leave, buf->len);
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(status));
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RSP, IP_OPT_VM, IP_OPT_VM_FIELD(rsp));
+  ip_jit_jmp_mem(buf, IP_OPT_VM, IP_OPT_VM_FIELD(out));
+
+  ip_jit_link(buf, over, buf->len);
+}
+
+static void
+ip_opt_emit_value(struct ip_ir* ir, struct ip_opt_emitter* e, size_t i)
+{
+  struct ip_proc* proc = ir->proc;
+  struct ip_ir_value* v = &ir->values[i];
+  struct ip_jit_buf* buf = &e->buf;
+
+  switch (v->op) {
+    case IP_IR_ARG: {
+      if (IP_OPT_LOC_REG == v->loc.kind) {
+        ip_jit_op_mem(
+          buf, IP_JIT_OP_MOV_R_RM, v->loc.r, IP_OPT_BASE, 8 * (int32_t)v->k);
+      } else {
+        ip_jit_op_mem(
+          buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_OPT_BASE, 8 * (int32_t)v->k);
+        ip_opt_emit_store(buf, v->loc, IP_JIT_RAX);
+      }
+      break;
+    }
+    case IP_IR_ADD:
+    case IP_IR_SUB: {
+      int r = IP_OPT_LOC_REG == v->loc.kind ? v->loc.r : IP_JIT_RAX;
+
+      ip_opt_emit_load(buf, r, ip_opt_loc_of(ir, ir->ops[v->first]));
+      if (IP_IR_ADD == v->op) {
+        ip_opt_emit_arith(buf,
+                          IP_JIT_OP_ADD_RM_R,
+                          IP_JIT_OP_ADD_R_RM,
+                          IP_JIT_EXT_ADD,
+                          r,
+                          ip_opt_loc_of(ir, ir->ops[v->first + 1]));
+      } else {
+        ip_opt_emit_arith(buf,
+                          IP_JIT_OP_SUB_RM_R,
+                          IP_JIT_OP_SUB_R_RM,
+                          IP_JIT_EXT_SUB,
+                          r,
+                          ip_opt_loc_of(ir, ir->ops[v->first + 1]));
+      }
+      ip_opt_emit_store(buf, v->loc, r);
+      break;
+    }
+    case IP_IR_CALL: {
+      ip_opt_emit_args(ir, e, v, v->nops);
+      if (proc->nargs) {
+        ip_jit_op_imm(buf, IP_JIT_EXT_ADD, IP_OPT_BASE, 8 * proc->nargs);
+      }
+      proc->calls[proc->ncalls].offset = ip_jit_call(buf);
+      proc->calls[proc->ncalls].ref = v->k;
+      proc->ncalls++;
+      if (proc->nargs) {
+        ip_jit_op_imm(buf, IP_JIT_EXT_SUB, IP_OPT_BASE, 8 * proc->nargs);
+      }
+      ip_opt_emit_store(buf, v->loc, IP_JIT_RAX);
+      break;
+    }
+    case IP_IR_CALL_INDIRECT: {
+      /* the frame follows the procref when the arity was guessed */
+      size_t nframe = -1 != v->k ? proc->nargs + proc->nlocals : 0;
+      size_t nargs = v->nops - 1 - nframe, done[IP_OPT_IC_SIZE], next, full, j;
+      struct ip_opt_ic* ic = &proc->ics[proc->nics++];
+      size_t miss = 0;
+
+      ip_opt_emit_args(ir, e, v, nargs);
+      ip_opt_emit_load(
+        buf, IP_JIT_RAX, ip_opt_loc_of(ir, ir->ops[v->first + nargs]));
+      if (proc->nargs) {
+        ip_jit_op_imm(buf, IP_JIT_EXT_ADD, IP_OPT_BASE, 8 * proc->nargs);
+      }
+      ic->start = buf->len;
+      for (j = 0; j < IP_OPT_IC_SIZE; j++) {
+        ip_jit_op_imm(buf, IP_JIT_EXT_CMP, IP_JIT_RAX, -1);
+        ic->refs[j] = buf->len - 4;
+        next = ip_jit_jcc(buf, IP_JIT_CC_NE);
+#ifdef IP_OPT_IC_STATS
+        ip_jit_mov_imm(buf, IP_JIT_RDX, (int64_t)(intptr_t)ic);
+        ip_jit_op_mem_imm(
+          buf, IP_JIT_EXT_ADD, IP_JIT_RDX, IP_OPT_IC_FIELD(hits), 1);
+#endif
+        ic->calls[j] = ip_jit_call(buf);
+        done[j] = ip_jit_jmp(buf);
+        ip_jit_link(buf, next, buf->len);
+      }
+
+      ic->miss = buf->len;
+      ip_jit_mov_imm(buf, IP_JIT_RDX, (int64_t)(intptr_t)ic);
+#ifdef IP_OPT_IC_STATS
+      ip_jit_op_mem_imm(
+        buf, IP_JIT_EXT_ADD, IP_JIT_RDX, IP_OPT_IC_FIELD(misses), 1);
+#endif
+      ip_jit_op_mem(
+        buf, IP_JIT_OP_CMP_R_RM, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(nprocs));
+      e->errors[e->nerrors++] = ip_jit_jcc(buf, IP_JIT_CC_AE);
+      ip_jit_op_mem(
+        buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RCX, IP_OPT_VM, IP_OPT_VM_FIELD(procs));
+      /* mov rcx, [rcx + rax * 8] */
+      ip_jit_emit_u8(buf, 0x48);
+      ip_jit_emit_u8(buf, 0x8b);
+      ip_jit_emit_u8(buf, 0x0c);
+      ip_jit_emit_u8(buf, 0xc1);
+      ip_jit_op_reg(buf, IP_JIT_OP_TEST_RM_R, IP_JIT_RCX, IP_JIT_RCX);
+      e->errors[e->nerrors++] = ip_jit_jcc(buf, IP_JIT_CC_E);
+      ip_jit_op_mem_imm(
+        buf, IP_JIT_EXT_CMP, IP_JIT_RCX, offsetof(struct ip_proc, nargs), nargs);
+      if (nframe) {
+        miss = ip_jit_jcc(buf, IP_JIT_CC_NE);
+      } else {
+        e->errors[e->nerrors++] = ip_jit_jcc(buf, IP_JIT_CC_NE);
+      }
+      ip_jit_op_mem_imm(
+        buf, IP_JIT_EXT_CMP, IP_JIT_RCX, offsetof(struct ip_proc, code), 0);
+      e->errors[e->nerrors++] = ip_jit_jcc(buf, IP_JIT_CC_E);
+
+      /* fill an entry on a 16 byte aligned stack, keeping the proc */
+      ip_jit_op_mem_imm(
+        buf, IP_JIT_EXT_CMP, IP_JIT_RDX, IP_OPT_IC_FIELD(n), IP_OPT_IC_SIZE + 1);
+      full = ip_jit_jcc(buf, IP_JIT_CC_AE);
+      ip_jit_push(buf, IP_JIT_RCX);
+      ip_jit_push(buf, IP_JIT_RBP);
+      ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RSP, IP_JIT_RBP);
+      /* and rsp, -16 */
+      ip_jit_emit_u8(buf, 0x48);
+      ip_jit_emit_u8(buf, 0x83);
+      ip_jit_emit_u8(buf, 0xe4);
+      ip_jit_emit_u8(buf, 0xf0);
+      ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RDX, IP_JIT_RDI);
+      ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_JIT_RSI);
+      ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RCX, IP_JIT_RDX);
+      ip_jit_mov_imm(buf, IP_JIT_RAX, (int64_t)(intptr_t)ip_opt_ic_fill);
+      ip_jit_call_reg(buf, IP_JIT_RAX);
+      ip_jit_op_reg(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RBP, IP_JIT_RSP);
+      ip_jit_pop(buf, IP_JIT_RBP);
+      ip_jit_pop(buf, IP_JIT_RCX);
+      ip_jit_link(buf, full, buf->len);
+      ip_jit_call_mem(buf, IP_JIT_RCX, offsetof(struct ip_proc, code));
+
+      for (j = 0; j < IP_OPT_IC_SIZE; j++) {
+        ip_jit_link(buf, done[j], buf->len);
+      }
+      if (proc->nargs) {
+        ip_jit_op_imm(buf, IP_JIT_EXT_SUB, IP_OPT_BASE, 8 * proc->nargs);
+      }
+      ip_opt_emit_store(buf, v->loc, IP_JIT_RAX);
+      if (nframe) {
+        ip_opt_emit_call_deopt(ir, e, v, nargs, miss);
+      }
+      break;
+    }
+    case IP_IR_DEOPT: {
+      size_t j;
+
+      /* hand the frame back to the interpreter */
+      for (j = 0; j < v->nops; j++) {
+        ip_opt_emit_frame_store(
+          ir, buf, 8 * (int32_t)j, ir->ops[v->first + j]);
+      }
+      ip_jit_op_mem(
+        buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_OPT_BASE, 8 * (int32_t)v->nops);
+      ip_jit_op_mem(
+        buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(sp));
+#ifdef IP_VM_TIERED
+      ip_jit_mov_mem_imm(
+        buf, IP_OPT_VM, IP_OPT_VM_FIELD(resume), (int32_t)v->k);
+#endif
+      break;
+    }
+    default: {
+      /* phis are moves on the edges, constants are immediates */
+      break;
+    }
+  }
+}
+
+/* the next reachable block after `b`, where falling through leads */
+static size_t
+ip_ir_next_block(struct ip_ir* ir, size_t b)
+{
+  for (b++; b < ir->nblocks; b++) {
+    if (ir->blocks[b].reachable) {
+      return b;
+    }
+  }
+  return IP_IR_NONE;
+}
+
+static void
+ip_opt_emit_term(struct ip_ir* ir, struct ip_opt_emitter* e, size_t b)
+{
+  struct ip_ir_block* blk = &ir->blocks[b];
+  struct ip_jit_buf* buf = &e->buf;
+  size_t next = ip_ir_next_block(ir, b);
+
+  switch (blk->term) {
+    case IP_IR_TERM_JUMP: {
+      ip_opt_emit_edge(ir, buf, b, blk->succs[0], e->moves);
+      if (blk->succs[0] != next) {
+        ip_opt_jump_to(e, ip_jit_jmp(buf), blk->succs[0]);
+      }
+      break;
+    }
+    case IP_IR_TERM_JUMP_IF_ZERO:
+    case IP_IR_TERM_JUMP_IF_NEG: {
+      enum ip_jit_cond cc;
+      size_t taken, skip = 0;
+
+      if (blk->fused) {
+        struct ip_ir_value* c = &ir->values[blk->cond];
+        struct ip_opt_loc a = ip_opt_loc_of(ir, ir->ops[c->first]);
+        int r = IP_OPT_LOC_REG == a.kind ? a.r : IP_JIT_RAX;
+
+        /* cmp sets the flags as the sub would */
+        ip_opt_emit_load(buf, r, a);
+        ip_opt_emit_arith(buf,
+                          IP_JIT_OP_CMP_RM_R,
+                          IP_JIT_OP_CMP_R_RM,
+                          IP_JIT_EXT_CMP,
+                          r,
+                          ip_opt_loc_of(ir, ir->ops[c->first + 1]));
+        cc = IP_IR_TERM_JUMP_IF_ZERO == blk->term ? IP_JIT_CC_E : IP_JIT_CC_S;
+      } else {
+        struct ip_opt_loc c = ip_opt_loc_of(ir, blk->cond);
+
+        if (IP_OPT_LOC_SLOT == c.kind) {
+          ip_jit_op_mem_imm(buf, IP_JIT_EXT_CMP, IP_JIT_RSP, 8 * c.r, 0);
+        } else {
+          int r = IP_OPT_LOC_REG == c.kind ? c.r : IP_JIT_RAX;
+
+          ip_opt_emit_load(buf, r, c);
+          ip_jit_op_reg(buf, IP_JIT_OP_TEST_RM_R, r, r);
+        }
+        cc = IP_IR_TERM_JUMP_IF_ZERO == blk->term ? IP_JIT_CC_E : IP_JIT_CC_L;
+      }
+
+      if (ip_opt_edge_moves(ir, b, blk->succs[0], e->moves)) {
+        /* the moves of the taken edge are done after the fall through */
+        cc ^= 1;
+        skip = ip_jit_jcc(buf, cc);
+        ip_opt_emit_edge(ir, buf, b, blk->succs[0], e->moves);
+        ip_opt_jump_to(e, ip_jit_jmp(buf), blk->succs[0]);
+        ip_jit_link(buf, skip, buf->len);
+      } else {
+        taken = ip_jit_jcc(buf, cc);
+        ip_opt_jump_to(e, taken, blk->succs[0]);
+      }
+      ip_opt_emit_edge(ir, buf, b, blk->succs[1], e->moves);
+      if (blk->succs[1] != next) {
+        ip_opt_jump_to(e, ip_jit_jmp(buf), blk->succs[1]);
+      }
+      break;
+    }
+    case IP_IR_TERM_RETURN: {
+      ip_opt_emit_load(buf, IP_JIT_RAX, ip_opt_loc_of(ir, blk->cond));
+      ip_opt_emit_epilogue(ir, e);
+      break;
+    }
+    case IP_IR_TERM_EXIT: {
+      ip_opt_emit_load(buf, IP_JIT_RAX, ip_opt_loc_of(ir, blk->cond));
+      ip_jit_op_mem(buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_BASE, 0);
+      ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_OPT_BASE, 8);
+      ip_jit_op_mem(
+        buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(sp));
+      ip_opt_emit_leave(buf, 0);
+      break;
+    }
+    case IP_IR_TERM_DEOPT: {
+      /* the DEOPT value wrote the frame back */
+      ip_opt_emit_leave(buf, IP_OPT_DEOPT);
+      break;
+    }
+    default: {
+      e->errors[e->nerrors++] = ip_jit_jmp(buf);
+      break;
+    }
+  }
+}
+
+static int
+ip_opt_emit(struct ip_ir* ir, int used)
+{
+  struct ip_proc* proc = ir->proc;
+  struct ip_opt_emitter e;
+  size_t b, i, err, nbranches = 0, nics = 0;
+
+  /* bound the branches: per block two jumps, per value five checks */
+  nbranches = 2 * ir->nblocks + 5 * ir->nvalues + 2;
+  e.used = used;
+  e.nerrors = 0;
+  e.njumps = 0;
+  e.errors = malloc(nbranches * sizeof(size_t));
+  e.jumps = malloc(nbranches * sizeof(size_t));
+  e.jump_targets = malloc(nbranches * sizeof(size_t));
+  e.moves = malloc((ir->nvars + 1) * sizeof(struct ip_opt_move));
+  proc->calls = malloc((ir->nvalues + 1) * sizeof(struct ip_call_site));
+  proc->ncalls = 0;
+  for (i = 0; i < ir->nvalues; i++) {
+    nics += ir->values[i].live && IP_IR_CALL_INDIRECT == ir->values[i].op;
+  }
+  /* the code points to them, they stay with the proc */
+  proc->ics = malloc((nics + 1) * sizeof(struct ip_opt_ic));
+  proc->nics = 0;
+  if (NULL == e.errors || NULL == e.jumps || NULL == e.jump_targets ||
+      NULL == e.moves || NULL == proc->calls || NULL == proc->ics ||
+      ip_jit_buf_init(&e.buf)) {
+    free(e.errors);
+    free(e.jumps);
+    free(e.jump_targets);
+    free(e.moves);
+    free(proc->calls);
+    free(proc->ics);
+    proc->calls = NULL;
+    proc->ics = NULL;
+    return 1;
+  }
+#ifdef IP_OPT_IC_STATS
+  memset(proc->ics, 0, (nics + 1) * sizeof(struct ip_opt_ic));
+#endif
+
+  /* prologue */
+  ip_jit_op_mem(&e.buf,
+                IP_JIT_OP_CMP_R_RM,
+                IP_JIT_RSP,
+                IP_OPT_VM,
+                IP_OPT_VM_FIELD(rsp_limit));
+  e.errors[e.nerrors++] = ip_jit_jcc(&e.buf, IP_JIT_CC_B);
+  for (i = 0; i < IP_OPT_NCALLEE_SAVED; i++) {
+    if (used & (1 << ip_opt_callee_saved[i])) {
+      ip_jit_push(&e.buf, ip_opt_callee_saved[i]);
+    }
+  }
+  if (ir->nslots) {
+    ip_jit_op_imm(&e.buf, IP_JIT_EXT_SUB, IP_JIT_RSP, 8 * ir->nslots);
+  }
+
+  for (b = 0; b < ir->nblocks; b++) {
+    struct ip_ir_block* blk = &ir->blocks[b];
+
+    if (!blk->reachable) {
+      continue;
+    }
+    blk->label = e.buf.len;
+    for (i = blk->first; i < blk->last; i++) {
+      if (ir->values[i].live) {
+        ip_opt_emit_value(ir, &e, i);
+      }
+    }
+    ip_opt_emit_term(ir, &e, b);
+  }
+
+  /* overflows and bad calls end here, as well as unlinked calls */
+  err = e.buf.len;
+  ip_opt_emit_leave(&e.buf, 1);
+
+  for (i = 0; i < e.nerrors; i++) {
+    ip_jit_link(&e.buf, e.errors[i], err);
+  }
+  for (i = 0; i < e.njumps; i++) {
+    ip_jit_link(&e.buf, e.jumps[i], ir->blocks[e.jump_targets[i]].label);
+  }
+  for (i = 0; i < proc->ncalls; i++) {
+    ip_jit_link(&e.buf, proc->calls[i].offset, err);
+  }
+
+  proc->code = ip_jit_place(&e.buf);
+  for (i = 0; NULL != proc->code && i < proc->nics; i++) {
+    proc->ics[i].code = proc->code;
+    ip_opt_ic_flush(&proc->ics[i]);
+  }
+
+  ip_jit_buf_dtor(&e.buf);
+  free(e.errors);
+  free(e.jumps);
+  free(e.jump_targets);
+  free(e.moves);
+  if (NULL == proc->code) {
+    free(proc->calls);
+    free(proc->ics);
+    proc->calls = NULL;
+    proc->ics = NULL;
+    proc->nics = 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void
+ip_ir_dtor(struct ip_ir* ir)
+{
+  size_t i;
+
+  for (i = 0; i < ir->nblocks; i++) {
+    free(ir->blocks[i].preds);
+    free(ir->blocks[i].out);
+    free(ir->blocks[i].live_in);
+  }
+  free(ir->blocks);
+  free(ir->values);
+  free(ir->ops);
+}
+
+/**
+ * compile `proc`, entering at `entry` for OSR code, if its callees are known.
+ * returns 0 on success, 1 on malformed code and -1 if a callee is missing.
+ */
+static int
+ip_opt_compile(struct ip_proc* proc, struct ip_vm* vm, size_t entry)
+{
+  struct ip_ir ir;
+  size_t* depths;
+  size_t max_depth;
+  int ret, used;
+
+  depths = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == depths) {
+    return 1;
+  }
+  ret = ip_compute_depths(proc, vm, depths, &max_depth);
+  if (ret) {
+    free(depths);
+    return ret;
+  }
+#ifdef IP_VM_TIERED
+  if (IP_IR_NONE != entry && entry < proc->ninsts) {
+    proc->osr_nlive = proc->nargs + proc->nlocals + depths[entry];
+  }
+#endif
+
+  memset(&ir, 0, sizeof(ir));
+  ir.proc = proc;
+  ir.vm = vm;
+  ir.entry = entry;
+  ir.nvars = proc->nargs + proc->nlocals + max_depth;
+
+  ret = ip_ir_build_cfg(&ir, depths) || ip_ir_build_ssa(&ir) ||
+        ip_ir_optimize(&ir) || ip_ir_live_ranges(&ir) ||
+        ip_ir_allocate(&ir, &used) || ip_opt_emit(&ir, used);
+
+  ip_ir_dtor(&ir);
+  free(depths);
+  return ret;
+}
+
+static int
+ip_proc_compile(struct ip_proc* proc, struct ip_vm* vm)
+{
+  return ip_opt_compile(proc, vm, IP_IR_NONE);
+}
+
+static int
+ip_opt_init_trampoline(void)
+{
+  struct ip_jit_buf buf;
+  size_t out;
+  unsigned char* code;
+
+  if (NULL != ip_opt_trampoline) {
+    return 0;
+  }
+
+  if (ip_jit_buf_init(&buf)) {
+    return 1;
+  }
+
+  ip_jit_push(&buf, IP_JIT_RBX);
+  ip_jit_push(&buf, IP_JIT_RBP);
+  ip_jit_push(&buf, IP_JIT_R12);
+  ip_jit_push(&buf, IP_JIT_R13);
+  ip_jit_push(&buf, IP_JIT_R14);
+  ip_jit_push(&buf, IP_JIT_R15);
+  /* mov r14, rdi */
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RDI, IP_OPT_VM);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_OPT_BASE, IP_OPT_VM, IP_OPT_VM_FIELD(base));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_OPT_LIMIT, IP_OPT_VM, IP_OPT_VM_FIELD(limit));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RSP, IP_OPT_VM, IP_OPT_VM_FIELD(rsp));
+  ip_jit_call_reg(&buf, IP_JIT_RSI);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(result));
+  ip_jit_mov_imm(&buf, IP_JIT_RAX, IP_OPT_RETURNED);
+  out = buf.len;
+  ip_jit_pop(&buf, IP_JIT_R15);
+  ip_jit_pop(&buf, IP_JIT_R14);
+  ip_jit_pop(&buf, IP_JIT_R13);
+  ip_jit_pop(&buf, IP_JIT_R12);
+  ip_jit_pop(&buf, IP_JIT_RBP);
+  ip_jit_pop(&buf, IP_JIT_RBX);
+  ip_jit_ret(&buf);
+
+  code = ip_jit_place(&buf);
+  ip_jit_buf_dtor(&buf);
+  if (NULL == code) {
+    return 1;
+  }
+
+  ip_opt_trampoline = (ip_opt_trampoline_t)(void*)code;
+  ip_opt_trampoline_out = code + out;
+
+  if (ip_jit_buf_init(&buf)) {
+    return 1;
+  }
+  ip_opt_emit_leave(&buf, 1);
+  ip_opt_fail = ip_jit_place(&buf);
+  ip_jit_buf_dtor(&buf);
+  if (NULL == ip_opt_fail) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * run `code` with its args at `base`. returns 0 on EXIT, 1 on errors and
+ * IP_OPT_RETURNED with the result in vm->result if it returned.
+ */
+static int
+ip_opt_call(struct ip_vm* vm, unsigned char* code, ip_value_t* base)
+{
+  void* rsp = vm->rsp;
+  int ret;
+
+  vm->base = base;
+  ret = ip_opt_trampoline(vm, code);
+  /* an enclosing trampoline may be left next */
+  vm->rsp = rsp;
+
+  return ret;
+}
+
+#ifdef IP_VM_TIERED
+static unsigned char* ip_tier_emit_stub(struct ip_proc* proc);
+#endif
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  if (ip_opt_init_trampoline()) {
+    return 1;
+  }
+
+  /* TAIL_CALL runs as CALL; RETURN */
+  if (ip_tail_call_lower(insts, ninsts, &proc->insts, &ninsts)) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+  proc->code = NULL;
+  proc->ncalls = 0;
+  proc->calls = NULL;
+  proc->nics = 0;
+  proc->ics = NULL;
+
+#ifdef IP_VM_TIERED
+  /* compiled when it gets hot */
+  proc->tier = 0;
+  proc->call_count = 0;
+  proc->loop_count = 0;
+  proc->osr_entry = IP_TIER_NO_OSR;
+  proc->osr_nlive = 0;
+  proc->osr_code = NULL;
+  proc->osr_ncalls = 0;
+  proc->osr_calls = NULL;
+  proc->osr_nics = 0;
+  proc->osr_ics = NULL;
+  proc->stub = ip_tier_emit_stub(proc);
+  proc->code = proc->stub;
+  if (NULL == proc->stub) {
+    free(proc->insts);
+    return 1;
+  }
+  return 0;
+#else
+  /* procs with direct calls wait for their callees to be registered */
+  return 0 < ip_proc_compile(proc, NULL);
+#endif
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  /* the code stays in the arena */
+  free(proc->insts);
+  free(proc->calls);
+  free(proc->ics);
+#ifdef IP_VM_TIERED
+  free(proc->osr_calls);
+  free(proc->osr_ics);
+#endif
+}
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  vm->callstack = malloc(1024 * sizeof(ip_callinfo_t));
+  if (NULL == vm->callstack) {
+    return 1;
+  }
+  vm->csp = vm->callstack;
+  vm->climit = vm->callstack + 1024;
+
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->owned = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+/* point the calls in `code` to their callees */
+static void
+ip_opt_link_calls(struct ip_vm* vm,
+                  unsigned char* code,
+                  struct ip_call_site* calls,
+                  size_t ncalls)
+{
+  size_t i;
+
+  for (i = 0; i < ncalls; i++) {
+    struct ip_call_site* site = &calls[i];
+    struct ip_proc* callee;
+
+    if (site->ref < 0 || (size_t)site->ref >= vm->nprocs) {
+      continue;
+    }
+    callee = vm->procs[site->ref];
+    /* a callee waiting for its own callees fails the call */
+    ip_jit_link_abs(code + site->offset,
+                    NULL != callee && NULL != callee->code ? callee->code
+                                                           : ip_opt_fail);
+  }
+}
+
+/* point the calls of the filled cache entries to the code of their procs */
+static void
+ip_opt_link_ics(struct ip_opt_ic* ics, size_t nics)
+{
+  size_t i, j;
+
+  for (i = 0; i < nics; i++) {
+    for (j = 0; j < ics[i].n && j < IP_OPT_IC_SIZE; j++) {
+      ip_jit_link_abs(ics[i].code + ics[i].calls[j], ics[i].procs[j]->code);
+    }
+  }
+}
+
+/* point the calls of `proc` to their callees */
+static void
+ip_vm_link(struct ip_vm* vm, struct ip_proc* proc)
+{
+  ip_opt_link_calls(vm, proc->code, proc->calls, proc->ncalls);
+  ip_opt_link_ics(proc->ics, proc->nics);
+#ifdef IP_VM_TIERED
+  if (NULL != proc->osr_code) {
+    ip_opt_link_calls(vm, proc->osr_code, proc->osr_calls, proc->osr_ncalls);
+    ip_opt_link_ics(proc->osr_ics, proc->osr_nics);
+  }
+#endif
+}
+
+/* empty every inline cache, when a cached proc is replaced */
+static void
+ip_vm_flush_ics(struct ip_vm* vm)
+{
+  size_t i, j;
+
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+
+    if (NULL == p) {
+      continue;
+    }
+    for (j = 0; j < p->nics; j++) {
+      ip_opt_ic_flush(&p->ics[j]);
+    }
+#ifdef IP_VM_TIERED
+    for (j = 0; j < p->osr_nics; j++) {
+      ip_opt_ic_flush(&p->osr_ics[j]);
+    }
+#endif
+  }
+}
+
+/* whether `proc` calls the proc at `ref` directly or through a constant */
+static int
+ip_proc_calls(struct ip_proc* proc, ip_proc_ref_t ref)
+{
+  size_t i;
+
+  for (i = 0; i < proc->ninsts; i++) {
+    if ((IP_CODE_CALL == proc->insts[i].code && ref == proc->insts[i].u.p) ||
+        (IP_CODE_CALL_INDIRECT == proc->insts[i].code &&
+         ref == ip_call_indirect_callee(proc->insts, proc->ninsts, i))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* drop the code of `proc`, laid out for the arity of a replaced callee */
+static void
+ip_proc_discard_code(struct ip_proc* proc)
+{
+  /* the code is not running, nothing points to its caches after linking */
+  free(proc->calls);
+  free(proc->ics);
+  proc->ncalls = 0;
+  proc->calls = NULL;
+  proc->nics = 0;
+  proc->ics = NULL;
+#ifdef IP_VM_TIERED
+  free(proc->osr_calls);
+  free(proc->osr_ics);
+  proc->osr_entry = IP_TIER_NO_OSR;
+  proc->osr_code = NULL;
+  proc->osr_ncalls = 0;
+  proc->osr_calls = NULL;
+  proc->osr_nics = 0;
+  proc->osr_ics = NULL;
+  /* back in the interpreter until it gets hot again */
+  proc->code = proc->stub;
+  proc->tier = 0;
+  proc->call_count = 0;
+  proc->loop_count = 0;
+#else
+  proc->code = NULL;
+#endif
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  struct ip_proc* old = vm->procs[at];
+  size_t i;
+
+  if (NULL != old) {
+    ip_vm_flush_ics(vm);
+  }
+  vm->procs[at] = proc;
+
+  /* the callers of the proc it replaces were compiled for its arity */
+  for (i = 0; NULL != old && old->nargs != proc->nargs && i < vm->nprocs;
+       i++) {
+    struct ip_proc* p = vm->procs[i];
+    if (NULL != p && ip_proc_calls(p, at)) {
+      ip_proc_discard_code(p);
+    }
+  }
+
+  /* the arity of `at` is known now */
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+    if (NULL != p && NULL == p->code) {
+      ip_proc_compile(p, vm);
+    }
+  }
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+    if (NULL != p && NULL != p->code) {
+      ip_vm_link(vm, p);
+    }
+  }
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+#ifdef IP_OPT_IC_STATS
+static void
+ip_opt_ic_dump_sites(FILE* out,
+                     size_t ref,
+                     const char* kind,
+                     struct ip_opt_ic* ics,
+                     size_t nics)
+{
+  size_t j;
+
+  for (j = 0; j < nics; j++) {
+    unsigned long n = ics[j].hits + ics[j].misses;
+
+    fprintf(out,
+            "proc %lu, %s site %lu: %lu hits, %lu misses (%.1f%% hits)\n",
+            (unsigned long)ref,
+            kind,
+            (unsigned long)j,
+            ics[j].hits,
+            ics[j].misses,
+            n ? 100.0 * ics[j].hits / n : 0.0);
+  }
+}
+
+/* hit rates of the inline caches */
+static void
+ip_opt_ic_dump(struct ip_vm* vm, FILE* out)
+{
+  size_t i;
+
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+
+    if (NULL == p) {
+      continue;
+    }
+    ip_opt_ic_dump_sites(out, i, "call", p->ics, p->nics);
+#ifdef IP_VM_TIERED
+    ip_opt_ic_dump_sites(out, i, "osr", p->osr_ics, p->osr_nics);
+#endif
+  }
+}
+#endif
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc *proc, *next;
+
+#ifdef IP_OPT_IC_STATS
+  ip_opt_ic_dump(vm, stderr);
+#endif
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  free(vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
+}
+
+#ifdef IP_VM_TIERED
+/* compile `proc` and point the calls to it at the new code */
+static void
+ip_tier_promote(struct ip_vm* vm, struct ip_proc* proc)
+{
+  size_t i;
+  int ret;
+
+  proc->code = NULL;
+  ret = ip_proc_compile(proc, vm);
+  if (ret) {
+    proc->code = proc->stub;
+    if (0 < ret) {
+      /* malformed for the compiler, it stays in the interpreter */
+      proc->tier = -1;
+    } else {
+      /* a callee is missing, try again later */
+      proc->call_count = 0;
+      proc->loop_count = 0;
+    }
+    return;
+  }
+  proc->tier = 1;
+
+  for (i = 0; i < vm->nprocs; i++) {
+    if (NULL != vm->procs[i]) {
+      ip_vm_link(vm, vm->procs[i]);
+    }
+  }
+}
+
+static void
+ip_tier_count_call(struct ip_vm* vm, struct ip_proc* proc)
+{
+  if (0 == proc->tier && IP_TIER_CALL_THRESHOLD <= ++proc->call_count) {
+    ip_tier_promote(vm, proc);
+  }
+}
+
+/**
+ * move the activation of `proc` at `base`, whose frame ends at `sp`, to the
+ * OSR code of the loop starting at `entry`. returns -1 if there is none, or
+ * the status of ip_opt_call.
+ */
+static int
+ip_tier_osr(struct ip_vm* vm,
+            struct ip_proc* proc,
+            size_t entry,
+            ip_value_t* base,
+            ip_value_t* sp)
+{
+  if (entry != proc->osr_entry) {
+    unsigned char* code = proc->code;
+    struct ip_call_site* calls = proc->calls;
+    size_t ncalls = proc->ncalls;
+    struct ip_opt_ic* ics = proc->ics;
+    size_t nics = proc->nics;
+
+    /* the compiler leaves its results in the proc */
+    free(proc->osr_calls);
+    proc->osr_entry = entry;
+    proc->osr_code = NULL;
+    proc->osr_ncalls = 0;
+    proc->osr_calls = NULL;
+    if (0 == ip_opt_compile(proc, vm, entry)) {
+      proc->osr_code = proc->code;
+      proc->osr_ncalls = proc->ncalls;
+      proc->osr_calls = proc->calls;
+      ip_opt_link_calls(vm, proc->osr_code, proc->osr_calls, proc->osr_ncalls);
+      /* OSR only starts in activations begun before the proc was compiled,
+       * so none of them runs the old OSR code and its caches can go */
+      free(proc->osr_ics);
+      proc->osr_nics = proc->nics;
+      proc->osr_ics = proc->ics;
+    }
+    proc->code = code;
+    proc->calls = calls;
+    proc->ncalls = ncalls;
+    proc->ics = ics;
+    proc->nics = nics;
+  }
+
+  /* a CALL_INDIRECT that missed its guessed arity left another depth */
+  if (NULL == proc->osr_code || (size_t)(sp - base) != proc->osr_nlive) {
+    return -1;
+  }
+  return ip_opt_call(vm, proc->osr_code, base);
+}
+
+/* whether calls to `proc` run its compiled code */
+#define IP_TIER_COMPILED(proc) (0 < (proc)->tier)
+#else
+#define IP_TIER_COMPILED(proc) (NULL != (proc)->code)
+#endif
+
+/**
+ * run `proc`, whose args are at `base`, in the interpreter. `sp` is NULL to
+ * start it, or the top of the frame written back by compiled code to resume
+ * it at `ip`. Statuses are those of ip_opt_call.
+ */
+static int
+ip_tier_run(struct ip_vm* vm,
+            struct ip_proc* proc,
+            ip_value_t* base,
+            ip_value_t* sp,
+            size_t ip,
+            ip_value_t* result)
+{
+  /* the callinfos below belong to enclosing runs */
+  ip_callinfo_t* floor = vm->csp;
+
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    if (sp >= vm->limit) {                                                     \
+      return 1;                                                                \
+    }                                                                          \
+    *sp++ = (v);                                                               \
+  } while (0)
+#define CHECK_POPS(n)                                                          \
+  do {                                                                         \
+    if ((size_t)(sp - vm->stack.data) < (n)) {                                 \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+#define RETURN(v)                                                              \
+  do {                                                                         \
+    if (vm->csp == floor) {                                                    \
+      *result = (v);                                                           \
+      return IP_OPT_RETURNED;                                                  \
+    }                                                                          \
+    base[0] = (v);                                                             \
+    sp = base + 1;                                                             \
+                                                                               \
+    vm->csp--;                                                                 \
+    ip = vm->csp->ip;                                                          \
+    base = vm->csp->base;                                                      \
+    proc = vm->csp->proc;                                                      \
+  } while (0)
+#define ENTER()                                                                \
+  do {                                                                         \
+    size_t i;                                                                  \
+                                                                               \
+    if ((size_t)(vm->limit - sp) < proc->nlocals) {                            \
+      return 1;                                                                \
+    }                                                                          \
+    for (i = 0; i < proc->nlocals; i++) {                                      \
+      *sp++ = IP_LLINT2VALUE(0);                                               \
+    }                                                                          \
+  } while (0)
+
+  if (NULL == sp) {
+    sp = base + proc->nargs;
+    ENTER();
+  }
+
+  while (1) {
+    struct ip_inst inst;
+
+    if (ip >= proc->ninsts) {
+      return 1;
+    }
+
+    inst = proc->insts[ip];
+    switch (inst.code) {
+      case IP_CODE_CONST: {
+        PUSH(inst.u.v);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        PUSH(base[inst.u.i]);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        CHECK_POPS(1);
+        base[inst.u.i] = *--sp;
+        break;
+      }
+      case IP_CODE_ADD: {
+        long long int y;
+
+        CHECK_POPS(2);
+        y = IP_VALUE2LLINT(*--sp);
+        sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) + y);
+        break;
+      }
+      case IP_CODE_SUB: {
+        long long int y;
+
+        CHECK_POPS(2);
+        y = IP_VALUE2LLINT(*--sp);
+        sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) - y);
+        break;
+      }
+      case IP_CODE_JUMP: {
+#ifdef IP_VM_TIERED
+        int ret;
+
+        if (inst.u.pos + 1 > ip) {
+          ip = inst.u.pos;
+          break;
+        }
+
+        /* a back-edge */
+        if (0 == proc->tier && IP_TIER_LOOP_THRESHOLD <= ++proc->loop_count) {
+          ip_tier_promote(vm, proc);
+        }
+        ret = 0 < proc->tier
+                ? ip_tier_osr(vm, proc, inst.u.pos + 1, base, sp)
+                : -1;
+        if (IP_OPT_DEOPT == ret) {
+          ip = vm->resume;
+          sp = vm->sp;
+          continue;
+        } else if (IP_OPT_RETURNED == ret) {
+          RETURN(vm->result);
+        } else if (0 == ret) {
+          vm->csp = floor;
+          return 0;
+        } else if (1 == ret) {
+          return 1;
+        } else {
+          ip = inst.u.pos;
+        }
+#else
+        ip = inst.u.pos;
+#endif
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO: {
+        CHECK_POPS(1);
+        if (!IP_VALUE2LLINT(*--sp)) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_JUMP_IF_NEG: {
+        CHECK_POPS(1);
+        if (IP_VALUE2LLINT(*--sp) < 0) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        ip_proc_ref_t p = inst.u.p;
+        struct ip_proc* callee;
+
+        if (IP_CODE_CALL_INDIRECT == inst.code) {
+          CHECK_POPS(1);
+          p = IP_VALUE2PROCREF(*--sp);
+        }
+        if (p < 0 || (size_t)p >= vm->nprocs || NULL == vm->procs[p]) {
+          return 1;
+        }
+        callee = vm->procs[p];
+        CHECK_POPS(callee->nargs);
+#ifdef IP_VM_TIERED
+        ip_tier_count_call(vm, callee);
+#endif
+
+        if (IP_TIER_COMPILED(callee)) {
+          int ret = ip_opt_call(vm, callee->code, sp - callee->nargs);
+
+          if (IP_OPT_RETURNED != ret) {
+            return ret;
+          }
+          sp -= callee->nargs;
+          *sp++ = vm->result;
+          break;
+        }
+
+        if (vm->csp >= vm->climit) {
+          return 1;
+        }
+        vm->csp->ip = ip;
+        vm->csp->base = base;
+        vm->csp->proc = proc;
+        vm->csp++;
+
+        proc = callee;
+        base = sp - proc->nargs;
+        ENTER();
+        ip = -1;
+        break;
+      }
+      case IP_CODE_RETURN: {
+        CHECK_POPS(1 + proc->nargs + proc->nlocals);
+        RETURN(sp[-1]);
+        break;
+      }
+      case IP_CODE_EXIT: {
+        CHECK_POPS(1 + proc->nargs + proc->nlocals);
+        base[0] = sp[-1];
+        vm->sp = base + 1;
+        vm->csp = floor;
+        return 0;
+      }
+      default: {
+        printf("code: %d, u: %d", inst.code, inst.u.i);
+        return 1;
+      }
+    }
+    ip += 1;
+  }
+
+#undef PUSH
+#undef CHECK_POPS
+#undef RETURN
+#undef ENTER
+}
+
+#ifdef IP_VM_TIERED
+/* called by the stubs. the status is left in vm->status */
+static ip_value_t
+ip_tier_enter(struct ip_vm* vm, struct ip_proc* proc, ip_value_t* base)
+{
+  ip_value_t result = 0;
+  ip_callinfo_t* csp = vm->csp;
+
+  ip_tier_count_call(vm, proc);
+  if (0 < proc->tier) {
+    vm->status = ip_opt_call(vm, proc->code, base);
+    result = vm->result;
+  } else {
+    vm->status = ip_tier_run(vm, proc, base, NULL, 0, &result);
+  }
+  vm->csp = csp;
+
+  return result;
+}
+#endif
+
+/**
+ * called by compiled code whose CALL_INDIRECT found a callee of another
+ * arity than it guessed, with the frame written back up to vm->sp. The
+ * activation goes on in the interpreter from the call at vm->resume, the
+ * status is left in vm->status.
+ */
+static ip_value_t
+ip_tier_deopt(struct ip_vm* vm, struct ip_proc* proc, ip_value_t* base)
+{
+  ip_value_t result = 0;
+  ip_callinfo_t* csp = vm->csp;
+
+  vm->status = ip_tier_run(vm, proc, base, vm->sp, vm->resume, &result);
+  vm->csp = csp;
+
+  return result;
+}
+
+#ifdef IP_VM_TIERED
+/**
+ * the code of a proc not compiled yet: call ip_tier_enter on a 16 byte
+ * aligned stack, then return its result or leave with its status.
+ */
+static unsigned char*
+ip_tier_emit_stub(struct ip_proc* proc)
+{
+  struct ip_jit_buf buf;
+  size_t leave;
+  unsigned char* code;
+
+  if (ip_jit_buf_init(&buf)) {
+    return NULL;
+  }
+
+  ip_jit_push(&buf, IP_JIT_RBP);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RSP, IP_JIT_RBP);
+  /* and rsp, -16 */
+  ip_jit_emit_u8(&buf, 0x48);
+  ip_jit_emit_u8(&buf, 0x83);
+  ip_jit_emit_u8(&buf, 0xe4);
+  ip_jit_emit_u8(&buf, 0xf0);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_OPT_VM, IP_JIT_RDI);
+  ip_jit_mov_imm(&buf, IP_JIT_RSI, (int64_t)(intptr_t)proc);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_OPT_BASE, IP_JIT_RDX);
+  ip_jit_mov_imm(&buf, IP_JIT_RAX, (int64_t)(intptr_t)ip_tier_enter);
+  ip_jit_call_reg(&buf, IP_JIT_RAX);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RBP, IP_JIT_RSP);
+  ip_jit_pop(&buf, IP_JIT_RBP);
+
+  ip_jit_op_mem_imm(&buf,
+                    IP_JIT_EXT_CMP,
+                    IP_OPT_VM,
+                    IP_OPT_VM_FIELD(status),
+                    IP_OPT_RETURNED);
+  leave = ip_jit_jcc(&buf, IP_JIT_CC_NE);
+  ip_jit_ret(&buf);
+  ip_jit_link(&buf, leave, buf.len);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_OPT_VM, IP_OPT_VM_FIELD(status));
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RSP, IP_OPT_VM, IP_OPT_VM_FIELD(rsp));
+  ip_jit_jmp_mem(&buf, IP_OPT_VM, IP_OPT_VM_FIELD(out));
+
+  code = ip_jit_place(&buf);
+  ip_jit_buf_dtor(&buf);
+
+  return code;
+}
+#endif
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  struct ip_proc* proc = vm->procs[procref];
+  ip_value_t* base;
+  int ret;
+
+  if (NULL == proc || NULL == proc->code || vm->stack.sp < proc->nargs) {
+    return 1;
+  }
+
+  base = vm->stack.data + vm->stack.sp - proc->nargs;
+  vm->limit = vm->stack.data + vm->stack.size;
+  vm->out = ip_opt_trampoline_out;
+  /* the native stack starts about here */
+  vm->rsp_limit = (char*)__builtin_frame_address(0) - IP_OPT_NATIVE_STACK;
+
+  vm->csp = vm->callstack;
+#ifdef IP_VM_TIERED
+  ip_tier_count_call(vm, proc);
+  if (0 == proc->tier || -1 == proc->tier) {
+    ret = ip_tier_run(vm, proc, base, NULL, 0, &vm->result);
+  } else {
+    ret = ip_opt_call(vm, proc->code, base);
+  }
+#else
+  ret = ip_opt_call(vm, proc->code, base);
+#endif
+
+  if (0 == ret) {
+    vm->stack.sp = vm->sp - vm->stack.data;
+  }
+
+  /* returning from the entry proc means there was no EXIT */
+  return 0 == ret ? 0 : 1;
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
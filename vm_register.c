@@ -0,0 +1,1242 @@
+#include "arena.h"
+#include "call.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * register vm.
+ * The stack code is translated to three address code working on the slots
+ * of the frame. The operand stack of the stack code becomes temporary
+ * slots after the locals, so an operand at depth d lives in slot
+ * nargs + nlocals + d. GET_LOCAL and CONST do not move anything, they are
+ * folded into the operands of the inst that consumes them, and SET_LOCAL
+ * retargets the inst that produced the value.
+ *
+ * The sum loop
+ *
+ *   GET_LOCAL n; GET_LOCAL i; SUB; JUMP_IF_NEG exit;
+ *   GET_LOCAL sum; GET_LOCAL i; ADD; SET_LOCAL sum;
+ *   GET_LOCAL i; CONST 1; ADD; SET_LOCAL i; JUMP loop
+ *
+ * becomes
+ *
+ *   JUMP_IF_SUB_NEG n, i, exit; ADD sum, sum, i; ADDK i, i, 1; JUMP loop
+ *
+ * The slots of the args of a call are fixed by the translation, see
+ * call.h. A proc with a CALL_INDIRECT whose procref is not a constant
+ * cannot have them fixed. It keeps its stack code, translated one to one
+ * to the IP_RCODE_S_ insts run on an sp. Its operand stack is where the
+ * temporaries would be, so both kinds of procs call each other.
+ */
+
+enum ip_rcode
+{
+  IP_RCODE_LOADK,
+  IP_RCODE_MOVE,
+  IP_RCODE_ADD,
+  IP_RCODE_SUB,
+  IP_RCODE_ADDK,
+  IP_RCODE_SUBK,
+  IP_RCODE_JUMP,
+  IP_RCODE_JUMP_IF_ZERO,
+  IP_RCODE_JUMP_IF_NEG,
+  IP_RCODE_JUMP_IF_SUB_NEG,
+  IP_RCODE_CALL,
+  IP_RCODE_CALL_INDIRECT,
+  IP_RCODE_TAIL_CALL,
+  IP_RCODE_RETURN,
+  IP_RCODE_EXIT,
+  IP_RCODE_END,
+  /* stack code */
+  IP_RCODE_S_ENTER,
+  IP_RCODE_S_CONST,
+  IP_RCODE_S_GET_LOCAL,
+  IP_RCODE_S_SET_LOCAL,
+  IP_RCODE_S_ADD,
+  IP_RCODE_S_SUB,
+  IP_RCODE_S_JUMP_IF_ZERO,
+  IP_RCODE_S_JUMP_IF_NEG,
+  IP_RCODE_S_CALL,
+  IP_RCODE_S_CALL_INDIRECT,
+  IP_RCODE_S_TAIL_CALL,
+  IP_RCODE_S_RETURN,
+  IP_RCODE_S_EXIT,
+};
+
+/**
+ * a, b and c are slots. For calls `a` is the slot of the first arg, which
+ * becomes the first slot of the callee frame and receives the result.
+ */
+struct ip_rinst
+{
+  enum ip_rcode code;
+  int a;
+  int b;
+  int c;
+  union
+  {
+    ip_value_t k;
+    size_t pos;
+    ip_proc_ref_t p;
+  } u;
+};
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst* insts;
+  /* the arena of the vm it was made in, or NULL. the rinsts are translated
+   * again as the callees change, they are always malloced */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+  /* args, locals and temporaries, or args and locals for stack code */
+  size_t nslots;
+  /* NULL until the callees are known */
+  size_t nrinsts;
+  struct ip_rinst* rinsts;
+};
+
+typedef struct ip_callinfo
+{
+  size_t ip;
+  size_t fp;
+  struct ip_proc* proc;
+} ip_callinfo_t;
+
+def_ip_stack(ip_callinfo_t);
+
+/**
+ * stack usage
+ *        base
+ *         v
+ *        --+----------+------------+-------------------
+ * bottom <-| args ... | locals ... | temporaries ... | -> top
+ *        --+----------+------------+-------------------
+ *
+ * a call places the frame of the callee at the slot of its first arg.
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  ip_stack(ip_callinfo_t) callstack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
+};
+
+/* translation */
+
+enum ip_operand_kind
+{
+  IP_OPERAND_TEMP,
+  IP_OPERAND_LOCAL,
+  IP_OPERAND_CONST,
+};
+
+struct ip_operand
+{
+  enum ip_operand_kind kind;
+  int i;
+  ip_value_t k;
+};
+
+struct ip_translator
+{
+  struct ip_proc* proc;
+  struct ip_rinst* out;
+  size_t nout;
+  /* index of the inst that wrote the last temp, or -1 */
+  long last_def;
+  struct ip_operand* stack;
+  size_t depth;
+};
+
+#define IP_DEPTH_UNKNOWN ((size_t)-1)
+
+static int
+ip_vm_nargs_lookup(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (NULL == vm || ref < 0 || vm->nprocs <= (size_t)ref ||
+      NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/* number of args taken by the call at insts[at], or < 0 if not known yet */
+static long
+ip_proc_call_nargs(struct ip_proc* proc, struct ip_vm* vm, size_t at)
+{
+  return ip_call_nargs(proc->insts, proc->ninsts, at, ip_vm_nargs_lookup, vm);
+}
+
+/* whether the call at insts[at] of `proc` goes to the proc at `ref` */
+static int
+ip_proc_calls(struct ip_proc* proc, size_t at, ip_proc_ref_t ref)
+{
+  switch (proc->insts[at].code) {
+    case IP_CODE_CALL:
+    case IP_CODE_TAIL_CALL:
+      return ref == proc->insts[at].u.p;
+    case IP_CODE_CALL_INDIRECT:
+      return ref == ip_call_indirect_callee(proc->insts, proc->ninsts, at);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * compute the operand stack depth before each inst.
+ * returns 0 on success, 1 on malformed code and -1 if a callee is missing.
+ */
+static int
+ip_compute_depths(struct ip_proc* proc,
+                  struct ip_vm* vm,
+                  size_t* depths,
+                  size_t* max_depth)
+{
+  size_t* work;
+  size_t nwork = 0, i;
+
+  work = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == work) {
+    return 1;
+  }
+
+  for (i = 0; i < proc->ninsts; i++) {
+    depths[i] = IP_DEPTH_UNKNOWN;
+  }
+  *max_depth = 0;
+
+#define FLOW(to, d)                                                            \
+  do {                                                                         \
+    size_t to_ = (to), d_ = (d);                                               \
+    if (to_ >= proc->ninsts) {                                                 \
+      /* runs into END */                                                      \
+      break;                                                                   \
+    }                                                                          \
+    if (IP_DEPTH_UNKNOWN == depths[to_]) {                                     \
+      depths[to_] = d_;                                                        \
+      work[nwork++] = to_;                                                     \
+    } else if (depths[to_] != d_) {                                            \
+      free(work);                                                              \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+  if (proc->ninsts) {
+    depths[0] = 0;
+    work[nwork++] = 0;
+  }
+
+  while (nwork) {
+    size_t at = work[--nwork];
+    size_t d = depths[at];
+    struct ip_inst* inst = &proc->insts[at];
+    long pops = 0, pushes = 0;
+    int falls = 1;
+
+    switch (inst->code) {
+      case IP_CODE_CONST:
+      case IP_CODE_GET_LOCAL:
+        pushes = 1;
+        break;
+      case IP_CODE_SET_LOCAL:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG:
+        pops = 1;
+        break;
+      case IP_CODE_ADD:
+      case IP_CODE_SUB:
+        pops = 2;
+        pushes = 1;
+        break;
+      case IP_CODE_JUMP:
+        falls = 0;
+        break;
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT:
+      case IP_CODE_TAIL_CALL: {
+        long nargs;
+        if (IP_CODE_CALL_INDIRECT == inst->code && !d) {
+          free(work);
+          return 1;
+        }
+        nargs = ip_proc_call_nargs(proc, vm, at);
+        if (nargs < 0) {
+          free(work);
+          return -1;
+        }
+        pops = nargs + (IP_CODE_CALL_INDIRECT == inst->code);
+        pushes = 1;
+        /* the callee returns to our caller */
+        falls = IP_CODE_TAIL_CALL != inst->code;
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT:
+        pops = 1;
+        falls = 0;
+        break;
+      default:
+        free(work);
+        return 1;
+    }
+
+    if ((size_t)pops > d) {
+      free(work);
+      return 1;
+    }
+    d = d - pops + pushes;
+    if (d > *max_depth) {
+      *max_depth = d;
+    }
+
+    if (IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+        IP_CODE_JUMP_IF_NEG == inst->code) {
+      /* jumps land after the target, as `ip` is incremented afterwards */
+      FLOW(inst->u.pos + 1, d);
+    }
+    if (falls) {
+      FLOW(at + 1, d);
+    }
+  }
+
+#undef FLOW
+
+  free(work);
+  return 0;
+}
+
+static int
+ip_slot_of(struct ip_translator* t, size_t depth)
+{
+  struct ip_operand* o = &t->stack[depth];
+
+  switch (o->kind) {
+    case IP_OPERAND_LOCAL:
+      return o->i;
+    default:
+      return t->proc->nargs + t->proc->nlocals + depth;
+  }
+}
+
+static struct ip_rinst*
+ip_emit(struct ip_translator* t, enum ip_rcode code, int a, int b, int c)
+{
+  struct ip_rinst* r = &t->out[t->nout++];
+
+  r->code = code;
+  r->a = a;
+  r->b = b;
+  r->c = c;
+  r->u.k = 0;
+  t->last_def = -1;
+  return r;
+}
+
+/* move the operand at `depth` to its temp slot */
+static void
+ip_materialize(struct ip_translator* t, size_t depth)
+{
+  struct ip_operand* o = &t->stack[depth];
+  int slot = t->proc->nargs + t->proc->nlocals + depth;
+
+  if (IP_OPERAND_LOCAL == o->kind) {
+    ip_emit(t, IP_RCODE_MOVE, slot, o->i, 0);
+  } else if (IP_OPERAND_CONST == o->kind) {
+    ip_emit(t, IP_RCODE_LOADK, slot, 0, 0)->u.k = o->k;
+  }
+  o->kind = IP_OPERAND_TEMP;
+}
+
+static void
+ip_materialize_all(struct ip_translator* t)
+{
+  size_t i;
+
+  for (i = 0; i < t->depth; i++) {
+    ip_materialize(t, i);
+  }
+}
+
+static void
+ip_emit_arith(struct ip_translator* t, enum ip_code code)
+{
+  struct ip_operand* x = &t->stack[t->depth - 2];
+  struct ip_operand* y = &t->stack[t->depth - 1];
+  int dst = t->proc->nargs + t->proc->nlocals + t->depth - 2;
+  int add = IP_CODE_ADD == code;
+
+  if (IP_OPERAND_CONST == x->kind && IP_OPERAND_CONST == y->kind) {
+    unsigned long long int ux = x->k, uy = y->k;
+    x->k = IP_LLINT2VALUE(add ? ux + uy : ux - uy);
+    t->depth--;
+    return;
+  }
+
+  if (IP_OPERAND_CONST == y->kind) {
+    ip_emit(t, add ? IP_RCODE_ADDK : IP_RCODE_SUBK, dst, ip_slot_of(t, t->depth - 2), 0)
+      ->u.k = y->k;
+  } else if (IP_OPERAND_CONST == x->kind && add) {
+    ip_emit(t, IP_RCODE_ADDK, dst, ip_slot_of(t, t->depth - 1), 0)->u.k = x->k;
+  } else {
+    if (IP_OPERAND_CONST == x->kind) {
+      ip_materialize(t, t->depth - 2);
+    }
+    ip_emit(t,
+            add ? IP_RCODE_ADD : IP_RCODE_SUB,
+            dst,
+            ip_slot_of(t, t->depth - 2),
+            ip_slot_of(t, t->depth - 1));
+  }
+
+  t->depth--;
+  x->kind = IP_OPERAND_TEMP;
+  t->last_def = t->nout - 1;
+}
+
+/* keep the stack code of `proc`, the callees are looked up as it runs */
+static int
+ip_proc_translate_stack(struct ip_proc* proc)
+{
+  static const enum ip_rcode codes[] = {
+    IP_RCODE_S_CONST,        IP_RCODE_S_GET_LOCAL,    IP_RCODE_S_SET_LOCAL,
+    IP_RCODE_S_ADD,          IP_RCODE_S_SUB,          IP_RCODE_JUMP,
+    IP_RCODE_S_JUMP_IF_ZERO, IP_RCODE_S_JUMP_IF_NEG,  IP_RCODE_S_CALL,
+    IP_RCODE_S_CALL_INDIRECT, IP_RCODE_S_RETURN,      IP_RCODE_S_EXIT,
+    IP_RCODE_S_TAIL_CALL,
+  };
+  struct ip_rinst* out;
+  size_t i, n = proc->ninsts;
+
+  /* S_ENTER, the insts and END */
+  out = malloc((n + 2) * sizeof(struct ip_rinst));
+  if (NULL == out) {
+    return 1;
+  }
+
+  memset(out, 0, (n + 2) * sizeof(struct ip_rinst));
+  out[0].code = IP_RCODE_S_ENTER;
+  for (i = 0; i < n; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+    struct ip_rinst* r = &out[i + 1];
+
+    if (inst->code > IP_CODE_TAIL_CALL) {
+      free(out);
+      return 1;
+    }
+    r->code = codes[inst->code];
+    switch (inst->code) {
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG: {
+        /* jumps land after the target, the rinsts start with S_ENTER */
+        r->u.pos = inst->u.pos + 1 <= n ? inst->u.pos + 2 : n + 1;
+        break;
+      }
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL: {
+        r->a = inst->u.i;
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_TAIL_CALL: {
+        r->u.p = inst->u.p;
+        break;
+      }
+      default: {
+        r->u.k = inst->u.v;
+        break;
+      }
+    }
+  }
+  out[n + 1].code = IP_RCODE_END;
+
+  proc->rinsts = out;
+  proc->nrinsts = n + 2;
+  proc->nslots = proc->nargs + proc->nlocals;
+
+  return 0;
+}
+
+/**
+ * translate the stack code of `proc`.
+ * returns 0 on success, 1 on malformed code and -1 if a callee is missing.
+ */
+static int
+ip_proc_translate(struct ip_proc* proc, struct ip_vm* vm)
+{
+  struct ip_translator t;
+  size_t *depths, *rpos, i, max_depth;
+  char* targets;
+  int ret;
+
+  for (i = 0; i < proc->ninsts; i++) {
+    if (IP_CODE_CALL_INDIRECT == proc->insts[i].code &&
+        IP_CALL_UNKNOWN ==
+          ip_call_nargs(proc->insts, proc->ninsts, i, NULL, NULL)) {
+      return ip_proc_translate_stack(proc);
+    }
+  }
+
+  depths = malloc((proc->ninsts + 1) * sizeof(size_t));
+  rpos = malloc((proc->ninsts + 1) * sizeof(size_t));
+  if (NULL == depths || NULL == rpos) {
+    free(depths);
+    free(rpos);
+    return 1;
+  }
+
+  ret = ip_compute_depths(proc, vm, depths, &max_depth);
+  if (ret) {
+    free(depths);
+    free(rpos);
+    return ret;
+  }
+
+  targets = calloc(proc->ninsts + 1, sizeof(char));
+  if (NULL == targets) {
+    free(depths);
+    free(rpos);
+    return 1;
+  }
+  for (i = 0; i < proc->ninsts; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+    if ((IP_CODE_JUMP == inst->code || IP_CODE_JUMP_IF_ZERO == inst->code ||
+         IP_CODE_JUMP_IF_NEG == inst->code) &&
+        inst->u.pos + 1 < proc->ninsts) {
+      targets[inst->u.pos + 1] = 1;
+    }
+  }
+
+  /* every stack inst gives at most one inst per operand plus itself */
+  t.proc = proc;
+  t.out = malloc((proc->ninsts * (max_depth + 2) + 1) * sizeof(struct ip_rinst));
+  t.stack = malloc((max_depth + 1) * sizeof(struct ip_operand));
+  t.nout = 0;
+  t.depth = 0;
+  t.last_def = -1;
+  if (NULL == t.out || NULL == t.stack) {
+    free(depths);
+    free(rpos);
+    free(targets);
+    free(t.out);
+    free(t.stack);
+    return 1;
+  }
+
+  for (i = 0; i < proc->ninsts; i++) {
+    struct ip_inst* inst = &proc->insts[i];
+
+    if (IP_DEPTH_UNKNOWN == depths[i]) {
+      /* unreachable */
+      rpos[i] = t.nout;
+      continue;
+    }
+
+    if (targets[i]) {
+      /* a jump target is entered with everything in temps */
+      size_t j;
+      if (i && IP_DEPTH_UNKNOWN != depths[i - 1] &&
+          IP_CODE_JUMP != proc->insts[i - 1].code &&
+          IP_CODE_RETURN != proc->insts[i - 1].code &&
+          IP_CODE_EXIT != proc->insts[i - 1].code) {
+        ip_materialize_all(&t);
+      }
+      t.depth = depths[i];
+      for (j = 0; j < t.depth; j++) {
+        t.stack[j].kind = IP_OPERAND_TEMP;
+      }
+      t.last_def = -1;
+    }
+
+    rpos[i] = t.nout;
+
+    switch (inst->code) {
+      case IP_CODE_CONST: {
+        struct ip_operand* o = &t.stack[t.depth++];
+        o->kind = IP_OPERAND_CONST;
+        o->k = inst->u.v;
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        struct ip_operand* o = &t.stack[t.depth++];
+        o->kind = IP_OPERAND_LOCAL;
+        o->i = inst->u.i;
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        struct ip_operand* o = &t.stack[--t.depth];
+        size_t j;
+        int reads_local = 0;
+
+        /* pending reads of the local must see the old value */
+        for (j = 0; j < t.depth; j++) {
+          if (IP_OPERAND_LOCAL == t.stack[j].kind && inst->u.i == t.stack[j].i) {
+            ip_materialize(&t, j);
+            reads_local = 1;
+          }
+        }
+
+        if (IP_OPERAND_TEMP == o->kind && !reads_local && 0 <= t.last_def &&
+            (size_t)t.last_def == t.nout - 1 &&
+            t.out[t.last_def].a == ip_slot_of(&t, t.depth)) {
+          t.out[t.last_def].a = inst->u.i;
+        } else if (IP_OPERAND_CONST == o->kind) {
+          ip_emit(&t, IP_RCODE_LOADK, inst->u.i, 0, 0)->u.k = o->k;
+        } else {
+          ip_emit(&t, IP_RCODE_MOVE, inst->u.i, ip_slot_of(&t, t.depth), 0);
+        }
+        t.last_def = -1;
+        break;
+      }
+      case IP_CODE_ADD:
+      case IP_CODE_SUB: {
+        ip_emit_arith(&t, inst->code);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        ip_materialize_all(&t);
+        ip_emit(&t, IP_RCODE_JUMP, 0, 0, 0)->u.pos = inst->u.pos + 1;
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG: {
+        struct ip_operand* o = &t.stack[--t.depth];
+        long def = t.last_def;
+        int slot = ip_slot_of(&t, t.depth);
+        size_t before = t.nout;
+
+        if (IP_OPERAND_CONST == o->kind) {
+          long long int v = IP_VALUE2LLINT(o->k);
+          ip_materialize_all(&t);
+          if (IP_CODE_JUMP_IF_ZERO == inst->code ? !v : v < 0) {
+            ip_emit(&t, IP_RCODE_JUMP, 0, 0, 0)->u.pos = inst->u.pos + 1;
+          }
+          break;
+        }
+
+        ip_materialize_all(&t);
+        if (IP_CODE_JUMP_IF_NEG == inst->code && IP_OPERAND_TEMP == o->kind &&
+            0 <= def && (size_t)def == before - 1 && before == t.nout &&
+            IP_RCODE_SUB == t.out[def].code && t.out[def].a == slot) {
+          /* the difference is only used by the branch */
+          t.out[def].code = IP_RCODE_JUMP_IF_SUB_NEG;
+          t.out[def].a = t.out[def].b;
+          t.out[def].b = t.out[def].c;
+          t.out[def].u.pos = inst->u.pos + 1;
+        } else {
+          ip_emit(&t,
+                  IP_CODE_JUMP_IF_ZERO == inst->code ? IP_RCODE_JUMP_IF_ZERO
+                                                     : IP_RCODE_JUMP_IF_NEG,
+                  slot,
+                  0,
+                  0)
+            ->u.pos = inst->u.pos + 1;
+        }
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT:
+      case IP_CODE_TAIL_CALL: {
+        long nargs;
+        int ref_slot = 0;
+        struct ip_rinst* r;
+
+        if (IP_CODE_CALL_INDIRECT == inst->code) {
+          struct ip_operand* o = &t.stack[t.depth - 1];
+          if (IP_OPERAND_CONST == o->kind) {
+            ip_materialize(&t, t.depth - 1);
+          }
+          ref_slot = ip_slot_of(&t, t.depth - 1);
+          t.depth--;
+        }
+        nargs = ip_proc_call_nargs(proc, vm, i);
+        ip_materialize_all(&t);
+
+        r = ip_emit(&t,
+                    IP_CODE_CALL == inst->code        ? IP_RCODE_CALL
+                    : IP_CODE_TAIL_CALL == inst->code ? IP_RCODE_TAIL_CALL
+                                                      : IP_RCODE_CALL_INDIRECT,
+                    proc->nargs + proc->nlocals + t.depth - nargs,
+                    ref_slot,
+                    nargs);
+        r->u.p = inst->u.p;
+
+        t.depth -= nargs;
+        t.stack[t.depth++].kind = IP_OPERAND_TEMP;
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT: {
+        t.depth--;
+        /* a constant has no slot yet */
+        if (IP_OPERAND_CONST == t.stack[t.depth].kind) {
+          ip_materialize(&t, t.depth);
+        }
+        ip_emit(&t,
+                IP_CODE_RETURN == inst->code ? IP_RCODE_RETURN : IP_RCODE_EXIT,
+                ip_slot_of(&t, t.depth),
+                0,
+                0);
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+  }
+
+  /* falling off the end, or jumping there */
+  if (proc->ninsts && IP_DEPTH_UNKNOWN != depths[proc->ninsts - 1]) {
+    ip_materialize_all(&t);
+  }
+  rpos[proc->ninsts] = t.nout;
+  ip_emit(&t, IP_RCODE_END, 0, 0, 0);
+
+  for (i = 0; i < t.nout; i++) {
+    enum ip_rcode code = t.out[i].code;
+    if (IP_RCODE_JUMP == code || IP_RCODE_JUMP_IF_ZERO == code ||
+        IP_RCODE_JUMP_IF_NEG == code || IP_RCODE_JUMP_IF_SUB_NEG == code) {
+      size_t pos = t.out[i].u.pos;
+      t.out[i].u.pos = rpos[pos <= proc->ninsts ? pos : proc->ninsts];
+    }
+  }
+
+  proc->rinsts = t.out;
+  proc->nrinsts = t.nout;
+  proc->nslots = proc->nargs + proc->nlocals + max_depth;
+
+  free(depths);
+  free(rpos);
+  free(targets);
+  free(t.stack);
+
+  return 0;
+}
+
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
+{
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  proc->arena = arena;
+  proc->insts = ip_arena_alloc(arena, ninsts * sizeof(struct ip_inst));
+  if (NULL == proc->insts) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+  proc->rinsts = NULL;
+  proc->nrinsts = 0;
+  memcpy(proc->insts, insts, ninsts * sizeof(struct ip_inst));
+  ip_tail_call_rewrite(proc->insts, ninsts);
+
+  /* procs with direct calls wait for their callees to be registered */
+  return 0 < ip_proc_translate(proc, NULL);
+}
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  ip_arena_release(proc->arena, proc->insts);
+  free(proc->rinsts);
+}
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  ret = ip_stack_init(ip_callinfo_t, &vm->callstack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
+  vm->nprocs = 0;
+  vm->procs = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  return ip_stack_limit(ip_value_t, &vm->stack, nvalues) ||
+         ip_stack_limit(ip_callinfo_t, &vm->callstack, ncalls);
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  size_t i, j;
+
+  /* the callers of the proc it replaces are translated for its arity */
+  for (i = 0; NULL != vm->procs[at] && i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+    for (j = 0; NULL != p && NULL != p->rinsts && j < p->ninsts; j++) {
+      if (ip_proc_calls(p, j, at)) {
+        free(p->rinsts);
+        p->rinsts = NULL;
+        p->nrinsts = 0;
+      }
+    }
+  }
+
+  vm->procs[at] = proc;
+
+  /* the arity of `at` is known now */
+  for (i = 0; i < vm->nprocs; i++) {
+    struct ip_proc* p = vm->procs[i];
+    if (NULL != p && NULL == p->rinsts) {
+      ip_proc_translate(p, vm);
+    }
+  }
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc* proc;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  size_t pc = 0;
+  ip_value_t* base;
+  /* the top of the operand stack of stack code */
+  ip_value_t* sp = NULL;
+  ip_value_t* end = vm->stack.data + vm->stack.size;
+  struct ip_proc* proc;
+  struct ip_proc* callee;
+  struct ip_rinst* r;
+  ip_value_t v;
+  static void* labels[] = {
+    &&L_LOADK,           &&L_MOVE,
+    &&L_ADD,             &&L_SUB,
+    &&L_ADDK,            &&L_SUBK,
+    &&L_JUMP,            &&L_JUMP_IF_ZERO,
+    &&L_JUMP_IF_NEG,     &&L_JUMP_IF_SUB_NEG,
+    &&L_CALL,            &&L_CALL_INDIRECT,
+    &&L_TAIL_CALL,       &&L_RETURN,
+    &&L_EXIT,            &&L_END,
+    &&L_S_ENTER,         &&L_S_CONST,
+    &&L_S_GET_LOCAL,     &&L_S_SET_LOCAL,
+    &&L_S_ADD,           &&L_S_SUB,
+    &&L_S_JUMP_IF_ZERO,  &&L_S_JUMP_IF_NEG,
+    &&L_S_CALL,          &&L_S_CALL_INDIRECT,
+    &&L_S_TAIL_CALL,     &&L_S_RETURN,
+    &&L_S_EXIT,
+  };
+
+#define R(i) base[i]
+#define ENTER(callee)                                                          \
+  do {                                                                         \
+    size_t i;                                                                  \
+    if (NULL == (callee)->rinsts) {                                            \
+      return 1;                                                                \
+    }                                                                          \
+    if ((size_t)(end - base) < (callee)->nslots) {                             \
+      if (ip_stack_commit(ip_value_t,                                          \
+                          &vm->stack,                                          \
+                          base - vm->stack.data + (callee)->nslots)) {         \
+        return 1;                                                              \
+      }                                                                        \
+      end = vm->stack.data + vm->stack.size;                                   \
+    }                                                                          \
+    for (i = 0; i < (callee)->nlocals; i++) {                                  \
+      base[(callee)->nargs + i] = IP_LLINT2VALUE(0);                           \
+    }                                                                          \
+  } while (0)
+#define CALL(callee, at)                                                       \
+  do {                                                                         \
+    ip_callinfo_t ci = { .ip = pc, .fp = base - vm->stack.data, .proc = proc }; \
+    if (ip_stack_push(ip_callinfo_t, &vm->callstack, ci)) {                    \
+      return 1;                                                                \
+    }                                                                          \
+    base += (at);                                                              \
+    proc = (callee);                                                           \
+    ENTER(proc);                                                               \
+    pc = 0;                                                                    \
+  } while (0)
+
+#define JUMP()                                                                 \
+  do {                                                                         \
+    r = &proc->rinsts[pc++];                                                   \
+    goto* labels[r->code];                                                     \
+  } while (0)
+/* stack code, sp is under `end` and over the bottom of the stack */
+#define S_PUSH(x)                                                              \
+  do {                                                                         \
+    if (sp >= end) {                                                           \
+      if (ip_stack_commit(ip_value_t, &vm->stack, sp - vm->stack.data + 1)) {  \
+        return 1;                                                              \
+      }                                                                        \
+      end = vm->stack.data + vm->stack.size;                                   \
+    }                                                                          \
+    *sp++ = (x);                                                               \
+  } while (0)
+#define S_POPS(n)                                                              \
+  do {                                                                         \
+    if ((size_t)(sp - vm->stack.data) < (n)) {                                 \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+/* the callee of stack code, whose args are on top */
+#define S_CALLEE(p)                                                            \
+  do {                                                                         \
+    ip_proc_ref_t p_ = (p);                                                    \
+    if (p_ < 0 || (size_t)p_ >= vm->nprocs || NULL == vm->procs[p_]) {         \
+      return 1;                                                                \
+    }                                                                          \
+    callee = vm->procs[p_];                                                    \
+    S_POPS(callee->nargs);                                                     \
+  } while (0)
+/* `v` to the caller, whose stack code goes on above it */
+#define RETURN()                                                               \
+  do {                                                                         \
+    ip_callinfo_t ci;                                                          \
+                                                                               \
+    R(0) = v;                                                                  \
+    sp = base + 1;                                                             \
+                                                                               \
+    if (ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci)) {                    \
+      return 1;                                                                \
+    }                                                                          \
+                                                                               \
+    pc = ci.ip;                                                                \
+    base = vm->stack.data + ci.fp;                                             \
+    proc = ci.proc;                                                            \
+  } while (0)
+
+  proc = vm->procs[procref];
+  if (NULL == proc || vm->stack.sp < proc->nargs) {
+    return 1;
+  }
+  base = vm->stack.data + vm->stack.sp - proc->nargs;
+  ENTER(proc);
+
+  JUMP();
+
+L_LOADK : {
+  R(r->a) = r->u.k;
+  JUMP();
+}
+L_MOVE : {
+  R(r->a) = R(r->b);
+  JUMP();
+}
+L_ADD : {
+  R(r->a) = IP_LLINT2VALUE(IP_VALUE2LLINT(R(r->b)) + IP_VALUE2LLINT(R(r->c)));
+  JUMP();
+}
+L_SUB : {
+  R(r->a) = IP_LLINT2VALUE(IP_VALUE2LLINT(R(r->b)) - IP_VALUE2LLINT(R(r->c)));
+  JUMP();
+}
+L_ADDK : {
+  R(r->a) = IP_LLINT2VALUE(IP_VALUE2LLINT(R(r->b)) + IP_VALUE2LLINT(r->u.k));
+  JUMP();
+}
+L_SUBK : {
+  R(r->a) = IP_LLINT2VALUE(IP_VALUE2LLINT(R(r->b)) - IP_VALUE2LLINT(r->u.k));
+  JUMP();
+}
+L_JUMP : {
+  pc = r->u.pos;
+  JUMP();
+}
+L_JUMP_IF_ZERO : {
+  if (!IP_VALUE2LLINT(R(r->a))) {
+    pc = r->u.pos;
+  }
+  JUMP();
+}
+L_JUMP_IF_NEG : {
+  if (IP_VALUE2LLINT(R(r->a)) < 0) {
+    pc = r->u.pos;
+  }
+  JUMP();
+}
+L_JUMP_IF_SUB_NEG : {
+  if (IP_VALUE2LLINT(R(r->a)) - IP_VALUE2LLINT(R(r->b)) < 0) {
+    pc = r->u.pos;
+  }
+  JUMP();
+}
+L_CALL : {
+  CALL(vm->procs[r->u.p], r->a);
+  JUMP();
+}
+L_CALL_INDIRECT : {
+  ip_proc_ref_t p = IP_VALUE2PROCREF(R(r->b));
+
+  if (p < 0 || (size_t)p >= vm->nprocs) {
+    return 1;
+  }
+  callee = vm->procs[p];
+  if (NULL == callee || callee->nargs != (size_t)r->c) {
+    return 1;
+  }
+
+  CALL(callee, r->a);
+  JUMP();
+}
+L_TAIL_CALL : {
+  callee = vm->procs[r->u.p];
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(base, base + r->a, callee->nargs * sizeof(ip_value_t));
+  proc = callee;
+  ENTER(proc);
+  pc = 0;
+  JUMP();
+}
+L_RETURN : {
+  v = R(r->a);
+  RETURN();
+  JUMP();
+}
+L_EXIT : {
+  v = R(r->a);
+  R(0) = v;
+  vm->stack.sp = base - vm->stack.data + 1;
+
+  return 0;
+}
+L_END : {
+  return 1;
+}
+L_S_ENTER : {
+  sp = base + proc->nargs + proc->nlocals;
+  JUMP();
+}
+L_S_CONST : {
+  S_PUSH(r->u.k);
+  JUMP();
+}
+L_S_GET_LOCAL : {
+  S_PUSH(R(r->a));
+  JUMP();
+}
+L_S_SET_LOCAL : {
+  S_POPS(1);
+  R(r->a) = *--sp;
+  JUMP();
+}
+L_S_ADD : {
+  S_POPS(2);
+  sp--;
+  sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) + IP_VALUE2LLINT(sp[0]));
+  JUMP();
+}
+L_S_SUB : {
+  S_POPS(2);
+  sp--;
+  sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) - IP_VALUE2LLINT(sp[0]));
+  JUMP();
+}
+L_S_JUMP_IF_ZERO : {
+  S_POPS(1);
+  if (!IP_VALUE2LLINT(*--sp)) {
+    pc = r->u.pos;
+  }
+  JUMP();
+}
+L_S_JUMP_IF_NEG : {
+  S_POPS(1);
+  if (IP_VALUE2LLINT(*--sp) < 0) {
+    pc = r->u.pos;
+  }
+  JUMP();
+}
+L_S_CALL : {
+  S_CALLEE(r->u.p);
+  CALL(callee, sp - callee->nargs - base);
+  JUMP();
+}
+L_S_CALL_INDIRECT : {
+  S_POPS(1);
+  sp--;
+  S_CALLEE(IP_VALUE2PROCREF(*sp));
+  CALL(callee, sp - callee->nargs - base);
+  JUMP();
+}
+L_S_TAIL_CALL : {
+  S_CALLEE(r->u.p);
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(base, sp - callee->nargs, callee->nargs * sizeof(ip_value_t));
+  proc = callee;
+  ENTER(proc);
+  pc = 0;
+  JUMP();
+}
+L_S_RETURN : {
+  S_POPS(1 + proc->nargs + proc->nlocals);
+  v = sp[-1];
+  RETURN();
+  JUMP();
+}
+L_S_EXIT : {
+  S_POPS(1 + proc->nargs + proc->nlocals);
+  R(0) = sp[-1];
+  vm->stack.sp = base - vm->stack.data + 1;
+
+  return 0;
+}
+
+#undef R
+#undef ENTER
+#undef CALL
+#undef JUMP
+#undef S_PUSH
+#undef S_POPS
+#undef S_CALLEE
+#undef RETURN
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
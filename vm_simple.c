@@ -1,4 +1,9 @@
+#include "arena.h"
+#include "loop.h"
+#include "memo.h"
+#include "peephole.h"
 #include "stack.h"
+#include "tail_call.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,16 +17,36 @@ struct ip_proc
   size_t nlocals;
   size_t ninsts;
   struct ip_inst* insts;
+  /* the arena of the vm it was made in, or NULL */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+#ifdef IP_VM_PROFILE
+  unsigned long* counts;
+#endif
+#ifdef IP_VM_MEMO
+  /* the results by args if the proc is pure, or NULL */
+  struct ip_memo* memo;
+#endif
 };
 
-int
-ip_proc_init(struct ip_proc* proc,
-             size_t nargs,
-             size_t nlocals,
-             size_t ninsts,
-             struct ip_inst* insts)
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
 {
-  proc->insts = malloc(ninsts * sizeof(struct ip_inst));
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  proc->arena = arena;
+  proc->insts = ip_arena_alloc(arena, ninsts * sizeof(struct ip_inst));
   if (NULL == proc->insts) {
     return 1;
   }
@@ -30,10 +55,32 @@ ip_proc_init(struct ip_proc* proc,
   proc->nlocals = nlocals;
   proc->ninsts = ninsts;
   memcpy(proc->insts, insts, ninsts * sizeof(struct ip_inst));
+  ip_tail_call_rewrite(proc->insts, ninsts);
+#ifdef IP_VM_MEMO
+  proc->memo = NULL;
+#endif
+
+#ifdef IP_VM_PROFILE
+  proc->counts = ip_arena_alloc(arena, ninsts * sizeof(unsigned long));
+  if (NULL == proc->counts) {
+    return 1;
+  }
+  memset(proc->counts, 0, ninsts * sizeof(unsigned long));
+#endif
 
   return 0;
 }
 
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
 int
 ip_proc_new(size_t nargs,
             size_t nlocals,
@@ -52,7 +99,13 @@ ip_proc_new(size_t nargs,
 void
 ip_proc_dtor(struct ip_proc* proc)
 {
-  free(proc->insts);
+  ip_arena_release(proc->arena, proc->insts);
+#ifdef IP_VM_PROFILE
+  ip_arena_release(proc->arena, proc->counts);
+#endif
+#ifdef IP_VM_MEMO
+  ip_memo_free(proc->memo);
+#endif
 }
 
 typedef struct ip_callinfo
@@ -60,6 +113,10 @@ typedef struct ip_callinfo
   size_t ip;
   size_t fp;
   struct ip_proc* proc;
+#ifdef IP_VM_MEMO
+  /* the callee whose args are kept in memostack for its result */
+  struct ip_proc* memo;
+#endif
 } ip_callinfo_t;
 
 def_ip_stack(ip_callinfo_t);
@@ -78,6 +135,14 @@ struct ip_vm
   ip_stack(ip_callinfo_t) callstack;
   size_t nprocs;
   struct ip_proc** procs;
+#ifdef IP_VM_MEMO
+  ip_stack(ip_value_t) memostack;
+  /* a proc was registered since the pure ones were marked */
+  int memo_dirty;
+#endif
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
 };
 
 int
@@ -92,9 +157,22 @@ ip_vm_init(struct ip_vm* vm)
 
   ret = ip_stack_init(ip_callinfo_t, &vm->callstack, 1024);
   if (ret) {
+    ip_stack_dtor(ip_value_t, &vm->stack);
+    return 1;
+  }
+
+#ifdef IP_VM_MEMO
+  ret = ip_stack_init(ip_value_t, &vm->memostack, 1024);
+  if (ret) {
+    ip_stack_dtor(ip_value_t, &vm->stack);
+    ip_stack_dtor(ip_callinfo_t, &vm->callstack);
     return 1;
   }
+  vm->memo_dirty = 1;
+#endif
 
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
   vm->nprocs = 0;
   vm->procs = NULL;
 
@@ -110,7 +188,48 @@ ip_vm_new(struct ip_vm** vm)
     return 1;
   }
 
-  return ip_vm_init(*vm);
+  if (ip_vm_init(*vm)) {
+    free(*vm);
+    *vm = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  if (ip_stack_limit(ip_value_t, &vm->stack, nvalues) ||
+      ip_stack_limit(ip_callinfo_t, &vm->callstack, ncalls)) {
+    return 1;
+  }
+#ifdef IP_VM_MEMO
+  /* the args of the calls being memoized */
+  if (ip_stack_limit(ip_value_t, &vm->memostack, nvalues)) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
 }
 
 ip_proc_ref_t
@@ -121,6 +240,7 @@ ip_vm_reserve_proc(struct ip_vm* vm)
   if (NULL == vm->procs) {
     return -1;
   }
+  vm->procs[vm->nprocs - 1] = NULL;
 
   return vm->nprocs - 1;
 }
@@ -129,6 +249,9 @@ void
 ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
 {
   vm->procs[at] = proc;
+#ifdef IP_VM_MEMO
+  vm->memo_dirty = 1;
+#endif
 }
 
 ip_proc_ref_t
@@ -148,16 +271,260 @@ ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
   return ret;
 }
 
+#ifdef IP_VM_PROFILE
+#include "superinst.h"
+
+/**
+ * profiling build.
+ * Counts how many times each inst is run. When the vm is destroyed, the
+ * sequences of insts in the registered procs are weighted by these counts
+ * and the ones saving most dispatches are written to stderr in the format
+ * of superinsts.def.
+ */
+
+#define IP_PROFILE_NSUPERINSTS 8
+
+static const char* ip_code_names[] = {
+  "CONST", "GET_LOCAL",     "SET_LOCAL",    "ADD",
+  "SUB",   "JUMP",          "JUMP_IF_ZERO", "JUMP_IF_NEG",
+  "CALL",  "CALL_INDIRECT", "RETURN",       "EXIT",
+  "TAIL_CALL",
+};
+
+struct ip_profile_set
+{
+  size_t n;
+  size_t len[IP_PROFILE_NSUPERINSTS + 1];
+  enum ip_code codes[IP_PROFILE_NSUPERINSTS + 1][IP_SUPERINST_MAXLEN];
+};
+
+/* can insts[i..i+len) be a superinst */
+static int
+ip_profile_is_candidate(struct ip_proc* proc, size_t i, size_t len)
+{
+  size_t k;
+
+  if (proc->ninsts < i + len) {
+    return 0;
+  }
+  for (k = 0; k < len - 1; k++) {
+    if (!IP_SUPERINST_IS_STRAIGHT(proc->insts[i + k].code)) {
+      return 0;
+    }
+  }
+  return IP_SUPERINST_IS_STRAIGHT(proc->insts[i + k].code) ||
+         IP_SUPERINST_IS_BRANCH(proc->insts[i + k].code);
+}
+
+/* dispatches saved if the procs were fused with the set, fusing the longest
+ * match from the head of each sequence like ip_proc_init does */
+static unsigned long
+ip_profile_saved(struct ip_vm* vm, struct ip_profile_set* set)
+{
+  size_t p, i, j, k;
+  unsigned long saved = 0;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    struct ip_proc* proc = vm->procs[p];
+
+    for (i = 0; i < proc->ninsts;) {
+      size_t best = 1;
+
+      for (j = 0; j < set->n; j++) {
+        if (set->len[j] <= best || proc->ninsts < i + set->len[j]) {
+          continue;
+        }
+        for (k = 0; k < set->len[j]; k++) {
+          if (proc->insts[i + k].code != set->codes[j][k]) {
+            break;
+          }
+        }
+        if (k == set->len[j]) {
+          best = set->len[j];
+        }
+      }
+      saved += proc->counts[i] * (best - 1);
+      i += best;
+    }
+  }
+
+  return saved;
+}
+
+static void
+ip_profile_dump(struct ip_vm* vm, FILE* out)
+{
+  struct ip_profile_set set;
+  unsigned long saved = 0, total = 0;
+  size_t p, i, j, len;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    for (i = 0; i < vm->procs[p]->ninsts; i++) {
+      total += vm->procs[p]->counts[i];
+    }
+  }
+
+  fprintf(out, "/* generated by main_profile. do not edit. */\n");
+
+  /* greedily by the dispatches the sequence saves on top of the ones
+   * already taken, as long as it is 1% of the dispatches */
+  for (set.n = 0; set.n < IP_PROFILE_NSUPERINSTS;) {
+    unsigned long best = saved, s;
+    struct ip_proc* best_proc = NULL;
+    size_t best_i = 0, best_len = 0;
+
+    for (p = 0; p < vm->nprocs; p++) {
+      struct ip_proc* proc = vm->procs[p];
+
+      for (i = 0; i < proc->ninsts; i++) {
+        for (len = 2; len <= IP_SUPERINST_MAXLEN; len++) {
+          if (!ip_profile_is_candidate(proc, i, len)) {
+            continue;
+          }
+          set.len[set.n] = len;
+          for (j = 0; j < len; j++) {
+            set.codes[set.n][j] = proc->insts[i + j].code;
+          }
+          set.n += 1;
+          s = ip_profile_saved(vm, &set);
+          set.n -= 1;
+          if (best < s) {
+            best = s;
+            best_proc = proc;
+            best_i = i;
+            best_len = len;
+          }
+        }
+      }
+    }
+    if (NULL == best_proc || best - saved < total / 100) {
+      break;
+    }
+
+    set.len[set.n] = best_len;
+    fprintf(out, "/* saves %lu dispatches */\n", best - saved);
+    fprintf(out, "IP_SUPERINST%lu(", (unsigned long)best_len);
+    for (j = 0; j < best_len; j++) {
+      set.codes[set.n][j] = best_proc->insts[best_i + j].code;
+      fprintf(out,
+              "%s%s",
+              j ? ", " : "",
+              ip_code_names[best_proc->insts[best_i + j].code]);
+    }
+    fprintf(out, ")\n");
+    set.n += 1;
+    saved = best;
+  }
+}
+#endif
+
 void
 ip_vm_dtor(struct ip_vm* vm)
 {
+  struct ip_proc* proc;
 
   ip_stack_dtor(ip_value_t, &vm->stack);
   ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+#ifdef IP_VM_MEMO
+  ip_stack_dtor(ip_value_t, &vm->memostack);
+#endif
+#ifdef IP_VM_PROFILE
+  ip_profile_dump(vm, stderr);
+#endif
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
 }
 
-int
-ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+#ifdef IP_VM_MEMO
+static int
+ip_vm_memo_lookup(void* ctx, ip_proc_ref_t ref, struct ip_memo_proc* ret)
+{
+  struct ip_vm* vm = ctx;
+
+  if (ref < 0 || vm->nprocs <= (size_t)ref || NULL == vm->procs[ref]) {
+    return 1;
+  }
+  ret->nargs = vm->procs[ref]->nargs;
+  ret->nlocals = vm->procs[ref]->nlocals;
+  ret->ninsts = vm->procs[ref]->ninsts;
+  ret->insts = vm->procs[ref]->insts;
+
+  return 0;
+}
+
+/* marks the pure procs again and gives them empty tables, a proc registered
+ * in place of another may change the results of its callers */
+static int
+ip_vm_memo_init(struct ip_vm* vm)
+{
+  char* pure;
+  size_t p;
+
+  pure = malloc(vm->nprocs + 1);
+  if (NULL == pure) {
+    return 1;
+  }
+  ip_memo_pure(vm->nprocs, ip_vm_memo_lookup, vm, pure);
+
+  for (p = 0; p < vm->nprocs; p++) {
+    if (NULL != vm->procs[p]) {
+      ip_memo_free(vm->procs[p]->memo);
+      vm->procs[p]->memo = NULL;
+    }
+  }
+  /* a proc may be registered at more than one ref */
+  for (p = 0; p < vm->nprocs; p++) {
+    if (pure[p] && NULL == vm->procs[p]->memo &&
+        ip_memo_new(vm->procs[p]->nargs, &vm->procs[p]->memo)) {
+      free(pure);
+      return 1;
+    }
+  }
+
+  free(pure);
+  vm->memo_dirty = 0;
+  return 0;
+}
+
+/* 0 if the result of callee for the args on the top of the stack is known,
+ * in place of them. otherwise the args are kept for the RETURN of ci if
+ * callee is pure and there is room for them */
+static int
+ip_vm_memo_call(struct ip_vm* vm, struct ip_proc* callee, ip_callinfo_t* ci)
+{
+  size_t i, n = callee->nargs, sp = vm->stack.sp;
+  ip_value_t result;
+
+  /* and room for the result */
+  if (NULL == callee->memo || sp < n ||
+      (0 == n && ip_stack_grow(ip_value_t, &vm->stack, 1))) {
+    return 1;
+  }
+
+  if (!ip_memo_find(callee->memo, &vm->stack.data[sp - n], &result)) {
+    vm->stack.sp -= n;
+    ip_stack_push(ip_value_t, &vm->stack, result);
+    return 0;
+  }
+
+  if (ip_stack_grow(ip_value_t, &vm->memostack, n)) {
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    ip_stack_push(ip_value_t, &vm->memostack, vm->stack.data[sp - n + i]);
+  }
+  ci->memo = callee;
+
+  return 1;
+}
+#endif
+
+static int
+ip_vm_run(struct ip_vm* vm, ip_proc_ref_t procref)
 {
   size_t ip = 0;
   size_t fp;
@@ -190,6 +557,14 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
       PUSH(v);                                                                 \
   } while (0)
 
+#ifdef IP_VM_MEMO
+  /* the args of the calls a failed exec left */
+  vm->memostack.sp = 0;
+  if (vm->memo_dirty && ip_vm_memo_init(vm)) {
+    return 1;
+  }
+#endif
+
   proc = vm->procs[procref];
 
   PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
@@ -197,6 +572,9 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 
   while (1) {
     struct ip_inst inst = proc->insts[ip];
+#ifdef IP_VM_PROFILE
+    proc->counts[ip] += 1;
+#endif
     switch (inst.code) {
       case IP_CODE_CONST: {
         ip_stack_push(ip_value_t, &vm->stack, inst.u.v);
@@ -281,6 +659,13 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
         int ret;
         ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
 
+#ifdef IP_VM_MEMO
+        /* the callee is not run */
+        if (!ip_vm_memo_call(vm, vm->procs[inst.u.p], &ci)) {
+          break;
+        }
+#endif
+
         ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
         if (ret) {
           return 1;
@@ -302,6 +687,12 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 
         POP(&p);
 
+#ifdef IP_VM_MEMO
+        if (!ip_vm_memo_call(vm, vm->procs[IP_VALUE2PROCREF(p)], &ci)) {
+          break;
+        }
+#endif
+
         ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
         if (ret) {
           return 1;
@@ -333,6 +724,15 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
           return 1;
         }
 
+#ifdef IP_VM_MEMO
+        /* the result of the callee, or of the procs it tail called */
+        if (NULL != ci.memo) {
+          vm->memostack.sp -= ci.memo->nargs;
+          ip_memo_put(
+            ci.memo->memo, &vm->memostack.data[vm->memostack.sp], v);
+        }
+#endif
+
         ip = ci.ip;
         fp = ci.fp;
         proc = ci.proc;
@@ -350,6 +750,32 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 
         return 0;
       }
+      case IP_CODE_TAIL_CALL: {
+        size_t base, sp;
+        struct ip_proc* callee;
+
+        callee = vm->procs[inst.u.p];
+        base = fp - (proc->nargs + proc->nlocals);
+        sp = ip_stack_size(ip_value_t, &vm->stack);
+        if (sp < callee->nargs) {
+          return 1;
+        }
+
+        /* the args over the frame, the callinfo is left to the callee */
+        memmove(&ip_stack_ref(ip_value_t, &vm->stack, base),
+                &ip_stack_ref(ip_value_t, &vm->stack, sp - callee->nargs),
+                callee->nargs * sizeof(ip_value_t));
+        vm->stack.sp = base + callee->nargs;
+
+        proc = callee;
+
+        PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
+
+        ip = -1;
+        fp = ip_stack_size(ip_value_t, &vm->stack);
+
+        break;
+      }
       default: {
         printf("code: %d, u: %d", inst.code, inst.u.i);
         return 1;
@@ -362,14 +788,47 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 #undef PUSH
 }
 
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+#ifdef IP_STACK_GUARD
+  int ret;
+
+  /* a push or pop faulted on a guard page, the stacks are dropped */
+  if (sigsetjmp(ip_stack_guard_env, 1)) {
+    vm->stack.sp = 0;
+    vm->callstack.sp = 0;
+    return 1;
+  }
+  ip_stack_guard_armed = 1;
+  ret = ip_vm_run(vm, procref);
+  ip_stack_guard_armed = 0;
+
+  return ret;
+#else
+  return ip_vm_run(vm, procref);
+#endif
+}
+
 int
 ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
 {
+#ifdef IP_STACK_GUARD
+  /* no ip_vm_exec catches the fault here */
+  if (vm->stack.size <= vm->stack.sp) {
+    return 1;
+  }
+#endif
   return ip_stack_push(ip_value_t, &vm->stack, arg);
 }
 
 int
 ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
 {
+#ifdef IP_STACK_GUARD
+  if (0 == vm->stack.sp) {
+    return 1;
+  }
+#endif
   return ip_stack_pop(ip_value_t, &vm->stack, result);
 }
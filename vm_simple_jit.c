@@ -1,84 +1,264 @@
+#include "jit.h"
+#include "loop.h"
+#include "peephole.h"
 #include "stack.h"
+#include "stencil.h"
+#include "tail_call.h"
+#include "verifier.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+
+#include "vm_simple_jit_stencils.h"
 
 def_ip_stack(ip_value_t);
 
-struct ip_inst_arg
-{
-  union
-  {
-    ip_value_t v;
-    int i;
-    size_t pos;
-    ip_proc_ref_t p;
-  } u;
-};
+/**
+ * copy-and-patch jit.
+ * Copying the code between two labels of one big function cannot work:
+ * the copy keeps rip relative references and jumps into the original.
+ * Instead every handler is a function of its own in
+ * vm_simple_jit_stencils.c, built so that its code is position independent
+ * except for the holes listed by stencil_gen. A proc is compiled by
+ * concatenating the stencils of its insts and patching the holes.
+ */
 
-enum ip_vm_mode
-{
-  IP_VM_COMPILE,
-  IP_VM_EXEC,
-};
-union ip_vm_arg
-{
-  struct
-  {
-    struct ip_vm* vm;
-    ip_proc_ref_t procref;
-  } exec;
-  struct
-  {
-    size_t ninsts;
-    struct ip_inst* insts;
-    void** labels;
-    void** code;
-    struct ip_inst_arg* args_result;
-  } compile;
+static const struct ip_stencil* ip_stencils[] = {
+  &ip_stencil_CONST,        &ip_stencil_GET_LOCAL,     &ip_stencil_SET_LOCAL,
+  &ip_stencil_ADD,          &ip_stencil_SUB,           &ip_stencil_JUMP,
+  &ip_stencil_JUMP_IF_ZERO, &ip_stencil_JUMP_IF_NEG,   &ip_stencil_CALL,
+  &ip_stencil_CALL_INDIRECT, &ip_stencil_RETURN,       &ip_stencil_EXIT,
 };
 
-int
-ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg);
-
 struct ip_proc
 {
   size_t nargs;
   size_t nlocals;
   size_t ninsts;
-  void* code;
-  void** labels;
-  struct ip_inst_arg* args;
+  unsigned char* code;
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
 };
 
-int
-ip_proc_init(struct ip_proc* proc,
+/* `movabs rax, hole; jmp rax` */
+static int
+ip_stencil_is_tail_jump(const struct ip_stencil* stencil, size_t offset)
+{
+  const unsigned char* code = stencil->code;
+
+  return 2 <= offset && offset + 10 <= stencil->size &&
+         0x48 == code[offset - 2] && 0xb8 == code[offset - 1] &&
+         0xff == code[offset + 8] && 0xe0 == code[offset + 9];
+}
+
+/* size of the stencil, without the jump to the next one if it ends with it */
+static size_t
+ip_stencil_size(const struct ip_stencil* stencil)
+{
+  size_t i;
+
+  for (i = 0; i < stencil->nholes; i++) {
+    const struct ip_stencil_hole* hole = &stencil->holes[i];
+    if (IP_HOLE_KIND_CONTINUE == hole->kind &&
+        hole->offset + 10 == stencil->size &&
+        ip_stencil_is_tail_jump(stencil, hole->offset)) {
+      return stencil->size - 12;
+    }
+  }
+  return stencil->size;
+}
+
+static void
+ip_stencil_patch_jump(const struct ip_stencil* stencil,
+                      unsigned char* code,
+                      size_t offset,
+                      unsigned char* target,
+                      long addend)
+{
+  if (offset + 10 <= ip_stencil_size(stencil) &&
+      ip_stencil_is_tail_jump(stencil, offset)) {
+    /* the arena is small enough for a `jmp rel32` */
+    code[offset - 2] = 0xe9;
+    ip_jit_link_abs(code + offset - 1, target + addend);
+  } else {
+    ip_jit_patch_u64(code + offset, (uint64_t)(target + addend));
+  }
+}
+
+static int
+ip_proc_emit(struct ip_proc* proc,
              size_t nargs,
              size_t nlocals,
              size_t ninsts,
              struct ip_inst* insts)
 {
-  union ip_vm_arg arg;
-
-  proc->args = malloc(ninsts * sizeof(struct ip_inst_arg));
-  proc->labels = malloc(ninsts * sizeof(void*));
-  if (NULL == proc->args) {
-    return 1;
-  }
+  size_t i, j, n, total;
+  size_t *offsets, *firsts, *floors;
+  const struct ip_stencil** stencils;
+  /* the inst of each stencil, NULL for ENTER, CHECK_POP and ERROR */
+  struct ip_inst** pieces;
+  struct ip_verify_proc vproc;
 
   proc->nargs = nargs;
   proc->nlocals = nlocals;
   proc->ninsts = ninsts;
 
-  arg.compile.ninsts = ninsts;
-  arg.compile.insts = insts;
-  arg.compile.labels = proc->labels;
-  arg.compile.code = &proc->code;
-  arg.compile.args_result = proc->args;
+  vproc.nargs = nargs;
+  vproc.nlocals = nlocals;
+  vproc.ninsts = ninsts;
+  vproc.insts = insts;
+
+  /* ENTER, the insts each after a CHECK_POP if needed, and ERROR */
+  offsets = malloc((2 * ninsts + 3) * sizeof(size_t));
+  stencils = malloc((2 * ninsts + 2) * sizeof(struct ip_stencil*));
+  pieces = malloc((2 * ninsts + 2) * sizeof(struct ip_inst*));
+  firsts = malloc((ninsts + 1) * sizeof(size_t));
+  floors = malloc((ninsts + 1) * sizeof(size_t));
+  if (NULL == offsets || NULL == stencils || NULL == pieces ||
+      NULL == firsts || NULL == floors || ip_verify_floors(&vproc, floors)) {
+    free(offsets);
+    free(stencils);
+    free(pieces);
+    free(firsts);
+    free(floors);
+    return 1;
+  }
+
+  n = 0;
+  pieces[n] = NULL;
+  stencils[n++] = &ip_stencil_ENTER;
+  for (i = 0; i < ninsts; i++) {
+    if (insts[i].code > IP_CODE_EXIT) {
+      printf("code: %d, u: %d", insts[i].code, insts[i].u.i);
+      free(offsets);
+      free(stencils);
+      free(pieces);
+      free(firsts);
+      free(floors);
+      return 1;
+    }
+    firsts[i] = n;
+    /* the pops that may go below the stack */
+    if (floors[i] < ip_verify_pops(&vproc, &insts[i])) {
+      pieces[n] = NULL;
+      stencils[n++] = &ip_stencil_CHECK_POP;
+    }
+    pieces[n] = &insts[i];
+    stencils[n++] = ip_stencils[insts[i].code];
+  }
+  firsts[ninsts] = n;
+  pieces[n] = NULL;
+  stencils[n++] = &ip_stencil_ERROR;
+
+  total = 0;
+  for (i = 0; i < n; i++) {
+    offsets[i] = total;
+    total += ip_stencil_size(stencils[i]);
+  }
+  offsets[n] = total;
+
+  proc->code = ip_jit_alloc(total);
+  if (NULL == proc->code) {
+    free(offsets);
+    free(stencils);
+    free(pieces);
+    free(firsts);
+    free(floors);
+    return 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    const struct ip_stencil* stencil = stencils[i];
+    unsigned char* code = proc->code + offsets[i];
+
+    memcpy(code, stencil->code, ip_stencil_size(stencil));
+
+    for (j = 0; j < stencil->nholes; j++) {
+      const struct ip_stencil_hole* hole = &stencil->holes[j];
+      struct ip_inst* inst = pieces[i];
+      size_t target;
+
+      if (hole->offset + 8 > ip_stencil_size(stencil)) {
+        /* the elided jump to the next stencil */
+        continue;
+      }
+
+      switch (hole->kind) {
+        case IP_HOLE_KIND_OPERAND: {
+          /* the operand of a CHECK_POP is the pops of the next inst */
+          uint64_t operand = NULL == inst
+                               ? ip_verify_pops(&vproc, pieces[i + 1])
+                               : (uint64_t)inst->u.v;
+          ip_jit_patch_u64(code + hole->offset, operand + hole->addend);
+          break;
+        }
+        case IP_HOLE_KIND_CONTINUE: {
+          ip_stencil_patch_jump(stencil,
+                                code,
+                                hole->offset,
+                                proc->code + offsets[i + 1],
+                                hole->addend);
+          break;
+        }
+        case IP_HOLE_KIND_JUMP: {
+          /* jumps land after the target, as `ip` is incremented afterwards */
+          target = inst->u.pos + 1;
+          target = target <= ninsts ? offsets[firsts[target]]
+                                    : offsets[firsts[ninsts]];
+          ip_stencil_patch_jump(
+            stencil, code, hole->offset, proc->code + target, hole->addend);
+          break;
+        }
+        case IP_HOLE_KIND_NARGS: {
+          ip_jit_patch_u64(code + hole->offset, nargs + hole->addend);
+          break;
+        }
+        case IP_HOLE_KIND_NLOCALS: {
+          ip_jit_patch_u64(code + hole->offset, nlocals + hole->addend);
+          break;
+        }
+        default: {
+          break;
+        }
+      }
+    }
+  }
+
+  free(offsets);
+  free(stencils);
+  free(pieces);
+  free(firsts);
+  free(floors);
+
+  return 0;
+}
+
+/* TAIL_CALL runs as CALL; RETURN */
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  struct ip_inst* lowered;
+  int ret;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
 
-  return ip_vm_main(IP_VM_COMPILE, arg);
+  if (ip_tail_call_lower(insts, ninsts, &lowered, &ninsts)) {
+    return 1;
+  }
+  ret = ip_proc_emit(proc, nargs, nlocals, ninsts, lowered);
+  free(lowered);
+
+  return ret;
 }
 
 int
@@ -99,19 +279,10 @@ ip_proc_new(size_t nargs,
 void
 ip_proc_dtor(struct ip_proc* proc)
 {
-  free(proc->args);
-  free(proc->code);
+  /* the code stays in the arena */
+  (void)proc;
 }
 
-typedef struct ip_callinfo
-{
-  size_t ip;
-  size_t fp;
-  struct ip_proc* proc;
-} ip_callinfo_t;
-
-def_ip_stack(ip_callinfo_t);
-
 /**
  * stack usage
  *               previous sp        fp             sp
@@ -123,9 +294,11 @@ def_ip_stack(ip_callinfo_t);
 struct ip_vm
 {
   ip_stack(ip_value_t) stack;
-  ip_stack(ip_callinfo_t) callstack;
   size_t nprocs;
   struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+  struct ip_stencil_state st;
 };
 
 int
@@ -138,13 +311,11 @@ ip_vm_init(struct ip_vm* vm)
     return 1;
   }
 
-  ret = ip_stack_init(ip_callinfo_t, &vm->callstack, 1024);
-  if (ret) {
-    return 1;
-  }
-
   vm->nprocs = 0;
   vm->procs = NULL;
+  vm->owned = NULL;
+  vm->st.entries = NULL;
+  vm->st.nentries = 0;
 
   return 0;
 }
@@ -161,6 +332,35 @@ ip_vm_new(struct ip_vm** vm)
   return ip_vm_init(*vm);
 }
 
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
 ip_proc_ref_t
 ip_vm_reserve_proc(struct ip_vm* vm)
 {
@@ -169,6 +369,13 @@ ip_vm_reserve_proc(struct ip_vm* vm)
   if (NULL == vm->procs) {
     return -1;
   }
+  vm->st.entries = realloc(vm->st.entries, vm->nprocs * sizeof(void*));
+  if (NULL == vm->st.entries) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+  vm->st.entries[vm->nprocs - 1] = NULL;
+  vm->st.nentries = vm->nprocs;
 
   return vm->nprocs - 1;
 }
@@ -177,6 +384,7 @@ void
 ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
 {
   vm->procs[at] = proc;
+  vm->st.entries[at] = proc->code;
 }
 
 ip_proc_ref_t
@@ -199,319 +407,39 @@ ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
 void
 ip_vm_dtor(struct ip_vm* vm)
 {
+  struct ip_proc *proc, *next;
 
   ip_stack_dtor(ip_value_t, &vm->stack);
-  ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+  free(vm->st.entries);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
 }
 
 int
 ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
 {
-  union ip_vm_arg arg;
-
-  arg.exec.vm = vm;
-  arg.exec.procref = procref;
-
-  return ip_vm_main(IP_VM_EXEC, arg);
-}
-
-int
-ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg vm_arg)
-{
-
-  if (IP_VM_COMPILE == mode) {
-    int ret;
-    size_t i, code_size, total_code_size = 0;
-    size_t* label_offsets;
-    void* tmp;
-
-    size_t ninsts = vm_arg.compile.ninsts;
-    struct ip_inst* insts = vm_arg.compile.insts;
-    struct ip_inst_arg* args_result = vm_arg.compile.args_result;
-    void** labels = vm_arg.compile.labels;
-    void** code = vm_arg.compile.code;
-
-    tmp = malloc(total_code_size);
-    label_offsets = malloc(ninsts * sizeof(size_t));
-    if (NULL == label_offsets) {
-      return 1;
-    }
-
-    for (i = 0; i < ninsts; i++) {
-      label_offsets[i] = total_code_size;
-      args_result[i].u.v = insts[i].u.v;
-      args_result[i].u.i = insts[i].u.i;
-      args_result[i].u.pos = insts[i].u.pos;
-      args_result[i].u.p = insts[i].u.p;
-
-      switch (insts[i].code) {
-#define GEN_ARM(VARIANT)                                                       \
-  case IP_CODE_##VARIANT: {                                                    \
-    code_size = &&L_##VARIANT##_END - &&L_##VARIANT;                           \
-    tmp = realloc(tmp, total_code_size + code_size);                           \
-    if (NULL == tmp) {                                                         \
-      return 1;                                                                \
-    }                                                                          \
-    memcpy(tmp + total_code_size, &&L_##VARIANT, code_size);                   \
-    total_code_size += code_size;                                              \
-    break;                                                                     \
-  }
-
-        GEN_ARM(CONST);
-        GEN_ARM(GET_LOCAL);
-        GEN_ARM(SET_LOCAL);
-        GEN_ARM(ADD);
-        GEN_ARM(SUB);
-        GEN_ARM(JUMP);
-        GEN_ARM(JUMP_IF_ZERO);
-        GEN_ARM(JUMP_IF_NEG);
-        GEN_ARM(CALL);
-        GEN_ARM(CALL_INDIRECT);
-        GEN_ARM(RETURN);
-        GEN_ARM(EXIT);
-      }
-    }
+  ip_value_t* sp;
+  ip_stencil_fn entry;
 
-    /* TODO get _SC_PAGESIZE */
-    posix_memalign(code, 4 * 1024, total_code_size);
-    if (NULL == *code) {
-      return 1;
-    }
-
-    memcpy(*code, tmp, total_code_size);
-
-    for (i = 0; i < ninsts; i++) {
-      labels[i] = *code + label_offsets[i];
-    }
-
-    ret = mprotect(*code, total_code_size, PROT_EXEC | PROT_READ);
-    if (ret) {
-      return 1;
-    }
-    return 0;
-  }
-  /* else exec */
-  size_t ip = 0;
-  size_t fp;
-  struct ip_proc* proc;
-  struct ip_inst_arg arg;
-  struct ip_vm* vm = vm_arg.exec.vm;
-  ip_proc_ref_t procref = vm_arg.exec.procref;
-
-#define LOCAL(i)                                                               \
-  ip_stack_ref(ip_value_t, &vm->stack, fp - (proc->nargs + proc->nlocals) + i)
-#define POP(ref)                                                               \
-  do {                                                                         \
-    if (ip_stack_pop(ip_value_t, &vm->stack, ref)) {                           \
-      return 1;                                                                \
-    }                                                                          \
-  } while (0)
-#define PUSH(v)                                                                \
-  do {                                                                         \
-    if (ip_stack_push(ip_value_t, &vm->stack, v)) {                            \
-      return 1;                                                                \
-    }                                                                          \
-  } while (0)
-#define POPN(n, ref)                                                           \
-  do {                                                                         \
-    size_t i;                                                                  \
-    for (i = 0; i < (n); i++)                                                  \
-      POP(ref);                                                                \
-  } while (0)
-#define PUSHN(n, v)                                                            \
-  do {                                                                         \
-    size_t i;                                                                  \
-    for (i = 0; i < (n); i++)                                                  \
-      PUSH(v);                                                                 \
-  } while (0)
-
-  proc = vm->procs[procref];
-
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
-  fp = ip_stack_size(ip_value_t, &vm->stack);
-
-#define NEXT() arg = proc->args[++ip];
-
-  arg = proc->args[ip];
-  goto * proc->code;
-
-L_CONST : {
-  ip_stack_push(ip_value_t, &vm->stack, arg.u.v);
-  NEXT();
-}
-L_CONST_END:
-L_GET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = arg.u.i;
-  v = LOCAL(i);
-
-  PUSH(v);
-  NEXT();
-}
-L_GET_LOCAL_END:
-L_SET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = arg.u.i;
-  POP(&v);
-
-  LOCAL(i) = v;
-
-  NEXT();
-}
-L_SET_LOCAL_END:
-L_ADD : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_INT2VALUE(x + y);
-
-  PUSH(ret);
-
-  NEXT();
-}
-L_ADD_END:
-L_SUB : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_LLINT2VALUE(x - y);
-
-  PUSH(ret);
-
-  NEXT();
-}
-L_SUB_END:
-L_JUMP : {
-  ip = arg.u.pos;
-  NEXT();
-  goto * proc->labels[ip];
-}
-L_JUMP_END:
-L_JUMP_IF_ZERO : {
-  ip_value_t v;
+  vm->st.bottom = vm->stack.data;
+  vm->st.limit = vm->stack.data + vm->stack.size;
+  vm->st.depth = 0;
+  vm->st.exited = 0;
 
-  POP(&v);
-
-  if (!IP_VALUE2LLINT(v)) {
-    ip = arg.u.pos;
-    NEXT();
-    goto * proc->labels[ip];
-  }
-  NEXT();
-}
-L_JUMP_IF_ZERO_END:
-L_JUMP_IF_NEG : {
-  ip_value_t v;
-
-  POP(&v);
-
-  if (IP_VALUE2LLINT(v) < 0) {
-    ip = arg.u.pos;
-    NEXT();
-    goto * proc->labels[ip];
-  }
-  NEXT();
-}
-L_JUMP_IF_NEG_END:
-L_CALL : {
-  int ret;
-  ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
-
-  ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
-  if (ret) {
-    return 1;
-  }
-
-  proc = vm->procs[arg.u.p];
-
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
-
-  ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
-
-  NEXT();
-  goto * proc->code;
-}
-L_CALL_END:
-L_CALL_INDIRECT : {
-  int ret;
-  ip_value_t p;
-  ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
-
-  POP(&p);
-
-  ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
-  if (ret) {
+  entry = (ip_stencil_fn)(void*)vm->procs[procref]->code;
+  sp = entry(vm->stack.data + vm->stack.sp, NULL, &vm->st);
+  if (NULL == sp) {
     return 1;
   }
 
-  proc = vm->procs[IP_VALUE2PROCREF(p)];
-
-  PUSHN(proc->nlocals, IP_INT2VALUE(0));
-
-  ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
-
-  NEXT();
-  goto * proc->code;
-}
-L_CALL_INDIRECT_END:
-L_RETURN : {
-  int ret;
-  ip_value_t v;
-  ip_value_t ignore;
-  ip_callinfo_t ci;
-
-  POP(&v);
-
-  POPN(proc->nlocals + proc->nargs, &ignore);
-
-  PUSH(v);
-
-  ret = ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci);
-  if (ret) {
-    return 1;
-  }
-
-  ip = ci.ip;
-  fp = ci.fp;
-  proc = ci.proc;
-
-  NEXT();
-  goto * proc->code;
-}
-L_RETURN_END:
-L_EXIT : {
-  ip_value_t v;
-  ip_value_t ignore;
-  POP(&v);
-
-  POPN(proc->nlocals + proc->nargs, &ignore);
-
-  PUSH(v);
-
-  return 0;
-}
-L_EXIT_END:
-  /* unreachable */
-  return 0;
+  vm->stack.sp = sp - vm->stack.data;
 
-#undef POP
-#undef PUSH
+  /* returning from the entry proc means there was no EXIT */
+  return vm->st.exited ? 0 : 1;
 }
 
 int
@@ -0,0 +1,197 @@
+#include "stencil.h"
+
+/**
+ * handlers of the copy-and-patch engine.
+ * This file is not linked. It is compiled to an object and its code is
+ * extracted by stencil_gen into vm_simple_jit_stencils.h.
+ */
+
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+#define CONTINUE() return IP_HOLE_CONTINUE(sp, base, st)
+
+ip_value_t*
+ip_stencil_ENTER(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  long long int i, nlocals = IP_HOLE_VALUE(IP_HOLE_NLOCALS);
+
+  base = sp - IP_HOLE_VALUE(IP_HOLE_NARGS);
+  if (UNLIKELY(st->limit - sp < nlocals || base < st->bottom)) {
+    return NULL;
+  }
+
+  for (i = 0; i < nlocals; i++) {
+    *sp++ = IP_LLINT2VALUE(0);
+  }
+
+  CONTINUE();
+}
+
+/* put before an inst whose pops may go below the stack, operand is the pops */
+ip_value_t*
+ip_stencil_CHECK_POP(ip_value_t* sp,
+                     ip_value_t* base,
+                     struct ip_stencil_state* st)
+{
+  if (UNLIKELY(sp - st->bottom < IP_HOLE_VALUE(IP_HOLE_OPERAND))) {
+    return NULL;
+  }
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_CONST(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  if (UNLIKELY(sp >= st->limit)) {
+    return NULL;
+  }
+  *sp++ = IP_LLINT2VALUE(IP_HOLE_VALUE(IP_HOLE_OPERAND));
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_GET_LOCAL(ip_value_t* sp,
+                     ip_value_t* base,
+                     struct ip_stencil_state* st)
+{
+  if (UNLIKELY(sp >= st->limit)) {
+    return NULL;
+  }
+  *sp++ = base[(int)IP_HOLE_VALUE(IP_HOLE_OPERAND)];
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_SET_LOCAL(ip_value_t* sp,
+                     ip_value_t* base,
+                     struct ip_stencil_state* st)
+{
+  base[(int)IP_HOLE_VALUE(IP_HOLE_OPERAND)] = *--sp;
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_ADD(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  long long int x, y;
+
+  y = IP_VALUE2LLINT(*--sp);
+  x = IP_VALUE2LLINT(sp[-1]);
+  sp[-1] = IP_LLINT2VALUE(x + y);
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_SUB(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  long long int x, y;
+
+  y = IP_VALUE2LLINT(*--sp);
+  x = IP_VALUE2LLINT(sp[-1]);
+  sp[-1] = IP_LLINT2VALUE(x - y);
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_JUMP(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  return IP_HOLE_JUMP(sp, base, st);
+}
+
+ip_value_t*
+ip_stencil_JUMP_IF_ZERO(ip_value_t* sp,
+                        ip_value_t* base,
+                        struct ip_stencil_state* st)
+{
+  if (!IP_VALUE2LLINT(*--sp)) {
+    return IP_HOLE_JUMP(sp, base, st);
+  }
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_JUMP_IF_NEG(ip_value_t* sp,
+                       ip_value_t* base,
+                       struct ip_stencil_state* st)
+{
+  if (IP_VALUE2LLINT(*--sp) < 0) {
+    return IP_HOLE_JUMP(sp, base, st);
+  }
+  CONTINUE();
+}
+
+static __inline__ ip_value_t*
+ip_stencil_call(ip_value_t* sp,
+                struct ip_stencil_state* st,
+                ip_proc_ref_t ref) __attribute__((always_inline));
+static __inline__ ip_value_t*
+ip_stencil_call(ip_value_t* sp, struct ip_stencil_state* st, ip_proc_ref_t ref)
+{
+  ip_stencil_fn entry;
+
+  if (UNLIKELY(ref < 0 || (size_t)ref >= st->nentries ||
+               st->depth >= IP_STENCIL_MAX_DEPTH)) {
+    return NULL;
+  }
+  entry = (ip_stencil_fn)st->entries[ref];
+  if (UNLIKELY(NULL == entry)) {
+    return NULL;
+  }
+
+  st->depth++;
+  sp = entry(sp, NULL, st);
+  st->depth--;
+
+  return sp;
+}
+
+ip_value_t*
+ip_stencil_CALL(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  sp = ip_stencil_call(sp, st, (ip_proc_ref_t)IP_HOLE_VALUE(IP_HOLE_OPERAND));
+  if (UNLIKELY(NULL == sp || st->exited)) {
+    return sp;
+  }
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_CALL_INDIRECT(ip_value_t* sp,
+                         ip_value_t* base,
+                         struct ip_stencil_state* st)
+{
+  ip_value_t p = *--sp;
+
+  sp = ip_stencil_call(sp, st, IP_VALUE2PROCREF(p));
+  if (UNLIKELY(NULL == sp || st->exited)) {
+    return sp;
+  }
+  CONTINUE();
+}
+
+ip_value_t*
+ip_stencil_RETURN(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  (void)st;
+  base[0] = sp[-1];
+  return base + 1;
+}
+
+ip_value_t*
+ip_stencil_EXIT(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  st->exited = 1;
+  base[0] = sp[-1];
+  return base + 1;
+}
+
+/* falling off the end of the code, or jumping out of it */
+ip_value_t*
+ip_stencil_ERROR(ip_value_t* sp, ip_value_t* base, struct ip_stencil_state* st)
+{
+  (void)sp;
+  (void)base;
+  (void)st;
+  return NULL;
+}
@@ -0,0 +1,1125 @@
+#include "arena.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "superinst.h"
+#include "tail_call.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * stack caching.
+ * The top two values of the stack are kept in local variables, which the
+ * compiler keeps in registers. Each inst has three handlers, one for each
+ * number of cached values (0, 1 or 2), and the handler is chosen when the
+ * code is compiled by tracking how many values each inst leaves cached.
+ * Jump targets, calls and returns are entered with nothing cached, so a
+ * FLUSH is inserted before a jump target reached with cached values.
+ *
+ *   state 0: nothing cached
+ *   state 1: t0 is the top
+ *   state 2: t1 is the top, t0 is below it
+ *
+ * GET_LOCAL; GET_LOCAL; SUB; JUMP_IF_NEG goes through the states
+ * 0, 1, 2, 1, 0 and never touches the stack.
+ *
+ * The insts are dispatched through a pointer to them, not copied. The
+ * superinsts of superinst.h have handlers for each state too, they are not
+ * made over a jump target as the FLUSH before it would be skipped. Procs
+ * that pass the verifier run on handlers without the stack checks.
+ */
+
+#define IP_NSTATES 3
+
+struct ip_inst_internal
+{
+  void* label;
+  union
+  {
+    ip_value_t v;
+    int i;
+    size_t pos;
+    ip_proc_ref_t p;
+  } u;
+};
+
+enum ip_vm_mode
+{
+  IP_VM_COMPILE,
+  IP_VM_EXEC,
+};
+union ip_vm_arg
+{
+  struct
+  {
+    struct ip_vm* vm;
+    ip_proc_ref_t procref;
+  } exec;
+  struct
+  {
+    size_t ninsts;
+    struct ip_inst* insts;
+    struct ip_inst_internal** result;
+    size_t* nresult;
+    /* to the handlers without checks if verified */
+    int verified;
+  } compile;
+};
+
+int
+ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg);
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst_internal* insts;
+  /* as registered, compiled again when verified */
+  size_t nsrc;
+  struct ip_inst* src;
+  /* the arena of the vm it was made in, or NULL */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+  /* the deepest point of the stack above the locals if verified, else 0 */
+  size_t depth;
+  int verified;
+};
+
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
+{
+  union ip_vm_arg arg;
+  struct ip_inst_internal* compiled;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  proc->arena = arena;
+  proc->src = ip_arena_alloc(arena, (ninsts + 1) * sizeof(struct ip_inst));
+  if (NULL == proc->src) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->nsrc = ninsts;
+  proc->depth = 0;
+  proc->verified = 0;
+  memcpy(proc->src, insts, ninsts * sizeof(struct ip_inst));
+
+  arg.compile.ninsts = ninsts;
+  arg.compile.insts = insts;
+  arg.compile.result = &proc->insts;
+  arg.compile.nresult = &proc->ninsts;
+  arg.compile.verified = 0;
+
+  if (ip_vm_main(IP_VM_COMPILE, arg)) {
+    ip_arena_release(arena, proc->src);
+    return 1;
+  }
+  if (NULL == arena) {
+    return 0;
+  }
+
+  /* the compiled insts without the room left for FLUSHes */
+  compiled = proc->insts;
+  proc->insts =
+    ip_arena_alloc(arena, proc->ninsts * sizeof(struct ip_inst_internal));
+  if (NULL != proc->insts) {
+    memcpy(
+      proc->insts, compiled, proc->ninsts * sizeof(struct ip_inst_internal));
+  }
+  free(compiled);
+
+  return NULL == proc->insts;
+}
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  ip_arena_release(proc->arena, proc->insts);
+  ip_arena_release(proc->arena, proc->src);
+}
+
+typedef struct ip_callinfo
+{
+  size_t ip;
+  size_t fp;
+  struct ip_proc* proc;
+} ip_callinfo_t;
+
+def_ip_stack(ip_callinfo_t);
+
+/**
+ * stack usage
+ *               previous sp        fp             sp
+ *                     v            v              v
+ *        --+----------+------------+--------------
+ * bottom <-| args ... | locals ... | data | data | -> top
+ *        --+----------+------------+--------------
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  ip_stack(ip_callinfo_t) callstack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* are the registered procs verified against each other */
+  int verified;
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
+};
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  ret = ip_stack_init(ip_callinfo_t, &vm->callstack, 1024);
+  if (ret) {
+    return 1;
+  }
+
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->verified = 0;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  return ip_stack_limit(ip_value_t, &vm->stack, nvalues) ||
+         ip_stack_limit(ip_callinfo_t, &vm->callstack, ncalls);
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  vm->procs[at] = proc;
+  vm->verified = 0;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc* proc;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
+}
+
+static int
+ip_vm_nargs(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (ref < 0 || vm->nprocs <= (size_t)ref || NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/* verifies every registered proc and compiles it again to the handlers of
+ * its kind, the number of compiled insts does not change. a proc registered
+ * again has all of them verified again */
+static int
+ip_vm_verify(struct ip_vm* vm)
+{
+  size_t p, n, depth;
+  int verified;
+  union ip_vm_arg arg;
+  struct ip_verify_proc src;
+  struct ip_inst_internal* compiled;
+  struct ip_proc* proc;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    proc = vm->procs[p];
+    if (NULL == proc) {
+      continue;
+    }
+
+    src.nargs = proc->nargs;
+    src.nlocals = proc->nlocals;
+    src.ninsts = proc->nsrc;
+    src.insts = proc->src;
+    verified = !ip_verify(&src, ip_vm_nargs, vm, &depth);
+    proc->depth = verified ? depth : 0;
+    if (verified == proc->verified) {
+      continue;
+    }
+
+    arg.compile.ninsts = proc->nsrc;
+    arg.compile.insts = proc->src;
+    arg.compile.result = &compiled;
+    arg.compile.nresult = &n;
+    arg.compile.verified = verified;
+    if (ip_vm_main(IP_VM_COMPILE, arg)) {
+      return 1;
+    }
+    memcpy(proc->insts, compiled, n * sizeof(struct ip_inst_internal));
+    free(compiled);
+    proc->verified = verified;
+  }
+  vm->verified = 1;
+
+  return 0;
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  union ip_vm_arg arg;
+
+  if (!vm->verified && ip_vm_verify(vm)) {
+    return 1;
+  }
+
+  arg.exec.vm = vm;
+  arg.exec.procref = procref;
+
+  return ip_vm_main(IP_VM_EXEC, arg);
+}
+
+
+/* number of cached values after an inst entered with `state` cached */
+static int
+ip_next_state(enum ip_code code, int state)
+{
+  switch (code) {
+    case IP_CODE_CONST:
+    case IP_CODE_GET_LOCAL:
+      return state < 2 ? state + 1 : 2;
+    case IP_CODE_SET_LOCAL:
+      return state ? state - 1 : 0;
+    case IP_CODE_ADD:
+    case IP_CODE_SUB:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int
+ip_vm_main(enum ip_vm_mode mode, union ip_vm_arg arg)
+{
+#define STATES(name) { &&L_##name##_0, &&L_##name##_1, &&L_##name##_2 }
+  static void* labels[][IP_NSTATES] = {
+    STATES(CONST),        STATES(GET_LOCAL),   STATES(SET_LOCAL),
+    STATES(ADD),          STATES(SUB),         STATES(JUMP),
+    STATES(JUMP_IF_ZERO), STATES(JUMP_IF_NEG), STATES(CALL),
+    STATES(CALL_INDIRECT), STATES(RETURN),     STATES(EXIT),
+    STATES(TAIL_CALL),
+  /* superinsts, in the order of ip_superinsts */
+#define IP_SUPERINST2(a, b) STATES(a##_##b),
+#define IP_SUPERINST3(a, b, c) STATES(a##_##b##_##c),
+#define IP_SUPERINST4(a, b, c, d) STATES(a##_##b##_##c##_##d),
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+  };
+  /* the handlers of the verified procs */
+  static void* verified_labels[][IP_NSTATES] = {
+    STATES(V_CONST),        STATES(V_GET_LOCAL),   STATES(V_SET_LOCAL),
+    STATES(V_ADD),          STATES(V_SUB),         STATES(JUMP),
+    STATES(V_JUMP_IF_ZERO), STATES(V_JUMP_IF_NEG), STATES(CALL),
+    STATES(CALL_INDIRECT),  STATES(V_RETURN),      STATES(V_EXIT),
+    STATES(TAIL_CALL),
+#define IP_SUPERINST2(a, b) STATES(V_##a##_##b),
+#define IP_SUPERINST3(a, b, c) STATES(V_##a##_##b##_##c),
+#define IP_SUPERINST4(a, b, c, d) STATES(V_##a##_##b##_##c##_##d),
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+  };
+#undef STATES
+  static void* flush_labels[IP_NSTATES] = { NULL, &&L_FLUSH_1, &&L_FLUSH_2 };
+
+  if (IP_VM_COMPILE == mode) {
+    size_t i, j, n = 0, ninsts = arg.compile.ninsts;
+    struct ip_inst* insts = arg.compile.insts;
+    void* (*table)[IP_NSTATES] =
+      arg.compile.verified ? verified_labels : labels;
+    struct ip_inst_internal* result;
+    size_t* map;
+    char* targets;
+    int state = 0, s;
+
+    /* at most one FLUSH per inst, and END */
+    result = malloc((2 * ninsts + 1) * sizeof(struct ip_inst_internal));
+    map = malloc((ninsts + 1) * sizeof(size_t));
+    targets = calloc(ninsts + 1, sizeof(char));
+    if (NULL == result || NULL == map || NULL == targets) {
+      free(result);
+      free(map);
+      free(targets);
+      return 1;
+    }
+
+    for (i = 0; i < ninsts; i++) {
+      enum ip_code code = insts[i].code;
+      if ((IP_CODE_JUMP == code || IP_CODE_JUMP_IF_ZERO == code ||
+           IP_CODE_JUMP_IF_NEG == code) &&
+          insts[i].u.pos + 1 <= ninsts) {
+        targets[insts[i].u.pos + 1] = 1;
+      }
+    }
+
+    for (i = 0; i <= ninsts; i++) {
+      struct ip_inst_internal inst;
+
+      if (targets[i] && state) {
+        inst.label = flush_labels[state];
+        inst.u.v = 0;
+        result[n++] = inst;
+        state = 0;
+      }
+
+      map[i] = n;
+      if (i == ninsts) {
+        inst.label = &&L_END;
+        inst.u.v = 0;
+        result[n++] = inst;
+        break;
+      }
+
+      if (insts[i].code > IP_CODE_TAIL_CALL) {
+        printf("code: %d, u: %d", insts[i].code, insts[i].u.i);
+        free(result);
+        free(map);
+        free(targets);
+        return 1;
+      }
+
+      inst.label = table[IP_TAIL_CALL_AT(insts, ninsts, i) ? IP_CODE_TAIL_CALL
+                                                           : insts[i].code]
+                        [state];
+      inst.u.v = insts[i].u.v;
+      inst.u.i = insts[i].u.i;
+      inst.u.pos = insts[i].u.pos;
+      inst.u.p = insts[i].u.p;
+
+      /* the following insts are kept for jumps into the superinst, which
+       * must not go over the FLUSH of a jump target */
+      s = ip_superinst_match(insts, ninsts, i);
+      for (j = 1; 0 <= s && j < ip_superinsts[s].len; j++) {
+        if (targets[i + j]) {
+          s = -1;
+        }
+      }
+      if (0 <= s) {
+        inst.label = table[IP_CODE_TAIL_CALL + 1 + s][state];
+      }
+      result[n++] = inst;
+
+      state = ip_next_state(insts[i].code, state);
+    }
+
+    /* jumps land after the target, as `ip` is incremented afterwards */
+    for (i = 0; i < ninsts; i++) {
+      enum ip_code code = insts[i].code;
+      if (IP_CODE_JUMP == code || IP_CODE_JUMP_IF_ZERO == code ||
+          IP_CODE_JUMP_IF_NEG == code) {
+        size_t pos = insts[i].u.pos + 1;
+        result[map[i]].u.pos = map[pos <= ninsts ? pos : ninsts] - 1;
+      }
+    }
+
+    free(map);
+    free(targets);
+
+    *arg.compile.result = result;
+    *arg.compile.nresult = n;
+    return 0;
+  }
+  /* else exec */
+  size_t ip = 0;
+  size_t fp;
+  struct ip_proc* proc;
+  const struct ip_inst_internal* inst;
+  struct ip_vm* vm = arg.exec.vm;
+  ip_proc_ref_t procref = arg.exec.procref;
+  ip_value_t t0 = IP_LLINT2VALUE(0), t1 = IP_LLINT2VALUE(0);
+
+#define LOCAL(i)                                                               \
+  ip_stack_ref(ip_value_t, &vm->stack, fp - (proc->nargs + proc->nlocals) + i)
+#define POP(ref)                                                               \
+  do {                                                                         \
+    if (ip_stack_pop(ip_value_t, &vm->stack, ref)) {                           \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    if (ip_stack_push(ip_value_t, &vm->stack, v)) {                            \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+#define POPN(n, ref)                                                           \
+  do {                                                                         \
+    size_t i;                                                                  \
+    for (i = 0; i < (n); i++)                                                  \
+      POP(ref);                                                                \
+  } while (0)
+/* the frame of proc over its args, with room for its deepest point if it
+ * is verified */
+#define ENTER()                                                                \
+  do {                                                                         \
+    size_t i;                                                                  \
+                                                                               \
+    if (vm->stack.sp < proc->nargs ||                                          \
+        (vm->stack.size - vm->stack.sp < proc->nlocals + proc->depth &&        \
+         ip_stack_grow(                                                        \
+           ip_value_t, &vm->stack, proc->nlocals + proc->depth))) {            \
+      return 1;                                                                \
+    }                                                                          \
+    for (i = 0; i < proc->nlocals; i++) {                                      \
+      ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) =                   \
+        IP_LLINT2VALUE(0);                                                     \
+    }                                                                          \
+    fp = vm->stack.sp;                                                         \
+  } while (0)
+
+  proc = vm->procs[procref];
+
+  ENTER();
+
+  /* the insts are read in place, not copied */
+#define JUMP()                                                                 \
+  do {                                                                         \
+    inst = &proc->insts[++ip];                                                 \
+    goto* inst->label;                                                         \
+  } while (0)
+
+  inst = proc->insts;
+  goto* inst->label;
+
+  /* the handler bodies by number of cached values, shared with the
+   * superinsts. pushing a value */
+#define OP_PUSH_0(v)                                                           \
+  do {                                                                         \
+    t0 = (v);                                                                  \
+  } while (0)
+#define OP_PUSH_1(v)                                                           \
+  do {                                                                         \
+    t1 = (v);                                                                  \
+  } while (0)
+#define OP_PUSH_2(v)                                                           \
+  do {                                                                         \
+    PUSH(t0);                                                                  \
+    t0 = t1;                                                                   \
+    t1 = (v);                                                                  \
+  } while (0)
+#define OP_CONST_0() OP_PUSH_0(inst->u.v)
+#define OP_CONST_1() OP_PUSH_1(inst->u.v)
+#define OP_CONST_2() OP_PUSH_2(inst->u.v)
+#define OP_GET_LOCAL_0() OP_PUSH_0(LOCAL(inst->u.i))
+#define OP_GET_LOCAL_1() OP_PUSH_1(LOCAL(inst->u.i))
+#define OP_GET_LOCAL_2() OP_PUSH_2(LOCAL(inst->u.i))
+#define OP_SET_LOCAL_0()                                                       \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+    LOCAL(inst->u.i) = v;                                                      \
+  } while (0)
+#define OP_SET_LOCAL_1()                                                       \
+  do {                                                                         \
+    LOCAL(inst->u.i) = t0;                                                     \
+  } while (0)
+#define OP_SET_LOCAL_2()                                                       \
+  do {                                                                         \
+    LOCAL(inst->u.i) = t1;                                                     \
+  } while (0)
+
+  /* the result is left in t0 */
+#define OP_ARITH_0(OP)                                                         \
+  do {                                                                         \
+    ip_value_t v1, v2;                                                         \
+                                                                               \
+    POP(&v1);                                                                  \
+    POP(&v2);                                                                  \
+    t0 = IP_LLINT2VALUE(IP_VALUE2LLINT(v2) OP IP_VALUE2LLINT(v1));             \
+  } while (0)
+#define OP_ARITH_1(OP)                                                         \
+  do {                                                                         \
+    ip_value_t v2;                                                             \
+                                                                               \
+    POP(&v2);                                                                  \
+    t0 = IP_LLINT2VALUE(IP_VALUE2LLINT(v2) OP IP_VALUE2LLINT(t0));             \
+  } while (0)
+#define OP_ARITH_2(OP)                                                         \
+  do {                                                                         \
+    t0 = IP_LLINT2VALUE(IP_VALUE2LLINT(t0) OP IP_VALUE2LLINT(t1));             \
+  } while (0)
+#define OP_ADD_0() OP_ARITH_0(+)
+#define OP_ADD_1() OP_ARITH_1(+)
+#define OP_ADD_2() OP_ARITH_2(+)
+#define OP_SUB_0() OP_ARITH_0(-)
+#define OP_SUB_1() OP_ARITH_1(-)
+#define OP_SUB_2() OP_ARITH_2(-)
+
+  /* jump targets are entered with nothing cached */
+#define OP_JUMP_0()                                                            \
+  do {                                                                         \
+    ip = inst->u.pos;                                                          \
+  } while (0)
+#define OP_JUMP_1()                                                            \
+  do {                                                                         \
+    PUSH(t0);                                                                  \
+    ip = inst->u.pos;                                                          \
+  } while (0)
+#define OP_JUMP_2()                                                            \
+  do {                                                                         \
+    PUSH(t0);                                                                  \
+    PUSH(t1);                                                                  \
+    ip = inst->u.pos;                                                          \
+  } while (0)
+
+  /* the value tested is taken, what is left is flushed */
+#define OP_BRANCH_0(COND)                                                      \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+    if (COND(IP_VALUE2LLINT(v))) {                                             \
+      ip = inst->u.pos;                                                        \
+    }                                                                          \
+  } while (0)
+#define OP_BRANCH_1(COND)                                                      \
+  do {                                                                         \
+    if (COND(IP_VALUE2LLINT(t0))) {                                            \
+      ip = inst->u.pos;                                                        \
+    }                                                                          \
+  } while (0)
+#define OP_BRANCH_2(COND)                                                      \
+  do {                                                                         \
+    PUSH(t0);                                                                  \
+    if (COND(IP_VALUE2LLINT(t1))) {                                            \
+      ip = inst->u.pos;                                                        \
+    }                                                                          \
+  } while (0)
+#define IS_ZERO(v) (!(v))
+#define IS_NEG(v) ((v) < 0)
+#define OP_JUMP_IF_ZERO_0() OP_BRANCH_0(IS_ZERO)
+#define OP_JUMP_IF_ZERO_1() OP_BRANCH_1(IS_ZERO)
+#define OP_JUMP_IF_ZERO_2() OP_BRANCH_2(IS_ZERO)
+#define OP_JUMP_IF_NEG_0() OP_BRANCH_0(IS_NEG)
+#define OP_JUMP_IF_NEG_1() OP_BRANCH_1(IS_NEG)
+#define OP_JUMP_IF_NEG_2() OP_BRANCH_2(IS_NEG)
+
+  /* the handlers of an op, one per number of cached values */
+#define HANDLERS(NAME, OP)                                                     \
+  L_##NAME##_0 : {                                                             \
+    OP##_0();                                                                  \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##NAME##_1 : {                                                             \
+    OP##_1();                                                                  \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##NAME##_2 : {                                                             \
+    OP##_2();                                                                  \
+    JUMP();                                                                    \
+  }
+
+  HANDLERS(CONST, OP_CONST)
+  HANDLERS(GET_LOCAL, OP_GET_LOCAL)
+  HANDLERS(SET_LOCAL, OP_SET_LOCAL)
+  HANDLERS(ADD, OP_ADD)
+  HANDLERS(SUB, OP_SUB)
+  HANDLERS(JUMP, OP_JUMP)
+  HANDLERS(JUMP_IF_ZERO, OP_JUMP_IF_ZERO)
+  HANDLERS(JUMP_IF_NEG, OP_JUMP_IF_NEG)
+
+  /* the args are passed on the stack */
+L_CALL_2 : {
+  PUSH(t0);
+  t0 = t1;
+  goto L_CALL_1;
+}
+L_CALL_1 : {
+  PUSH(t0);
+  goto L_CALL_0;
+}
+L_CALL_0 : {
+  int ret;
+  ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
+
+  ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
+  if (ret) {
+    return 1;
+  }
+
+  proc = vm->procs[inst->u.p];
+
+  ENTER();
+
+  ip = -1;
+
+  JUMP();
+}
+L_CALL_INDIRECT_2 : {
+  PUSH(t0);
+  t0 = t1;
+  goto L_CALL_INDIRECT_1;
+}
+L_CALL_INDIRECT_0 : {
+  POP(&t0);
+  goto L_CALL_INDIRECT_1;
+}
+L_CALL_INDIRECT_1 : {
+  int ret;
+  ip_value_t p = t0;
+  ip_callinfo_t ci = { .ip = ip, .fp = fp, .proc = proc };
+
+  ret = ip_stack_push(ip_callinfo_t, &vm->callstack, ci);
+  if (ret) {
+    return 1;
+  }
+
+  proc = vm->procs[IP_VALUE2PROCREF(p)];
+
+  ENTER();
+
+  ip = -1;
+
+  JUMP();
+}
+L_RETURN_2 : {
+  PUSH(t0);
+  t0 = t1;
+  goto L_RETURN_1;
+}
+L_RETURN_0 : {
+  POP(&t0);
+  goto L_RETURN_1;
+}
+L_RETURN_1 : {
+  int ret;
+  size_t base;
+  ip_value_t ignore;
+  ip_callinfo_t ci;
+
+  base = fp - (proc->nlocals + proc->nargs);
+
+  POPN(proc->nlocals + proc->nargs, &ignore);
+
+  PUSH(t0);
+
+  ret = ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci);
+  if (ret) {
+    return 1;
+  }
+  /* a verified caller runs on the depth it expects after the call */
+  if (ci.proc->verified && base + 1 != vm->stack.sp) {
+    return 1;
+  }
+
+  ip = ci.ip;
+  fp = ci.fp;
+  proc = ci.proc;
+
+  JUMP();
+}
+L_EXIT_2 : {
+  PUSH(t0);
+  t0 = t1;
+  goto L_EXIT_1;
+}
+L_EXIT_0 : {
+  POP(&t0);
+  goto L_EXIT_1;
+}
+L_EXIT_1 : {
+  ip_value_t ignore;
+
+  POPN(proc->nlocals + proc->nargs, &ignore);
+
+  PUSH(t0);
+
+  return 0;
+}
+L_TAIL_CALL_2 : {
+  PUSH(t0);
+  t0 = t1;
+  goto L_TAIL_CALL_1;
+}
+L_TAIL_CALL_1 : {
+  PUSH(t0);
+  goto L_TAIL_CALL_0;
+}
+L_TAIL_CALL_0 : {
+  size_t base, sp;
+  struct ip_proc* callee;
+
+  callee = vm->procs[inst->u.p];
+  base = fp - (proc->nargs + proc->nlocals);
+  sp = ip_stack_size(ip_value_t, &vm->stack);
+  if (sp < callee->nargs) {
+    return 1;
+  }
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(&ip_stack_ref(ip_value_t, &vm->stack, base),
+          &ip_stack_ref(ip_value_t, &vm->stack, sp - callee->nargs),
+          callee->nargs * sizeof(ip_value_t));
+  vm->stack.sp = base + callee->nargs;
+
+  proc = callee;
+
+  ENTER();
+
+  ip = -1;
+
+  JUMP();
+}
+L_FLUSH_2 : {
+  PUSH(t0);
+  PUSH(t1);
+  JUMP();
+}
+L_FLUSH_1 : {
+  PUSH(t0);
+  JUMP();
+}
+L_END : {
+  /* fell off the end of the code */
+  return 1;
+}
+
+  /* run the bodies of the insts in order, without dispatching in between.
+   * the number of cached values after each one is known when the handler
+   * is written, AFTER gives it */
+#define NEXT() inst = &proc->insts[++ip]
+#define AFTER(op, state) AFTER_(op, state)
+#define AFTER_(op, state) AFTER_##op##_##state
+#define AFTER_CONST_0 1
+#define AFTER_CONST_1 2
+#define AFTER_CONST_2 2
+#define AFTER_GET_LOCAL_0 1
+#define AFTER_GET_LOCAL_1 2
+#define AFTER_GET_LOCAL_2 2
+#define AFTER_SET_LOCAL_0 0
+#define AFTER_SET_LOCAL_1 0
+#define AFTER_SET_LOCAL_2 1
+#define AFTER_ADD_0 1
+#define AFTER_ADD_1 1
+#define AFTER_ADD_2 1
+#define AFTER_SUB_0 1
+#define AFTER_SUB_1 1
+#define AFTER_SUB_2 1
+#define RUN(op, state) RUN_(op, state)
+#define RUN_(op, state) OP_##op##_##state()
+#define SUPER2(a, b, state)                                                    \
+  RUN(a, state);                                                               \
+  NEXT();                                                                      \
+  RUN(b, AFTER(a, state))
+#define SUPER3(a, b, c, state)                                                 \
+  SUPER2(a, b, state);                                                         \
+  NEXT();                                                                      \
+  RUN(c, AFTER(b, AFTER(a, state)))
+#define SUPER4(a, b, c, d, state)                                              \
+  SUPER3(a, b, c, state);                                                      \
+  NEXT();                                                                      \
+  RUN(d, AFTER(c, AFTER(b, AFTER(a, state))))
+#define IP_SUPERINST2(a, b)                                                    \
+  L_##a##_##b##_0 : {                                                          \
+    SUPER2(a, b, 0);                                                           \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_1 : {                                                          \
+    SUPER2(a, b, 1);                                                           \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_2 : {                                                          \
+    SUPER2(a, b, 2);                                                           \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_##a##_##b##_##c##_0 : {                                                    \
+    SUPER3(a, b, c, 0);                                                        \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_##c##_1 : {                                                    \
+    SUPER3(a, b, c, 1);                                                        \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_##c##_2 : {                                                    \
+    SUPER3(a, b, c, 2);                                                        \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_##a##_##b##_##c##_##d##_0 : {                                              \
+    SUPER4(a, b, c, d, 0);                                                     \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_##c##_##d##_1 : {                                              \
+    SUPER4(a, b, c, d, 1);                                                     \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_##a##_##b##_##c##_##d##_2 : {                                              \
+    SUPER4(a, b, c, d, 2);                                                     \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+
+#undef POP
+#undef PUSH
+  /* the handlers of the verified procs. ENTER reserved their stack, it can
+   * neither overflow nor underflow */
+#define POP(ref)                                                               \
+  do {                                                                         \
+    *(ref) = ip_stack_ref(ip_value_t, &vm->stack, --vm->stack.sp);             \
+  } while (0)
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) = (v);                \
+  } while (0)
+
+  HANDLERS(V_CONST, OP_CONST)
+  HANDLERS(V_GET_LOCAL, OP_GET_LOCAL)
+  HANDLERS(V_SET_LOCAL, OP_SET_LOCAL)
+  HANDLERS(V_ADD, OP_ADD)
+  HANDLERS(V_SUB, OP_SUB)
+  HANDLERS(V_JUMP_IF_ZERO, OP_JUMP_IF_ZERO)
+  HANDLERS(V_JUMP_IF_NEG, OP_JUMP_IF_NEG)
+
+  /* the result is the only value over the frame */
+L_V_RETURN_2 : {
+  t0 = t1;
+  goto L_V_RETURN_1;
+}
+L_V_RETURN_0 : {
+  POP(&t0);
+  goto L_V_RETURN_1;
+}
+L_V_RETURN_1 : {
+  int ret;
+  ip_callinfo_t ci;
+
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(t0);
+
+  ret = ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci);
+  if (ret) {
+    return 1;
+  }
+
+  ip = ci.ip;
+  fp = ci.fp;
+  proc = ci.proc;
+
+  JUMP();
+}
+L_V_EXIT_2 : {
+  t0 = t1;
+  goto L_V_EXIT_1;
+}
+L_V_EXIT_0 : {
+  POP(&t0);
+  goto L_V_EXIT_1;
+}
+L_V_EXIT_1 : {
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(t0);
+
+  return 0;
+}
+
+#define IP_SUPERINST2(a, b)                                                    \
+  L_V_##a##_##b##_0 : {                                                        \
+    SUPER2(a, b, 0);                                                           \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_1 : {                                                        \
+    SUPER2(a, b, 1);                                                           \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_2 : {                                                        \
+    SUPER2(a, b, 2);                                                           \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_V_##a##_##b##_##c##_0 : {                                                  \
+    SUPER3(a, b, c, 0);                                                        \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_##c##_1 : {                                                  \
+    SUPER3(a, b, c, 1);                                                        \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_##c##_2 : {                                                  \
+    SUPER3(a, b, c, 2);                                                        \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_V_##a##_##b##_##c##_##d##_0 : {                                            \
+    SUPER4(a, b, c, d, 0);                                                     \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_##c##_##d##_1 : {                                            \
+    SUPER4(a, b, c, d, 1);                                                     \
+    JUMP();                                                                    \
+  }                                                                            \
+  L_V_##a##_##b##_##c##_##d##_2 : {                                            \
+    SUPER4(a, b, c, d, 2);                                                     \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#undef SUPER2
+#undef SUPER3
+#undef SUPER4
+#undef RUN
+#undef RUN_
+#undef AFTER
+#undef AFTER_
+#undef NEXT
+#undef HANDLERS
+#undef IS_ZERO
+#undef IS_NEG
+
+#undef POP
+#undef PUSH
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
@@ -0,0 +1,633 @@
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * tail call dispatched vm.
+ * Every op is a function of its own taking the interpreter state in
+ * argument registers, and dispatch is a tail call to the handler of the
+ * next inst. The compiler allocates registers per handler instead of for
+ * one huge function, and nothing relies on computed goto.
+ * The tail calls are guaranteed by musttail on clang. gcc turns them into
+ * jumps as sibling calls when optimizing, which this engine needs: without
+ * it the C stack grows with every inst run.
+ */
+
+#if defined(__clang__)
+#define MUSTTAIL __attribute__((musttail))
+#else
+#define MUSTTAIL
+#endif
+
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+struct ip_vm;
+struct ip_tinst;
+
+/* returns 0 on EXIT and 1 on error */
+typedef int ip_handler_fn(const struct ip_tinst* ip,
+                          ip_value_t* sp,
+                          ip_value_t* fp,
+                          struct ip_vm* vm);
+
+struct ip_tinst
+{
+  ip_handler_fn* handler;
+  union
+  {
+    ip_value_t v;
+    int i;
+    /* the inst run after a taken jump */
+    const struct ip_tinst* target;
+    ip_proc_ref_t p;
+    /* the args and locals dropped by RETURN and EXIT */
+    size_t nframe;
+  } u;
+};
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_tinst* insts;
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
+};
+
+typedef struct ip_callinfo
+{
+  const struct ip_tinst* ip;
+  ip_value_t* fp;
+} ip_callinfo_t;
+
+/**
+ * stack usage
+ *               fp                               sp
+ *               v                                v
+ *        --+----------+------------+--------------
+ * bottom <-| args ... | locals ... | data | data | -> top
+ *        --+----------+------------+--------------
+ * fp points to the first arg so that RETURN needs nothing from the proc.
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  ip_value_t* limit;
+  ip_callinfo_t* callstack;
+  ip_callinfo_t* csp;
+  ip_callinfo_t* climit;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+};
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    MUSTTAIL return ip->handler(ip, sp, fp, vm);                               \
+  } while (0)
+#define NEXT()                                                                 \
+  do {                                                                         \
+    ip++;                                                                      \
+    DISPATCH();                                                                \
+  } while (0)
+#define LOCAL(i) fp[i]
+/* there are less than `n` values on the stack */
+#define UNDERFLOWS(n) ((size_t)(sp - vm->stack.data) < (n))
+
+static int
+ip_op_CONST(const struct ip_tinst* ip,
+            ip_value_t* sp,
+            ip_value_t* fp,
+            struct ip_vm* vm)
+{
+  if (UNLIKELY(sp >= vm->limit)) {
+    return 1;
+  }
+  *sp++ = ip->u.v;
+  NEXT();
+}
+
+static int
+ip_op_GET_LOCAL(const struct ip_tinst* ip,
+                ip_value_t* sp,
+                ip_value_t* fp,
+                struct ip_vm* vm)
+{
+  if (UNLIKELY(sp >= vm->limit)) {
+    return 1;
+  }
+  *sp++ = LOCAL(ip->u.i);
+  NEXT();
+}
+
+static int
+ip_op_SET_LOCAL(const struct ip_tinst* ip,
+                ip_value_t* sp,
+                ip_value_t* fp,
+                struct ip_vm* vm)
+{
+  if (UNLIKELY(UNDERFLOWS(1))) {
+    return 1;
+  }
+  LOCAL(ip->u.i) = *--sp;
+  NEXT();
+}
+
+static int
+ip_op_ADD(const struct ip_tinst* ip,
+          ip_value_t* sp,
+          ip_value_t* fp,
+          struct ip_vm* vm)
+{
+  long long int x, y;
+
+  if (UNLIKELY(UNDERFLOWS(2))) {
+    return 1;
+  }
+  y = IP_VALUE2LLINT(*--sp);
+  x = IP_VALUE2LLINT(sp[-1]);
+  sp[-1] = IP_LLINT2VALUE(x + y);
+  NEXT();
+}
+
+static int
+ip_op_SUB(const struct ip_tinst* ip,
+          ip_value_t* sp,
+          ip_value_t* fp,
+          struct ip_vm* vm)
+{
+  long long int x, y;
+
+  if (UNLIKELY(UNDERFLOWS(2))) {
+    return 1;
+  }
+  y = IP_VALUE2LLINT(*--sp);
+  x = IP_VALUE2LLINT(sp[-1]);
+  sp[-1] = IP_LLINT2VALUE(x - y);
+  NEXT();
+}
+
+static int
+ip_op_JUMP(const struct ip_tinst* ip,
+           ip_value_t* sp,
+           ip_value_t* fp,
+           struct ip_vm* vm)
+{
+  ip = ip->u.target;
+  DISPATCH();
+}
+
+static int
+ip_op_JUMP_IF_ZERO(const struct ip_tinst* ip,
+                   ip_value_t* sp,
+                   ip_value_t* fp,
+                   struct ip_vm* vm)
+{
+  if (UNLIKELY(UNDERFLOWS(1))) {
+    return 1;
+  }
+  if (!IP_VALUE2LLINT(*--sp)) {
+    ip = ip->u.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+
+static int
+ip_op_JUMP_IF_NEG(const struct ip_tinst* ip,
+                  ip_value_t* sp,
+                  ip_value_t* fp,
+                  struct ip_vm* vm)
+{
+  if (UNLIKELY(UNDERFLOWS(1))) {
+    return 1;
+  }
+  if (IP_VALUE2LLINT(*--sp) < 0) {
+    ip = ip->u.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+
+/* the args are on the stack. returns the first inst of the proc */
+static __inline__ const struct ip_tinst*
+ip_call(const struct ip_tinst* ip,
+        ip_value_t** sp,
+        ip_value_t** fp,
+        struct ip_vm* vm,
+        ip_proc_ref_t p) __attribute__((always_inline));
+static __inline__ const struct ip_tinst*
+ip_call(const struct ip_tinst* ip,
+        ip_value_t** sp,
+        ip_value_t** fp,
+        struct ip_vm* vm,
+        ip_proc_ref_t p)
+{
+  struct ip_proc* proc;
+  size_t i;
+
+  if (UNLIKELY(p < 0 || (size_t)p >= vm->nprocs || NULL == vm->procs[p] ||
+               vm->csp >= vm->climit)) {
+    return NULL;
+  }
+  proc = vm->procs[p];
+  if (UNLIKELY((size_t)(vm->limit - *sp) < proc->nlocals ||
+               (size_t)(*sp - vm->stack.data) < proc->nargs)) {
+    return NULL;
+  }
+
+  vm->csp->ip = ip + 1;
+  vm->csp->fp = *fp;
+  vm->csp++;
+
+  *fp = *sp - proc->nargs;
+  for (i = 0; i < proc->nlocals; i++) {
+    *(*sp)++ = IP_LLINT2VALUE(0);
+  }
+
+  return proc->insts;
+}
+
+static int
+ip_op_CALL(const struct ip_tinst* ip,
+           ip_value_t* sp,
+           ip_value_t* fp,
+           struct ip_vm* vm)
+{
+  ip = ip_call(ip, &sp, &fp, vm, ip->u.p);
+  if (UNLIKELY(NULL == ip)) {
+    return 1;
+  }
+  DISPATCH();
+}
+
+static int
+ip_op_TAIL_CALL(const struct ip_tinst* ip,
+                ip_value_t* sp,
+                ip_value_t* fp,
+                struct ip_vm* vm)
+{
+  struct ip_proc* proc;
+  ip_proc_ref_t p = ip->u.p;
+  size_t i;
+
+  if (UNLIKELY(p < 0 || (size_t)p >= vm->nprocs || NULL == vm->procs[p])) {
+    return 1;
+  }
+  proc = vm->procs[p];
+  if (UNLIKELY(UNDERFLOWS(proc->nargs))) {
+    return 1;
+  }
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(fp, sp - proc->nargs, proc->nargs * sizeof(ip_value_t));
+  sp = fp + proc->nargs;
+  if (UNLIKELY((size_t)(vm->limit - sp) < proc->nlocals)) {
+    return 1;
+  }
+  for (i = 0; i < proc->nlocals; i++) {
+    *sp++ = IP_LLINT2VALUE(0);
+  }
+
+  ip = proc->insts;
+  DISPATCH();
+}
+
+static int
+ip_op_CALL_INDIRECT(const struct ip_tinst* ip,
+                    ip_value_t* sp,
+                    ip_value_t* fp,
+                    struct ip_vm* vm)
+{
+  ip_value_t p;
+
+  if (UNLIKELY(UNDERFLOWS(1))) {
+    return 1;
+  }
+  p = *--sp;
+  ip = ip_call(ip, &sp, &fp, vm, IP_VALUE2PROCREF(p));
+  if (UNLIKELY(NULL == ip)) {
+    return 1;
+  }
+  DISPATCH();
+}
+
+static int
+ip_op_RETURN(const struct ip_tinst* ip,
+             ip_value_t* sp,
+             ip_value_t* fp,
+             struct ip_vm* vm)
+{
+  if (UNLIKELY(vm->csp == vm->callstack || UNDERFLOWS(1 + ip->u.nframe))) {
+    return 1;
+  }
+
+  fp[0] = sp[-1];
+  sp = fp + 1;
+
+  vm->csp--;
+  ip = vm->csp->ip;
+  fp = vm->csp->fp;
+  DISPATCH();
+}
+
+static int
+ip_op_EXIT(const struct ip_tinst* ip,
+           ip_value_t* sp,
+           ip_value_t* fp,
+           struct ip_vm* vm)
+{
+  if (UNLIKELY(UNDERFLOWS(1 + ip->u.nframe))) {
+    return 1;
+  }
+
+  fp[0] = sp[-1];
+  sp = fp + 1;
+
+  vm->stack.sp = sp - vm->stack.data;
+  return 0;
+}
+
+/* falling off the end of the code */
+static int
+ip_op_END(const struct ip_tinst* ip,
+          ip_value_t* sp,
+          ip_value_t* fp,
+          struct ip_vm* vm)
+{
+  (void)ip;
+  (void)sp;
+  (void)fp;
+  (void)vm;
+
+  return 1;
+}
+
+#undef UNDERFLOWS
+#undef LOCAL
+#undef NEXT
+#undef DISPATCH
+
+static ip_handler_fn* ip_handlers[] = {
+  ip_op_CONST,        ip_op_GET_LOCAL,    ip_op_SET_LOCAL,
+  ip_op_ADD,          ip_op_SUB,          ip_op_JUMP,
+  ip_op_JUMP_IF_ZERO, ip_op_JUMP_IF_NEG,  ip_op_CALL,
+  ip_op_CALL_INDIRECT, ip_op_RETURN,      ip_op_EXIT,
+  ip_op_TAIL_CALL,
+};
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  size_t i;
+
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  /* and END */
+  proc->insts = malloc((ninsts + 1) * sizeof(struct ip_tinst));
+  if (NULL == proc->insts) {
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+
+  for (i = 0; i < ninsts; i++) {
+    struct ip_tinst* inst = &proc->insts[i];
+    enum ip_code code = insts[i].code;
+
+    if (code > IP_CODE_TAIL_CALL) {
+      printf("code: %d, u: %d", insts[i].code, insts[i].u.i);
+      free(proc->insts);
+      return 1;
+    }
+    if (IP_TAIL_CALL_AT(insts, ninsts, i)) {
+      code = IP_CODE_TAIL_CALL;
+    }
+    inst->handler = ip_handlers[code];
+    switch (code) {
+      case IP_CODE_JUMP:
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG: {
+        /* jumps land after the target, as `ip` is incremented afterwards */
+        size_t pos = insts[i].u.pos + 1;
+        inst->u.target = &proc->insts[pos <= ninsts ? pos : ninsts];
+        break;
+      }
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_SET_LOCAL: {
+        inst->u.i = insts[i].u.i;
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_TAIL_CALL: {
+        inst->u.p = insts[i].u.p;
+        break;
+      }
+      case IP_CODE_RETURN:
+      case IP_CODE_EXIT: {
+        inst->u.nframe = nargs + nlocals;
+        break;
+      }
+      default: {
+        inst->u.v = insts[i].u.v;
+        break;
+      }
+    }
+  }
+  proc->insts[ninsts].handler = ip_op_END;
+  proc->insts[ninsts].u.v = 0;
+
+  return 0;
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  free(proc->insts);
+}
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+  vm->limit = vm->stack.data + vm->stack.size;
+
+  vm->callstack = malloc(1024 * sizeof(ip_callinfo_t));
+  if (NULL == vm->callstack) {
+    return 1;
+  }
+  vm->csp = vm->callstack;
+  vm->climit = vm->callstack + 1024;
+
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->owned = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  vm->procs[at] = proc;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc *proc, *next;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  free(vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  struct ip_proc* proc = vm->procs[procref];
+  ip_value_t* sp = vm->stack.data + vm->stack.sp;
+  ip_value_t* fp;
+  size_t i;
+
+  if ((size_t)(vm->limit - sp) < proc->nlocals) {
+    return 1;
+  }
+  fp = sp - proc->nargs;
+  for (i = 0; i < proc->nlocals; i++) {
+    *sp++ = IP_LLINT2VALUE(0);
+  }
+
+  vm->csp = vm->callstack;
+
+  return proc->insts->handler(proc->insts, sp, fp, vm);
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}
@@ -1,5 +1,14 @@
+#include "arena.h"
+#include "loop.h"
+#include "peephole.h"
 #include "stack.h"
+#include "superinst.h"
+#include "tail_call.h"
+#include "verifier.h"
 #include "vm.h"
+#ifdef IP_VM_INLINE
+#include "inliner.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,16 +21,59 @@ struct ip_proc
   size_t nlocals;
   size_t ninsts;
   struct ip_inst* insts;
+  /* the arena of the vm it was made in, or NULL */
+  struct ip_arena* arena;
+  /* the proc made before it in the arena */
+  struct ip_proc* next;
+  /* the deepest point of the stack above the locals if verified, else 0 */
+  size_t depth;
+  int verified;
+#ifdef IP_VM_INLINE
+  /* as registered. the callers splice these */
+  size_t src_nlocals;
+  size_t nsrc;
+  struct ip_inst* src;
+#endif
 };
 
-int
-ip_proc_init(struct ip_proc* proc,
-             size_t nargs,
-             size_t nlocals,
-             size_t ninsts,
-             struct ip_inst* insts)
+/* the superinsts get the codes after IP_CODE_TAIL_CALL. the following insts
+ * are kept for jumps into the superinst */
+#define IP_CODE_SUPERINST(s) (IP_CODE_TAIL_CALL + 1 + (s))
+/* the insts of a verified proc have their codes moved by this, to the
+ * handlers without checks */
+#define IP_CODE_VERIFIED ((int)IP_CODE_SUPERINST(IP_NSUPERINSTS))
+
+static void
+ip_proc_fuse(struct ip_inst* insts, size_t ninsts)
 {
-  proc->insts = malloc(ninsts * sizeof(struct ip_inst));
+  size_t i;
+  int s;
+
+  for (i = 0; i < ninsts; i++) {
+    s = ip_superinst_match(insts, ninsts, i);
+    if (0 <= s) {
+      insts[i].code = IP_CODE_SUPERINST(s);
+    }
+  }
+}
+
+static int
+ip_proc_init_in(struct ip_proc* proc,
+                struct ip_arena* arena,
+                size_t nargs,
+                size_t nlocals,
+                size_t ninsts,
+                struct ip_inst* insts)
+{
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  proc->arena = arena;
+  proc->insts = ip_arena_alloc(arena, ninsts * sizeof(struct ip_inst));
   if (NULL == proc->insts) {
     return 1;
   }
@@ -29,11 +81,35 @@ ip_proc_init(struct ip_proc* proc,
   proc->nargs = nargs;
   proc->nlocals = nlocals;
   proc->ninsts = ninsts;
+  proc->depth = 0;
+  proc->verified = 0;
   memcpy(proc->insts, insts, ninsts * sizeof(struct ip_inst));
+  ip_tail_call_rewrite(proc->insts, ninsts);
+  ip_proc_fuse(proc->insts, ninsts);
+
+#ifdef IP_VM_INLINE
+  proc->src = ip_arena_alloc(arena, ninsts * sizeof(struct ip_inst));
+  if (NULL == proc->src) {
+    return 1;
+  }
+  proc->src_nlocals = nlocals;
+  proc->nsrc = ninsts;
+  memcpy(proc->src, insts, ninsts * sizeof(struct ip_inst));
+#endif
 
   return 0;
 }
 
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+  return ip_proc_init_in(proc, NULL, nargs, nlocals, ninsts, insts);
+}
+
 int
 ip_proc_new(size_t nargs,
             size_t nlocals,
@@ -52,7 +128,10 @@ ip_proc_new(size_t nargs,
 void
 ip_proc_dtor(struct ip_proc* proc)
 {
-  free(proc->insts);
+  ip_arena_release(proc->arena, proc->insts);
+#ifdef IP_VM_INLINE
+  ip_arena_release(proc->arena, proc->src);
+#endif
 }
 
 typedef struct ip_callinfo
@@ -78,6 +157,15 @@ struct ip_vm
   ip_stack(ip_callinfo_t) callstack;
   size_t nprocs;
   struct ip_proc** procs;
+  /* are the registered procs verified against each other */
+  int verified;
+#ifdef IP_VM_INLINE
+  /* are the callees of the registered procs spliced */
+  int inlined;
+#endif
+  struct ip_arena arena;
+  /* the procs made in arena, the last first */
+  struct ip_proc* arena_procs;
 };
 
 int
@@ -95,8 +183,14 @@ ip_vm_init(struct ip_vm* vm)
     return 1;
   }
 
+  ip_arena_init(&vm->arena);
+  vm->arena_procs = NULL;
   vm->nprocs = 0;
   vm->procs = NULL;
+  vm->verified = 0;
+#ifdef IP_VM_INLINE
+  vm->inlined = 0;
+#endif
 
   return 0;
 }
@@ -113,6 +207,32 @@ ip_vm_new(struct ip_vm** vm)
   return ip_vm_init(*vm);
 }
 
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  return ip_stack_limit(ip_value_t, &vm->stack, nvalues) ||
+         ip_stack_limit(ip_callinfo_t, &vm->callstack, ncalls);
+}
+
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  *ret = ip_arena_alloc(&vm->arena, sizeof(struct ip_proc));
+  if (NULL == *ret ||
+      ip_proc_init_in(*ret, &vm->arena, nargs, nlocals, ninsts, insts)) {
+    return 1;
+  }
+  (*ret)->next = vm->arena_procs;
+  vm->arena_procs = *ret;
+
+  return 0;
+}
+
 ip_proc_ref_t
 ip_vm_reserve_proc(struct ip_vm* vm)
 {
@@ -121,6 +241,7 @@ ip_vm_reserve_proc(struct ip_vm* vm)
   if (NULL == vm->procs) {
     return -1;
   }
+  vm->procs[vm->nprocs - 1] = NULL;
 
   return vm->nprocs - 1;
 }
@@ -129,6 +250,10 @@ void
 ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
 {
   vm->procs[at] = proc;
+  vm->verified = 0;
+#ifdef IP_VM_INLINE
+  vm->inlined = 0;
+#endif
 }
 
 ip_proc_ref_t
@@ -151,9 +276,156 @@ ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
 void
 ip_vm_dtor(struct ip_vm* vm)
 {
+  struct ip_proc* proc;
 
   ip_stack_dtor(ip_value_t, &vm->stack);
   ip_stack_dtor(ip_callinfo_t, &vm->callstack);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->arena_procs; NULL != proc; proc = proc->next) {
+    ip_proc_dtor(proc);
+  }
+  ip_arena_dtor(&vm->arena);
+  free(vm->procs);
+}
+
+#ifdef IP_VM_INLINE
+static int
+ip_vm_lookup(void* ctx, ip_proc_ref_t ref, struct ip_inline_proc* ret)
+{
+  struct ip_vm* vm = ctx;
+  struct ip_proc* proc;
+
+  if (ref < 0 || vm->nprocs <= (size_t)ref || NULL == vm->procs[ref]) {
+    return 1;
+  }
+  proc = vm->procs[ref];
+  ret->nargs = proc->nargs;
+  ret->nlocals = proc->src_nlocals;
+  ret->ninsts = proc->nsrc;
+  ret->insts = proc->src;
+
+  return 0;
+}
+
+/* splices the callees into every registered proc. the procs are rebuilt
+ * from the insts they were registered with, a proc registered again is seen
+ * by all of its callers */
+static int
+ip_vm_inline(struct ip_vm* vm)
+{
+  size_t p, ninsts, nlocals;
+  struct ip_inst* insts;
+  struct ip_inline_proc src;
+  struct ip_proc* proc;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    if (ip_vm_lookup(vm, p, &src)) {
+      continue;
+    }
+    if (ip_inline(&src, ip_vm_lookup, vm, &insts, &ninsts, &nlocals)) {
+      return 1;
+    }
+    ip_tail_call_rewrite(insts, ninsts);
+    ip_proc_fuse(insts, ninsts);
+
+    proc = vm->procs[p];
+    ip_arena_release(proc->arena, proc->insts);
+    /* where the proc was made */
+    proc->insts = ip_arena_alloc(proc->arena, ninsts * sizeof(struct ip_inst));
+    if (NULL == proc->insts) {
+      free(insts);
+      return 1;
+    }
+    memcpy(proc->insts, insts, ninsts * sizeof(struct ip_inst));
+    free(insts);
+    proc->ninsts = ninsts;
+    proc->nlocals = nlocals;
+    proc->depth = 0;
+    proc->verified = 0;
+  }
+  vm->inlined = 1;
+
+  return 0;
+}
+#endif
+
+static int
+ip_vm_nargs(void* ctx, ip_proc_ref_t ref, size_t* nargs)
+{
+  struct ip_vm* vm = ctx;
+
+  if (ref < 0 || vm->nprocs <= (size_t)ref || NULL == vm->procs[ref]) {
+    return 1;
+  }
+  *nargs = vm->procs[ref]->nargs;
+
+  return 0;
+}
+
+/* the code inst had before it was verified and fused */
+static enum ip_code
+ip_inst_code(const struct ip_inst* inst)
+{
+  int code = inst->code;
+
+  if (IP_CODE_VERIFIED <= code) {
+    code -= IP_CODE_VERIFIED;
+  }
+  if (IP_CODE_TAIL_CALL < code) {
+    code = ip_superinsts[code - IP_CODE_SUPERINST(0)].codes[0];
+  }
+
+  return code;
+}
+
+/* verifies every registered proc and moves it to the handlers of its kind.
+ * the calls are checked against the arity of the procs registered now, a
+ * proc registered again has all of them verified again */
+static int
+ip_vm_verify(struct ip_vm* vm)
+{
+  size_t p, i, depth;
+  int verified;
+  struct ip_verify_proc src;
+  struct ip_inst* insts;
+  struct ip_proc* proc;
+
+  for (p = 0; p < vm->nprocs; p++) {
+    proc = vm->procs[p];
+    if (NULL == proc) {
+      continue;
+    }
+
+    insts = malloc((proc->ninsts + 1) * sizeof(struct ip_inst));
+    if (NULL == insts) {
+      return 1;
+    }
+    for (i = 0; i < proc->ninsts; i++) {
+      insts[i] = proc->insts[i];
+      insts[i].code = ip_inst_code(&proc->insts[i]);
+    }
+    src.nargs = proc->nargs;
+    src.nlocals = proc->nlocals;
+    src.ninsts = proc->ninsts;
+    src.insts = insts;
+    verified = !ip_verify(&src, ip_vm_nargs, vm, &depth);
+    free(insts);
+
+    if (verified != proc->verified) {
+      for (i = 0; i < proc->ninsts; i++) {
+        if (verified) {
+          proc->insts[i].code += IP_CODE_VERIFIED;
+        } else {
+          proc->insts[i].code -= IP_CODE_VERIFIED;
+        }
+      }
+    }
+    proc->verified = verified;
+    proc->depth = verified ? depth : 0;
+  }
+  vm->verified = 1;
+
+  return 0;
 }
 
 int
@@ -167,8 +439,38 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
     &&L_CONST, &&L_GET_LOCAL,     &&L_SET_LOCAL,    &&L_ADD,
     &&L_SUB,   &&L_JUMP,          &&L_JUMP_IF_ZERO, &&L_JUMP_IF_NEG,
     &&L_CALL,  &&L_CALL_INDIRECT, &&L_RETURN,       &&L_EXIT,
+    &&L_TAIL_CALL,
+  /* superinsts, in the order of ip_superinsts */
+#define IP_SUPERINST2(a, b) &&L_##a##_##b,
+#define IP_SUPERINST3(a, b, c) &&L_##a##_##b##_##c,
+#define IP_SUPERINST4(a, b, c, d) &&L_##a##_##b##_##c##_##d,
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+    /* the verified procs, after IP_CODE_VERIFIED */
+    &&L_V_CONST, &&L_V_GET_LOCAL,   &&L_V_SET_LOCAL,    &&L_V_ADD,
+    &&L_V_SUB,   &&L_JUMP,          &&L_V_JUMP_IF_ZERO, &&L_V_JUMP_IF_NEG,
+    &&L_CALL,    &&L_CALL_INDIRECT, &&L_V_RETURN,       &&L_V_EXIT,
+    &&L_TAIL_CALL,
+#define IP_SUPERINST2(a, b) &&L_V_##a##_##b,
+#define IP_SUPERINST3(a, b, c) &&L_V_##a##_##b##_##c,
+#define IP_SUPERINST4(a, b, c, d) &&L_V_##a##_##b##_##c##_##d,
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
   };
 
+#ifdef IP_VM_INLINE
+  if (!vm->inlined && ip_vm_inline(vm)) {
+    return 1;
+  }
+#endif
+  if (!vm->verified && ip_vm_verify(vm)) {
+    return 1;
+  }
+
 #define LOCAL(i)                                                               \
   ip_stack_ref(ip_value_t, &vm->stack, fp - (proc->nargs + proc->nlocals) + i)
 #define POP(ref)                                                               \
@@ -189,17 +491,28 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
     for (i = 0; i < (n); i++)                                                  \
       POP(ref);                                                                \
   } while (0)
-#define PUSHN(n, v)                                                            \
+/* the frame of proc over its args, with room for its deepest point if it
+ * is verified */
+#define ENTER()                                                                \
   do {                                                                         \
     size_t i;                                                                  \
-    for (i = 0; i < (n); i++)                                                  \
-      PUSH(v);                                                                 \
+                                                                               \
+    if (vm->stack.sp < proc->nargs ||                                          \
+        (vm->stack.size - vm->stack.sp < proc->nlocals + proc->depth &&        \
+         ip_stack_grow(                                                        \
+           ip_value_t, &vm->stack, proc->nlocals + proc->depth))) {            \
+      return 1;                                                                \
+    }                                                                          \
+    for (i = 0; i < proc->nlocals; i++) {                                      \
+      ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) =                   \
+        IP_LLINT2VALUE(0);                                                     \
+    }                                                                          \
+    fp = vm->stack.sp;                                                         \
   } while (0)
 
   proc = vm->procs[procref];
 
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
-  fp = ip_stack_size(ip_value_t, &vm->stack);
+  ENTER();
 
 #define JUMP()                                                                 \
   do {                                                                         \
@@ -210,83 +523,114 @@ ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
   inst = proc->insts[ip];
   goto* labels[inst.code];
 
+  /* the handler bodies, shared with the superinsts */
+#define OP_CONST()                                                             \
+  do {                                                                         \
+    PUSH(inst.u.v);                                                            \
+  } while (0)
+#define OP_GET_LOCAL()                                                         \
+  do {                                                                         \
+    int i;                                                                     \
+    ip_value_t v;                                                              \
+                                                                               \
+    i = inst.u.i;                                                              \
+    v = LOCAL(i);                                                              \
+                                                                               \
+    PUSH(v);                                                                   \
+  } while (0)
+#define OP_SET_LOCAL()                                                         \
+  do {                                                                         \
+    int i;                                                                     \
+    ip_value_t v;                                                              \
+                                                                               \
+    i = inst.u.i;                                                              \
+    POP(&v);                                                                   \
+                                                                               \
+    LOCAL(i) = v;                                                              \
+  } while (0)
+#define OP_ADD()                                                               \
+  do {                                                                         \
+    ip_value_t v1, v2, ret;                                                    \
+    long long int x, y;                                                        \
+                                                                               \
+    POP(&v1);                                                                  \
+    POP(&v2);                                                                  \
+    y = IP_VALUE2LLINT(v1);                                                    \
+    x = IP_VALUE2LLINT(v2);                                                    \
+                                                                               \
+    ret = IP_INT2VALUE(x + y);                                                 \
+                                                                               \
+    PUSH(ret);                                                                 \
+  } while (0)
+#define OP_SUB()                                                               \
+  do {                                                                         \
+    ip_value_t v1, v2, ret;                                                    \
+    long long int x, y;                                                        \
+                                                                               \
+    POP(&v1);                                                                  \
+    POP(&v2);                                                                  \
+    y = IP_VALUE2LLINT(v1);                                                    \
+    x = IP_VALUE2LLINT(v2);                                                    \
+                                                                               \
+    ret = IP_LLINT2VALUE(x - y);                                               \
+                                                                               \
+    PUSH(ret);                                                                 \
+  } while (0)
+#define OP_JUMP()                                                              \
+  do {                                                                         \
+    ip = inst.u.pos;                                                           \
+  } while (0)
+#define OP_JUMP_IF_ZERO()                                                      \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+                                                                               \
+    if (!IP_VALUE2LLINT(v)) {                                                  \
+      ip = inst.u.pos;                                                         \
+    }                                                                          \
+  } while (0)
+#define OP_JUMP_IF_NEG()                                                       \
+  do {                                                                         \
+    ip_value_t v;                                                              \
+                                                                               \
+    POP(&v);                                                                   \
+                                                                               \
+    if (IP_VALUE2LLINT(v) < 0) {                                               \
+      ip = inst.u.pos;                                                         \
+    }                                                                          \
+  } while (0)
+
 L_CONST : {
-  ip_stack_push(ip_value_t, &vm->stack, inst.u.v);
+  OP_CONST();
   JUMP();
 }
 L_GET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = inst.u.i;
-  v = LOCAL(i);
-
-  PUSH(v);
+  OP_GET_LOCAL();
   JUMP();
 }
 L_SET_LOCAL : {
-  int i;
-  ip_value_t v;
-
-  i = inst.u.i;
-  POP(&v);
-
-  LOCAL(i) = v;
-
+  OP_SET_LOCAL();
   JUMP();
 }
 L_ADD : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_INT2VALUE(x + y);
-
-  PUSH(ret);
-
+  OP_ADD();
   JUMP();
 }
 L_SUB : {
-  ip_value_t v1, v2, ret;
-  long long int x, y;
-
-  POP(&v1);
-  POP(&v2);
-  y = IP_VALUE2LLINT(v1);
-  x = IP_VALUE2LLINT(v2);
-
-  ret = IP_LLINT2VALUE(x - y);
-
-  PUSH(ret);
-
+  OP_SUB();
   JUMP();
 }
 L_JUMP : {
-  ip = inst.u.pos;
+  OP_JUMP();
   JUMP();
 }
 L_JUMP_IF_ZERO : {
-  ip_value_t v;
-
-  POP(&v);
-
-  if (!IP_VALUE2LLINT(v)) {
-    ip = inst.u.pos;
-  }
+  OP_JUMP_IF_ZERO();
   JUMP();
 }
 L_JUMP_IF_NEG : {
-  ip_value_t v;
-
-  POP(&v);
-
-  if (IP_VALUE2LLINT(v) < 0) {
-    ip = inst.u.pos;
-  }
+  OP_JUMP_IF_NEG();
   JUMP();
 }
 L_CALL : {
@@ -300,10 +644,9 @@ L_CALL : {
 
   proc = vm->procs[inst.u.p];
 
-  PUSHN(proc->nlocals, IP_LLINT2VALUE(0));
+  ENTER();
 
   ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
 
   JUMP();
 }
@@ -321,19 +664,21 @@ L_CALL_INDIRECT : {
 
   proc = vm->procs[IP_VALUE2PROCREF(p)];
 
-  PUSHN(proc->nlocals, IP_INT2VALUE(0));
+  ENTER();
 
   ip = -1;
-  fp = ip_stack_size(ip_value_t, &vm->stack);
 
   JUMP();
 }
 L_RETURN : {
   int ret;
+  size_t base;
   ip_value_t v;
   ip_value_t ignore;
   ip_callinfo_t ci;
 
+  base = fp - (proc->nlocals + proc->nargs);
+
   POP(&v);
 
   POPN(proc->nlocals + proc->nargs, &ignore);
@@ -344,6 +689,10 @@ L_RETURN : {
   if (ret) {
     return 1;
   }
+  /* a verified caller runs on the depth it expects after the call */
+  if (ci.proc->verified && base + 1 != vm->stack.sp) {
+    return 1;
+  }
 
   ip = ci.ip;
   fp = ci.fp;
@@ -362,6 +711,173 @@ L_EXIT : {
 
   return 0;
 }
+L_TAIL_CALL : {
+  size_t base, sp;
+  struct ip_proc* callee;
+
+  callee = vm->procs[inst.u.p];
+  base = fp - (proc->nargs + proc->nlocals);
+  sp = ip_stack_size(ip_value_t, &vm->stack);
+  if (sp < callee->nargs) {
+    return 1;
+  }
+
+  /* the args over the frame, the callinfo is left to the callee */
+  memmove(&ip_stack_ref(ip_value_t, &vm->stack, base),
+          &ip_stack_ref(ip_value_t, &vm->stack, sp - callee->nargs),
+          callee->nargs * sizeof(ip_value_t));
+  vm->stack.sp = base + callee->nargs;
+
+  proc = callee;
+
+  ENTER();
+
+  ip = -1;
+
+  JUMP();
+}
+
+  /* run the bodies of the insts in order, without dispatching in between */
+#define NEXT() inst = proc->insts[++ip]
+#define IP_SUPERINST2(a, b)                                                    \
+  L_##a##_##b : {                                                              \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_##a##_##b##_##c : {                                                        \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_##a##_##b##_##c##_##d : {                                                  \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    NEXT();                                                                    \
+    OP_##d();                                                                  \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+
+#undef POP
+#undef PUSH
+  /* the handlers of the verified procs. ENTER reserved their stack, it can
+   * neither overflow nor underflow */
+#define POP(ref)                                                               \
+  do {                                                                         \
+    *(ref) = ip_stack_ref(ip_value_t, &vm->stack, --vm->stack.sp);             \
+  } while (0)
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    ip_stack_ref(ip_value_t, &vm->stack, vm->stack.sp++) = (v);                \
+  } while (0)
+
+L_V_CONST : {
+  OP_CONST();
+  JUMP();
+}
+L_V_GET_LOCAL : {
+  OP_GET_LOCAL();
+  JUMP();
+}
+L_V_SET_LOCAL : {
+  OP_SET_LOCAL();
+  JUMP();
+}
+L_V_ADD : {
+  OP_ADD();
+  JUMP();
+}
+L_V_SUB : {
+  OP_SUB();
+  JUMP();
+}
+L_V_JUMP_IF_ZERO : {
+  OP_JUMP_IF_ZERO();
+  JUMP();
+}
+L_V_JUMP_IF_NEG : {
+  OP_JUMP_IF_NEG();
+  JUMP();
+}
+L_V_RETURN : {
+  int ret;
+  ip_value_t v;
+  ip_callinfo_t ci;
+
+  POP(&v);
+
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(v);
+
+  ret = ip_stack_pop(ip_callinfo_t, &vm->callstack, &ci);
+  if (ret) {
+    return 1;
+  }
+
+  ip = ci.ip;
+  fp = ci.fp;
+  proc = ci.proc;
+
+  JUMP();
+}
+L_V_EXIT : {
+  ip_value_t v;
+
+  POP(&v);
+
+  vm->stack.sp = fp - (proc->nlocals + proc->nargs);
+
+  PUSH(v);
+
+  return 0;
+}
+
+#define IP_SUPERINST2(a, b)                                                    \
+  L_V_##a##_##b : {                                                            \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST3(a, b, c)                                                 \
+  L_V_##a##_##b##_##c : {                                                      \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    JUMP();                                                                    \
+  }
+#define IP_SUPERINST4(a, b, c, d)                                              \
+  L_V_##a##_##b##_##c##_##d : {                                                \
+    OP_##a();                                                                  \
+    NEXT();                                                                    \
+    OP_##b();                                                                  \
+    NEXT();                                                                    \
+    OP_##c();                                                                  \
+    NEXT();                                                                    \
+    OP_##d();                                                                  \
+    JUMP();                                                                    \
+  }
+#include "superinsts.def"
+#undef IP_SUPERINST2
+#undef IP_SUPERINST3
+#undef IP_SUPERINST4
+#undef NEXT
 
 #undef POP
 #undef PUSH
@@ -0,0 +1,936 @@
+#include "jit.h"
+#include "loop.h"
+#include "peephole.h"
+#include "stack.h"
+#include "tail_call.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+def_ip_stack(ip_value_t);
+
+/**
+ * tracing jit.
+ * The interpreter counts the backward JUMPs per target. When a target gets
+ * hot it records the insts run from there until it comes back to it in the
+ * same frame, following the branches taken and going into the procs
+ * called. The trace is compiled to straight x86-64 code looping to its
+ * head, with a guard where the path could have gone another way. A failed
+ * guard leaves the trace and the interpreter resumes where the guarded
+ * inst would have gone.
+ *
+ * The trace keeps the interpreter's stacks as they are, pushing and popping
+ * the callinfos of the procs it goes into, so that leaving it only needs
+ * sp and base back. Registers in the trace:
+ *
+ *   rbx - sp, address of the next free slot of vm->stack
+ *   r12 - address of the first arg of the current frame
+ *   r13 - end of vm->stack, for overflow checks
+ *   r14 - the struct ip_vm
+ */
+
+/* backward jumps to a target before it is traced */
+#define IP_TRACE_HOT 1000
+/* a target whose recording failed waits this many more jumps */
+#define IP_TRACE_BACKOFF (16 * IP_TRACE_HOT)
+#define IP_TRACE_MAX_LEN 1024
+#define IP_TRACE_MAX_DEPTH 32
+
+#define IP_TRACE_SP IP_JIT_RBX
+#define IP_TRACE_BASE IP_JIT_R12
+#define IP_TRACE_LIMIT IP_JIT_R13
+#define IP_TRACE_VM IP_JIT_R14
+
+struct ip_proc;
+
+/* where the interpreter resumes after a trace exit */
+struct ip_trace_exit
+{
+  struct ip_proc* proc;
+  size_t ip;
+};
+
+/* returns the index of the exit taken */
+typedef int (*ip_trace_fn)(struct ip_vm* vm);
+
+struct ip_trace
+{
+  ip_trace_fn code;
+  size_t nexits;
+  struct ip_trace_exit* exits;
+};
+
+struct ip_proc
+{
+  size_t nargs;
+  size_t nlocals;
+  size_t ninsts;
+  struct ip_inst* insts;
+  /* per inst, for the backward jump targets */
+  int* counters;
+  struct ip_trace** traces;
+  /* the proc made before it by ip_vm_new_proc */
+  struct ip_proc* next;
+};
+
+int
+ip_proc_init(struct ip_proc* proc,
+             size_t nargs,
+             size_t nlocals,
+             size_t ninsts,
+             struct ip_inst* insts)
+{
+#ifdef IP_PEEPHOLE
+  insts = ip_peephole(nargs, nlocals, &ninsts, insts);
+#endif
+#ifdef IP_LOOP
+  insts = ip_loop(nargs, nlocals, &ninsts, insts);
+#endif
+
+  /* TAIL_CALL runs as CALL; RETURN */
+  if (ip_tail_call_lower(insts, ninsts, &proc->insts, &ninsts)) {
+    return 1;
+  }
+  proc->counters = calloc(ninsts + 1, sizeof(int));
+  proc->traces = calloc(ninsts + 1, sizeof(struct ip_trace*));
+  if (NULL == proc->counters || NULL == proc->traces) {
+    free(proc->insts);
+    free(proc->counters);
+    free(proc->traces);
+    return 1;
+  }
+
+  proc->nargs = nargs;
+  proc->nlocals = nlocals;
+  proc->ninsts = ninsts;
+
+  return 0;
+}
+
+int
+ip_proc_new(size_t nargs,
+            size_t nlocals,
+            size_t ninsts,
+            struct ip_inst* insts,
+            struct ip_proc** ret)
+{
+  *ret = malloc(sizeof(struct ip_proc));
+  if (NULL == *ret) {
+    return 1;
+  }
+
+  return ip_proc_init(*ret, nargs, nlocals, ninsts, insts);
+}
+
+void
+ip_proc_dtor(struct ip_proc* proc)
+{
+  size_t i;
+
+  for (i = 0; i <= proc->ninsts; i++) {
+    if (NULL != proc->traces[i]) {
+      /* the code stays in the arena */
+      free(proc->traces[i]->exits);
+      free(proc->traces[i]);
+    }
+  }
+  free(proc->insts);
+  free(proc->counters);
+  free(proc->traces);
+}
+
+typedef struct ip_callinfo
+{
+  size_t ip;
+  ip_value_t* base;
+  struct ip_proc* proc;
+} ip_callinfo_t;
+
+/* an inst run while recording */
+struct ip_record
+{
+  struct ip_proc* proc;
+  size_t ip;
+  /* the branch taken, or the proc called by CALL_INDIRECT */
+  ip_value_t v;
+};
+
+/**
+ * stack usage
+ *               base                             sp
+ *               v                                v
+ *        --+----------+------------+--------------
+ * bottom <-| args ... | locals ... | data | data | -> top
+ *        --+----------+------------+--------------
+ */
+struct ip_vm
+{
+  ip_stack(ip_value_t) stack;
+  size_t nprocs;
+  struct ip_proc** procs;
+  /* the procs of ip_vm_new_proc, the last one first */
+  struct ip_proc* owned;
+
+  /* state shared with the traces */
+  ip_value_t* sp;
+  ip_value_t* base;
+  ip_value_t* bottom;
+  ip_value_t* limit;
+  ip_callinfo_t* callstack;
+  ip_callinfo_t* csp;
+  ip_callinfo_t* climit;
+
+  /* recording, if `recording` */
+  int recording;
+  struct ip_proc* anchor_proc;
+  size_t anchor;
+  size_t depth;
+  size_t nrecords;
+  struct ip_record* records;
+};
+
+#define IP_TRACE_VM_FIELD(f) ((int32_t)offsetof(struct ip_vm, f))
+#define IP_TRACE_CI_FIELD(f) ((int32_t)offsetof(ip_callinfo_t, f))
+
+int
+ip_vm_init(struct ip_vm* vm)
+{
+  int ret;
+
+  ret = ip_stack_init(ip_value_t, &vm->stack, 1024);
+  if (ret) {
+    return 1;
+  }
+  vm->bottom = vm->stack.data;
+  vm->limit = vm->stack.data + vm->stack.size;
+
+  vm->callstack = malloc(1024 * sizeof(ip_callinfo_t));
+  vm->records = malloc(IP_TRACE_MAX_LEN * sizeof(struct ip_record));
+  if (NULL == vm->callstack || NULL == vm->records) {
+    return 1;
+  }
+  vm->csp = vm->callstack;
+  vm->climit = vm->callstack + 1024;
+  vm->recording = 0;
+
+  vm->nprocs = 0;
+  vm->procs = NULL;
+  vm->owned = NULL;
+
+  return 0;
+}
+
+int
+ip_vm_new(struct ip_vm** vm)
+{
+
+  *vm = malloc(sizeof(struct ip_vm));
+  if (NULL == *vm) {
+    return 1;
+  }
+
+  return ip_vm_init(*vm);
+}
+
+/* only the interpreters keeping their calls in stack.h stacks have limits */
+int
+ip_vm_set_stack_limits(struct ip_vm* vm, size_t nvalues, size_t ncalls)
+{
+  (void)vm;
+  (void)nvalues;
+  (void)ncalls;
+  return 1;
+}
+
+/* the proc of ip_proc_new, freed with the vm */
+int
+ip_vm_new_proc(struct ip_vm* vm,
+               size_t nargs,
+               size_t nlocals,
+               size_t ninsts,
+               struct ip_inst* insts,
+               struct ip_proc** ret)
+{
+  if (ip_proc_new(nargs, nlocals, ninsts, insts, ret)) {
+    free(*ret);
+    return 1;
+  }
+  (*ret)->next = vm->owned;
+  vm->owned = *ret;
+
+  return 0;
+}
+
+ip_proc_ref_t
+ip_vm_reserve_proc(struct ip_vm* vm)
+{
+  vm->nprocs += 1;
+  vm->procs = realloc(vm->procs, vm->nprocs * sizeof(struct ip_proc*));
+  if (NULL == vm->procs) {
+    return -1;
+  }
+  vm->procs[vm->nprocs - 1] = NULL;
+
+  return vm->nprocs - 1;
+}
+
+void
+ip_vm_register_proc_at(struct ip_vm* vm, struct ip_proc* proc, ip_proc_ref_t at)
+{
+  vm->procs[at] = proc;
+}
+
+ip_proc_ref_t
+ip_vm_register_proc(struct ip_vm* vm, struct ip_proc* proc)
+{
+
+  ip_proc_ref_t ret;
+
+  ret = ip_vm_reserve_proc(vm);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  ip_vm_register_proc_at(vm, proc, ret);
+
+  return ret;
+}
+
+void
+ip_vm_dtor(struct ip_vm* vm)
+{
+  struct ip_proc *proc, *next;
+
+  ip_stack_dtor(ip_value_t, &vm->stack);
+  free(vm->callstack);
+  free(vm->records);
+  /* the procs of ip_vm_new_proc go with it */
+  for (proc = vm->owned; NULL != proc; proc = next) {
+    next = proc->next;
+    ip_proc_dtor(proc);
+    free(proc);
+  }
+}
+
+/* jump to a new exit stub if `cc`, resuming at `ip` of `proc` */
+static void
+ip_trace_emit_guard(struct ip_jit_buf* buf,
+                    enum ip_jit_cond cc,
+                    struct ip_trace* trace,
+                    size_t* fixups,
+                    struct ip_proc* proc,
+                    size_t ip)
+{
+  fixups[trace->nexits] = ip_jit_jcc(buf, cc);
+  trace->exits[trace->nexits].proc = proc;
+  trace->exits[trace->nexits].ip = ip;
+  trace->nexits++;
+}
+
+/* leave the trace at the inst itself if there is no room for `n` values */
+static void
+ip_trace_emit_check_push(struct ip_jit_buf* buf,
+                         size_t n,
+                         struct ip_trace* trace,
+                         size_t* fixups,
+                         struct ip_proc* proc,
+                         size_t ip)
+{
+  ip_jit_op_mem(buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_TRACE_SP, n * 8);
+  ip_jit_op_reg(buf, IP_JIT_OP_CMP_RM_R, IP_TRACE_LIMIT, IP_JIT_RAX);
+  ip_trace_emit_guard(buf, IP_JIT_CC_A, trace, fixups, proc, ip);
+}
+
+/**
+ * the frame of `callee` for the call at `ip`, popping `npop` values first
+ * (the procref of CALL_INDIRECT). The guards come before anything is
+ * changed so that the interpreter can run the call again.
+ */
+static void
+ip_trace_emit_call(struct ip_jit_buf* buf,
+                   struct ip_trace* trace,
+                   size_t* fixups,
+                   struct ip_proc* proc,
+                   size_t ip,
+                   struct ip_proc* callee,
+                   size_t npop)
+{
+  size_t i;
+
+  ip_trace_emit_check_push(buf, callee->nlocals, trace, fixups, proc, ip);
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_VM, IP_TRACE_VM_FIELD(csp));
+  ip_jit_op_mem(buf,
+                IP_JIT_OP_CMP_R_RM,
+                IP_JIT_RAX,
+                IP_TRACE_VM,
+                IP_TRACE_VM_FIELD(climit));
+  ip_trace_emit_guard(buf, IP_JIT_CC_AE, trace, fixups, proc, ip);
+  if (npop) {
+    ip_jit_op_imm(buf, IP_JIT_EXT_SUB, IP_TRACE_SP, 8 * npop);
+  }
+
+  ip_jit_mov_mem_imm(buf, IP_JIT_RAX, IP_TRACE_CI_FIELD(ip), ip);
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_RM_R, IP_TRACE_BASE, IP_JIT_RAX, IP_TRACE_CI_FIELD(base));
+  ip_jit_mov_imm(buf, IP_JIT_RCX, (int64_t)(intptr_t)proc);
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RCX, IP_JIT_RAX, IP_TRACE_CI_FIELD(proc));
+  ip_jit_op_imm(buf, IP_JIT_EXT_ADD, IP_JIT_RAX, sizeof(ip_callinfo_t));
+  ip_jit_op_mem(
+    buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_VM, IP_TRACE_VM_FIELD(csp));
+
+  ip_jit_op_mem(buf,
+                IP_JIT_OP_LEA,
+                IP_TRACE_BASE,
+                IP_TRACE_SP,
+                -(int32_t)(8 * callee->nargs));
+  if (callee->nlocals) {
+    for (i = 0; i < callee->nlocals; i++) {
+      ip_jit_mov_mem_imm(buf, IP_TRACE_SP, 8 * i, 0);
+    }
+    ip_jit_op_imm(buf, IP_JIT_EXT_ADD, IP_TRACE_SP, 8 * callee->nlocals);
+  }
+}
+
+/**
+ * the values vm->records pop below the sp at the head of the trace. Checked
+ * there, this covers every pop of the trace, as they follow one path.
+ */
+static size_t
+ip_trace_pops(struct ip_vm* vm)
+{
+  /* from the sp at the head, for the frames entered in the trace too */
+  long depth = 0, need = 0, bases[IP_TRACE_MAX_DEPTH];
+  size_t i, nframes = 0;
+
+  for (i = 0; i < vm->nrecords; i++) {
+    struct ip_record* r = &vm->records[i];
+    struct ip_inst inst = r->proc->insts[r->ip];
+    struct ip_verify_proc vproc;
+    struct ip_proc* callee;
+
+    vproc.nargs = r->proc->nargs;
+    vproc.nlocals = r->proc->nlocals;
+    vproc.ninsts = r->proc->ninsts;
+    vproc.insts = r->proc->insts;
+    depth -= ip_verify_pops(&vproc, &inst);
+    need = need < -depth ? -depth : need;
+
+    switch (inst.code) {
+      case IP_CODE_CONST:
+      case IP_CODE_GET_LOCAL:
+      case IP_CODE_ADD:
+      case IP_CODE_SUB: {
+        depth += 1;
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        callee = vm->procs[IP_VALUE2PROCREF(r->v)];
+        depth -= callee->nargs;
+        need = need < -depth ? -depth : need;
+        bases[nframes++] = depth;
+        depth += callee->nargs + callee->nlocals;
+        break;
+      }
+      case IP_CODE_RETURN: {
+        depth = bases[--nframes] + 1;
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+  }
+
+  return need;
+}
+
+/* compile vm->records into a trace, or return NULL */
+static struct ip_trace*
+ip_trace_compile(struct ip_vm* vm)
+{
+  struct ip_jit_buf buf;
+  struct ip_trace* trace;
+  size_t i, head, tail, npops;
+  size_t* fixups;
+
+  trace = malloc(sizeof(struct ip_trace));
+  /* at most three guards per inst, and one at the head */
+  fixups = malloc((3 * vm->nrecords + 1) * sizeof(size_t));
+  if (NULL == trace || NULL == fixups) {
+    free(trace);
+    free(fixups);
+    return NULL;
+  }
+  trace->nexits = 0;
+  trace->exits =
+    malloc((3 * vm->nrecords + 1) * sizeof(struct ip_trace_exit));
+  if (NULL == trace->exits || ip_jit_buf_init(&buf)) {
+    free(trace->exits);
+    free(trace);
+    free(fixups);
+    return NULL;
+  }
+
+  ip_jit_push(&buf, IP_JIT_RBX);
+  ip_jit_push(&buf, IP_JIT_R12);
+  ip_jit_push(&buf, IP_JIT_R13);
+  ip_jit_push(&buf, IP_JIT_R14);
+  ip_jit_op_reg(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RDI, IP_TRACE_VM);
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_R_RM, IP_TRACE_SP, IP_TRACE_VM, IP_TRACE_VM_FIELD(sp));
+  ip_jit_op_mem(&buf,
+                IP_JIT_OP_MOV_R_RM,
+                IP_TRACE_BASE,
+                IP_TRACE_VM,
+                IP_TRACE_VM_FIELD(base));
+  ip_jit_op_mem(&buf,
+                IP_JIT_OP_MOV_R_RM,
+                IP_TRACE_LIMIT,
+                IP_TRACE_VM,
+                IP_TRACE_VM_FIELD(limit));
+  head = buf.len;
+
+  /* the interpreter runs the loop, checking its pops, if it may underflow */
+  npops = ip_trace_pops(vm);
+  if (npops) {
+    ip_jit_op_mem(
+      &buf, IP_JIT_OP_LEA, IP_JIT_RAX, IP_TRACE_SP, -(int32_t)(8 * npops));
+    ip_jit_op_mem(&buf,
+                  IP_JIT_OP_CMP_R_RM,
+                  IP_JIT_RAX,
+                  IP_TRACE_VM,
+                  IP_TRACE_VM_FIELD(bottom));
+    ip_trace_emit_guard(
+      &buf, IP_JIT_CC_B, trace, fixups, vm->anchor_proc, vm->anchor);
+  }
+
+  for (i = 0; i < vm->nrecords; i++) {
+    struct ip_record* r = &vm->records[i];
+    struct ip_inst inst = r->proc->insts[r->ip];
+
+    switch (inst.code) {
+      case IP_CODE_CONST: {
+        ip_trace_emit_check_push(&buf, 1, trace, fixups, r->proc, r->ip);
+        if (INT32_MIN <= inst.u.v && inst.u.v <= INT32_MAX) {
+          ip_jit_mov_mem_imm(&buf, IP_TRACE_SP, 0, (int32_t)inst.u.v);
+        } else {
+          ip_jit_mov_imm(&buf, IP_JIT_RAX, inst.u.v);
+          ip_jit_op_mem(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_SP, 0);
+        }
+        ip_jit_op_imm(&buf, IP_JIT_EXT_ADD, IP_TRACE_SP, 8);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        ip_trace_emit_check_push(&buf, 1, trace, fixups, r->proc, r->ip);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_BASE, 8 * inst.u.i);
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_SP, 0);
+        ip_jit_op_imm(&buf, IP_JIT_EXT_ADD, IP_TRACE_SP, 8);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_TRACE_SP, 8);
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_SP, 0);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_BASE, 8 * inst.u.i);
+        break;
+      }
+      case IP_CODE_ADD:
+      case IP_CODE_SUB: {
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_TRACE_SP, 8);
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_SP, 0);
+        ip_jit_op_mem(&buf,
+                      IP_CODE_ADD == inst.code ? IP_JIT_OP_ADD_RM_R
+                                               : IP_JIT_OP_SUB_RM_R,
+                      IP_JIT_RAX,
+                      IP_TRACE_SP,
+                      -8);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        /* the trace goes on at the target */
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO:
+      case IP_CODE_JUMP_IF_NEG: {
+        enum ip_jit_cond cc;
+        size_t other;
+
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_TRACE_SP, 8);
+        ip_jit_op_mem_imm(&buf, IP_JIT_EXT_CMP, IP_TRACE_SP, 0, 0);
+        /* leave when the branch goes the other way */
+        if (IP_CODE_JUMP_IF_ZERO == inst.code) {
+          cc = r->v ? IP_JIT_CC_NE : IP_JIT_CC_E;
+        } else {
+          cc = r->v ? IP_JIT_CC_GE : IP_JIT_CC_L;
+        }
+        other = r->v ? r->ip + 1 : inst.u.pos + 1;
+        ip_trace_emit_guard(&buf, cc, trace, fixups, r->proc, other);
+        break;
+      }
+      case IP_CODE_CALL: {
+        ip_trace_emit_call(
+          &buf, trace, fixups, r->proc, r->ip, vm->procs[inst.u.p], 0);
+        break;
+      }
+      case IP_CODE_CALL_INDIRECT: {
+        ip_jit_op_mem_imm(&buf, IP_JIT_EXT_CMP, IP_TRACE_SP, -8, (int32_t)r->v);
+        ip_trace_emit_guard(&buf, IP_JIT_CC_NE, trace, fixups, r->proc, r->ip);
+        ip_trace_emit_call(&buf,
+                           trace,
+                           fixups,
+                           r->proc,
+                           r->ip,
+                           vm->procs[IP_VALUE2PROCREF(r->v)],
+                           1);
+        break;
+      }
+      case IP_CODE_RETURN: {
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_SP, -8);
+        ip_jit_op_mem(&buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_BASE, 0);
+        ip_jit_op_mem(&buf, IP_JIT_OP_LEA, IP_TRACE_SP, IP_TRACE_BASE, 8);
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_R_RM, IP_JIT_RAX, IP_TRACE_VM, IP_TRACE_VM_FIELD(csp));
+        ip_jit_op_imm(&buf, IP_JIT_EXT_SUB, IP_JIT_RAX, sizeof(ip_callinfo_t));
+        ip_jit_op_mem(
+          &buf, IP_JIT_OP_MOV_RM_R, IP_JIT_RAX, IP_TRACE_VM, IP_TRACE_VM_FIELD(csp));
+        ip_jit_op_mem(&buf,
+                      IP_JIT_OP_MOV_R_RM,
+                      IP_TRACE_BASE,
+                      IP_JIT_RAX,
+                      IP_TRACE_CI_FIELD(base));
+        break;
+      }
+      default: {
+        /* EXIT ends the recording before it gets here */
+        break;
+      }
+    }
+  }
+
+  ip_jit_link(&buf, ip_jit_jmp(&buf), head);
+
+  /* the exit stubs */
+  tail = buf.len;
+  ip_jit_op_mem(
+    &buf, IP_JIT_OP_MOV_RM_R, IP_TRACE_SP, IP_TRACE_VM, IP_TRACE_VM_FIELD(sp));
+  ip_jit_op_mem(&buf,
+                IP_JIT_OP_MOV_RM_R,
+                IP_TRACE_BASE,
+                IP_TRACE_VM,
+                IP_TRACE_VM_FIELD(base));
+  ip_jit_pop(&buf, IP_JIT_R14);
+  ip_jit_pop(&buf, IP_JIT_R13);
+  ip_jit_pop(&buf, IP_JIT_R12);
+  ip_jit_pop(&buf, IP_JIT_RBX);
+  ip_jit_ret(&buf);
+  for (i = 0; i < trace->nexits; i++) {
+    ip_jit_link(&buf, fixups[i], buf.len);
+    ip_jit_mov_imm(&buf, IP_JIT_RAX, i);
+    ip_jit_link(&buf, ip_jit_jmp(&buf), tail);
+  }
+
+  trace->code = (ip_trace_fn)ip_jit_place(&buf);
+  ip_jit_buf_dtor(&buf);
+  free(fixups);
+  if (NULL == trace->code) {
+    free(trace->exits);
+    free(trace);
+    return NULL;
+  }
+
+  return trace;
+}
+
+static void
+ip_trace_start(struct ip_vm* vm, struct ip_proc* proc, size_t anchor)
+{
+  vm->recording = 1;
+  vm->anchor_proc = proc;
+  vm->anchor = anchor;
+  vm->depth = 0;
+  vm->nrecords = 0;
+}
+
+static void
+ip_trace_abort(struct ip_vm* vm)
+{
+  vm->recording = 0;
+  vm->anchor_proc->counters[vm->anchor] = -IP_TRACE_BACKOFF;
+}
+
+/* record the inst about to run. returns 1 when the trace is complete */
+static int
+ip_trace_record(struct ip_vm* vm,
+                struct ip_proc* proc,
+                size_t ip,
+                ip_value_t* sp)
+{
+  struct ip_record* r;
+
+  if (vm->nrecords && proc == vm->anchor_proc && ip == vm->anchor &&
+      0 == vm->depth) {
+    vm->recording = 0;
+    proc->traces[ip] = ip_trace_compile(vm);
+    if (NULL == proc->traces[ip]) {
+      proc->counters[ip] = -IP_TRACE_BACKOFF;
+      return 0;
+    }
+    return 1;
+  }
+  if (IP_TRACE_MAX_LEN == vm->nrecords || ip >= proc->ninsts) {
+    ip_trace_abort(vm);
+    return 0;
+  }
+
+  r = &vm->records[vm->nrecords++];
+  r->proc = proc;
+  r->ip = ip;
+  r->v = 0;
+
+  switch (proc->insts[ip].code) {
+    case IP_CODE_JUMP_IF_ZERO: {
+      r->v = !IP_VALUE2LLINT(sp[-1]);
+      break;
+    }
+    case IP_CODE_JUMP_IF_NEG: {
+      r->v = IP_VALUE2LLINT(sp[-1]) < 0;
+      break;
+    }
+    case IP_CODE_CALL_INDIRECT:
+    case IP_CODE_CALL: {
+      ip_proc_ref_t p = IP_CODE_CALL == proc->insts[ip].code
+                          ? proc->insts[ip].u.p
+                          : IP_VALUE2PROCREF(sp[-1]);
+
+      if (p < 0 || (size_t)p >= vm->nprocs || NULL == vm->procs[p] ||
+          IP_TRACE_MAX_DEPTH == vm->depth) {
+        ip_trace_abort(vm);
+        return 0;
+      }
+      r->v = IP_PROCREF2VALUE(p);
+      vm->depth++;
+      break;
+    }
+    case IP_CODE_RETURN: {
+      /* leaving the frame of the loop */
+      if (0 == vm->depth) {
+        ip_trace_abort(vm);
+        return 0;
+      }
+      vm->depth--;
+      break;
+    }
+    case IP_CODE_EXIT: {
+      ip_trace_abort(vm);
+      return 0;
+    }
+    default: {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+int
+ip_vm_exec(struct ip_vm* vm, ip_proc_ref_t procref)
+{
+  size_t ip = 0;
+  ip_value_t* sp;
+  ip_value_t* base;
+  struct ip_proc* proc;
+
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    if (sp >= vm->limit) {                                                     \
+      return 1;                                                                \
+    }                                                                          \
+    *sp++ = (v);                                                               \
+  } while (0)
+#define CHECK_POPS(n)                                                          \
+  do {                                                                         \
+    if ((size_t)(sp - vm->bottom) < (n)) {                                     \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+#define ENTER(p)                                                               \
+  do {                                                                         \
+    size_t i;                                                                  \
+                                                                               \
+    proc = (p);                                                                \
+    if ((size_t)(vm->limit - sp) < proc->nlocals ||                            \
+        (size_t)(sp - vm->bottom) < proc->nargs) {                             \
+      return 1;                                                                \
+    }                                                                          \
+    base = sp - proc->nargs;                                                   \
+    for (i = 0; i < proc->nlocals; i++) {                                      \
+      *sp++ = IP_LLINT2VALUE(0);                                               \
+    }                                                                          \
+  } while (0)
+
+  sp = vm->stack.data + vm->stack.sp;
+  vm->csp = vm->callstack;
+  vm->recording = 0;
+  ENTER(vm->procs[procref]);
+
+  while (1) {
+    struct ip_inst inst;
+    struct ip_trace* trace = NULL;
+
+    if (ip >= proc->ninsts) {
+      return 1;
+    }
+    if (vm->recording && ip_trace_record(vm, proc, ip, sp)) {
+      trace = proc->traces[ip];
+      goto run_trace;
+    }
+
+    inst = proc->insts[ip];
+    switch (inst.code) {
+      case IP_CODE_CONST: {
+        PUSH(inst.u.v);
+        break;
+      }
+      case IP_CODE_GET_LOCAL: {
+        PUSH(base[inst.u.i]);
+        break;
+      }
+      case IP_CODE_SET_LOCAL: {
+        CHECK_POPS(1);
+        base[inst.u.i] = *--sp;
+        break;
+      }
+      case IP_CODE_ADD: {
+        long long int y;
+
+        CHECK_POPS(2);
+        y = IP_VALUE2LLINT(*--sp);
+        sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) + y);
+        break;
+      }
+      case IP_CODE_SUB: {
+        long long int y;
+
+        CHECK_POPS(2);
+        y = IP_VALUE2LLINT(*--sp);
+        sp[-1] = IP_LLINT2VALUE(IP_VALUE2LLINT(sp[-1]) - y);
+        break;
+      }
+      case IP_CODE_JUMP: {
+        size_t target = inst.u.pos + 1;
+
+        if (target <= ip && target < proc->ninsts) {
+          trace = proc->traces[target];
+          if (NULL != trace && vm->recording) {
+            /* an inner loop already traced */
+            ip_trace_abort(vm);
+          } else if (NULL == trace && !vm->recording &&
+                     IP_TRACE_HOT <= ++proc->counters[target]) {
+            ip_trace_start(vm, proc, target);
+          }
+        }
+        ip = inst.u.pos;
+        break;
+      }
+      case IP_CODE_JUMP_IF_ZERO: {
+        CHECK_POPS(1);
+        if (!IP_VALUE2LLINT(*--sp)) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_JUMP_IF_NEG: {
+        CHECK_POPS(1);
+        if (IP_VALUE2LLINT(*--sp) < 0) {
+          ip = inst.u.pos;
+        }
+        break;
+      }
+      case IP_CODE_CALL:
+      case IP_CODE_CALL_INDIRECT: {
+        ip_proc_ref_t p = inst.u.p;
+
+        if (IP_CODE_CALL_INDIRECT == inst.code) {
+          CHECK_POPS(1);
+          p = IP_VALUE2PROCREF(*--sp);
+        }
+        if (p < 0 || (size_t)p >= vm->nprocs || NULL == vm->procs[p] ||
+            vm->csp >= vm->climit) {
+          return 1;
+        }
+        vm->csp->ip = ip;
+        vm->csp->base = base;
+        vm->csp->proc = proc;
+        vm->csp++;
+
+        ENTER(vm->procs[p]);
+        ip = -1;
+        break;
+      }
+      case IP_CODE_RETURN: {
+        if (vm->csp == vm->callstack) {
+          return 1;
+        }
+        CHECK_POPS(1 + proc->nargs + proc->nlocals);
+        base[0] = sp[-1];
+        sp = base + 1;
+
+        vm->csp--;
+        ip = vm->csp->ip;
+        base = vm->csp->base;
+        proc = vm->csp->proc;
+        break;
+      }
+      case IP_CODE_EXIT: {
+        CHECK_POPS(1 + proc->nargs + proc->nlocals);
+        base[0] = sp[-1];
+        sp = base + 1;
+
+        vm->stack.sp = sp - vm->stack.data;
+        return 0;
+      }
+      default: {
+        printf("code: %d, u: %d", inst.code, inst.u.i);
+        return 1;
+      }
+    }
+    ip += 1;
+
+  run_trace:
+    if (NULL != trace) {
+      struct ip_trace_exit* exit;
+
+      vm->sp = sp;
+      vm->base = base;
+      exit = &trace->exits[trace->code(vm)];
+      sp = vm->sp;
+      base = vm->base;
+      proc = exit->proc;
+      ip = exit->ip;
+    }
+  }
+
+#undef PUSH
+#undef CHECK_POPS
+#undef ENTER
+}
+
+int
+ip_vm_push_arg(struct ip_vm* vm, ip_value_t arg)
+{
+  return ip_stack_push(ip_value_t, &vm->stack, arg);
+}
+
+int
+ip_vm_get_result(struct ip_vm* vm, ip_value_t* result)
+{
+  return ip_stack_pop(ip_value_t, &vm->stack, result);
+}